@@ -123,6 +123,10 @@ slab_init()
 	int i;
 	uint64_t slab_sz;
 
+	/* Already set up, e.g. by the process this one was forked from. */
+	if (inited)
+		return;
+
 	/* Check bypass env variable. */
 	if (getenv("ALLOCATOR_BYPASS") != NULL) {
 		bypass = 1;
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <utils.h>
 #include <sys/mman.h>
 #include <ctype.h>
@@ -43,51 +44,121 @@
 #include "pc_archive.h"
 
 #define	PACKJPG_DEF_BUFSIZ	(512 * 1024)
-#define	JPG_SIZE_LIMIT		(8 * 1024 * 1024)
+#define	JPG_SIZE_LIMIT		FILTER_SIZE_LIMIT
+#define	FILTER_BUF_ROUND	(64 * 1024)
+#define	FILTER_BUF_MAX_FREE	(16)
 #define	PJG_APPVERSION1		(25)
 #define	PJG_APPVERSION2		(25)
 
-struct scratch_buffer {
-	uchar_t *in_buff;
-	size_t in_bufflen;
+/*
+ * Filter buffers are recycled through a free list instead of being allocated
+ * and freed per member. A small header in front of each buffer records its
+ * capacity.
+ */
+struct filter_buffer {
+	struct filter_buffer *next;
+	uint64_t size;
 };
+#define	FILTER_BUF_HDR	(sizeof (struct filter_buffer))
+
+static struct filter_buffer *free_buffers = NULL;
+static int nfree_buffers = 0;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
 
-extern size_t packjpg_filter_process(uchar_t *in_buf, size_t len, uchar_t **out_buf);
+extern size_t packjpg_filter_process(uchar_t *in_buf, size_t len, uchar_t *out_buf,
+    size_t out_size);
 
 int64_t packjpg_filter(struct filter_info *fi, void *filter_private);
+int packjpg_filter_pre(int fd, uint64_t len, struct filter_output *fout,
+    void *filter_private);
+int packjpg_filter_post(uchar_t *in, uint64_t len, struct filter_output *fout,
+    void *filter_private);
 
 void
 add_filters_by_type(struct type_data *typetab, struct filter_flags *ff)
 {
-	struct scratch_buffer *sdat;
 	int slot;
 
 	if (ff->enable_packjpg) {
-		sdat = (struct scratch_buffer *)malloc(sizeof (struct scratch_buffer));
-		sdat->in_buff = NULL;
-		sdat->in_bufflen = 0;
-
 		slot = TYPE_JPEG >> 3;
-		typetab[slot].filter_private = sdat;
+		typetab[slot].filter_private = NULL;
 		typetab[slot].filter_func = packjpg_filter;
+		typetab[slot].filter_pre_func = packjpg_filter_pre;
+		typetab[slot].filter_post_func = packjpg_filter_post;
 		typetab[slot].filter_name = "packJPG";
 	}
 }
 
-static void
-ensure_buffer(struct scratch_buffer *sdat, uint64_t len)
+/*
+ * Get a buffer of at least len bytes from the pool.
+ */
+uchar_t *
+filter_buffer_get(uint64_t len)
+{
+	struct filter_buffer *fb, **pfb;
+
+	pthread_mutex_lock(&buffer_lock);
+	for (pfb = &free_buffers; *pfb != NULL; pfb = &((*pfb)->next)) {
+		if ((*pfb)->size >= len)
+			break;
+	}
+	fb = *pfb;
+	if (fb == NULL && free_buffers != NULL) {
+		/*
+		 * No buffer is large enough. Drop one so that the pool does not keep
+		 * growing with small buffers.
+		 */
+		fb = free_buffers;
+		free_buffers = fb->next;
+		nfree_buffers--;
+		pthread_mutex_unlock(&buffer_lock);
+		free(fb);
+		fb = NULL;
+	} else {
+		if (fb != NULL) {
+			*pfb = fb->next;
+			nfree_buffers--;
+		}
+		pthread_mutex_unlock(&buffer_lock);
+	}
+
+	if (fb == NULL) {
+		len = (len + FILTER_BUF_ROUND - 1) & ~((uint64_t)FILTER_BUF_ROUND - 1);
+		fb = (struct filter_buffer *)malloc(FILTER_BUF_HDR + len);
+		if (fb == NULL)
+			return (NULL);
+		fb->size = len;
+	}
+	fb->next = NULL;
+	return ((uchar_t *)fb + FILTER_BUF_HDR);
+}
+
+/*
+ * Return a buffer to the pool.
+ */
+void
+filter_buffer_release(uchar_t *buf)
 {
-	if (sdat->in_bufflen < len) {
-		if (sdat->in_buff) free(sdat->in_buff);
-		sdat->in_bufflen = len;
-		sdat->in_buff = malloc(sdat->in_bufflen);
+	struct filter_buffer *fb;
+
+	if (buf == NULL)
+		return;
+	fb = (struct filter_buffer *)(buf - FILTER_BUF_HDR);
+	pthread_mutex_lock(&buffer_lock);
+	if (nfree_buffers < FILTER_BUF_MAX_FREE) {
+		fb->next = free_buffers;
+		free_buffers = fb;
+		nfree_buffers++;
+		fb = NULL;
 	}
+	pthread_mutex_unlock(&buffer_lock);
+	free(fb);
 }
 
 /*
  * Copy current entry data from the archive being extracted into the given buffer.
  */
-static ssize_t
+ssize_t
 copy_archive_data(struct archive *ar, uchar_t *out_buf)
 {
 	int64_t offset;
@@ -108,6 +179,35 @@ copy_archive_data(struct archive *ar, uchar_t *out_buf)
 	return (tot);
 }
 
+/*
+ * Pass current entry data from the archive being extracted straight through to
+ * the target archive, one block at a time.
+ */
+static ssize_t
+copy_archive_stream(struct archive *ar, struct archive *aw)
+{
+	int64_t offset;
+	const void *buff;
+	size_t size, tot;
+	int r;
+
+	tot = 0;
+	for (;;) {
+		r = archive_read_data_block(ar, &buff, &size, &offset);
+		if (r == ARCHIVE_EOF)
+			break;
+		if (r != ARCHIVE_OK)
+			return (FILTER_RETURN_ERROR);
+		r = (int)archive_write_data_block(aw, buff, size, offset);
+		if (r < ARCHIVE_WARN)
+			r = ARCHIVE_WARN;
+		if (r != ARCHIVE_OK)
+			return (FILTER_RETURN_ERROR);
+		tot += size;
+	}
+	return (tot);
+}
+
 /*
  * Copy the given buffer into the archive stream.
  */
@@ -144,112 +244,213 @@ pjg_version_supported(char ver)
 	return (ver >= PJG_APPVERSION1 && ver <= PJG_APPVERSION2);
 }
 
-ssize_t
-packjpg_filter(struct filter_info *fi, void *filter_private)
+/*
+ * Run packJPG on a JPEG file being archived. The output buffer comes from the
+ * filter buffer pool and must be released by the caller. Returns 0 on success.
+ */
+static int
+packjpg_compress_file(int fd, uint64_t len, uchar_t **out, uint64_t *outlen)
 {
-	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
-	uint64_t len, in_size = 0, len1;
-	ssize_t rv;
+	uchar_t *mapbuf;
+	size_t olen;
 
-	len = archive_entry_size(fi->entry);
-	len1 = len;
+	*out = NULL;
 	if (len > JPG_SIZE_LIMIT) // Bork on massive JPEGs
 		return (FILTER_RETURN_SKIP);
 
-	if (fi->compressing) {
-		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fi->fd, 0);
-		if (mapbuf == NULL) {
-			log_msg(LOG_ERR, 1, "Mmap failed in packJPG filter.");
-			return (FILTER_RETURN_ERROR);
-		}
+	mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapbuf == MAP_FAILED) {
+		log_msg(LOG_ERR, 1, "Mmap failed in packJPG filter.");
+		return (FILTER_RETURN_ERROR);
+	}
 
-		/*
-		 * We are trying to compress and this is not a proper jpeg. Skip.
-		 */
-		if (mapbuf[0] != 0xFF || mapbuf[1] != 0xD8) {
-			munmap(mapbuf, len);
-			return (FILTER_RETURN_SKIP);
-		}
-		if (strncmp((char *)&mapbuf[6], "Exif", 4) != 0 &&
-		    strncmp((char *)&mapbuf[6], "JFIF", 4) != 0) {
-			munmap(mapbuf, len);
-			return (FILTER_RETURN_SKIP);
-		}
-	} else {
-		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
-		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
-			return (FILTER_RETURN_ERROR);
-		}
+	/*
+	 * We are trying to compress and this is not a proper jpeg. Skip.
+	 */
+	if (mapbuf[0] != 0xFF || mapbuf[1] != 0xD8) {
+		munmap(mapbuf, len);
+		return (FILTER_RETURN_SKIP);
+	}
+	if (strncmp((char *)&mapbuf[6], "Exif", 4) != 0 &&
+	    strncmp((char *)&mapbuf[6], "JFIF", 4) != 0) {
+		munmap(mapbuf, len);
+		return (FILTER_RETURN_SKIP);
+	}
 
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
-			return (FILTER_RETURN_ERROR);
-		}
+	/*
+	 * Output larger than the input is useless, so the buffer is bounded by
+	 * the input size.
+	 */
+	*out = filter_buffer_get(len);
+	if (*out == NULL) {
+		munmap(mapbuf, len);
+		return (FILTER_RETURN_SKIP);
+	}
+	olen = packjpg_filter_process(mapbuf, len, *out, len - 8);
+	munmap(mapbuf, len);
+	if (olen == 0 || olen >= (len - 8)) {
+		filter_buffer_release(*out);
+		*out = NULL;
+		return (FILTER_RETURN_SKIP);
+	}
+	*outlen = olen;
+	return (0);
+}
 
-		/*
-		 * First 8 bytes in the data is the compressed size of the entry.
-		 * LibArchive always zero-pads entries to their original size so
-		 * we need to separately store the compressed size.
-		 */
-		in_size = LE64(U64_P(sdat->in_buff));
-		mapbuf = sdat->in_buff + 8;
+/*
+ * Called from a filter worker thread to convert a JPEG before the archiver
+ * reaches it. packjpg_filter() later picks up the result.
+ */
+int
+packjpg_filter_pre(int fd, uint64_t len, struct filter_output *fout, void *filter_private)
+{
+	fout->in_size = len;
+	fout->out_size = 0;
+	fout->result = packjpg_compress_file(fd, len, &(fout->out), &(fout->out_size));
+	return (fout->result);
+}
+
+/*
+ * Decode packJPG data read from the archive. This is called from an extraction
+ * worker thread or in-line by packjpg_filter(). If the data is not a packJPG
+ * stream the input is passed through unchanged.
+ */
+int
+packjpg_filter_post(uchar_t *in, uint64_t len, struct filter_output *fout, void *filter_private)
+{
+	uchar_t *mapbuf;
+	uint64_t in_size;
+	size_t olen;
+
+	fout->in_size = len;
+	fout->out = NULL;
+	fout->out_size = len;
+	fout->result = 0;
+
+	/*
+	 * First 8 bytes in the data is the compressed size of the entry.
+	 * LibArchive always zero-pads entries to their original size so
+	 * we need to separately store the compressed size.
+	 */
+	if (len < 11)
+		return (0);
+	in_size = LE64(U64_P(in));
+	mapbuf = in + 8;
 
+	/*
+	 * We are trying to decompress and this is not a packJPG file.
+	 * Write the raw data and skip. Third byte in PackJPG file is
+	 * version number. We also check if it is supported.
+	 */
+	if (mapbuf[0] != 'J' || mapbuf[1] != 'S' || !pjg_version_supported(mapbuf[2]) ||
+	    in_size > len - 8) {
+		return (0);
+	}
+
+	/*
+	 * The archive entry size is the size of the original JPEG, so that bounds
+	 * the decoded output.
+	 */
+	fout->out = filter_buffer_get(len);
+	if (fout->out == NULL) {
+		log_msg(LOG_ERR, 1, "Out of memory.");
+		fout->result = FILTER_RETURN_ERROR;
+		return (fout->result);
+	}
+	olen = packjpg_filter_process(mapbuf, in_size, fout->out, len);
+	if (olen == 0) {
 		/*
-		 * We are trying to decompress and this is not a packJPG file.
-		 * Write the raw data and skip. Third byte in PackJPG file is
-		 * version number. We also check if it is supported.
+		 * If filter failed we write out the original data and indicate skip
+		 * to continue the archive extraction.
 		 */
-		if (mapbuf[0] != 'J' || mapbuf[1] != 'S' || !pjg_version_supported(mapbuf[2])) {
-			return (write_archive_data(fi->target_arc, sdat->in_buff,
-			    len, fi->block_size));
-		}
+		filter_buffer_release(fout->out);
+		fout->out = NULL;
+		fout->result = FILTER_RETURN_SKIP;
+		return (fout->result);
 	}
+	fout->out_size = olen;
+	return (0);
+}
+
+ssize_t
+packjpg_filter(struct filter_info *fi, void *filter_private)
+{
+	struct filter_output fo;
+	uchar_t *in_buff, *out;
+	uint64_t len, in_size = 0;
+	ssize_t rv;
+
+	len = archive_entry_size(fi->entry);
 
 	/*
-	 * Compression case.
+	 * Compression case. Use the output of a filter worker if one is present
+	 * and was computed for the same file size, otherwise convert here.
 	 */
 	if (fi->compressing) {
-		out = NULL;
-		len = packjpg_filter_process(mapbuf, len, &out);
-		if (len == 0 || len >= (len1 - 8)) {
-			munmap(mapbuf, len1);
-			free(out);
+		int ret;
+
+		if (len > JPG_SIZE_LIMIT) // Bork on massive JPEGs
 			return (FILTER_RETURN_SKIP);
+
+		if (fi->fout != NULL && fi->fout->in_size == len) {
+			ret = fi->fout->result;
+			out = fi->fout->out;
+			len = fi->fout->out_size;
+			fi->fout->out = NULL;
+			fi->fout->in_size = 0;
+		} else {
+			ret = packjpg_compress_file(fi->fd, len, &out, &len);
 		}
-		munmap(mapbuf, len1);
+		if (ret != 0)
+			return (ret);
 
 		in_size = LE64(len);
 		rv = archive_write_data(fi->target_arc, &in_size, 8);
-		if (rv != 8)
+		if (rv != 8) {
+			filter_buffer_release(out);
 			return (rv);
+		}
 		rv = archive_write_data(fi->target_arc, out, len);
-		free(out);
+		filter_buffer_release(out);
 		return (rv);
 	}
 
 	/*
-	 * Decompression case.
+	 * Decompression case. Members above the size limit were never filtered, so
+	 * stream them through without buffering the whole member.
 	 */
-	out = NULL;
-	if ((len = packjpg_filter_process(mapbuf, in_size, &out)) == 0) {
-		/*
-		 * If filter failed we write out the original data and indicate skip
-		 * to continue the archive extraction.
-		 */
-		free(out);
-		if (write_archive_data(fi->target_arc, mapbuf, len1, fi->block_size) < len1)
+	if (len > JPG_SIZE_LIMIT)
+		return (copy_archive_stream(fi->source_arc, fi->target_arc));
+
+	/*
+	 * Get an input buffer and read archive data stream for the entry into
+	 * this buffer.
+	 */
+	in_buff = filter_buffer_get(len);
+	if (in_buff == NULL) {
+		log_msg(LOG_ERR, 1, "Out of memory.");
+		return (FILTER_RETURN_ERROR);
+	}
+
+	in_size = copy_archive_data(fi->source_arc, in_buff);
+	if (in_size != len) {
+		log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		filter_buffer_release(in_buff);
+		return (FILTER_RETURN_ERROR);
+	}
+
+	if (packjpg_filter_post(in_buff, len, &fo, filter_private) == FILTER_RETURN_ERROR) {
+		filter_buffer_release(in_buff);
+		return (FILTER_RETURN_ERROR);
+	}
+	out = (fo.out ? fo.out : in_buff);
+	rv = write_archive_data(fi->target_arc, out, fo.out_size, fi->block_size);
+	filter_buffer_release(fo.out);
+	filter_buffer_release(in_buff);
+	if (fo.result == FILTER_RETURN_SKIP) {
+		if (rv < fo.out_size)
 			return (FILTER_RETURN_ERROR);
 		return (FILTER_RETURN_SKIP);
 	}
-	rv = write_archive_data(fi->target_arc, out, len, fi->block_size);
-	free(out);
 	return (rv);
 }
-
@@ -40,10 +40,28 @@ extern "C" {
 #define	FILTER_RETURN_SKIP	(1)
 #define	FILTER_RETURN_ERROR	(-1)
 
+/*
+ * Members larger than this are never filtered and are not buffered in memory.
+ */
+#define	FILTER_SIZE_LIMIT	(8 * 1024 * 1024)
+
+/*
+ * Result of running a filter in a filter worker thread, either ahead of the
+ * archiver or on member data read by the extractor. A NULL out buffer from a
+ * post-filter means that out_size bytes of the input are to be written as-is.
+ * Output buffers come from the filter buffer pool.
+ */
+struct filter_output {
+	uchar_t *out;
+	uint64_t in_size, out_size;
+	int result;
+};
+
 struct filter_info {
 	struct archive *source_arc;
 	struct archive *target_arc;
 	struct archive_entry *entry;
+	struct filter_output *fout;
 	int fd;
 	int compressing, block_size;
 };
@@ -53,14 +71,23 @@ struct filter_flags {
 };
 
 typedef ssize_t (*filter_func_ptr)(struct filter_info *fi, void *filter_private);
+typedef int (*filter_pre_func_ptr)(int fd, uint64_t len, struct filter_output *fout,
+    void *filter_private);
+typedef int (*filter_post_func_ptr)(uchar_t *in, uint64_t len, struct filter_output *fout,
+    void *filter_private);
 
 struct type_data {
 	void *filter_private;
 	filter_func_ptr filter_func;
+	filter_pre_func_ptr filter_pre_func;
+	filter_post_func_ptr filter_post_func;
 	char *filter_name;
 };
 
 void add_filters_by_type(struct type_data *typetab, struct filter_flags *ff);
+ssize_t copy_archive_data(struct archive *ar, uchar_t *out_buf);
+uchar_t *filter_buffer_get(uint64_t len);
+void filter_buffer_release(uchar_t *buf);
 
 #ifdef	__cplusplus
 }
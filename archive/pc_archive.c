@@ -28,7 +28,9 @@
  * based on extension (or first 4 chars of name if no extension) and size. A simple
  * external merge sort is used. This sorting yields better compression ratio.
  *
- * Sorting is enabled for compression levels greater than 6.
+ * Sorting is enabled for compression levels greater than 6. Optionally files
+ * within the same name/extension group are further ordered by a content sketch
+ * so that similar files end up next to each other.
  */
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -48,11 +50,13 @@
 #include <phash/phash.h>
 #include <phash/extensions.h>
 #include <phash/standard.h>
+#include <dirent.h>
+#include <time.h>
+#include <xxhash.h>
+#include <rabin_dedup.h>
 #include "pc_archive.h"
-
-#undef _FEATURES_H
-#define _XOPEN_SOURCE 700
-#include <ftw.h>
+#include "pc_catalog.h"
+#include "pc_filedup.h"
 #include <stdint.h>
 
 static int inited = 0, filters_inited = 0;
@@ -81,14 +85,52 @@ AE_IFIFO   Named pipe (fifo)
 #define	TEMP_MMAP_SIZE		(128 * 1024)
 #define	AW_BLOCK_SIZE		(256 * 1024)
 
+/*
+ * Private extended attributes used to flag special members. They are removed
+ * again when extracting.
+ */
+#define	XATTR_PRIVATE_PFX	"@."
+#define	XATTR_DUP_FILE		"@.d"
+#define	XATTR_WHITEOUT		"@.w"
+#define	XATTR_PACK		"@.p"
+
+/*
+ * Small file packing. Regular files of up to PACK_FILE_MAX bytes are stored
+ * as records in a pack member instead of as members of their own:
+ *
+ * Pack:    record count (4), records
+ * Record:  path length (4), mode (4), uid (4), gid (4), mtime (8),
+ *          mtime nanoseconds (4), size (4), path, data
+ *
+ * Integers are in network byte order.
+ */
+#define	PACK_FILE_MAX		4096
+#define	PACK_SIZE_MAX		MMAP_SIZE
+#define	PACK_REC_HDR		(4 * 4 + 8 + 4 * 2)
+#define	PACK_NAME		".pcompress-pack.%u"
+
+/*
+ * Content similarity sketch. Up to SKETCH_SAMPLES windows of a file are split
+ * into content defined blocks using a Rabin style rolling hash. The sketch is
+ * the MinHash of the block hashes, so two files have the same sketch with a
+ * probability equal to the fraction of blocks they have in common.
+ */
+#define	SKETCH_SAMPLES		4
+#define	SKETCH_WINDOW		(64 * 1024)
+#define	SKETCH_BUF_SIZE		(SKETCH_SAMPLES * SKETCH_WINDOW)
+#define	SKETCH_ROLL_WIN		16
+#define	SKETCH_BLK_MIN		64
+#define	SKETCH_BLK_MASK		(256 - 1)
+
 typedef struct member_entry {
 	char name[NAMELEN];
 	uint32_t file_pos; // 32-bit file position to limit memory usage.
 	uint64_t size;
+	uint32_t sketch;
 } member_entry_t;
 
 struct sort_buf {
-	member_entry_t members[SORT_BUF_SIZE]; // Use 1MB per sorted buffer
+	member_entry_t members[SORT_BUF_SIZE]; // Use 1.5MB per sorted buffer
 	int pos, max;
 	struct sort_buf *next;
 };
@@ -100,13 +142,68 @@ static struct arc_list_state {
 	int fd;
 	struct sort_buf *srt, *head;
 	int srt_pos;
+	int similarity;
 } a_state;
 
-pthread_mutex_t nftw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t sketch_out[256];
+
+/*
+ * Directory tree scan state. Directories are queued and read by a set of
+ * threads. The entries of a directory are sorted by name and added to the
+ * global list under scan_mutex strictly in queue order, so the member order
+ * does not depend on thread timing.
+ *
+ * When members are not sorted the scan runs in the background and the
+ * archiver reads pathnames from the list as they are added, so compression
+ * overlaps the scan.
+ */
+#define	SCAN_THREADS_MIN	4
+#define	SCAN_THREADS_MAX	32
+
+struct scan_entry {
+	uint64_t size;
+	mode_t mode;
+	uint32_t sketch;
+	int name;
+	const char *sname;
+};
+
+struct scan_dir {
+	struct scan_dir *next;
+	struct scan_entry *ents;
+	char *names;
+	int nents, done;
+	char path[1];
+};
+
+static struct scan_state {
+	struct scan_dir *head, *tail, *next;
+	int err, done, async, waiting;
+	uint64_t size_wanted;
+	pthread_t driver;
+	pthread_cond_t cv, list_cv;
+} s_state;
 
+pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int flush_pathlist(void);
 static int detect_type_by_ext(const char *path, int pathlen);
 static int detect_type_by_data(uchar_t *buf, size_t len);
 
+/*
+ * Member file data is not passed through libarchive's data pointer. Instead
+ * libarchive is handed this marker and the write callback read()s the data
+ * from pctx->arc_src_fd directly into the chunk buffer.
+ *
+ * This depends on libarchive internals: the pax writer hands entry data to
+ * the output without looking at it, and with bytes_per_block set to 0 and no
+ * filters the output passes the data pointer through to the write callback.
+ * setup_archiver() checks what it can of this and falls back to copying the
+ * data otherwise. The write callback refuses any other pointer while a member
+ * is being read directly.
+ */
+static const uchar_t fd_source_mark[1];
+
 /*
  * Archive writer callback routines for archive creation operation.
  */
@@ -120,9 +217,38 @@ arc_open_callback(struct archive *arc, void *ctx)
 	pctx->arc_buf = NULL;
 	pctx->arc_buf_pos = 0;
 	pctx->arc_buf_size = 0;
+	pctx->arc_src_fd = -1;
+	pctx->arc_stream_pos = 0;
 	return (ARCHIVE_OK);
 }
 
+/*
+ * Fill part of the chunk buffer either from the given data or from the member
+ * file when file data is being read directly.
+ */
+static void
+arc_copy_in(pc_ctx_t *pctx, uchar_t *tbuf, const uchar_t *buff, size_t len)
+{
+	int64_t rd;
+
+	if (pctx->arc_src_fd == -1) {
+		memcpy(tbuf, buff, len);
+		return;
+	}
+
+	/*
+	 * If the file shrank after its size was recorded in the header pad with
+	 * zeroes to keep the archive consistent.
+	 */
+	rd = Read(pctx->arc_src_fd, tbuf, len);
+	if (rd < (int64_t)len) {
+		if (rd < 0)
+			rd = 0;
+		memset(tbuf + rd, 0, len - rd);
+		pctx->arc_src_short = 1;
+	}
+}
+
 static int
 creat_close_callback(struct archive *arc, void *ctx)
 {
@@ -157,6 +283,10 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 		archive_set_error(arc, ARCHIVE_EOF, "End of file when writing archive.");
 		return (-1);
 	}
+	if (pctx->arc_src_fd != -1 && buff != fd_source_mark) {
+		archive_set_error(arc, ARCHIVE_FATAL, "Member data was buffered by libarchive.");
+		return (-1);
+	}
 	pctx->arc_writing = 1;
 
 	remaining = len;
@@ -194,7 +324,7 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 
 		if (remaining > pctx->arc_buf_size - pctx->arc_buf_pos) {
 			size_t nlen = pctx->arc_buf_size - pctx->arc_buf_pos;
-			memcpy(tbuf, buff, nlen);
+			arc_copy_in(pctx, tbuf, buff, nlen);
 			remaining -= nlen;
 			pctx->arc_buf_pos += nlen;
 			buff += nlen;
@@ -203,7 +333,7 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 			sem_wait(&(pctx->write_sem));
 			pctx->arc_writing = 1;
 		} else {
-			memcpy(tbuf, buff, remaining);
+			arc_copy_in(pctx, tbuf, buff, remaining);
 			pctx->arc_buf_pos += remaining;
 			remaining = 0;
 			if (pctx->arc_buf_pos == pctx->arc_buf_size) {
@@ -214,6 +344,7 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 		}
 	}
 
+	pctx->arc_stream_pos += len - remaining;
 	return (len - remaining);
 }
 
@@ -222,6 +353,12 @@ archiver_read(void *ctx, void *buf, uint64_t count)
 {
 	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
 
+	/*
+	 * Non-archive input that is scanned for content types.
+	 */
+	if (pctx->stream_scan != NULL)
+		return (stream_scan_read(pctx, buf, count));
+
 	if (pctx->arc_closed)
 		return (0);
 
@@ -322,8 +459,9 @@ archiver_write(void *ctx, void *buf, uint64_t count)
 }
 
 /*
- * Comparison function for sorting pathname members. Sort by name/extension and then
- * by size.
+ * Comparison function for sorting pathname members. Sort by name/extension, then
+ * by content sketch and then by size. Sketches are all zero unless similarity
+ * ordering is enabled.
  */
 static int
 compare_members(const void *a, const void *b) {
@@ -337,6 +475,10 @@ compare_members(const void *a, const void *b) {
 		if (rv != 0)
 			return (rv);
 	}
+	if (mem1->sketch > mem2->sketch)
+		return (1);
+	else if (mem1->sketch < mem2->sketch)
+		return (-1);
 	if (mem1->size > mem2->size)
 		return (1);
 	else if (mem1->size < mem2->size)
@@ -360,11 +502,119 @@ compare_members_lt(member_entry_t *mem1, member_entry_t *mem2) {
 		else if (rv > 0)
 			return (0);
 	}
+	if (mem1->sketch < mem2->sketch)
+		return (1);
+	else if (mem1->sketch > mem2->sketch)
+		return (0);
 	if (mem1->size < mem2->size)
 		return (1);
 	return (0);
 }
 
+/*
+ * Sort a buffer of members. With similarity ordering a sketch that is not shared
+ * with any other member of the same name/extension group does not help, so it
+ * is cleared and such members fall back to being ordered by size.
+ */
+static void
+sort_members(member_entry_t *members, int n)
+{
+	int i, j, cleared;
+
+	qsort(members, n, sizeof (member_entry_t), compare_members);
+	if (!a_state.similarity)
+		return;
+
+	cleared = 0;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; j++) {
+			if (members[j].sketch != members[i].sketch ||
+			    memcmp(members[j].name, members[i].name, NAMELEN) != 0)
+				break;
+		}
+		if (j - i == 1 && members[i].sketch != 0) {
+			members[i].sketch = 0;
+			cleared = 1;
+		}
+	}
+	if (cleared)
+		qsort(members, n, sizeof (member_entry_t), compare_members);
+}
+
+/*
+ * Rolling hash table for removing the byte leaving the window, similar to
+ * the one used by Rabin dedupe.
+ */
+static void
+sketch_init(void)
+{
+	uint64_t poly_pow;
+	int i;
+
+	poly_pow = 1;
+	for (i = 0; i < SKETCH_ROLL_WIN; i++)
+		poly_pow = (poly_pow * RAB_POLYNOMIAL_CONST) & POLY_MASK;
+	for (i = 0; i < 256; i++)
+		sketch_out[i] = (i * poly_pow) & POLY_MASK;
+}
+
+/*
+ * Feed the content defined blocks of one sample window to the MinHash functions.
+ */
+static void
+sketch_window(uchar_t *buf, size_t len, uint32_t *sketch)
+{
+	uint64_t roll;
+	size_t i, last;
+	uint32_t h;
+
+	roll = 0;
+	last = 0;
+	for (i = 0; i < len; i++) {
+		roll = roll * RAB_POLYNOMIAL_CONST + buf[i];
+		if (i >= SKETCH_ROLL_WIN)
+			roll -= sketch_out[buf[i - SKETCH_ROLL_WIN]];
+		roll &= POLY_MASK;
+		if (i + 1 < len && (i + 1 - last < SKETCH_BLK_MIN ||
+		    ((roll >> 8) & SKETCH_BLK_MASK) != 0))
+			continue;
+
+		h = XXH32(buf + last, i + 1 - last, 0);
+		last = i + 1;
+		if (h < *sketch)
+			*sketch = h;
+	}
+}
+
+/*
+ * Compute the content sketch of a regular file. Small files are read entirely,
+ * larger ones are sampled at evenly spaced offsets. The sketch is left zeroed
+ * if the file cannot be read.
+ */
+static void
+file_sketch(int fd, uint64_t size, uchar_t *buf, uint32_t *sketch)
+{
+	uint64_t off;
+	ssize_t rd;
+	int k;
+
+	*sketch = UINT32_MAX;
+	if (size <= SKETCH_BUF_SIZE) {
+		rd = Read(fd, buf, size);
+		if (rd > 0)
+			sketch_window(buf, rd, sketch);
+	} else {
+		for (k = 0; k < SKETCH_SAMPLES; k++) {
+			off = (size - SKETCH_WINDOW) / (SKETCH_SAMPLES - 1) * k;
+			rd = pread(fd, buf, SKETCH_WINDOW, off);
+			if (rd > 0)
+				sketch_window(buf, rd, sketch);
+		}
+	}
+	if (*sketch == UINT32_MAX)
+		*sketch = 0;
+}
+
 /*
  * Fetch the next entry from the pathlist file. If we are doing sorting then this
  * fetches the next entry in ascending order of the predetermined sort keys.
@@ -375,6 +625,7 @@ read_next_path(pc_ctx_t *pctx, char *fpath, char **namechars, int *fpathlen)
 	short namelen;
 	ssize_t rbytes;
 	uchar_t *buf;
+	int n;
 
 	if (pctx->enable_archive_sort) {
 		member_entry_t *mem1, *mem2;
@@ -436,7 +687,7 @@ read_next_path(pc_ctx_t *pctx, char *fpath, char **namechars, int *fpathlen)
 	 * new mmap.
 	 */
 	if (pctx->temp_mmap_len > 0) {
-		int retried, n;
+		int retried;
 
 		if (pctx->temp_file_pos < pctx->temp_mmap_pos ||
 		    pctx->temp_file_pos - pctx->temp_mmap_pos > pctx->temp_mmap_len ||
@@ -494,6 +745,38 @@ do_mmap:
 		return (namelen);
 	}
 
+	/*
+	 * With a background scan wait till the next entry is in the file. Entries
+	 * are written out whole so a complete entry can be read.
+	 */
+	if (s_state.async) {
+		uint64_t avail;
+		int err;
+
+		pthread_mutex_lock(&scan_mutex);
+		while (pctx->temp_file_pos >= a_state.pathlist_size && !s_state.err) {
+			if (a_state.bufpos > 0) {
+				if (flush_pathlist() == -1)
+					s_state.err = 1;
+			} else if (s_state.done) {
+				break;
+			} else {
+				s_state.waiting = 1;
+				pthread_cond_wait(&(s_state.list_cv), &scan_mutex);
+				s_state.waiting = 0;
+			}
+		}
+		err = s_state.err;
+		avail = a_state.pathlist_size;
+		pthread_mutex_unlock(&scan_mutex);
+		if (err) {
+			log_msg(LOG_ERR, 0, "Directory scan failed.");
+			return (-1);
+		}
+		if (pctx->temp_file_pos >= avail)
+			return (0);
+	}
+
 	/*
 	 * This code is used if mmap is not being used for the pathlist file.
 	 */
@@ -508,26 +791,47 @@ do_mmap:
 			return (-1);
 		}
 		fpath[namelen] = '\0';
+		*fpathlen = namelen;
+
+		n = namelen-1;
+		while (fpath[n] == '/' && n > 0) n--;
+		while (fpath[n] != '/' && fpath[n] != '\\' && n > 0) n--;
+		*namechars = &fpath[n+1];
+		pctx->temp_file_pos += sizeof (namelen) + namelen;
 	}
 	return (rbytes);
 }
 
 /*
- * Build list of pathnames in a temp file.
+ * Write out the buffered pathname entries. Called with scan_mutex held.
  */
 static int
-add_pathname(const char *fpath, const struct stat *sb,
-                    int tflag, struct FTW *ftwbuf)
+flush_pathlist(void)
 {
-	short len;
-	uchar_t *buf;
-	const char *basename;
+	ssize_t wrtn;
 
-	if (tflag == FTW_DP) return (0);
-	if (tflag == FTW_DNR || tflag == FTW_NS) {
-		log_msg(LOG_WARN, 0, "Cannot access %s\n", fpath);
+	if (a_state.bufpos == 0)
 		return (0);
+	wrtn = Write(a_state.fd, a_state.pbuf, a_state.bufpos);
+	if (wrtn < a_state.bufpos) {
+		log_msg(LOG_ERR, 1, "Write: ");
+		return (-1);
 	}
+	a_state.bufpos = 0;
+	a_state.pathlist_size += wrtn;
+	return (0);
+}
+
+/*
+ * Build list of pathnames in a temp file. Base is the offset of the basename
+ * within fpath. Called with scan_mutex held.
+ */
+static int
+add_pathname(const char *fpath, const struct stat *sb, int base, uint32_t sketch)
+{
+	short len;
+	uchar_t *buf;
+	const char *basename;
 
 	/*
 	 * Pathname entries are pushed into a memory buffer till buffer is full. The
@@ -535,15 +839,8 @@ add_pathname(const char *fpath, const struct stat *sb,
 	 */
 	a_state.arc_size += (sb->st_size + ARC_ENTRY_OVRHEAD);
 	len = strlen(fpath);
-	if (a_state.bufpos + len + 14 > a_state.bufsiz) {
-		ssize_t wrtn = Write(a_state.fd, a_state.pbuf, a_state.bufpos);
-		if (wrtn < a_state.bufpos) {
-			log_msg(LOG_ERR, 1, "Write: ");
-			return (-1);
-		}
-		a_state.bufpos = 0;
-		a_state.pathlist_size += wrtn;
-	}
+	if (a_state.bufpos + len + 14 > a_state.bufsiz && flush_pathlist() == -1)
+		return (-1);
 
 	/*
 	 * If we are sorting path entries then sort per buffer and then merge when iterating
@@ -554,7 +851,7 @@ add_pathname(const char *fpath, const struct stat *sb,
 		int i;
 		char *dot;
 
-		basename = &fpath[ftwbuf->base];
+		basename = &fpath[base];
 		if (a_state.srt_pos == SORT_BUF_SIZE) {
 			struct sort_buf *srt;
 
@@ -576,7 +873,7 @@ add_pathname(const char *fpath, const struct stat *sb,
 			} else {
 				log_msg(LOG_INFO, 0, "Sorting ...");
 				a_state.srt->max = a_state.srt_pos - 1;
-				qsort(a_state.srt->members, SORT_BUF_SIZE, sizeof (member_entry_t), compare_members);
+				sort_members(a_state.srt->members, SORT_BUF_SIZE);
 				srt->next = NULL;
 				srt->pos = 0;
 				a_state.srt->next = srt;
@@ -605,6 +902,7 @@ add_pathname(const char *fpath, const struct stat *sb,
 		member = &(a_state.srt->members[a_state.srt_pos++]);
 		member->size = sb->st_size;
 		member->file_pos = a_state.pathlist_size + a_state.bufpos;
+		member->sketch = sketch;
 		dot = strrchr(basename, '.');
 
 		// Small NAMELEN so these loops will be unrolled by compiler.
@@ -628,9 +926,410 @@ cont:
 	memcpy(buf, fpath, len);
 	a_state.bufpos += (len + 2);
 	a_state.fcount++;
+
+	/*
+	 * Wake up the archiver or setup_archiver() waiting on a background scan.
+	 */
+	if (s_state.waiting || (s_state.size_wanted && a_state.arc_size >= s_state.size_wanted)) {
+		s_state.size_wanted = 0;
+		pthread_cond_broadcast(&(s_state.list_cv));
+	}
+	return (0);
+}
+
+/*
+ * Queue a directory for scanning. Called with scan_mutex held.
+ */
+static int
+scan_queue_dir(const char *path, int len)
+{
+	struct scan_dir *sd;
+
+	sd = (struct scan_dir *)malloc(sizeof (struct scan_dir) + len);
+	if (sd == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (-1);
+	}
+	memcpy(sd->path, path, len);
+	sd->path[len] = '\0';
+	sd->next = NULL;
+	sd->ents = NULL;
+	sd->names = NULL;
+	sd->nents = 0;
+	sd->done = 0;
+	if (s_state.tail)
+		s_state.tail->next = sd;
+	else
+		s_state.head = sd;
+	s_state.tail = sd;
+	if (s_state.next == NULL)
+		s_state.next = sd;
+	pthread_cond_signal(&(s_state.cv));
+	return (0);
+}
+
+static void
+scan_free_dir(struct scan_dir *sd)
+{
+	free(sd->ents);
+	free(sd->names);
+	free(sd);
+}
+
+static int
+compare_scan_entries(const void *a, const void *b)
+{
+	return (strcmp(((const struct scan_entry *)a)->sname,
+	    ((const struct scan_entry *)b)->sname));
+}
+
+/*
+ * Read one directory into sd's entry list, sorted by name. Called without
+ * scan_mutex. Returns -1 if out of memory.
+ */
+static int
+scan_dir(struct scan_dir *sd, char *fpath, uchar_t *skbuf)
+{
+	struct dirent *de;
+	struct stat sb;
+	struct scan_entry *ent;
+	int dfd, dlen, nlen, fd, nalloc, nsize, nused, i;
+	DIR *dirp;
+
+	dfd = open(sd->path, O_RDONLY | O_DIRECTORY);
+	if (dfd == -1 || (dirp = fdopendir(dfd)) == NULL) {
+		log_msg(LOG_WARN, 0, "Cannot access %s\n", sd->path);
+		if (dfd != -1)
+			close(dfd);
+		return (0);
+	}
+
+	dlen = strlen(sd->path);
+	memcpy(fpath, sd->path, dlen);
+	if (dlen > 0 && fpath[dlen - 1] != PATHSEP_CHAR)
+		fpath[dlen++] = PATHSEP_CHAR;
+
+	nalloc = 0;
+	nsize = 0;
+	nused = 0;
+	while ((de = readdir(dirp)) != NULL) {
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+		    (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+		nlen = strlen(de->d_name);
+		if (dlen + nlen >= PATH_MAX) {
+			log_msg(LOG_WARN, 0, "Pathname too long, skipping %s/%s\n",
+			    sd->path, de->d_name);
+			continue;
+		}
+		memcpy(fpath + dlen, de->d_name, nlen + 1);
+		if (fstatat(dfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			log_msg(LOG_WARN, 0, "Cannot access %s\n", fpath);
+			continue;
+		}
+
+		if (sd->nents == nalloc) {
+			nalloc = (nalloc ? nalloc * 2 : 64);
+			ent = (struct scan_entry *)realloc(sd->ents, nalloc * sizeof (*ent));
+			if (ent == NULL)
+				goto oom;
+			sd->ents = ent;
+		}
+		if (nused + nlen + 1 > nsize) {
+			char *names;
+
+			nsize = (nsize ? nsize * 2 : 4096);
+			while (nused + nlen + 1 > nsize)
+				nsize *= 2;
+			names = (char *)realloc(sd->names, nsize);
+			if (names == NULL)
+				goto oom;
+			sd->names = names;
+		}
+		ent = &(sd->ents[sd->nents++]);
+		ent->size = sb.st_size;
+		ent->mode = sb.st_mode;
+		ent->name = nused;
+		memcpy(sd->names + nused, de->d_name, nlen + 1);
+		nused += nlen + 1;
+
+		/*
+		 * File data is sampled outside the lock so that the scan threads
+		 * overlap their reads.
+		 */
+		ent->sketch = 0;
+		if (skbuf && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+			fd = openat(dfd, de->d_name, O_RDONLY | O_NOFOLLOW);
+			if (fd != -1) {
+				file_sketch(fd, sb.st_size, skbuf, &(ent->sketch));
+				close(fd);
+			}
+		}
+	}
+	closedir(dirp);
+
+	for (i = 0; i < sd->nents; i++)
+		sd->ents[i].sname = sd->names + sd->ents[i].name;
+	qsort(sd->ents, sd->nents, sizeof (struct scan_entry), compare_scan_entries);
+	return (0);
+oom:
+	closedir(dirp);
+	log_msg(LOG_ERR, 0, "Out of memory.");
+	return (-1);
+}
+
+/*
+ * Add the entries of a scanned directory to the pathname list and queue its
+ * subdirectories. Called with scan_mutex held.
+ */
+static int
+scan_emit_dir(struct scan_dir *sd, char *fpath)
+{
+	struct stat sb;
+	struct scan_entry *ent;
+	int i, dlen, nlen;
+
+	dlen = strlen(sd->path);
+	memcpy(fpath, sd->path, dlen);
+	if (dlen > 0 && fpath[dlen - 1] != PATHSEP_CHAR)
+		fpath[dlen++] = PATHSEP_CHAR;
+
+	memset(&sb, 0, sizeof (sb));
+	for (i = 0; i < sd->nents; i++) {
+		ent = &(sd->ents[i]);
+		nlen = strlen(ent->sname);
+		memcpy(fpath + dlen, ent->sname, nlen + 1);
+		sb.st_size = ent->size;
+		sb.st_mode = ent->mode;
+		if (add_pathname(fpath, &sb, dlen, ent->sketch) == -1)
+			return (-1);
+		if (S_ISDIR(ent->mode) && scan_queue_dir(fpath, dlen + nlen) == -1)
+			return (-1);
+	}
 	return (0);
 }
 
+static void *
+scan_thread_func(void *dat)
+{
+	struct scan_dir *sd;
+	char *fpath;
+	uchar_t *skbuf;
+	int rv;
+
+	fpath = (char *)malloc(PATH_MAX);
+	skbuf = NULL;
+	if (a_state.similarity)
+		skbuf = (uchar_t *)malloc(SKETCH_BUF_SIZE);
+	pthread_mutex_lock(&scan_mutex);
+	if (fpath == NULL || (a_state.similarity && skbuf == NULL)) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		s_state.err = 1;
+	}
+	for (;;) {
+		/*
+		 * Directories being read can still queue more, so wait till
+		 * everything queued has been added to the list.
+		 */
+		while (s_state.next == NULL && s_state.head != NULL && !s_state.err)
+			pthread_cond_wait(&(s_state.cv), &scan_mutex);
+		if (s_state.next == NULL || s_state.err)
+			break;
+		sd = s_state.next;
+		s_state.next = sd->next;
+		pthread_mutex_unlock(&scan_mutex);
+
+		rv = scan_dir(sd, fpath, skbuf);
+
+		pthread_mutex_lock(&scan_mutex);
+		sd->done = 1;
+		if (rv == -1)
+			s_state.err = 1;
+		while (s_state.head != NULL && s_state.head->done && !s_state.err) {
+			sd = s_state.head;
+			if (scan_emit_dir(sd, fpath) == -1)
+				s_state.err = 1;
+			s_state.head = sd->next;
+			if (s_state.head == NULL)
+				s_state.tail = NULL;
+			scan_free_dir(sd);
+		}
+		if (s_state.head == NULL)
+			pthread_cond_broadcast(&(s_state.cv));
+	}
+
+	/*
+	 * Nothing left to scan or an error occured, wake up the others.
+	 */
+	pthread_cond_broadcast(&(s_state.cv));
+	pthread_mutex_unlock(&scan_mutex);
+	free(fpath);
+	free(skbuf);
+	return (NULL);
+}
+
+/*
+ * Scan a directory hierarchy using multiple threads. The directory itself is
+ * added first followed by everything below it in breadth first order.
+ * Called with scan_mutex held.
+ */
+static int
+scan_tree(pc_ctx_t *pctx, const char *path, struct stat *sb, int base)
+{
+	pthread_t *threads;
+	int i, nthreads, started;
+	struct scan_dir *sd;
+
+	s_state.head = NULL;
+	s_state.tail = NULL;
+	s_state.next = NULL;
+	if (add_pathname(path, sb, base, 0) == -1 || scan_queue_dir(path, strlen(path)) == -1)
+		return (-1);
+
+	/*
+	 * Directory scanning is mostly waiting on the filesystem, so use a few
+	 * threads even on small systems.
+	 */
+	nthreads = pctx->nthreads;
+	if (nthreads < SCAN_THREADS_MIN)
+		nthreads = SCAN_THREADS_MIN;
+	if (nthreads > SCAN_THREADS_MAX)
+		nthreads = SCAN_THREADS_MAX;
+	threads = (pthread_t *)malloc(nthreads * sizeof (pthread_t));
+	if (threads == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (-1);
+	}
+
+	/*
+	 * The caller holds scan_mutex so the threads block until we drop it
+	 * below.
+	 */
+	started = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_thread_func, NULL) != 0) {
+			log_msg(LOG_WARN, 1, "Unable to create directory scan thread.");
+			break;
+		}
+		started++;
+	}
+	pthread_mutex_unlock(&scan_mutex);
+	if (started == 0)
+		scan_thread_func(NULL);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_lock(&scan_mutex);
+	free(threads);
+
+	while (s_state.head) {
+		sd = s_state.head;
+		s_state.head = sd->next;
+		scan_free_dir(sd);
+	}
+	s_state.tail = NULL;
+	s_state.next = NULL;
+	return (s_state.err ? -1 : 0);
+}
+
+/*
+ * Add everything given on the command line to the pathname list. Called with
+ * scan_mutex held.
+ */
+static int
+scan_inputs(pc_ctx_t *pctx)
+{
+	struct fn_list *fn;
+	char *pos;
+	int err, fd, base;
+
+	for (fn = pctx->fn; fn != NULL && !s_state.err; fn = fn->next) {
+		struct stat sb;
+
+		if (lstat(fn->filename, &sb) == -1) {
+			log_msg(LOG_ERR, 1, "Ignoring %s.", fn->filename);
+			continue;
+		}
+
+		/*
+		 * Find out basename.
+		 */
+		pos = strrchr(fn->filename, PATHSEP_CHAR);
+		if (pos)
+			base = pos - fn->filename + 1;
+		else
+			base = 0;
+		if (S_ISDIR(sb.st_mode)) {
+			err = scan_tree(pctx, fn->filename, &sb, base);
+		} else {
+			uint32_t sketch;
+
+			sketch = 0;
+			if (a_state.similarity && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+				uchar_t *skbuf;
+
+				skbuf = (uchar_t *)malloc(SKETCH_BUF_SIZE);
+				fd = open(fn->filename, O_RDONLY | O_NOFOLLOW);
+				if (skbuf && fd != -1)
+					file_sketch(fd, sb.st_size, skbuf, &sketch);
+				if (fd != -1)
+					close(fd);
+				free(skbuf);
+			}
+			err = add_pathname(fn->filename, &sb, base, sketch);
+			a_state.arc_size -= ARC_ENTRY_OVRHEAD;
+		}
+		if (err == -1)
+			return (-1);
+		if (flush_pathlist() == -1)
+			return (-1);
+	}
+	return (s_state.err ? -1 : 0);
+}
+
+/*
+ * Background scan. The archiver is woken up as pathnames are added and once
+ * the scan is done.
+ */
+static void *
+scan_driver_func(void *dat)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)dat;
+
+	pthread_mutex_lock(&scan_mutex);
+	if (scan_inputs(pctx) == -1)
+		s_state.err = 1;
+	else if (flush_pathlist() == -1)
+		s_state.err = 1;
+	pctx->archive_size = a_state.arc_size;
+	pctx->archive_members_count = a_state.fcount;
+	s_state.done = 1;
+	pthread_cond_broadcast(&(s_state.list_cv));
+	pthread_mutex_unlock(&scan_mutex);
+	return (NULL);
+}
+
+/*
+ * Stop a background scan if it is still running and release the scan state.
+ */
+static void
+scan_finish(pc_ctx_t *pctx)
+{
+	if (!s_state.async)
+		return;
+	pthread_mutex_lock(&scan_mutex);
+	if (!s_state.done) {
+		s_state.err = 1;
+		pthread_cond_broadcast(&(s_state.cv));
+	}
+	pthread_mutex_unlock(&scan_mutex);
+	pthread_join(s_state.driver, NULL);
+	pthread_cond_destroy(&(s_state.cv));
+	pthread_cond_destroy(&(s_state.list_cv));
+	close(a_state.fd);
+	free(a_state.pbuf);
+	s_state.async = 0;
+}
+
 /*
  * Archiving related functions.
  * This one creates a list of files to be included into the archive and
@@ -640,10 +1339,9 @@ int
 setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 {
 	char *tmpfile, *tmp;
-	int err, fd;
+	int err, fd, fd1, nthreads;
 	uchar_t *pbuf;
 	struct archive *arc;
-	struct fn_list *fn;
 
 	/*
 	 * If sorting is enabled create the initial sort buffer.
@@ -684,10 +1382,10 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 	}
 
 	/*
-	 * Use nftw() to scan all the directory hierarchies provided on the command
-	 * line and generate a consolidated list of pathnames to be archived. By
-	 * doing this we can sort the pathnames and estimate the total archive size.
-	 * Total archive size is needed by the subsequent compression stages.
+	 * Scan all the directory hierarchies provided on the command line and
+	 * generate a consolidated list of pathnames to be archived. By doing this
+	 * we can sort the pathnames and estimate the total archive size. Total
+	 * archive size is needed by the subsequent compression stages.
 	 */
 	log_msg(LOG_INFO, 0, "Scanning files.");
 	sbuf->st_size = 0;
@@ -695,11 +1393,12 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 	pctx->archive_members_count = 0;
 
 	/*
-	 * nftw requires using global state variable. So we lock to be mt-safe.
+	 * The pathname list uses global state variables. So we lock to be mt-safe.
 	 * This means only one directory tree scan can happen at a time.
 	 */
-	pthread_mutex_lock(&nftw_mutex);
-	fn = pctx->fn;
+	pthread_mutex_lock(&scan_mutex);
+	pthread_cond_init(&(s_state.cv), NULL);
+	pthread_cond_init(&(s_state.list_cv), NULL);
 	a_state.pbuf = pbuf;
 	a_state.bufsiz = pctx->chunksize;
 	a_state.bufpos = 0;
@@ -708,69 +1407,80 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 	a_state.srt_pos = 0;
 	a_state.head = a_state.srt;
 	a_state.pathlist_size = 0;
+	a_state.arc_size = 0;
+	a_state.fcount = 0;
+	a_state.similarity = (pctx->enable_archive_sort && pctx->enable_similarity_sort);
+	if (a_state.similarity) {
+		log_msg(LOG_INFO, 0, "Computing content sketches.");
+		sketch_init();
+	}
+	s_state.err = 0;
+	s_state.done = 0;
+	s_state.waiting = 0;
+	s_state.size_wanted = 0;
 
-	while (fn) {
-		struct stat sb;
+	/*
+	 * Unsorted members are archived while the scan goes on. Compression is
+	 * set up once enough data is found to keep all the threads busy. Global
+	 * Deduplication sizes its index from the total so it waits for the scan.
+	 */
+	s_state.async = 0;
+	if (!pctx->enable_archive_sort && !pctx->enable_rabin_global &&
+	    (fd1 = open(tmpfile, O_RDONLY)) != -1) {
+		nthreads = pctx->nthreads;
+		if (nthreads <= 0)
+			nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		s_state.size_wanted = pctx->chunksize * nthreads;
+		if (pthread_create(&(s_state.driver), NULL, scan_driver_func, pctx) == 0) {
+			s_state.async = 1;
+		} else {
+			s_state.size_wanted = 0;
+			close(fd1);
+		}
+	}
 
-		if (lstat(fn->filename, &sb) == -1) {
-			log_msg(LOG_ERR, 1, "Ignoring %s.", fn->filename);
-			fn = fn->next;
-			continue;
+	if (s_state.async) {
+		while (!s_state.done && s_state.size_wanted)
+			pthread_cond_wait(&(s_state.list_cv), &scan_mutex);
+		s_state.size_wanted = 0;
+		err = (s_state.done && s_state.err);
+		pctx->archive_size = a_state.arc_size;
+		pctx->archive_members_count = a_state.fcount;
+		pthread_mutex_unlock(&scan_mutex);
+		if (err) {
+			scan_finish(pctx);
+			close(fd1);  unlink(tmpfile);
+			return (-1);
+		}
+		pctx->enable_archive_sort = 0;
+	} else {
+		if (scan_inputs(pctx) == -1) {
+			pthread_cond_destroy(&(s_state.cv));
+			pthread_cond_destroy(&(s_state.list_cv));
+			pthread_mutex_unlock(&scan_mutex);
+			close(fd);  unlink(tmpfile);
+			return (-1);
 		}
+		pctx->archive_size = a_state.arc_size;
+		pctx->archive_members_count = a_state.fcount;
 
-		a_state.arc_size = 0;
-		a_state.fcount = 0;
-		if (S_ISDIR(sb.st_mode)) {
-			err = nftw(fn->filename, add_pathname, 1024, FTW_PHYS);
+		if (a_state.srt == NULL) {
+			pctx->enable_archive_sort = 0;
 		} else {
-			int tflag;
-			struct FTW ftwbuf;
-			char *pos;
-
-			if (S_ISLNK(sb.st_mode))
-				tflag = FTW_SL;
-			else
-				tflag = FTW_F;
-
-			/*
-			 * Find out basename to mimic FTW.
-			 */
-			pos = strrchr(fn->filename, PATHSEP_CHAR);
-			if (pos)
-				ftwbuf.base = pos - fn->filename + 1;
-			else
-				ftwbuf.base = 0;
-			add_pathname(fn->filename, &sb, tflag, &ftwbuf);
-			a_state.arc_size = sb.st_size;
-		}
-		if (a_state.bufpos > 0) {
-			ssize_t wrtn = Write(a_state.fd, a_state.pbuf, a_state.bufpos);
-			if (wrtn < a_state.bufpos) {
-				log_msg(LOG_ERR, 1, "Write failed.");
-				close(fd);  unlink(tmpfile);
-				return (-1);
-			}
-			a_state.bufpos = 0;
-			a_state.pathlist_size += wrtn;
+			log_msg(LOG_INFO, 0, "Sorting ...");
+			a_state.srt->max = a_state.srt_pos - 1;
+			sort_members(a_state.srt->members, a_state.srt_pos);
+			pctx->archive_temp_size = a_state.pathlist_size;
 		}
-		pctx->archive_size += a_state.arc_size;
-		pctx->archive_members_count += a_state.fcount;
-		fn = fn->next;
+		pthread_cond_destroy(&(s_state.cv));
+		pthread_cond_destroy(&(s_state.list_cv));
+		pthread_mutex_unlock(&scan_mutex);
+		lseek(fd, 0, SEEK_SET);
+		free(pbuf);
+		fd1 = fd;
 	}
 
-	if (a_state.srt == NULL) {
-		pctx->enable_archive_sort = 0;
-	} else {
-		log_msg(LOG_INFO, 0, "Sorting ...");
-		a_state.srt->max = a_state.srt_pos - 1;
-		qsort(a_state.srt->members, a_state.srt_pos, sizeof (member_entry_t), compare_members);
-		pctx->archive_temp_size = a_state.pathlist_size;
-	}
-	pthread_mutex_unlock(&nftw_mutex);
-
 	sbuf->st_size = pctx->archive_size;
-	lseek(fd, 0, SEEK_SET);
-	free(pbuf);
 	sbuf->st_uid = geteuid();
 	sbuf->st_gid = getegid();
 	sbuf->st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
@@ -778,7 +1488,8 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 	arc = archive_write_new();
 	if (!arc) {
 		log_msg(LOG_ERR, 1, "Unable to create libarchive context.\n");
-		close(fd);
+		scan_finish(pctx);
+		close(fd1);
 		unlink(tmpfile);
 		return (-1);
 	}
@@ -786,16 +1497,30 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 	archive_write_set_bytes_per_block(arc, 0);
 	archive_write_open(arc, pctx, arc_open_callback,
 			   creat_write_callback, creat_close_callback);
+
+	/*
+	 * Member data can only be read straight into the chunk buffers if
+	 * libarchive passes it through unbuffered and unfiltered.
+	 */
+	pctx->arc_direct = (archive_format(arc) == ARCHIVE_FORMAT_TAR_PAX_RESTRICTED &&
+	    archive_write_get_bytes_per_block(arc) == 0 && archive_filter_count(arc) == 1 &&
+	    archive_filter_code(arc, 0) == ARCHIVE_FILTER_NONE);
+	if (!pctx->arc_direct)
+		log_msg(LOG_WARN, 0, "Libarchive buffers output, member data will be copied.");
 	pctx->archive_ctx = arc;
-	pctx->archive_members_fd = fd;
-	pctx->temp_mmap_len = TEMP_MMAP_SIZE;
-	pctx->temp_mmap_buf = mmap(NULL, pctx->temp_mmap_len, PROT_READ,
-				   MAP_SHARED, pctx->archive_members_fd, 0);
-	if (pctx->temp_mmap_buf == NULL) {
-		log_msg(LOG_WARN, 1, "Unable to mmap pathlist file, switching to read().");
-		pctx->temp_mmap_len = 0;
+	pctx->archive_members_fd = fd1;
+	pctx->temp_mmap_len = 0;
+	if (!s_state.async) {
+		pctx->temp_mmap_len = TEMP_MMAP_SIZE;
+		pctx->temp_mmap_buf = mmap(NULL, pctx->temp_mmap_len, PROT_READ,
+					   MAP_SHARED, pctx->archive_members_fd, 0);
+		if (pctx->temp_mmap_buf == NULL) {
+			log_msg(LOG_WARN, 1, "Unable to mmap pathlist file, switching to read().");
+			pctx->temp_mmap_len = 0;
+		}
 	}
 	pctx->temp_mmap_pos = 0;
+	pctx->temp_file_pos = 0;
 	pctx->arc_writing = 0;
 
 	return (0);
@@ -830,7 +1555,8 @@ setup_extractor(pc_ctx_t *pctx)
 
 static ssize_t
 process_by_filter(int fd, int typ, struct archive *target_arc,
-    struct archive *source_arc, struct archive_entry *entry, int cmp)
+    struct archive *source_arc, struct archive_entry *entry, int cmp,
+    struct filter_output *fout)
 {
 	struct filter_info fi;
 	int64_t wrtn;
@@ -838,6 +1564,7 @@ process_by_filter(int fd, int typ, struct archive *target_arc,
 	fi.source_arc = source_arc;
 	fi.target_arc = target_arc;
 	fi.entry = entry;
+	fi.fout = fout;
 	fi.fd = fd;
 	fi.compressing = cmp;
 	fi.block_size = AW_BLOCK_SIZE;
@@ -849,35 +1576,296 @@ process_by_filter(int fd, int typ, struct archive *target_arc,
 	return (wrtn);
 }
 
+/*
+ * Member prefetch pool. The archiver reads pathnames through a lookahead
+ * window of the next few members. Worker threads stat and open these members
+ * ahead of time and read small files into a buffer, or hint the kernel to
+ * start reading larger ones, so that the archiver thread does not wait on
+ * open and first read latency for each member. Members having a filter that
+ * can be run ahead of time (presently packJPG) are also converted by the
+ * workers. The archiver consumes members strictly in order.
+ */
+#define	PREFETCH_THREADS_MIN	2
+#define	PREFETCH_READ_MAX	(256 * 1024)
+#define	PREFETCH_ADVISE_SIZE	(4 * 1024 * 1024)
+
+typedef struct arc_member {
+	char fpath[PATH_MAX];
+	char *bnchars;
+	int fpathlen, rbytes, typ;
+	int queued, waited;
+	int fd, have_st;
+	struct stat st;
+	uchar_t *data;
+	struct filter_output fout;
+	sem_t done_sem;
+} arc_member_t;
+
+struct member_pool {
+	arc_member_t *win, **queue;
+	int win_size, win_head, win_count, eof;
+	int qhead, qtail, stop;
+	int nworkers;
+	pthread_t *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+};
+
+static void
+member_prefetch(arc_member_t *mem)
+{
+	int typ, fd;
+
+	if (lstat(mem->fpath, &(mem->st)) == -1)
+		return;
+	mem->have_st = 1;
+	if (!S_ISREG(mem->st.st_mode) || mem->st.st_size == 0)
+		return;
+	fd = open(mem->fpath, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	typ = mem->typ;
+	if (typ != TYPE_UNKNOWN && typetab[(typ >> 3)].filter_pre_func != NULL) {
+		(*(typetab[(typ >> 3)].filter_pre_func))(fd, mem->st.st_size,
+		    &(mem->fout), typetab[(typ >> 3)].filter_private);
+		if (mem->fout.result == 0) {
+			mem->fd = fd;
+			return;
+		}
+	}
+
+	if (mem->st.st_size <= PREFETCH_READ_MAX) {
+		mem->data = filter_buffer_get(mem->st.st_size);
+		if (mem->data != NULL && Read(fd, mem->data, mem->st.st_size) < mem->st.st_size) {
+			filter_buffer_release(mem->data);
+			mem->data = NULL;
+		}
+	} else {
+#ifdef	POSIX_FADV_WILLNEED
+		posix_fadvise(fd, 0, PREFETCH_ADVISE_SIZE, POSIX_FADV_WILLNEED);
+#endif
+	}
+	mem->fd = fd;
+}
+
+static void *
+member_worker_func(void *dat)
+{
+	struct member_pool *mp = (struct member_pool *)dat;
+	arc_member_t *mem;
+
+	for (;;) {
+		pthread_mutex_lock(&(mp->lock));
+		while (mp->qhead == mp->qtail && !mp->stop)
+			pthread_cond_wait(&(mp->cv), &(mp->lock));
+		if (mp->qhead == mp->qtail) {
+			pthread_mutex_unlock(&(mp->lock));
+			break;
+		}
+		mem = mp->queue[mp->qhead % mp->win_size];
+		mp->qhead++;
+		pthread_mutex_unlock(&(mp->lock));
+
+		/*
+		 * When stopping just drain the queue. The archiver falls back to
+		 * doing everything in-line for members that are skipped here.
+		 */
+		if (!mp->stop)
+			member_prefetch(mem);
+		sem_post(&(mem->done_sem));
+	}
+	return (NULL);
+}
+
+static int
+member_pool_init(pc_ctx_t *pctx, struct member_pool *mp)
+{
+	int i, nworkers;
+
+	memset(mp, 0, sizeof (struct member_pool));
+	nworkers = pctx->nthreads;
+	if (nworkers < PREFETCH_THREADS_MIN)
+		nworkers = PREFETCH_THREADS_MIN;
+
+	mp->win_size = nworkers * 2;
+	mp->win = (arc_member_t *)calloc(mp->win_size, sizeof (arc_member_t));
+	mp->queue = (arc_member_t **)calloc(mp->win_size, sizeof (arc_member_t *));
+	if (mp->win == NULL || mp->queue == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		free(mp->win);
+		free(mp->queue);
+		mp->win = NULL;
+		mp->queue = NULL;
+		return (-1);
+	}
+	for (i = 0; i < mp->win_size; i++) {
+		sem_init(&(mp->win[i].done_sem), 0, 0);
+		mp->win[i].fd = -1;
+	}
+
+	pthread_mutex_init(&(mp->lock), NULL);
+	pthread_cond_init(&(mp->cv), NULL);
+	mp->workers = (pthread_t *)malloc(nworkers * sizeof (pthread_t));
+	if (mp->workers == NULL) {
+		log_msg(LOG_WARN, 0, "Out of memory, members will not be prefetched.");
+		return (0);
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&(mp->workers[i]), NULL, member_worker_func, mp) != 0) {
+			log_msg(LOG_WARN, 1, "Unable to create prefetch thread.");
+			break;
+		}
+		mp->nworkers++;
+	}
+	return (0);
+}
+
+/*
+ * Wait for a queued member and release its prefetched state.
+ */
+static void
+member_release(arc_member_t *mem)
+{
+	if (mem->queued && !mem->waited) {
+		sem_wait(&(mem->done_sem));
+		mem->waited = 1;
+	}
+	if (mem->fd != -1) {
+		close(mem->fd);
+		mem->fd = -1;
+	}
+	filter_buffer_release(mem->data);
+	mem->data = NULL;
+	filter_buffer_release(mem->fout.out);
+	mem->fout.out = NULL;
+}
+
+/*
+ * Release the current member and return the next one from the lookahead window,
+ * refilling the window from the pathlist and queueing prefetch work as needed.
+ */
+static arc_member_t *
+member_pool_next(pc_ctx_t *pctx, struct member_pool *mp, int advance)
+{
+	arc_member_t *mem;
+
+	if (advance && mp->win_count > 0) {
+		member_release(&(mp->win[mp->win_head]));
+		mp->win_head = (mp->win_head + 1) % mp->win_size;
+		mp->win_count--;
+	}
+
+	while (!mp->eof && mp->win_count < mp->win_size) {
+		mem = &(mp->win[(mp->win_head + mp->win_count) % mp->win_size]);
+		mem->queued = 0;
+		mem->waited = 0;
+		mem->have_st = 0;
+		mem->fd = -1;
+		mem->data = NULL;
+		mem->fout.out = NULL;
+		mem->fout.in_size = 0;
+		mem->fout.result = FILTER_RETURN_SKIP;
+		mem->bnchars = NULL;
+		mem->rbytes = read_next_path(pctx, mem->fpath, &(mem->bnchars), &(mem->fpathlen));
+		if (mem->rbytes == 0) {
+			mp->eof = 1;
+			break;
+		}
+		mp->win_count++;
+		if (mem->rbytes == -1) {
+			mp->eof = 1;
+			break;
+		}
+
+		if (mp->nworkers > 0) {
+			mem->typ = detect_type_by_ext(mem->fpath, mem->fpathlen);
+			mem->queued = 1;
+			pthread_mutex_lock(&(mp->lock));
+			mp->queue[mp->qtail % mp->win_size] = mem;
+			mp->qtail++;
+			pthread_cond_signal(&(mp->cv));
+			pthread_mutex_unlock(&(mp->lock));
+		}
+	}
+
+	if (mp->win_count == 0)
+		return (NULL);
+	mem = &(mp->win[mp->win_head]);
+	if (mem->queued && !mem->waited) {
+		sem_wait(&(mem->done_sem));
+		mem->waited = 1;
+	}
+	return (mem);
+}
+
+static void
+member_pool_destroy(struct member_pool *mp)
+{
+	int i;
+
+	if (mp->nworkers > 0) {
+		pthread_mutex_lock(&(mp->lock));
+		mp->stop = 1;
+		pthread_cond_broadcast(&(mp->cv));
+		pthread_mutex_unlock(&(mp->lock));
+		for (i = 0; i < mp->nworkers; i++)
+			pthread_join(mp->workers[i], NULL);
+	}
+	if (mp->win) {
+		for (i = 0; i < mp->win_count; i++)
+			member_release(&(mp->win[(mp->win_head + i) % mp->win_size]));
+		for (i = 0; i < mp->win_size; i++)
+			sem_destroy(&(mp->win[i].done_sem));
+		pthread_mutex_destroy(&(mp->lock));
+		pthread_cond_destroy(&(mp->cv));
+	}
+	free(mp->workers);
+	free(mp->queue);
+	free(mp->win);
+}
+
 /*
  * Routines to archive members and write the file data to the callback. Portions of
  * the following code is adapted from some of the Libarchive bsdtar code.
  */
 static int
-copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ)
+copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ,
+    arc_member_t *mem)
 {
-	size_t sz, offset, len;
+	size_t sz, len;
 	ssize_t bytes_to_write;
-	uchar_t *mapbuf;
+	uchar_t *mapbuf, *cbuf;
+	const void *src;
 	int rv, fd;
 	const char *fpath;
 
-	offset = 0;
 	rv = 0;
+	cbuf = NULL;
 	sz = archive_entry_size(entry);
 	bytes_to_write = sz;
 	fpath = archive_entry_sourcepath(entry);
-	fd = open(fpath, O_RDONLY);
-	if (fd == -1) {
-		log_msg(LOG_ERR, 1, "Failed to open %s.", fpath);
-		return (-1);
+
+	/*
+	 * Use the file descriptor opened by the prefetch worker if there is one.
+	 */
+	if (mem != NULL && mem->fd != -1) {
+		fd = mem->fd;
+		mem->fd = -1;
+	} else {
+		fd = open(fpath, O_RDONLY);
+		if (fd == -1) {
+			log_msg(LOG_ERR, 1, "Failed to open %s.", fpath);
+			return (-1);
+		}
 	}
 
 	if (typ != TYPE_UNKNOWN) {
 		if (typetab[(typ >> 3)].filter_func != NULL) {
 			int64_t rv;
 
-			rv = process_by_filter(fd, typ, arc, NULL, entry, 1); 
+			rv = process_by_filter(fd, typ, arc, NULL, entry, 1,
+			    mem ? &(mem->fout) : NULL);
 			if (rv == FILTER_RETURN_ERROR) {
 				close(fd);
 				return (-1);
@@ -889,78 +1877,136 @@ copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
 	}
 
 	/*
-	 * Use mmap for copying file data. Not necessarily for performance, but it saves on
-	 * resident memory use.
+	 * Small files are already read in by the prefetch worker.
 	 */
-	while (bytes_to_write > 0) {
-		uchar_t *src;
-		size_t wlen;
+	if (mem != NULL && mem->data != NULL && mem->st.st_size == sz) {
 		ssize_t wrtn;
 
-		if (bytes_to_write < MMAP_SIZE)
-			len = bytes_to_write;
-		else
-			len = MMAP_SIZE;
-do_map:
-		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
-		if (mapbuf == NULL) {
-			/* Mmap failed; this is bad. */
-			log_msg(LOG_ERR, 1, "Mmap failed for %s.", fpath);
-			rv = -1;
-			break;
-		}
-		offset += len;
-		src = mapbuf;
-		wlen = len;
-
 		if (typ == TYPE_UNKNOWN) {
-			pctx->ctype = detect_type_by_data(src, len);
+			pctx->ctype = detect_type_by_data(mem->data, sz);
 			typ = pctx->ctype;
-			if (typ != TYPE_UNKNOWN) {
-				if (typetab[(typ >> 3)].filter_func != NULL) {
-					int64_t rv;
-					munmap(mapbuf, len);
-
-					rv = process_by_filter(fd, typ, arc, NULL, entry, 1); 
-					if (rv == FILTER_RETURN_ERROR) {
-						return (-1);
-					} else if (rv == FILTER_RETURN_SKIP) {
-						lseek(fd, 0, SEEK_SET);
-						typ = TYPE_COMPRESSED;
-						offset = 0;
-						goto do_map;
-					} else {
-						return (ARCHIVE_OK);
-					}
+			if (typ != TYPE_UNKNOWN && typetab[(typ >> 3)].filter_func != NULL) {
+				int64_t rv;
+
+				rv = process_by_filter(fd, typ, arc, NULL, entry, 1, NULL);
+				if (rv == FILTER_RETURN_ERROR) {
+					close(fd);
+					return (-1);
+				} else if (rv != FILTER_RETURN_SKIP) {
+					close(fd);
+					return (ARCHIVE_OK);
 				}
 			}
 		}
-		typ = TYPE_COMPRESSED; // Need to avoid calling detect_type_by_data subsequently.
+		wrtn = archive_write_data(arc, mem->data, sz);
+		if (wrtn < sz) {
+			log_msg(LOG_ERR, 0, "Data write error: %s", archive_error_string(arc));
+			rv = -1;
+		}
+		close(fd);
+		return (rv);
+	}
+
+	/*
+	 * If the extension did not tell us the type, detect it from the first mmap
+	 * window of file data and invoke the filter for that type if one exists.
+	 */
+	if (typ == TYPE_UNKNOWN) {
+		len = (sz < MMAP_SIZE ? sz : MMAP_SIZE);
+		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+		if (mapbuf == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, "Mmap failed for %s.", fpath);
+			close(fd);
+			return (-1);
+		}
+		pctx->ctype = detect_type_by_data(mapbuf, len);
+		typ = pctx->ctype;
+		munmap(mapbuf, len);
+		if (typ != TYPE_UNKNOWN && typetab[(typ >> 3)].filter_func != NULL) {
+			int64_t rv;
+
+			rv = process_by_filter(fd, typ, arc, NULL, entry, 1, NULL);
+			if (rv == FILTER_RETURN_ERROR) {
+				close(fd);
+				return (-1);
+			} else if (rv != FILTER_RETURN_SKIP) {
+				close(fd);
+				return (ARCHIVE_OK);
+			}
+		}
+	}
+
+	/*
+	 * Libarchive still generates the entry header and padding but file data
+	 * is read straight into the compressor's chunk buffers by the write
+	 * callback, avoiding mmap and an extra copy. If libarchive would buffer
+	 * the data (see setup_archiver()) it is read into a bounce buffer instead.
+	 */
+	if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
+		log_msg(LOG_ERR, 1, "Seek failed for %s.", fpath);
+		close(fd);
+		return (-1);
+	}
+	src = fd_source_mark;
+	if (pctx->arc_direct) {
+		pctx->arc_src_fd = fd;
+	} else {
+		if ((cbuf = (uchar_t *)malloc(MMAP_SIZE)) == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory.");
+			close(fd);
+			return (-1);
+		}
+		src = cbuf;
+	}
+	pctx->arc_src_short = 0;
+	while (bytes_to_write > 0) {
+		ssize_t wrtn;
 
 		/*
-		 * Write the entire mmap-ed buffer. Since we are writing to the compressor
-		 * stage there is no need for blocking.
+		 * Write in MMAP_SIZE steps since the write callback decides on chunk
+		 * splits at data type changes based on the size of each write.
 		 */
-		wrtn = archive_write_data(arc, src, wlen);
-		if (wrtn < wlen) {
+		len = (bytes_to_write < MMAP_SIZE ? bytes_to_write : MMAP_SIZE);
+		if (cbuf != NULL) {
+			ssize_t rd;
+
+			rd = Read(fd, cbuf, len);
+			if (rd < (ssize_t)len) {
+				if (rd < 0)
+					rd = 0;
+				memset(cbuf + rd, 0, len - rd);
+				pctx->arc_src_short = 1;
+			}
+		}
+		wrtn = archive_write_data(arc, src, len);
+		if (wrtn <= 0) {
 			/* Write failed; this is bad */
 			log_msg(LOG_ERR, 0, "Data write error: %s", archive_error_string(arc));
 			rv = -1;
+			break;
 		}
 		bytes_to_write -= wrtn;
-		if (rv == -1) break;
-		munmap(mapbuf, len);
 	}
+	free(cbuf);
+	pctx->arc_src_fd = -1;
+	if (pctx->arc_src_short)
+		log_msg(LOG_WARN, 0, "%s: file shrank while being archived.", fpath);
 	close(fd);
 
 	return (rv);
 }
 
 static int
-write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ)
+write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ,
+    arc_member_t *mem)
 {
 	int rv;
 
+	if (pctx->catalog && catalog_add_member(pctx->catalog, entry,
+	    pctx->arc_stream_pos) == -1) {
+		log_msg(LOG_ERR, 0, "Out of memory adding catalog entry.");
+		return (-1);
+	}
 	rv = archive_write_header(arc, entry);
 	if (rv != ARCHIVE_OK) {
 		if (rv == ARCHIVE_FATAL || rv == ARCHIVE_FAILED) {
@@ -974,7 +2020,7 @@ write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, in
 	}
 
 	if (archive_entry_size(entry) > 0) {
-		return (copy_file_data(pctx, arc, entry, typ));
+		return (copy_file_data(pctx, arc, entry, typ, mem));
 	}
 
 	return (0);
@@ -984,21 +2030,265 @@ write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, in
  * Thread function. Archive members and write to pipe. The dispatcher thread
  * reads from the other end and compresses.
  */
+/*
+ * Check whether a member is unchanged since the base archive of an incremental
+ * archive. Unchanged regular files are only recorded in the catalog. Every
+ * member found in the base is marked as seen so that the rest can be recorded
+ * as deleted.
+ */
+static int
+incr_unchanged(pc_ctx_t *pctx, struct archive_entry *entry)
+{
+	catalog_member_t *bm;
+
+	bm = catalog_find(pctx->base_catalog, archive_entry_pathname(entry));
+	if (bm == NULL || (bm->flags & CATALOG_WHITEOUT))
+		return (0);
+	bm->selected = 1;
+	if (archive_entry_filetype(entry) != AE_IFREG || (bm->mode & S_IFMT) != S_IFREG ||
+	    (bm->flags & CATALOG_HARDLINK))
+		return (0);
+	if (bm->size != archive_entry_size(entry) || bm->mtime != archive_entry_mtime(entry) ||
+	    (bm->ino != 0 && bm->mtime_nsec != archive_entry_mtime_nsec(entry)) ||
+	    bm->mode != archive_entry_mode(entry) || bm->uid != archive_entry_uid(entry) ||
+	    bm->gid != archive_entry_gid(entry) ||
+	    (bm->ino != 0 && bm->ino != archive_entry_ino64(entry)))
+		return (0);
+	if (catalog_add_inherited(pctx->catalog, bm, pctx->arc_stream_pos) == -1) {
+		log_msg(LOG_WARN, 0, "Out of memory adding catalog entry.");
+		return (0);
+	}
+	return (1);
+}
+
+static int
+compare_whiteouts(const void *a, const void *b)
+{
+	catalog_member_t *m1 = *((catalog_member_t **)a);
+	catalog_member_t *m2 = *((catalog_member_t **)b);
+
+	return (strcmp(m2->path, m1->path));
+}
+
+/*
+ * Record the members of the base archive that no longer exist. They are written
+ * in descending path order so that directory contents precede the directory.
+ */
+static int
+write_whiteouts(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry)
+{
+	pc_catalog_t *base = pctx->base_catalog;
+	catalog_member_t **del;
+	uint64_t i, ndel;
+	char value[] = "1";
+	int rv;
+
+	del = (catalog_member_t **)malloc((base->nmembers + 1) * sizeof (catalog_member_t *));
+	if (del == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (-1);
+	}
+	ndel = 0;
+	for (i = 0; i < base->nmembers; i++) {
+		catalog_member_t *bm = &(base->members[i]);
+
+		if (bm->selected || (bm->flags & (CATALOG_WHITEOUT | CATALOG_PACK)))
+			continue;
+		if (catalog_find(base, bm->path) != bm)
+			continue;
+		del[ndel++] = bm;
+	}
+	qsort(del, ndel, sizeof (catalog_member_t *), compare_whiteouts);
+
+	rv = 0;
+	for (i = 0; i < ndel; i++) {
+		archive_entry_clear(entry);
+		archive_entry_copy_pathname(entry, del[i]->path);
+		archive_entry_set_filetype(entry, AE_IFREG);
+		archive_entry_set_perm(entry, 0);
+		archive_entry_set_size(entry, 0);
+		archive_entry_set_mtime(entry, time(NULL), 0);
+		archive_entry_xattr_add_entry(entry, XATTR_WHITEOUT, value, strlen(value));
+		if (pctx->verbose)
+			log_msg(LOG_INFO, 0, "  deleted %s", del[i]->path);
+		if (write_entry(pctx, arc, entry, TYPE_UNKNOWN, NULL) != 0) {
+			rv = -1;
+			break;
+		}
+		pctx->catalog->members[pctx->catalog->nmembers - 1].flags |= CATALOG_WHITEOUT;
+		archive_write_finish_entry(arc);
+	}
+	archive_entry_clear(entry);
+	free(del);
+	return (rv);
+}
+
+struct file_pack {
+	uchar_t *buf;
+	uint32_t len, count, seq;
+	int typ;
+	struct archive_entry *entry;
+};
+
+/*
+ * Write out the files collected so far as one pack member.
+ */
+static int
+pack_flush(pc_ctx_t *pctx, struct file_pack *pk, struct archive *arc)
+{
+	struct archive_entry *entry = pk->entry;
+	char name[32], value[] = "1";
+	int ctype, rv;
+
+	if (pk->count == 0)
+		return (0);
+	U32_P(pk->buf) = htonl(pk->count);
+	snprintf(name, sizeof (name), PACK_NAME, pk->seq++);
+	archive_entry_clear(entry);
+	archive_entry_copy_pathname(entry, name);
+	archive_entry_set_filetype(entry, AE_IFREG);
+	archive_entry_set_perm(entry, 0600);
+	archive_entry_set_size(entry, pk->len);
+	archive_entry_set_mtime(entry, time(NULL), 0);
+	archive_entry_xattr_add_entry(entry, XATTR_PACK, value, strlen(value));
+	if (pctx->catalog) {
+		if (catalog_add_member(pctx->catalog, entry, pctx->arc_stream_pos) == -1) {
+			log_msg(LOG_ERR, 0, "Out of memory adding catalog entry.");
+			return (-1);
+		}
+		pctx->catalog->members[pctx->catalog->nmembers - 1].flags |= CATALOG_PACK;
+	}
+
+	/*
+	 * The pack data is handed to the compressor with the type of the files in
+	 * it, which are grouped by type since members are sorted.
+	 */
+	ctype = pctx->ctype;
+	pctx->ctype = pk->typ;
+	rv = 0;
+	if (archive_write_header(arc, entry) != ARCHIVE_OK ||
+	    archive_write_data(arc, pk->buf, pk->len) < pk->len) {
+		log_msg(LOG_ERR, 0, "%s: %s", name, archive_error_string(arc));
+		rv = -1;
+	}
+	archive_write_finish_entry(arc);
+	pctx->ctype = ctype;
+	pk->len = 4;
+	pk->count = 0;
+	return (rv);
+}
+
+/*
+ * Add a small file to the current pack. Returns 1 if the file was packed, 0 if
+ * it has to be archived as a member and -1 on error.
+ */
+static int
+pack_add(pc_ctx_t *pctx, struct file_pack *pk, struct archive *arc,
+    struct archive_entry *entry, int typ, arc_member_t *mem)
+{
+	const char *path;
+	uint32_t plen, size;
+	uchar_t *pos;
+	int fd;
+
+	if (archive_entry_filetype(entry) != AE_IFREG || archive_entry_hardlink(entry) != NULL ||
+	    archive_entry_size(entry) > PACK_FILE_MAX || archive_entry_nlink(entry) > 1 ||
+	    archive_entry_xattr_count(entry) > 0 || archive_entry_acl_count(entry,
+	    ARCHIVE_ENTRY_ACL_TYPE_ACCESS | ARCHIVE_ENTRY_ACL_TYPE_DEFAULT) > 0 ||
+	    archive_entry_fflags_text(entry) != NULL)
+		return (0);
+	if (typ != TYPE_UNKNOWN && typetab[(typ >> 3)].filter_func != NULL)
+		return (0);
+
+	path = archive_entry_pathname(entry);
+	plen = strlen(path);
+	size = archive_entry_size(entry);
+	if (PACK_REC_HDR + plen + size > PACK_SIZE_MAX - 4)
+		return (0);
+	if (pk->count > 0 && (pk->typ != typ ||
+	    pk->len + PACK_REC_HDR + plen + size > PACK_SIZE_MAX)) {
+		if (pack_flush(pctx, pk, arc) == -1)
+			return (-1);
+	}
+
+	pos = pk->buf + pk->len + PACK_REC_HDR + plen;
+	if (size > 0) {
+		if (mem != NULL && mem->data != NULL && mem->st.st_size == size) {
+			memcpy(pos, mem->data, size);
+		} else {
+			fd = open(archive_entry_sourcepath(entry), O_RDONLY);
+			if (fd == -1) {
+				log_msg(LOG_ERR, 1, "Failed to open %s.",
+				    archive_entry_sourcepath(entry));
+				return (-1);
+			}
+			if (Read(fd, pos, size) < size) {
+				log_msg(LOG_ERR, 1, "Failed to read %s.",
+				    archive_entry_sourcepath(entry));
+				close(fd);
+				return (-1);
+			}
+			close(fd);
+		}
+	}
+	if (pctx->catalog && catalog_add_packed(pctx->catalog, entry,
+	    pctx->arc_stream_pos) == -1) {
+		log_msg(LOG_ERR, 0, "Out of memory adding catalog entry.");
+		return (-1);
+	}
+
+	pos = pk->buf + pk->len;
+	U32_P(pos) = htonl(plen);
+	U32_P(pos + 4) = htonl(archive_entry_mode(entry));
+	U32_P(pos + 8) = htonl(archive_entry_uid(entry));
+	U32_P(pos + 12) = htonl(archive_entry_gid(entry));
+	U64_P(pos + 16) = htonll(archive_entry_mtime(entry));
+	U32_P(pos + 24) = htonl(archive_entry_mtime_nsec(entry));
+	U32_P(pos + 28) = htonl(size);
+	memcpy(pos + PACK_REC_HDR, path, plen);
+	pk->len += PACK_REC_HDR + plen + size;
+	pk->typ = typ;
+	pk->count++;
+	return (1);
+}
+
 static void *
 archiver_thread_func(void *dat) {
 	pc_ctx_t *pctx = (pc_ctx_t *)dat;
-	char fpath[PATH_MAX], *name, *bnchars = NULL; // Silence compiler
-	int warn, rbytes, fpathlen = 0; // Silence compiler
+	char *fpath, *name, *bnchars;
+	int warn, fpathlen;
 	uint32_t ctr;
 	struct archive_entry *entry, *spare_entry, *ent;
 	struct archive *arc, *ard;
 	struct archive_entry_linkresolver *resolver;
-	int readdisk_flags;
+	struct member_pool mpool;
+	struct file_pack pack;
+	arc_member_t *mem;
+	int readdisk_flags, rv;
 
 	warn = 1;
 	entry = archive_entry_new();
 	arc = (struct archive *)(pctx->archive_ctx);
 
+	memset(&pack, 0, sizeof (pack));
+	if (pctx->enable_file_pack) {
+		pack.buf = (uchar_t *)malloc(PACK_SIZE_MAX);
+		pack.entry = archive_entry_new();
+		if (pack.buf == NULL || pack.entry == NULL) {
+			log_msg(LOG_WARN, 0, "Out of memory, small files will not be packed.");
+			free(pack.buf);
+			pack.buf = NULL;
+		}
+		pack.len = 4;
+	}
+
+	if (pctx->enable_file_dedup) {
+		pctx->filedup = filedup_new(pctx->archive_members_count, pctx->cksum,
+		    pctx->cksum_bytes);
+		if (pctx->filedup == NULL)
+			log_msg(LOG_WARN, 0, "Out of memory, duplicate files will be archived.");
+	}
+
 	if ((resolver = archive_entry_linkresolver_new()) != NULL) {
 		archive_entry_linkresolver_set_strategy(resolver, archive_format(arc));
 	} else {
@@ -1016,23 +2306,29 @@ archiver_thread_func(void *dat) {
 
 	/*
 	 * Read next path entry from list file. read_next_path() also handles sorted reading.
+	 * Path entries are fetched through the prefetch pool's lookahead window.
 	 */
-	while ((rbytes = read_next_path(pctx, fpath, &bnchars, &fpathlen)) != 0) {
+	mem = NULL;
+	if (member_pool_init(pctx, &mpool) == -1)
+		goto done;
+	while ((mem = member_pool_next(pctx, &mpool, mem != NULL)) != NULL) {
 		int typ;
 
-		if (rbytes == -1) break;
+		if (mem->rbytes == -1) break;
+		fpath = mem->fpath;
+		bnchars = mem->bnchars;
+		fpathlen = mem->fpathlen;
 		archive_entry_copy_sourcepath(entry, fpath);
-		if (archive_read_disk_entry_from_file(ard, entry, -1, NULL) != ARCHIVE_OK) {
+		if (archive_read_disk_entry_from_file(ard, entry, -1,
+		    mem->have_st ? &(mem->st) : NULL) != ARCHIVE_OK) {
 			log_msg(LOG_WARN, 1, "archive_read_disk_entry_from_file:\n  %s", archive_error_string(ard));
 			archive_entry_clear(entry);
 			continue;
 		}
 
 		typ = TYPE_UNKNOWN;
-		if (archive_entry_filetype(entry) == AE_IFREG) {
-			if ((typ = detect_type_by_ext(fpath, fpathlen)) != TYPE_UNKNOWN)
-				pctx->ctype = typ;
-		}
+		if (archive_entry_filetype(entry) == AE_IFREG)
+			typ = detect_type_by_ext(fpath, fpathlen);
 
 		/*
 		 * Strip leading '/' or '../' or '/../' from member name.
@@ -1075,125 +2371,852 @@ archiver_thread_func(void *dat) {
 		if (name != archive_entry_pathname(entry))
 			archive_entry_copy_pathname(entry, name);
 
-		if (archive_entry_filetype(entry) != AE_IFREG) {
-			archive_entry_set_size(entry, 0);
-		} else {
-			archive_entry_set_size(entry, archive_entry_size(entry));
-		}
-		if (pctx->verbose)
-			log_msg(LOG_INFO, 0, "%5d/%5d %8d %s", ctr, pctx->archive_members_count,
-			    archive_entry_size(entry), name);
+		if (archive_entry_filetype(entry) != AE_IFREG) {
+			archive_entry_set_size(entry, 0);
+		} else {
+			archive_entry_set_size(entry, archive_entry_size(entry));
+		}
+		if (pctx->base_catalog && incr_unchanged(pctx, entry)) {
+			archive_entry_clear(entry);
+			ctr++;
+			continue;
+		}
+
+		/*
+		 * Only members that are stored here may set the data type.
+		 */
+		if (typ != TYPE_UNKNOWN)
+			pctx->ctype = typ;
+		if (pctx->verbose)
+			log_msg(LOG_INFO, 0, "%5d/%5d %8d %s", ctr, pctx->archive_members_count,
+			    archive_entry_size(entry), name);
+
+		archive_entry_linkify(resolver, &entry, &spare_entry);
+		ent = entry;
+		while (ent != NULL) {
+			/*
+			 * A regular file identical to one archived earlier is stored as a
+			 * reference to that one. The marker tells extraction to restore it
+			 * as a separate file and not as a hard link.
+			 */
+			if (pctx->filedup && archive_entry_filetype(ent) == AE_IFREG &&
+			    archive_entry_hardlink(ent) == NULL) {
+				const char *orig;
+				uchar_t *data;
+				char value[] = "1";
+
+				data = NULL;
+				if (ent == entry && mem->data != NULL &&
+				    mem->st.st_size == archive_entry_size(ent))
+					data = mem->data;
+				orig = filedup_lookup(pctx->filedup, archive_entry_sourcepath(ent),
+				    archive_entry_pathname(ent), archive_entry_size(ent), data);
+				if (orig != NULL) {
+					if (pctx->verbose)
+						log_msg(LOG_INFO, 0, "  %s is a duplicate of %s",
+						    archive_entry_pathname(ent), orig);
+					archive_entry_copy_hardlink(ent, orig);
+					archive_entry_set_size(ent, 0);
+					archive_entry_xattr_add_entry(ent, XATTR_DUP_FILE, value,
+					    strlen(value));
+				}
+			}
+
+			/*
+			 * Members referring to an earlier file must come after the pack
+			 * holding it.
+			 */
+			if (pack.buf != NULL) {
+				rv = pack_add(pctx, &pack, arc, ent, typ, ent == entry ? mem : NULL);
+				if (rv == -1)
+					goto done;
+				if (rv == 1) {
+					ent = spare_entry;
+					spare_entry = NULL;
+					continue;
+				}
+				if (archive_entry_hardlink(ent) != NULL &&
+				    pack_flush(pctx, &pack, arc) == -1)
+					goto done;
+			}
+			if (write_entry(pctx, arc, ent, typ, mem) != 0) {
+				goto done;
+			}
+			ent = spare_entry;
+			spare_entry = NULL;
+		}
+		archive_write_finish_entry(arc);
+		archive_entry_clear(entry);
+		ctr++;
+	}
+	if (pack.buf != NULL && pack_flush(pctx, &pack, arc) == -1)
+		goto done;
+	if (pctx->base_catalog && (mem == NULL || mem->rbytes != -1))
+		write_whiteouts(pctx, arc, entry);
+
+done:
+	free(pack.buf);
+	if (pack.entry != NULL)
+		archive_entry_free(pack.entry);
+	member_pool_destroy(&mpool);
+	filedup_free(pctx->filedup);
+	pctx->filedup = NULL;
+
+	/*
+	 * Record the end of the last member before the end of archive blocks are
+	 * written by archive_write_free().
+	 */
+	if (pctx->catalog)
+		catalog_set_end(pctx->catalog, pctx->arc_stream_pos);
+	if (pctx->temp_mmap_len > 0)
+		munmap(pctx->temp_mmap_buf, pctx->temp_mmap_len);
+	archive_entry_free(entry);
+	archive_entry_linkresolver_free(resolver);
+	archive_read_free(ard);
+	archive_write_free(arc);
+	scan_finish(pctx);
+	close(pctx->archive_members_fd);
+	unlink(pctx->archive_members_file);
+	return (NULL);
+}
+
+int
+start_archiver(pc_ctx_t *pctx) {
+	return (pthread_create(&(pctx->archive_thread), NULL, archiver_thread_func, (void *)pctx));
+}
+
+/*
+ * The next two functions are from libArchive source/example:
+ * https://github.com/libarchive/libarchive/wiki/Examples#wiki-A_Complete_Extractor
+ * 
+ * We have to use low-level APIs to extract entries to disk. Normally one would use
+ * archive_read_extract2() but LibArchive has no option to set user-defined filter
+ * routines, so we have to handle here.
+ */
+static int
+copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entry,
+    int typ)
+{
+	int64_t offset;
+	const void *buff;
+	size_t size;
+	int r;
+
+	if (typ != TYPE_UNKNOWN) {
+		if (typetab[(typ >> 3)].filter_func != NULL) {
+			int64_t rv;
+
+			rv = process_by_filter(-1, typ, aw, ar, entry, 0, NULL);
+			if (rv == FILTER_RETURN_ERROR) {
+				archive_set_error(ar, archive_errno(aw),
+				    "%s", archive_error_string(aw));
+				return (ARCHIVE_FATAL);
+
+			} else if (rv == FILTER_RETURN_SKIP) {
+				log_msg(LOG_WARN, 0, "Filter function failed for entry.");
+				return (ARCHIVE_WARN);
+			} else {
+				return (ARCHIVE_OK);
+			}
+		}
+	}
+
+	for (;;) {
+		r = archive_read_data_block(ar, &buff, &size, &offset);
+		if (r == ARCHIVE_EOF)
+			return (ARCHIVE_OK);
+		if (r != ARCHIVE_OK)
+			return (r);
+		r = (int)archive_write_data_block(aw, buff, size, offset);
+		if (r < ARCHIVE_WARN)
+			r = ARCHIVE_WARN;
+		if (r != ARCHIVE_OK) {
+			archive_set_error(ar, archive_errno(aw),
+			    "%s", archive_error_string(aw));
+			return (r);
+		}
+	}
+}
+
+static int
+archive_extract_entry(struct archive *a, struct archive_entry *entry,
+    struct archive *ad, int typ)
+{
+	int r, r2;
+
+	r = archive_write_header(ad, entry);
+	if (r < ARCHIVE_WARN)
+		r = ARCHIVE_WARN;
+	if (r != ARCHIVE_OK) {
+		/* If _write_header failed, copy the error. */
+		archive_copy_error(a, ad);
+	} else if (!archive_entry_size_is_set(entry) || archive_entry_size(entry) > 0) {
+		/* Otherwise, pour data into the entry. */
+		r = copy_data_out(a, ad, entry, typ);
+	}
+	r2 = archive_write_finish_entry(ad);
+	if (r2 < ARCHIVE_WARN)
+		r2 = ARCHIVE_WARN;
+	/* Use the first message. */
+	if (r2 != ARCHIVE_OK && r == ARCHIVE_OK)
+		archive_copy_error(a, ad);
+	/* Use the worst error return. */
+	if (r2 < r)
+		r = r2;
+	return (r);
+}
+
+/*
+ * A duplicate file is archived as a hard link to its first copy. Restore it as
+ * a separate file by copying the data of the already extracted first copy.
+ */
+static int
+extract_dup_entry(struct archive *a, struct archive_entry *entry, struct archive *ad)
+{
+	const char *orig;
+	struct stat sb;
+	uchar_t *buf;
+	int64_t rd;
+	int fd, r, r2;
+
+	orig = archive_entry_hardlink(entry);
+	fd = open(orig, O_RDONLY);
+	if (fd == -1 || fstat(fd, &sb) == -1) {
+		archive_set_error(a, errno, "Cannot read duplicate source %s", orig);
+		if (fd != -1)
+			close(fd);
+		return (ARCHIVE_WARN);
+	}
+	buf = (uchar_t *)malloc(AW_BLOCK_SIZE);
+	if (buf == NULL) {
+		archive_set_error(a, ENOMEM, "Out of memory.");
+		close(fd);
+		return (ARCHIVE_FATAL);
+	}
+
+	archive_entry_set_hardlink(entry, NULL);
+	archive_entry_set_size(entry, sb.st_size);
+	r = archive_write_header(ad, entry);
+	if (r < ARCHIVE_WARN)
+		r = ARCHIVE_WARN;
+	if (r != ARCHIVE_OK) {
+		archive_copy_error(a, ad);
+	} else {
+		while ((rd = Read(fd, buf, AW_BLOCK_SIZE)) > 0) {
+			if (archive_write_data(ad, buf, rd) < rd) {
+				archive_copy_error(a, ad);
+				r = ARCHIVE_WARN;
+				break;
+			}
+		}
+	}
+	free(buf);
+	close(fd);
+	r2 = archive_write_finish_entry(ad);
+	if (r2 < ARCHIVE_WARN)
+		r2 = ARCHIVE_WARN;
+	if (r2 != ARCHIVE_OK && r == ARCHIVE_OK)
+		archive_copy_error(a, ad);
+	if (r2 < r)
+		r = r2;
+	return (r);
+}
+
+/*
+ * Check a member path that is handled outside libarchive the way its secure
+ * extraction does. Absolute paths, '..' components and parents that are not
+ * directories, like symbolic links, are refused. Missing parent directories
+ * are created if mkparents is set. Returns 0 if the path can be used, 1 if a
+ * parent directory is missing and -1 if the path is refused.
+ */
+static int
+check_member_path(const char *path, int mkparents)
+{
+	char *tmp, *pos;
+	struct stat sb;
+	int rv;
+
+	if (path[0] == '/' || strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0 ||
+	    strstr(path, "/../") != NULL || (strlen(path) >= 3 &&
+	    strcmp(path + strlen(path) - 3, "/..") == 0))
+		return (-1);
+	tmp = strdup(path);
+	if (tmp == NULL)
+		return (-1);
+	rv = 0;
+	for (pos = strchr(tmp, '/'); pos != NULL; pos = strchr(pos + 1, '/')) {
+		*pos = '\0';
+		if (lstat(tmp, &sb) == -1) {
+			if (!mkparents || mkdir(tmp, 0755) == -1) {
+				rv = 1;
+				break;
+			}
+		} else if (!S_ISDIR(sb.st_mode)) {
+			rv = -1;
+			break;
+		}
+		*pos = '/';
+	}
+	free(tmp);
+	return (rv);
+}
+
+/*
+ * Remove a path recorded as deleted in an incremental archive.
+ */
+static void
+remove_whiteout(const char *path, int verbose)
+{
+	struct stat sb;
+	int rv;
+
+	rv = check_member_path(path, 0);
+	if (rv == -1)
+		log_msg(LOG_WARN, 0, "Refusing to delete %s", path);
+	if (rv != 0 || lstat(path, &sb) == -1)
+		return;
+	if ((S_ISDIR(sb.st_mode) ? rmdir(path) : unlink(path)) == -1) {
+		log_msg(LOG_WARN, 1, "Cannot delete %s", path);
+	} else if (verbose) {
+		log_msg(LOG_INFO, 0, "Deleted %s", path);
+	}
+}
+
+/*
+ * Create one file stored in a pack with its metadata, replacing whatever is in
+ * its place like libarchive does.
+ */
+static int
+unpack_file(const char *path, uint32_t mode, uint32_t uid, uint32_t gid, int64_t mtime,
+    uint32_t nsec, uchar_t *data, uint32_t size, int flags, mode_t mask)
+{
+	struct timespec ts[2];
+	struct stat sb;
+	int fd, rv;
+
+	if (check_member_path(path, 1) != 0) {
+		log_msg(LOG_WARN, 0, "Refusing to extract %s", path);
+		return (-1);
+	}
+	if (lstat(path, &sb) == 0) {
+		if ((flags & ARCHIVE_EXTRACT_NO_OVERWRITE_NEWER) && (sb.st_mtime > mtime ||
+		    (sb.st_mtime == mtime && sb.st_mtim.tv_nsec >= nsec)))
+			return (0);
+		if (S_ISDIR(sb.st_mode))
+			rmdir(path);
+		else
+			unlink(path);
+	}
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+	if (fd == -1) {
+		log_msg(LOG_WARN, 1, "Cannot create %s", path);
+		return (-1);
+	}
+	rv = 0;
+	if (Write(fd, data, size) < size) {
+		log_msg(LOG_WARN, 1, "Write failed: %s", path);
+		rv = -1;
+	}
+	if ((flags & ARCHIVE_EXTRACT_OWNER) && fchown(fd, uid, gid) == -1)
+		log_msg(LOG_WARN, 1, "Cannot set owner of %s", path);
+	if (flags & ARCHIVE_EXTRACT_PERM)
+		mode &= 07777;
+	else
+		mode &= 0777 & ~mask;
+	fchmod(fd, mode);
+	if (flags & ARCHIVE_EXTRACT_TIME) {
+		ts[0].tv_sec = mtime;
+		ts[0].tv_nsec = nsec;
+		ts[1] = ts[0];
+		futimens(fd, ts);
+	}
+	close(fd);
+	return (rv);
+}
+
+/*
+ * Extract or list the small files stored in a pack member.
+ */
+static int
+extract_pack(pc_ctx_t *pctx, struct archive *a, struct archive_entry *entry, int flags,
+    uint32_t *ctr)
+{
+	uchar_t *buf, *pos, *end;
+	uint32_t count, i, plen, mode, uid, gid, nsec, size;
+	int64_t len, mtime;
+	char path[PATH_MAX];
+	mode_t mask;
+	int rv, want;
+
+	len = archive_entry_size(entry);
+	if (len < 4 || len > PACK_SIZE_MAX) {
+		log_msg(LOG_WARN, 0, "%s: Invalid pack size.", archive_entry_pathname(entry));
+		archive_read_data_skip(a);
+		return (ARCHIVE_WARN);
+	}
+	buf = (uchar_t *)malloc(len);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (ARCHIVE_FATAL);
+	}
+	if (copy_archive_data(a, buf) != len) {
+		log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		free(buf);
+		return (ARCHIVE_FATAL);
+	}
+	mask = umask(0);
+	umask(mask);
+
+	rv = ARCHIVE_OK;
+	count = ntohl(U32_P(buf));
+	pos = buf + 4;
+	end = buf + len;
+	for (i = 0; i < count; i++) {
+		if (end - pos < PACK_REC_HDR)
+			break;
+		plen = ntohl(U32_P(pos));
+		mode = ntohl(U32_P(pos + 4));
+		uid = ntohl(U32_P(pos + 8));
+		gid = ntohl(U32_P(pos + 12));
+		mtime = ntohll(U64_P(pos + 16));
+		nsec = ntohl(U32_P(pos + 24));
+		size = ntohl(U32_P(pos + 28));
+		if (plen == 0 || plen >= PATH_MAX ||
+		    (uint64_t)plen + size > (uint64_t)(end - pos - PACK_REC_HDR))
+			break;
+		memcpy(path, pos + PACK_REC_HDR, plen);
+		path[plen] = '\0';
+		pos += PACK_REC_HDR + plen;
+
+		/*
+		 * With a catalog the files needed were selected up front, including
+		 * originals of selected duplicates.
+		 */
+		if (pctx->catalog != NULL) {
+			catalog_member_t *cm = catalog_find(pctx->catalog, path);
+			want = (cm != NULL && cm->selected);
+		} else {
+			want = (pctx->member_names == NULL || catalog_name_match(path,
+			    pctx->member_names, pctx->member_count));
+		}
+		if (want) {
+			if (pctx->list_mode) {
+				catalog_print_member(stdout, mode, uid, gid, size, mtime, path,
+				    NULL, 0);
+			} else if (unpack_file(path, mode, uid, gid, mtime, nsec, pos, size,
+			    flags, mask) == -1) {
+				rv = ARCHIVE_WARN;
+			} else if (pctx->verbose) {
+				log_msg(LOG_INFO, 0, "%5d %8d %s", *ctr, size, path);
+			}
+			(*ctr)++;
+		}
+		pos += size;
+	}
+	if (i < count) {
+		log_msg(LOG_WARN, 0, "%s: Corrupt pack.", archive_entry_pathname(entry));
+		rv = ARCHIVE_WARN;
+	}
+	free(buf);
+	return (rv);
+}
+
+/*
+ * Remove the private marker attributes from an entry keeping all others.
+ */
+static void
+strip_private_xattrs(struct archive_entry *entry)
+{
+	struct archive_entry *tmp;
+	const char *xt_name;
+	const void *xt_value;
+	size_t xt_size;
+
+	tmp = archive_entry_new();
+	if (tmp == NULL)
+		return;
+	archive_entry_xattr_reset(entry);
+	while (archive_entry_xattr_next(entry, &xt_name, &xt_value, &xt_size) == ARCHIVE_OK) {
+		if (strncmp(xt_name, XATTR_PRIVATE_PFX, strlen(XATTR_PRIVATE_PFX)) != 0)
+			archive_entry_xattr_add_entry(tmp, xt_name, xt_value, xt_size);
+	}
+	archive_entry_xattr_clear(entry);
+	archive_entry_xattr_reset(tmp);
+	while (archive_entry_xattr_next(tmp, &xt_name, &xt_value, &xt_size) == ARCHIVE_OK)
+		archive_entry_xattr_add_entry(entry, xt_name, xt_value, xt_size);
+	archive_entry_free(tmp);
+}
+
+/*
+ * Regular file members are written to disk by a pool of worker threads during
+ * extraction. The extractor reads the member data into a buffer, queues it and
+ * moves on to the next header. Each worker decodes the member if it has a
+ * post-filter (e.g. packJPG) and creates the file through its own disk writer,
+ * so file creation, data writes and metadata updates for many members proceed
+ * concurrently. Directories, symlinks and other special members are created by
+ * the extractor thread. Directory permissions and times are fixed up when the
+ * extractor's disk writer is closed, after all workers are done.
+ *
+ * Hard links and non-directory special members wait for all queued members to
+ * be written, as does any member whose path is still pending, so that the
+ * final state on disk is the same as with serial extraction.
+ */
+#define	XJOB_FREE	0
+#define	XJOB_QUEUED	1
+#define	XJOB_BUSY	2
+#define	XJOB_DONE	3
+
+typedef struct xtract_job {
+	struct archive_entry *entry;
+	uchar_t *in;
+	uint64_t len;
+	int typ, state, rv;
+	char *err;
+	struct filter_output fout;
+} xtract_job_t;
+
+struct xtract_pool {
+	xtract_job_t *jobs;
+	int njobs, nworkers, stop, flags;
+	pthread_t *workers;
+	struct archive **awd;
+	pthread_mutex_t lock;
+	pthread_cond_t cv, done_cv;
+};
+
+struct xtract_worker {
+	struct xtract_pool *xp;
+	struct archive *ad;
+};
+
+/*
+ * Create the file for a member and write its data. Called by the workers with
+ * the pool lock released, so errors are recorded in the job.
+ */
+static void
+xtract_job_write(xtract_job_t *job, struct archive *ad)
+{
+	struct archive_entry *entry = job->entry;
+	uchar_t *out;
+	int r, r2;
+
+	job->err = NULL;
+	r = archive_write_header(ad, entry);
+	if (r < ARCHIVE_WARN)
+		r = ARCHIVE_WARN;
+	if (r != ARCHIVE_OK) {
+		job->err = strdup(archive_error_string(ad));
+	} else {
+		int64_t offset, len, block_size;
+
+		out = (job->fout.out ? job->fout.out : job->in);
+		len = job->fout.out_size;
+		offset = 0;
+		while (len > 0) {
+			block_size = (len < AW_BLOCK_SIZE ? len : AW_BLOCK_SIZE);
+			r = (int)archive_write_data_block(ad, out + offset, block_size, offset);
+			if (r < ARCHIVE_WARN)
+				r = ARCHIVE_WARN;
+			if (r != ARCHIVE_OK) {
+				job->err = strdup(archive_error_string(ad));
+				break;
+			}
+			offset += block_size;
+			len -= block_size;
+		}
+		if (r == ARCHIVE_OK && job->fout.result == FILTER_RETURN_SKIP) {
+			log_msg(LOG_WARN, 0, "Filter function failed for entry.");
+			r = ARCHIVE_WARN;
+		}
+	}
+	r2 = archive_write_finish_entry(ad);
+	if (r2 < ARCHIVE_WARN)
+		r2 = ARCHIVE_WARN;
+	if (r2 != ARCHIVE_OK && job->err == NULL)
+		job->err = strdup(archive_error_string(ad));
+	if (r2 < r)
+		r = r2;
+	job->rv = r;
+}
+
+static void *
+xtract_worker_func(void *dat)
+{
+	struct xtract_worker *xw = (struct xtract_worker *)dat;
+	struct xtract_pool *xp = xw->xp;
+	xtract_job_t *job;
+	int i, typ;
+
+	pthread_mutex_lock(&(xp->lock));
+	for (;;) {
+		job = NULL;
+		for (i = 0; i < xp->njobs; i++) {
+			if (xp->jobs[i].state == XJOB_QUEUED) {
+				job = &(xp->jobs[i]);
+				break;
+			}
+		}
+		if (job == NULL) {
+			if (xp->stop)
+				break;
+			pthread_cond_wait(&(xp->cv), &(xp->lock));
+			continue;
+		}
+		job->state = XJOB_BUSY;
+		pthread_mutex_unlock(&(xp->lock));
+
+		typ = job->typ;
+		if (job->len > 0 && typ != TYPE_UNKNOWN &&
+		    typetab[(typ >> 3)].filter_post_func != NULL) {
+			(*(typetab[(typ >> 3)].filter_post_func))(job->in, job->len,
+			    &(job->fout), typetab[(typ >> 3)].filter_private);
+		}
+		xtract_job_write(job, xw->ad);
+
+		pthread_mutex_lock(&(xp->lock));
+		job->state = XJOB_DONE;
+		pthread_cond_broadcast(&(xp->done_cv));
+	}
+	pthread_mutex_unlock(&(xp->lock));
+	free(xw);
+	return (NULL);
+}
+
+/*
+ * The pool is created lazily when the first regular file member is seen. By
+ * then the decompression threads are running and pctx->nthreads is final.
+ */
+static int
+xtract_pool_init(pc_ctx_t *pctx, struct xtract_pool *xp, int flags)
+{
+	int i, nworkers;
+
+	nworkers = pctx->nthreads;
+	if (nworkers < 2)
+		return (-1);
+	xp->jobs = (xtract_job_t *)calloc(nworkers * 2, sizeof (xtract_job_t));
+	xp->workers = (pthread_t *)malloc(nworkers * sizeof (pthread_t));
+	xp->awd = (struct archive **)calloc(nworkers, sizeof (struct archive *));
+	if (xp->jobs == NULL || xp->workers == NULL || xp->awd == NULL) {
+		log_msg(LOG_WARN, 0, "Out of memory, extraction will not use threads.");
+		free(xp->jobs);
+		free(xp->workers);
+		free(xp->awd);
+		xp->jobs = NULL;
+		xp->workers = NULL;
+		xp->awd = NULL;
+		return (-1);
+	}
+	xp->njobs = nworkers * 2;
+	xp->flags = flags;
+	pthread_mutex_init(&(xp->lock), NULL);
+	pthread_cond_init(&(xp->cv), NULL);
+	pthread_cond_init(&(xp->done_cv), NULL);
+	for (i = 0; i < nworkers; i++) {
+		struct xtract_worker *xw;
+
+		xw = (struct xtract_worker *)malloc(sizeof (struct xtract_worker));
+		if (xw == NULL)
+			break;
+		xw->xp = xp;
+		xw->ad = archive_write_disk_new();
+		if (xw->ad == NULL) {
+			free(xw);
+			break;
+		}
+		archive_write_disk_set_options(xw->ad, flags);
+		archive_write_disk_set_standard_lookup(xw->ad);
+		if (pthread_create(&(xp->workers[i]), NULL, xtract_worker_func, xw) != 0) {
+			log_msg(LOG_WARN, 1, "Unable to create extraction worker thread.");
+			archive_write_free(xw->ad);
+			free(xw);
+			break;
+		}
+		xp->awd[i] = xw->ad;
+		xp->nworkers++;
+	}
+	return (0);
+}
+
+/*
+ * Report the result of a member written by a worker and release the job slot.
+ * Called with the pool lock released.
+ */
+static int
+xtract_job_done(pc_ctx_t *pctx, xtract_job_t *job, uint32_t *ctr)
+{
+	struct archive_entry *entry = job->entry;
+	int r;
+
+	r = job->rv;
+	if (r != ARCHIVE_OK) {
+		log_msg(LOG_WARN, 0, "%s: %s", archive_entry_pathname(entry),
+		    job->err ? job->err : "Write failed");
 
-		archive_entry_linkify(resolver, &entry, &spare_entry);
-		ent = entry;
-		while (ent != NULL) {
-			if (write_entry(pctx, arc, ent, typ) != 0) {
-				goto done;
-			}
-			ent = spare_entry;
-			spare_entry = NULL;
-		}
-		archive_write_finish_entry(arc);
-		archive_entry_clear(entry);
-		ctr++;
+	} else if (pctx->verbose) {
+		log_msg(LOG_INFO, 0, "%5d %8d %s", *ctr, archive_entry_size(entry),
+		    archive_entry_pathname(entry));
 	}
+	(*ctr)++;
 
-done:
-	if (pctx->temp_mmap_len > 0)
-		munmap(pctx->temp_mmap_buf, pctx->temp_mmap_len);
+	free(job->err);
+	filter_buffer_release(job->fout.out);
+	filter_buffer_release(job->in);
 	archive_entry_free(entry);
-	archive_entry_linkresolver_free(resolver);
-	archive_read_free(ard);
-	archive_write_free(arc);
-	close(pctx->archive_members_fd);
-	unlink(pctx->archive_members_file);
-	return (NULL);
+	job->err = NULL;
+	job->fout.out = NULL;
+	job->in = NULL;
+	job->entry = NULL;
+	return (r);
 }
 
-int
-start_archiver(pc_ctx_t *pctx) {
-	return (pthread_create(&(pctx->archive_thread), NULL, archiver_thread_func, (void *)pctx));
+/*
+ * Reap completed members. If wait_all is set, block until every queued member
+ * has been written, otherwise if wait_slot is set block until at least one job
+ * slot is free.
+ */
+static int
+xtract_pool_flush(pc_ctx_t *pctx, struct xtract_pool *xp, uint32_t *ctr, int wait_all,
+    int wait_slot)
+{
+	int i, pending, nfree, rv, r;
+	xtract_job_t *job;
+
+	if (xp->jobs == NULL)
+		return (ARCHIVE_OK);
+	rv = ARCHIVE_OK;
+	pthread_mutex_lock(&(xp->lock));
+	for (;;) {
+		pending = 0;
+		nfree = 0;
+		job = NULL;
+		for (i = 0; i < xp->njobs; i++) {
+			if (xp->jobs[i].state == XJOB_DONE && job == NULL)
+				job = &(xp->jobs[i]);
+			else if (xp->jobs[i].state == XJOB_FREE)
+				nfree++;
+			else
+				pending++;
+		}
+		if (job != NULL) {
+			pthread_mutex_unlock(&(xp->lock));
+			r = xtract_job_done(pctx, job, ctr);
+			if (r < rv)
+				rv = r;
+			pthread_mutex_lock(&(xp->lock));
+			job->state = XJOB_FREE;
+			continue;
+		}
+		if ((wait_all && pending > 0) || (wait_slot && nfree == 0)) {
+			pthread_cond_wait(&(xp->done_cv), &(xp->lock));
+			continue;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&(xp->lock));
+	return (rv);
 }
 
 /*
- * The next two functions are from libArchive source/example:
- * https://github.com/libarchive/libarchive/wiki/Examples#wiki-A_Complete_Extractor
- * 
- * We have to use low-level APIs to extract entries to disk. Normally one would use
- * archive_read_extract2() but LibArchive has no option to set user-defined filter
- * routines, so we have to handle here.
+ * Check whether a member with the given path is still queued or being written.
+ * Only the extractor thread changes job entries so no locking is needed.
  */
 static int
-copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entry,
-    int typ)
+xtract_pool_pending(struct xtract_pool *xp, const char *path)
 {
-	int64_t offset;
-	const void *buff;
-	size_t size;
-	int r;
+	int i;
 
-	if (typ != TYPE_UNKNOWN) {
-		if (typetab[(typ >> 3)].filter_func != NULL) {
-			int64_t rv;
+	if (xp->jobs == NULL)
+		return (0);
+	for (i = 0; i < xp->njobs; i++) {
+		if (xp->jobs[i].entry != NULL &&
+		    strcmp(archive_entry_pathname(xp->jobs[i].entry), path) == 0)
+			return (1);
+	}
+	return (0);
+}
 
-			rv = process_by_filter(-1, typ, aw, ar, entry, 0); 
-			if (rv == FILTER_RETURN_ERROR) {
-				archive_set_error(ar, archive_errno(aw),
-				    "%s", archive_error_string(aw));
-				return (ARCHIVE_FATAL);
+/*
+ * Read the current member's data and queue it for writing. Returns ARCHIVE_OK
+ * if the member was queued, 1 if it must be extracted in-line and ARCHIVE_FATAL
+ * if reading the member data failed.
+ */
+static int
+xtract_pool_submit(pc_ctx_t *pctx, struct xtract_pool *xp, struct archive *a,
+    struct archive_entry *entry, int typ, int flags, uint32_t *ctr)
+{
+	xtract_job_t *job;
+	int64_t len;
+	int i;
 
-			} else if (rv == FILTER_RETURN_SKIP) {
-				log_msg(LOG_WARN, 0, "Filter function failed for entry.");
-				return (ARCHIVE_WARN);
-			} else {
-				return (ARCHIVE_OK);
-			}
+	if (xp->jobs == NULL) {
+		if (xp->nworkers < 0 || xtract_pool_init(pctx, xp, flags) == -1) {
+			xp->nworkers = -1;
+			return (1);
 		}
 	}
+	len = archive_entry_size(entry);
+	if (xp->nworkers == 0 || len > FILTER_SIZE_LIMIT)
+		return (1);
 
-	for (;;) {
-		r = archive_read_data_block(ar, &buff, &size, &offset);
-		if (r == ARCHIVE_EOF)
-			return (ARCHIVE_OK);
-		if (r != ARCHIVE_OK)
-			return (r);
-		r = (int)archive_write_data_block(aw, buff, size, offset);
-		if (r < ARCHIVE_WARN)
-			r = ARCHIVE_WARN;
-		if (r != ARCHIVE_OK) {
-			archive_set_error(ar, archive_errno(aw),
-			    "%s", archive_error_string(aw));
-			return (r);
+	if (xtract_pool_flush(pctx, xp, ctr, 0, 1) == ARCHIVE_FATAL)
+		return (ARCHIVE_FATAL);
+
+	job = NULL;
+	for (i = 0; i < xp->njobs; i++) {
+		if (xp->jobs[i].state == XJOB_FREE) {
+			job = &(xp->jobs[i]);
+			break;
+		}
+	}
+	job->in = NULL;
+	if (len > 0) {
+		job->in = filter_buffer_get(len);
+		if (job->in == NULL)
+			return (1);
+		if (copy_archive_data(a, job->in) != len) {
+			log_msg(LOG_ERR, 0, "Failed to read archive data.");
+			filter_buffer_release(job->in);
+			job->in = NULL;
+			return (ARCHIVE_FATAL);
 		}
 	}
+	job->entry = archive_entry_clone(entry);
+	job->len = len;
+	job->typ = typ;
+	job->fout.out = NULL;
+	job->fout.out_size = len;
+	job->fout.result = 0;
+
+	pthread_mutex_lock(&(xp->lock));
+	job->state = XJOB_QUEUED;
+	pthread_cond_signal(&(xp->cv));
+	pthread_mutex_unlock(&(xp->lock));
+	return (ARCHIVE_OK);
 }
 
-static int
-archive_extract_entry(struct archive *a, struct archive_entry *entry,
-    struct archive *ad, int typ)
+static void
+xtract_pool_destroy(pc_ctx_t *pctx, struct xtract_pool *xp, uint32_t *ctr)
 {
-	int r, r2;
-
-	r = archive_write_header(ad, entry);
-	if (r < ARCHIVE_WARN)
-		r = ARCHIVE_WARN;
-	if (r != ARCHIVE_OK) {
-		/* If _write_header failed, copy the error. */
-		archive_copy_error(a, ad);
-	} else if (!archive_entry_size_is_set(entry) || archive_entry_size(entry) > 0) {
-		/* Otherwise, pour data into the entry. */
-		r = copy_data_out(a, ad, entry, typ);
+	int i;
+
+	if (xp->jobs == NULL)
+		return;
+	xtract_pool_flush(pctx, xp, ctr, 1, 0);
+	pthread_mutex_lock(&(xp->lock));
+	xp->stop = 1;
+	pthread_cond_broadcast(&(xp->cv));
+	pthread_mutex_unlock(&(xp->lock));
+	for (i = 0; i < xp->nworkers; i++) {
+		pthread_join(xp->workers[i], NULL);
+		archive_write_free(xp->awd[i]);
 	}
-	r2 = archive_write_finish_entry(ad);
-	if (r2 < ARCHIVE_WARN)
-		r2 = ARCHIVE_WARN;
-	/* Use the first message. */
-	if (r2 != ARCHIVE_OK && r == ARCHIVE_OK)
-		archive_copy_error(a, ad);
-	/* Use the worst error return. */
-	if (r2 < r)
-		r = r2;
-	return (r);
+	pthread_mutex_destroy(&(xp->lock));
+	pthread_cond_destroy(&(xp->cv));
+	pthread_cond_destroy(&(xp->done_cv));
+	free(xp->awd);
+	free(xp->workers);
+	free(xp->jobs);
 }
 
 /*
@@ -1208,6 +3231,7 @@ extractor_thread_func(void *dat) {
 	uint32_t ctr;
 	struct archive_entry *entry;
 	struct archive *awd, *arc;
+	struct xtract_pool xpool;
 
 	flags = ARCHIVE_EXTRACT_TIME;
 	flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
@@ -1235,12 +3259,13 @@ extractor_thread_func(void *dat) {
 		got_cwd = 0;
 	}
 
-	if (chdir(pctx->to_filename) == -1) {
+	if (!pctx->list_mode && chdir(pctx->to_filename) == -1) {
 		log_msg(LOG_ERR, 1, "Cannot change to dir: %s", pctx->to_filename);
 		goto done;
 	}
 
 	ctr = 1;
+	memset(&xpool, 0, sizeof (xpool));
 	awd = archive_write_disk_new();
 	archive_write_disk_set_options(awd, flags);
 	archive_write_disk_set_standard_lookup(awd);
@@ -1253,7 +3278,7 @@ extractor_thread_func(void *dat) {
 	while ((rv = archive_read_next_header(arc, &entry)) != ARCHIVE_EOF) {
 		const char *xt_name, *xt_value;
 		size_t xt_size;
-		int typ;
+		int typ, ftype, dup, whiteout, pack, marked;
 
 		if (rv != ARCHIVE_OK)
 			log_msg(LOG_WARN, 0, "%s", archive_error_string(arc));
@@ -1275,14 +3300,32 @@ extractor_thread_func(void *dat) {
 		}
 
 		/*
-		 * Workaround for libarchive weirdness on Non MAC OS X platforms for filenames
-		 * starting with '._'. See above ...
+		 * Look for the private markers set when archiving and drop them so that
+		 * they do not end up on disk.
 		 */
-#ifndef	__APPLE__
+		dup = 0;
+		whiteout = 0;
+		pack = 0;
+		marked = 0;
 		if (archive_entry_xattr_reset(entry) > 0) {
 			while (archive_entry_xattr_next(entry, &xt_name, (const void **)&xt_value,
 			    &xt_size) == ARCHIVE_OK) {
-				if (xt_name[0] == '@' && xt_name[1] == '.' && xt_value[0] == 'm') {
+				if (strcmp(xt_name, XATTR_DUP_FILE) == 0) {
+					dup = 1;
+					marked = 1;
+				} else if (strcmp(xt_name, XATTR_WHITEOUT) == 0) {
+					whiteout = 1;
+					marked = 1;
+				} else if (strcmp(xt_name, XATTR_PACK) == 0) {
+					pack = 1;
+					marked = 1;
+				}
+#ifndef	__APPLE__
+				/*
+				 * Workaround for libarchive weirdness on Non MAC OS X platforms
+				 * for filenames starting with '._'. See above ...
+				 */
+				else if (xt_name[0] == '@' && xt_name[1] == '.' && xt_value[0] == 'm') {
 					const char *name;
 					char *pos;
 					name = archive_entry_pathname(entry);
@@ -1291,14 +3334,88 @@ extractor_thread_func(void *dat) {
 						*pos = '.';
 						archive_entry_set_pathname(entry, name);
 					}
-					archive_entry_xattr_clear(entry);
-					break;
+					marked = 1;
 				}
+#endif
+			}
+			if (marked)
+				strip_private_xattrs(entry);
+		}
+
+		/*
+		 * Packed small files are filtered by name individually. Queued
+		 * members are written out first to keep the order on disk.
+		 */
+		if (pack) {
+			if (!pctx->list_mode)
+				xtract_pool_flush(pctx, &xpool, &ctr, 1, 0);
+			if (extract_pack(pctx, arc, entry, flags, &ctr) == ARCHIVE_FATAL) {
+				log_msg(LOG_ERR, 0, "Fatal error aborting extraction.");
+				break;
+			}
+			continue;
+		}
+
+		/*
+		 * Only the named members are wanted. When a catalog is used the stream
+		 * already contains just those and the targets of hard links among them,
+		 * otherwise skip over the others here.
+		 */
+		if (pctx->member_names != NULL && pctx->catalog == NULL && !catalog_name_match(
+		    archive_entry_pathname(entry), pctx->member_names, pctx->member_count)) {
+			archive_read_data_skip(arc);
+			continue;
+		}
+		if (pctx->list_mode) {
+			catalog_print_member(stdout, archive_entry_mode(entry),
+			    archive_entry_uid(entry), archive_entry_gid(entry),
+			    archive_entry_size(entry), archive_entry_mtime(entry),
+			    archive_entry_pathname(entry), archive_entry_hardlink(entry) ?
+			    archive_entry_hardlink(entry) : archive_entry_symlink(entry),
+			    (archive_entry_hardlink(entry) != NULL ? CATALOG_HARDLINK : 0) |
+			    (whiteout ? CATALOG_WHITEOUT : 0));
+			archive_read_data_skip(arc);
+			continue;
+		}
+
+		/*
+		 * Members deleted since the base of an incremental archive are
+		 * removed from the target directory.
+		 */
+		if (whiteout) {
+			xtract_pool_flush(pctx, &xpool, &ctr, 1, 0);
+			remove_whiteout(archive_entry_pathname(entry), pctx->verbose);
+			ctr++;
+			continue;
+		}
+
+		/*
+		 * Regular files are handed to the worker pool. Hard links must not be
+		 * created before their target is on disk and special members or
+		 * members replacing a pending path must not overtake queued members,
+		 * so drain the pool first in those cases.
+		 */
+		ftype = archive_entry_filetype(entry);
+		if (archive_entry_hardlink(entry) != NULL || (ftype != AE_IFREG &&
+		    ftype != AE_IFDIR) || xtract_pool_pending(&xpool,
+		    archive_entry_pathname(entry))) {
+			xtract_pool_flush(pctx, &xpool, &ctr, 1, 0);
+		}
+		if (ftype == AE_IFREG && archive_entry_hardlink(entry) == NULL &&
+		    archive_entry_sparse_count(entry) == 0) {
+			rv = xtract_pool_submit(pctx, &xpool, arc, entry, typ, flags, &ctr);
+			if (rv == ARCHIVE_OK)
+				continue;
+			if (rv == ARCHIVE_FATAL) {
+				log_msg(LOG_ERR, 0, "Fatal error aborting extraction.");
+				break;
 			}
 		}
-#endif
 
-		rv = archive_extract_entry(arc, entry, awd, typ);
+		if (dup && archive_entry_hardlink(entry) != NULL)
+			rv = extract_dup_entry(arc, entry, awd);
+		else
+			rv = archive_extract_entry(arc, entry, awd, typ);
 		if (rv != ARCHIVE_OK) {
 			log_msg(LOG_WARN, 0, "%s: %s", archive_entry_pathname(entry),
 			    archive_error_string(arc));
@@ -1313,13 +3430,19 @@ extractor_thread_func(void *dat) {
 			break;
 		}
 		ctr++;
+		xtract_pool_flush(pctx, &xpool, &ctr, 0, 0);
 	}
+	xtract_pool_destroy(pctx, &xpool, &ctr);
 
+	/*
+	 * Closing the disk writer applies deferred directory permissions and
+	 * times using relative paths, so do it before changing back.
+	 */
+	archive_read_free(arc);
+	archive_write_free(awd);
 	if (got_cwd) {
 		rv = chdir(cwd);
 	}
-	archive_read_free(arc);
-	archive_write_free(awd);
 done:
 	return (NULL);
 }
@@ -1454,6 +3577,9 @@ out:
 #	define COM_MAGIC	(0x21cd)
 #endif
 
+/* ELF e_machine value for ARM64. */
+#define	EM_AARCH64_ID	183
+
 /*
  * Detect a few file types from looking at magic signatures.
  * NOTE: Jpeg files must be detected via '.jpg' or '.jpeg' (case-insensitive)
@@ -1472,6 +3598,18 @@ detect_type_by_data(uchar_t *buf, size_t len)
 	if (U32_P(buf) == ELFINT) {  // Regular ELF, check for 32/64-bit, core dump
 		if (*(buf + 16) != 4) {
 			if (*(buf + 4) == 2) {
+				uint16_t mach;
+
+				/*
+				 * Check the machine type to select the branch
+				 * filter. Data encoding is in byte 5, 1 = LSB.
+				 */
+				if (*(buf + 5) == 1)
+					mach = buf[18] | (buf[19] << 8);
+				else
+					mach = (buf[18] << 8) | buf[19];
+				if (mach == EM_AARCH64_ID)
+					return (TYPE_BINARY|TYPE_EXE_ARM64);
 				return (TYPE_BINARY|TYPE_EXE64);
 			} else {
 				return (TYPE_BINARY|TYPE_EXE32);
@@ -1543,3 +3681,280 @@ detect_type_by_data(uchar_t *buf, size_t len)
 	}
 	return (TYPE_UNKNOWN);
 }
+
+/*
+ * Content type detection for non-archive input. Data types are otherwise only
+ * known when pcompress creates the archive itself. A tar stream, like one piped
+ * in with '-p', is scanned for member headers as it is read and each regular
+ * member is typed by its name or its leading data. Chunks are ended where the
+ * member type changes, with the same minimum chunk size rule that
+ * creat_write_callback() applies. Other inputs are typed once from the file
+ * name and the first bytes.
+ */
+#define	TAR_BLOCK	512
+
+struct stream_scan {
+	int fd, is_tar, split;
+	int stream_type;
+	uint64_t skip;
+	uchar_t *carry;
+	uint64_t carry_len;
+	char name[PATH_MAX];
+};
+
+static uint64_t
+tar_number(const uchar_t *p, int len)
+{
+	uint64_t val;
+	int i;
+
+	val = 0;
+	if (p[0] & 0x80) {
+		/* GNU base-256 encoding. */
+		val = p[0] & 0x3f;
+		for (i = 1; i < len; i++)
+			val = (val << 8) | p[i];
+		return (val);
+	}
+	for (i = 0; i < len && p[i] == ' '; i++)
+		;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		val = (val << 3) | (p[i] - '0');
+	return (val);
+}
+
+static int
+tar_header_ok(const uchar_t *h)
+{
+	uint64_t sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : h[i];
+	for (i = 0; i < TAR_BLOCK && h[i] == 0; i++)
+		;
+	return (i < TAR_BLOCK && sum == tar_number(h + 148, 8));
+}
+
+/*
+ * Get the member name from a ustar header.
+ */
+static void
+tar_name(const uchar_t *h, char *name)
+{
+	int plen, nlen;
+
+	plen = 0;
+	if (memcmp(h + 257, "ustar", 5) == 0) {
+		plen = strnlen((const char *)h + 345, 155);
+		memcpy(name, h + 345, plen);
+		if (plen > 0)
+			name[plen++] = '/';
+	}
+	nlen = strnlen((const char *)h, 100);
+	memcpy(name + plen, h, nlen);
+	name[plen + nlen] = '\0';
+}
+
+/*
+ * Look for the path record in pax extended header data.
+ */
+static int
+pax_path(const uchar_t *p, uint64_t len, char *name)
+{
+	const uchar_t *end = p + len;
+
+	while (p < end) {
+		uint64_t rlen;
+		const uchar_t *rec;
+
+		rec = p;
+		rlen = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+			rlen = rlen * 10 + (*p++ - '0');
+		if (p >= end || *p != ' ' || rlen == 0 || rlen > end - rec)
+			return (0);
+		p++;
+		if (rec + rlen - p > 5 && memcmp(p, "path=", 5) == 0) {
+			uint64_t nlen = rec + rlen - p - 6;
+
+			if (nlen >= PATH_MAX)
+				return (0);
+			memcpy(name, p + 5, nlen);
+			name[nlen] = '\0';
+			return (1);
+		}
+		p = rec + rlen;
+	}
+	return (0);
+}
+
+/*
+ * Push the unused tail of a buffer back so that it is returned first by the
+ * next read.
+ */
+static void
+stream_scan_unread(struct stream_scan *ss, uchar_t *buf, uint64_t len)
+{
+	memmove(ss->carry + len, ss->carry, ss->carry_len);
+	memcpy(ss->carry, buf, len);
+	ss->carry_len += len;
+}
+
+/*
+ * Set up content type detection on the input. Chunks are never split when
+ * split is zero, for example when the whole input is a single chunk.
+ */
+int
+stream_scan_init(pc_ctx_t *pctx, int fd, const char *filename, uint64_t chunksize, int split)
+{
+	struct stream_scan *ss;
+
+	ss = (struct stream_scan *)calloc(1, sizeof (struct stream_scan));
+	if (ss == NULL)
+		return (-1);
+	ss->carry = (uchar_t *)malloc(chunksize);
+	if (ss->carry == NULL) {
+		free(ss);
+		return (-1);
+	}
+	ss->fd = fd;
+	ss->is_tar = -1;
+	ss->split = split;
+	ss->stream_type = TYPE_UNKNOWN;
+	if (filename != NULL)
+		ss->stream_type = detect_type_by_ext(filename, strlen(filename));
+	pctx->stream_scan = ss;
+	return (0);
+}
+
+void
+stream_scan_free(pc_ctx_t *pctx)
+{
+	if (pctx->stream_scan == NULL)
+		return;
+	free(pctx->stream_scan->carry);
+	free(pctx->stream_scan);
+	pctx->stream_scan = NULL;
+}
+
+/*
+ * Read the next chunk of input and set its type in pctx->btype. A tar chunk
+ * can be returned short if it ends at a member whose type differs.
+ */
+int64_t
+stream_scan_read(pc_ctx_t *pctx, uchar_t *buf, uint64_t count)
+{
+	struct stream_scan *ss = pctx->stream_scan;
+	uint64_t len, off, mstart, hoff, size, dsize;
+	int64_t rv;
+	uchar_t *h;
+	int flag, typ, have_name;
+
+	len = (ss->carry_len < count ? ss->carry_len : count);
+	if (len > 0) {
+		memcpy(buf, ss->carry, len);
+		ss->carry_len -= len;
+		memmove(ss->carry, ss->carry + len, ss->carry_len);
+	}
+	if (len < count) {
+		rv = Read(ss->fd, buf + len, count - len);
+		if (rv < 0)
+			return (rv);
+		len += rv;
+	}
+	if (len == 0)
+		return (0);
+
+	if (ss->is_tar == -1) {
+		ss->is_tar = (len >= TAR_BLOCK && memcmp(buf + 257, "ustar", 5) == 0 &&
+		    tar_header_ok(buf));
+		if (!ss->is_tar && ss->stream_type == TYPE_UNKNOWN && len >= TAR_BLOCK)
+			ss->stream_type = detect_type_by_data(buf, len);
+	}
+	if (!ss->is_tar) {
+		pctx->btype = ss->stream_type;
+		return (len);
+	}
+
+	pctx->btype = TYPE_UNKNOWN;
+	off = ss->skip;
+	while (off < len) {
+		mstart = off;
+		have_name = 0;
+
+		/*
+		 * Skip over pax extended and GNU long name headers picking up the
+		 * name of the member that follows them.
+		 */
+		for (;;) {
+			if (len - off < TAR_BLOCK)
+				goto partial;
+			h = buf + off;
+			if (!tar_header_ok(h)) {
+				/* End of archive or not a tar stream after all. */
+				ss->is_tar = 0;
+				ss->stream_type = TYPE_UNKNOWN;
+				return (len);
+			}
+			size = tar_number(h + 124, 12);
+			flag = h[156];
+			dsize = (size + TAR_BLOCK - 1) & ~((uint64_t)TAR_BLOCK - 1);
+			if (flag != 'x' && flag != 'L')
+				break;
+			if (len - off - TAR_BLOCK < dsize)
+				goto partial;
+			if (flag == 'x') {
+				have_name |= pax_path(h + TAR_BLOCK, size, ss->name);
+			} else if (!have_name && size > 0) {
+				uint64_t nlen = (size < PATH_MAX ? size : PATH_MAX - 1);
+
+				memcpy(ss->name, h + TAR_BLOCK, nlen);
+				ss->name[nlen] = '\0';
+				have_name = 1;
+			}
+			off += TAR_BLOCK + dsize;
+		}
+		if (!have_name)
+			tar_name(h, ss->name);
+		hoff = off;
+		off += TAR_BLOCK + dsize;
+		if (flag != '0' && flag != '\0' && flag != '7')
+			continue;
+
+		typ = detect_type_by_ext(ss->name, strlen(ss->name));
+		if (typ == TYPE_UNKNOWN && size > 0 && len - hoff - TAR_BLOCK >= TAR_BLOCK) {
+			typ = detect_type_by_data(buf + hoff + TAR_BLOCK,
+			    (size < len - hoff - TAR_BLOCK ? size : len - hoff - TAR_BLOCK));
+		}
+		if (typ == pctx->btype)
+			continue;
+		if (pctx->btype == TYPE_UNKNOWN || mstart == 0) {
+			pctx->btype = typ;
+		} else if (mstart < pctx->min_chunk || !ss->split) {
+			if (ss->split && size > pctx->min_chunk - mstart)
+				pctx->btype = typ;
+		} else {
+			stream_scan_unread(ss, buf + mstart, len - mstart);
+			ss->skip = 0;
+			return (mstart);
+		}
+	}
+	ss->skip = off - len;
+	return (len);
+
+partial:
+	/*
+	 * A header or its extended data runs past the end of the buffer. End the
+	 * chunk before the member so that it is scanned whole by the next read.
+	 */
+	if (mstart > 0 && ss->split) {
+		stream_scan_unread(ss, buf + mstart, len - mstart);
+		ss->skip = 0;
+		return (mstart);
+	}
+	ss->is_tar = 0;
+	ss->stream_type = TYPE_UNKNOWN;
+	return (len);
+}
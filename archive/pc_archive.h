@@ -51,6 +51,10 @@ int setup_extractor(pc_ctx_t *pctx);
 int start_extractor(pc_ctx_t *pctx);
 int64_t archiver_read(void *ctx, void *buf, uint64_t count);
 int64_t archiver_write(void *ctx, void *buf, uint64_t count);
+int stream_scan_init(pc_ctx_t *pctx, int fd, const char *filename, uint64_t chunksize,
+    int split);
+int64_t stream_scan_read(pc_ctx_t *pctx, uchar_t *buf, uint64_t count);
+void stream_scan_free(pc_ctx_t *pctx);
 int archiver_close(void *ctx);
 int init_archive_mod();
 int insert_filter_data(filter_func_ptr func, void *filter_private, const char *ext);
@@ -0,0 +1,804 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Member catalog for indexed archives. See pc_catalog.h for the layout.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <inttypes.h>
+#include <utils.h>
+#include <xxhash.h>
+#include <lzma_crc.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include "pc_archive.h"
+#include "pc_catalog.h"
+
+#define	CATALOG_HDR_SZ		(4 + 4 + 8)
+#define	CATALOG_CHUNK_SZ	(8 + 8)
+#define	CATALOG_MEMBER_SZ	(8 * 5 + 4 * 6 + 2 * 3)
+#define	CATALOG_MEMBER_SZ_V1	(8 * 4 + 4 * 5 + 2 * 3)
+#define	CATALOG_EOA_SZ		1024
+
+static const uchar_t eoa_blocks[CATALOG_EOA_SZ];
+
+static uchar_t *
+put_u64(uchar_t *pos, uint64_t val)
+{
+	val = htonll(val);
+	memcpy(pos, &val, sizeof (val));
+	return (pos + sizeof (val));
+}
+
+static uchar_t *
+put_u32(uchar_t *pos, uint32_t val)
+{
+	val = htonl(val);
+	memcpy(pos, &val, sizeof (val));
+	return (pos + sizeof (val));
+}
+
+static uchar_t *
+put_u16(uchar_t *pos, uint16_t val)
+{
+	val = htons(val);
+	memcpy(pos, &val, sizeof (val));
+	return (pos + sizeof (val));
+}
+
+static uint64_t
+get_u64(uchar_t **pos)
+{
+	uint64_t val;
+
+	memcpy(&val, *pos, sizeof (val));
+	*pos += sizeof (val);
+	return (ntohll(val));
+}
+
+static uint32_t
+get_u32(uchar_t **pos)
+{
+	uint32_t val;
+
+	memcpy(&val, *pos, sizeof (val));
+	*pos += sizeof (val);
+	return (ntohl(val));
+}
+
+static uint16_t
+get_u16(uchar_t **pos)
+{
+	uint16_t val;
+
+	memcpy(&val, *pos, sizeof (val));
+	*pos += sizeof (val);
+	return (ntohs(val));
+}
+
+pc_catalog_t *
+catalog_new(void)
+{
+	return ((pc_catalog_t *)calloc(1, sizeof (pc_catalog_t)));
+}
+
+void
+catalog_free(pc_catalog_t *cat)
+{
+	uint64_t i;
+
+	if (cat == NULL)
+		return;
+	for (i = 0; i < cat->nmembers; i++) {
+		free(cat->members[i].path);
+		free(cat->members[i].link);
+	}
+	free(cat->members);
+	free(cat->chunks);
+	free(cat->chunk_needed);
+	free(cat->htab);
+	free(cat);
+}
+
+/*
+ * Called by the writer thread, in chunk order, as each chunk is written out.
+ */
+int
+catalog_add_chunk(pc_catalog_t *cat, uint64_t stream_off, uint64_t disk_len)
+{
+	if (cat->nchunks == cat->chunks_alloc) {
+		uint32_t nalloc = cat->chunks_alloc ? cat->chunks_alloc * 2 : 256;
+		catalog_chunk_t *chunks;
+
+		chunks = realloc(cat->chunks, nalloc * sizeof (catalog_chunk_t));
+		if (chunks == NULL)
+			return (-1);
+		cat->chunks = chunks;
+		cat->chunks_alloc = nalloc;
+	}
+	cat->chunks[cat->nchunks].stream_off = stream_off;
+	cat->chunks[cat->nchunks].disk_len = disk_len;
+	cat->chunks[cat->nchunks].file_off = 0;
+	cat->nchunks++;
+	return (0);
+}
+
+/*
+ * Called by the archiver thread before the header of each member is written.
+ * The stream length of the previous member is known at this point.
+ */
+static catalog_member_t *
+catalog_next_member(pc_catalog_t *cat)
+{
+	catalog_member_t *mem;
+
+	if (cat->nmembers == cat->members_alloc) {
+		uint64_t nalloc = cat->members_alloc ? cat->members_alloc * 2 : 1024;
+		catalog_member_t *members;
+
+		members = realloc(cat->members, nalloc * sizeof (catalog_member_t));
+		if (members == NULL)
+			return (NULL);
+		cat->members = members;
+		cat->members_alloc = nalloc;
+	}
+	mem = &(cat->members[cat->nmembers]);
+	memset(mem, 0, sizeof (catalog_member_t));
+	return (mem);
+}
+
+static int
+catalog_fill_member(pc_catalog_t *cat, catalog_member_t *mem, struct archive_entry *entry,
+    uint64_t stream_off)
+{
+	const char *link;
+
+	mem->stream_off = stream_off;
+	mem->size = archive_entry_size(entry);
+	mem->mtime = archive_entry_mtime(entry);
+	mem->mtime_nsec = archive_entry_mtime_nsec(entry);
+	mem->ino = archive_entry_ino64(entry);
+	mem->mode = archive_entry_mode(entry);
+	mem->uid = archive_entry_uid(entry);
+	mem->gid = archive_entry_gid(entry);
+	mem->path = strdup(archive_entry_pathname(entry));
+	if ((link = archive_entry_hardlink(entry)) != NULL) {
+		mem->flags |= CATALOG_HARDLINK;
+	} else {
+		link = archive_entry_symlink(entry);
+	}
+	if (link != NULL)
+		mem->link = strdup(link);
+	if (mem->path == NULL || (link != NULL && mem->link == NULL)) {
+		free(mem->path);
+		free(mem->link);
+		return (-1);
+	}
+	cat->nmembers++;
+	return (0);
+}
+
+int
+catalog_add_member(pc_catalog_t *cat, void *entry, uint64_t stream_off)
+{
+	catalog_member_t *mem;
+
+	if ((mem = catalog_next_member(cat)) == NULL)
+		return (-1);
+	if (cat->open_member > 0) {
+		catalog_member_t *prev = &(cat->members[cat->open_member - 1]);
+		prev->stream_len = stream_off - prev->stream_off;
+	}
+	if (catalog_fill_member(cat, mem, (struct archive_entry *)entry, stream_off) == -1)
+		return (-1);
+	cat->open_member = cat->nmembers;
+	return (0);
+}
+
+/*
+ * Record a small file stored in the next pack member. It has no stream range
+ * of its own.
+ */
+int
+catalog_add_packed(pc_catalog_t *cat, void *entry, uint64_t stream_off)
+{
+	catalog_member_t *mem;
+
+	if ((mem = catalog_next_member(cat)) == NULL)
+		return (-1);
+	if (catalog_fill_member(cat, mem, (struct archive_entry *)entry, stream_off) == -1)
+		return (-1);
+	mem->flags |= CATALOG_PACKED;
+	return (0);
+}
+
+/*
+ * Record an unchanged member of the base archive in the catalog of an
+ * incremental archive.
+ */
+int
+catalog_add_inherited(pc_catalog_t *cat, catalog_member_t *src, uint64_t stream_off)
+{
+	catalog_member_t *mem;
+
+	if ((mem = catalog_next_member(cat)) == NULL)
+		return (-1);
+	*mem = *src;
+	mem->stream_off = stream_off;
+	mem->stream_len = 0;
+	mem->flags &= ~CATALOG_PACKED;
+	mem->flags |= CATALOG_INHERITED;
+	mem->selected = 0;
+	mem->path = strdup(src->path);
+	mem->link = NULL;
+	if (src->link != NULL)
+		mem->link = strdup(src->link);
+	if (mem->path == NULL || (src->link != NULL && mem->link == NULL)) {
+		free(mem->path);
+		free(mem->link);
+		return (-1);
+	}
+	cat->nmembers++;
+	return (0);
+}
+
+void
+catalog_set_end(pc_catalog_t *cat, uint64_t stream_end)
+{
+	cat->stream_end = stream_end;
+	if (cat->open_member > 0) {
+		catalog_member_t *mem = &(cat->members[cat->open_member - 1]);
+		mem->stream_len = stream_end - mem->stream_off;
+	}
+}
+
+/*
+ * Find the chunk containing the given stream offset.
+ */
+static uint32_t
+find_chunk(pc_catalog_t *cat, uint64_t stream_off)
+{
+	uint32_t lo, hi;
+
+	lo = 0;
+	hi = cat->nchunks;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (cat->chunks[mid].stream_off <= stream_off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/*
+ * Serialize the catalog and write it out at the current position of fd,
+ * which is just after the archive trailer.
+ */
+int
+catalog_write(pc_catalog_t *cat, int fd)
+{
+	uchar_t *buf, *pos;
+	uint64_t len, i;
+	uint32_t crc;
+	int rv;
+
+	len = CATALOG_HDR_SZ + (uint64_t)cat->nchunks * CATALOG_CHUNK_SZ;
+	for (i = 0; i < cat->nmembers; i++) {
+		len += CATALOG_MEMBER_SZ + strlen(cat->members[i].path);
+		if (cat->members[i].link)
+			len += strlen(cat->members[i].link);
+	}
+
+	buf = (uchar_t *)malloc(len + CATALOG_FOOTER_SZ);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory writing catalog.");
+		return (-1);
+	}
+	pos = buf;
+	pos = put_u32(pos, CATALOG_VERSION);
+	pos = put_u32(pos, cat->nchunks);
+	pos = put_u64(pos, cat->nmembers);
+	for (i = 0; i < cat->nchunks; i++) {
+		pos = put_u64(pos, cat->chunks[i].stream_off);
+		pos = put_u64(pos, cat->chunks[i].disk_len);
+	}
+
+	for (i = 0; i < cat->nmembers; i++) {
+		catalog_member_t *mem = &(cat->members[i]);
+		uint16_t plen, llen;
+
+		if (mem->flags & (CATALOG_INHERITED | CATALOG_PACKED)) {
+			mem->first_chunk = 0;
+			mem->nchunks = 0;
+		} else if (cat->nchunks > 0) {
+			mem->first_chunk = find_chunk(cat, mem->stream_off);
+			mem->nchunks = 1;
+			if (mem->stream_len > 0) {
+				mem->nchunks = find_chunk(cat, mem->stream_off +
+				    mem->stream_len - 1) - mem->first_chunk + 1;
+			}
+		}
+		plen = strlen(mem->path);
+		llen = mem->link ? strlen(mem->link) : 0;
+		pos = put_u64(pos, mem->stream_off);
+		pos = put_u64(pos, mem->stream_len);
+		pos = put_u64(pos, mem->size);
+		pos = put_u64(pos, mem->mtime);
+		pos = put_u64(pos, mem->ino);
+		pos = put_u32(pos, mem->mtime_nsec);
+		pos = put_u32(pos, mem->mode);
+		pos = put_u32(pos, mem->uid);
+		pos = put_u32(pos, mem->gid);
+		pos = put_u32(pos, mem->first_chunk);
+		pos = put_u32(pos, mem->nchunks);
+		pos = put_u16(pos, mem->flags);
+		pos = put_u16(pos, plen);
+		pos = put_u16(pos, llen);
+		memcpy(pos, mem->path, plen);
+		pos += plen;
+		if (llen) {
+			memcpy(pos, mem->link, llen);
+			pos += llen;
+		}
+	}
+
+	crc = lzma_crc32(buf, len, 0);
+	pos = put_u64(pos, len);
+	pos = put_u32(pos, crc);
+	pos = put_u32(pos, CATALOG_VERSION);
+	memcpy(pos, CATALOG_MAGIC, CATALOG_MAGIC_LEN);
+
+	rv = 0;
+	if (Write(fd, buf, len + CATALOG_FOOTER_SZ) != len + CATALOG_FOOTER_SZ) {
+		log_msg(LOG_ERR, 1, "Write ");
+		rv = -1;
+	}
+	free(buf);
+	return (rv);
+}
+
+/*
+ * Load the catalog from the end of a seekable archive file. The base_off
+ * argument is the file offset of the first chunk. It is used to compute chunk
+ * positions and to check that the catalog matches the chunks in the file.
+ * If it is CATALOG_NO_BASE these checks are skipped.
+ * Returns 1 if there is no usable catalog, -1 on errors.
+ */
+int
+catalog_read(int fd, uint64_t base_off, pc_catalog_t **catp)
+{
+	uchar_t footer[CATALOG_FOOTER_SZ], *buf, *pos, *end;
+	pc_catalog_t *cat;
+	struct stat sbuf;
+	uint64_t len, i, off;
+	uint32_t crc, version, msz;
+	int nobase;
+
+	*catp = NULL;
+	nobase = (base_off == CATALOG_NO_BASE);
+	if (nobase)
+		base_off = 0;
+	if (fstat(fd, &sbuf) == -1 || !S_ISREG(sbuf.st_mode))
+		return (1);
+	if (sbuf.st_size < base_off + sizeof (uint64_t) + CATALOG_HDR_SZ + CATALOG_FOOTER_SZ)
+		return (1);
+
+	if (pread(fd, footer, CATALOG_FOOTER_SZ, sbuf.st_size - CATALOG_FOOTER_SZ) !=
+	    CATALOG_FOOTER_SZ)
+		return (1);
+	if (memcmp(footer + CATALOG_FOOTER_SZ - CATALOG_MAGIC_LEN, CATALOG_MAGIC,
+	    CATALOG_MAGIC_LEN) != 0)
+		return (1);
+	pos = footer;
+	len = get_u64(&pos);
+	crc = get_u32(&pos);
+	version = get_u32(&pos);
+	msz = (version > 1 ? CATALOG_MEMBER_SZ : CATALOG_MEMBER_SZ_V1);
+	if (version > CATALOG_VERSION) {
+		log_msg(LOG_WARN, 0, "Unsupported catalog version, ignoring catalog.");
+		return (1);
+	}
+	if (len < CATALOG_HDR_SZ || len > sbuf.st_size - CATALOG_FOOTER_SZ - base_off) {
+		log_msg(LOG_WARN, 0, "Catalog length is invalid, ignoring catalog.");
+		return (1);
+	}
+
+	buf = (uchar_t *)malloc(len);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory reading catalog.");
+		return (-1);
+	}
+	if (pread(fd, buf, len, sbuf.st_size - CATALOG_FOOTER_SZ - len) != len) {
+		log_msg(LOG_ERR, 1, "Read: ");
+		free(buf);
+		return (-1);
+	}
+	if (lzma_crc32(buf, len, 0) != crc) {
+		log_msg(LOG_WARN, 0, "Catalog checksum mismatch, ignoring catalog.");
+		free(buf);
+		return (1);
+	}
+
+	cat = catalog_new();
+	if (cat == NULL) {
+		free(buf);
+		return (-1);
+	}
+	pos = buf;
+	end = buf + len;
+	pos += 4; /* Version */
+	cat->nchunks = get_u32(&pos);
+	cat->nmembers = get_u64(&pos);
+	if ((uint64_t)cat->nchunks * CATALOG_CHUNK_SZ > end - pos ||
+	    cat->nmembers > (end - pos) / msz)
+		goto corrupt;
+
+	cat->chunks = (catalog_chunk_t *)malloc(cat->nchunks * sizeof (catalog_chunk_t) + 1);
+	cat->members = (catalog_member_t *)calloc(cat->nmembers + 1, sizeof (catalog_member_t));
+	if (cat->chunks == NULL || cat->members == NULL)
+		goto corrupt;
+	cat->chunks_alloc = cat->nchunks;
+	cat->members_alloc = cat->nmembers;
+
+	off = base_off;
+	for (i = 0; i < cat->nchunks; i++) {
+		cat->chunks[i].stream_off = get_u64(&pos);
+		cat->chunks[i].disk_len = get_u64(&pos);
+		cat->chunks[i].file_off = off;
+		off += cat->chunks[i].disk_len;
+	}
+
+	/*
+	 * Chunks are followed by the zero-length trailer and then the catalog.
+	 */
+	if (!nobase && off + sizeof (uint64_t) + len + CATALOG_FOOTER_SZ != sbuf.st_size) {
+		log_msg(LOG_WARN, 0, "Catalog does not match archive chunks, ignoring catalog.");
+		catalog_free(cat);
+		free(buf);
+		return (1);
+	}
+
+	for (i = 0; i < cat->nmembers; i++) {
+		catalog_member_t *mem = &(cat->members[i]);
+		uint16_t plen, llen;
+
+		if (end - pos < msz)
+			goto corrupt;
+		mem->stream_off = get_u64(&pos);
+		mem->stream_len = get_u64(&pos);
+		mem->size = get_u64(&pos);
+		mem->mtime = get_u64(&pos);
+		if (version > 1) {
+			mem->ino = get_u64(&pos);
+			mem->mtime_nsec = get_u32(&pos);
+		}
+		mem->mode = get_u32(&pos);
+		mem->uid = get_u32(&pos);
+		mem->gid = get_u32(&pos);
+		mem->first_chunk = get_u32(&pos);
+		mem->nchunks = get_u32(&pos);
+		mem->flags = get_u16(&pos);
+		plen = get_u16(&pos);
+		llen = get_u16(&pos);
+		if (end - pos < plen + llen)
+			goto corrupt;
+		mem->path = strndup((char *)pos, plen);
+		pos += plen;
+		if (llen) {
+			mem->link = strndup((char *)pos, llen);
+			pos += llen;
+		}
+		if (mem->path == NULL || (llen && mem->link == NULL))
+			goto corrupt;
+	}
+	free(buf);
+	*catp = cat;
+	return (0);
+
+corrupt:
+	log_msg(LOG_WARN, 0, "Catalog is corrupt, ignoring catalog.");
+	catalog_free(cat);
+	free(buf);
+	return (1);
+}
+
+void
+catalog_print_member(FILE *out, uint32_t mode, uint32_t uid, uint32_t gid,
+    uint64_t size, int64_t mtime, const char *path, const char *link, int flags)
+{
+	char mstr[11], tstr[32];
+	time_t tm;
+	struct tm ltm;
+
+	switch (mode & S_IFMT) {
+	    case S_IFDIR: mstr[0] = 'd'; break;
+	    case S_IFLNK: mstr[0] = 'l'; break;
+	    case S_IFCHR: mstr[0] = 'c'; break;
+	    case S_IFBLK: mstr[0] = 'b'; break;
+	    case S_IFIFO: mstr[0] = 'p'; break;
+	    case S_IFSOCK: mstr[0] = 's'; break;
+	    default: mstr[0] = (flags & CATALOG_HARDLINK) ? 'h' : '-'; break;
+	}
+	mstr[1] = (mode & S_IRUSR) ? 'r' : '-';
+	mstr[2] = (mode & S_IWUSR) ? 'w' : '-';
+	mstr[3] = (mode & S_ISUID) ? ((mode & S_IXUSR) ? 's' : 'S') : ((mode & S_IXUSR) ? 'x' : '-');
+	mstr[4] = (mode & S_IRGRP) ? 'r' : '-';
+	mstr[5] = (mode & S_IWGRP) ? 'w' : '-';
+	mstr[6] = (mode & S_ISGID) ? ((mode & S_IXGRP) ? 's' : 'S') : ((mode & S_IXGRP) ? 'x' : '-');
+	mstr[7] = (mode & S_IROTH) ? 'r' : '-';
+	mstr[8] = (mode & S_IWOTH) ? 'w' : '-';
+	mstr[9] = (mode & S_ISVTX) ? ((mode & S_IXOTH) ? 't' : 'T') : ((mode & S_IXOTH) ? 'x' : '-');
+	mstr[10] = '\0';
+
+	tm = mtime;
+	tstr[0] = '\0';
+	if (localtime_r(&tm, &ltm) != NULL)
+		strftime(tstr, sizeof (tstr), "%Y-%m-%d %H:%M", &ltm);
+
+	fprintf(out, "%s %5u/%-5u %12" PRIu64 " %s %s", mstr, uid, gid, size, tstr, path);
+	if (link != NULL)
+		fprintf(out, (flags & CATALOG_HARDLINK) ? " link to %s" : " -> %s", link);
+	if (flags & CATALOG_WHITEOUT)
+		fprintf(out, " (deleted)");
+	fputc('\n', out);
+}
+
+void
+catalog_list(pc_catalog_t *cat, FILE *out, char **names, int nnames)
+{
+	uint64_t i;
+
+	for (i = 0; i < cat->nmembers; i++) {
+		catalog_member_t *mem = &(cat->members[i]);
+
+		if (mem->flags & (CATALOG_INHERITED | CATALOG_PACK))
+			continue;
+		if (names != NULL && !catalog_name_match(mem->path, names, nnames))
+			continue;
+		catalog_print_member(out, mem->mode, mem->uid, mem->gid, mem->size, mem->mtime,
+		    mem->path, mem->link, mem->flags);
+	}
+}
+
+/*
+ * Skip leading '/' and './' since member names are stored as relative paths.
+ */
+static const char *
+skip_leading(const char *name)
+{
+	for (;;) {
+		if (name[0] == '/') {
+			name++;
+		} else if (name[0] == '.' && name[1] == '/') {
+			name += 2;
+		} else {
+			break;
+		}
+	}
+	return (name);
+}
+
+/*
+ * Check whether the member name is one of the given names or lies under one
+ * of them if that is a directory.
+ */
+int
+catalog_name_match(const char *name, char **names, int nnames)
+{
+	int i;
+
+	name = skip_leading(name);
+	for (i = 0; i < nnames; i++) {
+		const char *sel = skip_leading(names[i]);
+		size_t len = strlen(sel);
+
+		while (len > 0 && sel[len - 1] == '/')
+			len--;
+		if (len == 0)
+			return (1);
+		if (strncmp(name, sel, len) == 0 && (name[len] == '\0' || name[len] == '/'))
+			return (1);
+	}
+	return (0);
+}
+
+static uint64_t
+path_hash(const char *path)
+{
+	return (XXH32(path, strlen(path), 0));
+}
+
+/*
+ * Build the index used by catalog_find(). Entries hold member number + 1 so
+ * that zero marks an empty slot.
+ */
+int
+catalog_index(pc_catalog_t *cat)
+{
+	uint64_t i, slot;
+
+	free(cat->htab);
+	cat->hsize = 1024;
+	while (cat->hsize < cat->nmembers * 2)
+		cat->hsize <<= 1;
+	cat->htab = (uint64_t *)calloc(cat->hsize, sizeof (uint64_t));
+	if (cat->htab == NULL)
+		return (-1);
+	for (i = 0; i < cat->nmembers; i++) {
+		slot = path_hash(cat->members[i].path) & (cat->hsize - 1);
+		while (cat->htab[slot] != 0)
+			slot = (slot + 1) & (cat->hsize - 1);
+		cat->htab[slot] = i + 1;
+	}
+	return (0);
+}
+
+/*
+ * Find the last member with the given path.
+ */
+catalog_member_t *
+catalog_find(pc_catalog_t *cat, const char *path)
+{
+	catalog_member_t *found;
+	uint64_t slot;
+
+	found = NULL;
+	slot = path_hash(path) & (cat->hsize - 1);
+	while (cat->htab[slot] != 0) {
+		catalog_member_t *mem = &(cat->members[cat->htab[slot] - 1]);
+
+		if (strcmp(mem->path, path) == 0 && (found == NULL || mem > found))
+			found = mem;
+		slot = (slot + 1) & (cat->hsize - 1);
+	}
+	return (found);
+}
+
+/*
+ * Mark members matching the given names and the chunks needed to extract
+ * them. Targets of selected hard links are selected as well since the link
+ * can only be created once the target exists. A selected packed file selects
+ * the pack holding it. Returns the selected count.
+ */
+uint64_t
+catalog_select(pc_catalog_t *cat, char **names, int nnames)
+{
+	uint64_t i, j, count;
+
+	count = 0;
+	for (i = 0; i < cat->nmembers; i++) {
+		cat->members[i].selected = !(cat->members[i].flags & CATALOG_INHERITED) &&
+		    catalog_name_match(cat->members[i].path, names, nnames);
+	}
+	for (i = cat->nmembers; i > 0; i--) {
+		catalog_member_t *mem = &(cat->members[i - 1]);
+
+		if (!mem->selected || !(mem->flags & CATALOG_HARDLINK))
+			continue;
+		for (j = 0; j < i - 1; j++) {
+			if (!(cat->members[j].flags & CATALOG_INHERITED) &&
+			    strcmp(cat->members[j].path, mem->link) == 0) {
+				cat->members[j].selected = 1;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < cat->nmembers; i++) {
+		if (!cat->members[i].selected || !(cat->members[i].flags & CATALOG_PACKED))
+			continue;
+		for (j = i + 1; j < cat->nmembers; j++) {
+			if (cat->members[j].flags & CATALOG_PACK) {
+				cat->members[j].selected = 1;
+				break;
+			}
+		}
+	}
+
+	free(cat->chunk_needed);
+	cat->chunk_needed = (uchar_t *)calloc(cat->nchunks + 1, 1);
+	if (cat->chunk_needed == NULL)
+		return (0);
+	for (i = 0; i < cat->nmembers; i++) {
+		catalog_member_t *mem = &(cat->members[i]);
+
+		if (!mem->selected)
+			continue;
+		count++;
+		for (j = mem->first_chunk; j < mem->first_chunk + mem->nchunks &&
+		    j < cat->nchunks; j++) {
+			cat->chunk_needed[j] = 1;
+		}
+	}
+	cat->cur_member = 0;
+	return (count);
+}
+
+uint32_t
+catalog_next_chunk(pc_catalog_t *cat, uint32_t from)
+{
+	while (from < cat->nchunks && !cat->chunk_needed[from])
+		from++;
+	return (from);
+}
+
+/*
+ * Pass only the stream ranges of selected members in the given decompressed
+ * chunk on to the extractor. Once the last selected member has been passed an
+ * end of archive marker is sent so that the extractor finishes without waiting
+ * for the rest of the stream.
+ */
+int64_t
+catalog_archiver_write(pc_ctx_t *pctx, pc_catalog_t *cat, uint32_t chunk,
+    uchar_t *buf, uint64_t len)
+{
+	uint64_t start, end;
+
+	if (chunk >= cat->nchunks)
+		return (len);
+	start = cat->chunks[chunk].stream_off;
+	end = start + len;
+
+	while (cat->cur_member < cat->nmembers) {
+		catalog_member_t *mem = &(cat->members[cat->cur_member]);
+		uint64_t mend = mem->stream_off + mem->stream_len;
+
+		if (mem->stream_off >= end)
+			break;
+		if (mem->selected && mem->stream_len > 0 && mend > start) {
+			uint64_t a, b;
+
+			a = (mem->stream_off > start ? mem->stream_off : start);
+			b = (mend < end ? mend : end);
+			if (archiver_write(pctx, buf + (a - start), b - a) != b - a)
+				return (-1);
+		}
+		if (mend > end)
+			break;
+		cat->cur_member++;
+
+		/*
+		 * Check whether any selected members remain.
+		 */
+		while (cat->cur_member < cat->nmembers &&
+		    !cat->members[cat->cur_member].selected)
+			cat->cur_member++;
+		if (cat->cur_member == cat->nmembers) {
+			if (archiver_write(pctx, (void *)eoa_blocks, CATALOG_EOA_SZ) !=
+			    CATALOG_EOA_SZ)
+				return (-1);
+		}
+	}
+	return (len);
+}
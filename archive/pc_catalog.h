@@ -0,0 +1,143 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_CATALOG_H
+#define	_PC_CATALOG_H
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <pcompress.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * The catalog is an index of archive members appended after the trailer of
+ * an archive created with '-I'. It is laid out as follows (all integers are
+ * in network byte order):
+ *
+ * Header:      version (4), chunk count (4), member count (8)
+ * Chunks:      uncompressed archive stream offset (8), on-disk length (8)
+ * Members:     stream offset (8), stream length (8), size (8), mtime (8),
+ *              inode (8), mtime nanoseconds (4), mode (4), uid (4), gid (4),
+ *              first chunk (4), chunk count (4), flags (2), path length (2),
+ *              link length (2), path, link
+ * Footer:      catalog length (8), CRC32 of catalog (4), version (4), magic (8)
+ *
+ * The stream range of a member covers its pax header, data and padding. Since
+ * a member is contained entirely in its stream range, extracting it only needs
+ * the chunks overlapping that range. Version 1 catalogs do not have the inode
+ * and mtime nanoseconds.
+ *
+ * The catalog of an incremental archive also lists the unchanged members of
+ * its base archive. These are flagged as inherited and have no stream range.
+ * Members deleted since the base are stored as whiteout entries.
+ *
+ * Small files packed together with '-J' are flagged as packed and have no
+ * stream range of their own. They are followed by the pack member that holds
+ * their data.
+ */
+#define	CATALOG_VERSION		2
+#define	CATALOG_MAGIC		"PZCATLOG"
+#define	CATALOG_MAGIC_LEN	8
+#define	CATALOG_FOOTER_SZ	(8 + 4 + 4 + CATALOG_MAGIC_LEN)
+#define	CATALOG_HARDLINK	1
+#define	CATALOG_WHITEOUT	2
+#define	CATALOG_INHERITED	4
+#define	CATALOG_PACKED		8
+#define	CATALOG_PACK		16
+
+/*
+ * Passed to catalog_read() if the position of the chunks is not known. The
+ * catalog can then only be used to look up members.
+ */
+#define	CATALOG_NO_BASE		((uint64_t)-1)
+
+typedef struct {
+	uint64_t stream_off;
+	uint64_t disk_len;
+	uint64_t file_off;
+} catalog_chunk_t;
+
+typedef struct {
+	uint64_t stream_off, stream_len;
+	uint64_t size;
+	int64_t mtime;
+	uint64_t ino;
+	uint32_t mtime_nsec;
+	uint32_t mode, uid, gid;
+	uint32_t first_chunk, nchunks;
+	uint16_t flags;
+	char *path, *link;
+	int selected;
+} catalog_member_t;
+
+typedef struct pc_catalog {
+	catalog_chunk_t *chunks;
+	uint32_t nchunks, chunks_alloc;
+	catalog_member_t *members;
+	uint64_t nmembers, members_alloc;
+	uint64_t stream_end;
+	uint64_t open_member;
+
+	/*
+	 * Path lookup index, built by catalog_index().
+	 */
+	uint64_t *htab;
+	uint64_t hsize;
+
+	/*
+	 * Selective extraction state.
+	 */
+	uchar_t *chunk_needed;
+	uint64_t cur_member;
+} pc_catalog_t;
+
+pc_catalog_t *catalog_new(void);
+void catalog_free(pc_catalog_t *cat);
+int catalog_add_chunk(pc_catalog_t *cat, uint64_t stream_off, uint64_t disk_len);
+int catalog_add_member(pc_catalog_t *cat, void *entry, uint64_t stream_off);
+int catalog_add_inherited(pc_catalog_t *cat, catalog_member_t *src, uint64_t stream_off);
+int catalog_add_packed(pc_catalog_t *cat, void *entry, uint64_t stream_off);
+void catalog_set_end(pc_catalog_t *cat, uint64_t stream_end);
+int catalog_write(pc_catalog_t *cat, int fd);
+int catalog_read(int fd, uint64_t base_off, pc_catalog_t **catp);
+void catalog_list(pc_catalog_t *cat, FILE *out, char **names, int nnames);
+void catalog_print_member(FILE *out, uint32_t mode, uint32_t uid, uint32_t gid,
+    uint64_t size, int64_t mtime, const char *path, const char *link, int flags);
+int catalog_name_match(const char *name, char **names, int nnames);
+int catalog_index(pc_catalog_t *cat);
+catalog_member_t *catalog_find(pc_catalog_t *cat, const char *path);
+uint64_t catalog_select(pc_catalog_t *cat, char **names, int nnames);
+uint32_t catalog_next_chunk(pc_catalog_t *cat, uint32_t from);
+int64_t catalog_archiver_write(pc_ctx_t *pctx, pc_catalog_t *cat, uint32_t chunk,
+    uchar_t *buf, uint64_t len);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Whole file duplicate detection for archiving. Files are looked up in
+ * archiving order. A file is compared only with earlier files of the same
+ * size, first using a quick hash of its first and last few KB and then
+ * using a digest of the entire data. The expensive values are computed
+ * lazily so files with a unique size are never read here.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <utils.h>
+#include <xxhash.h>
+#include <crypto_utils.h>
+#include "pc_filedup.h"
+
+#define	FILEDUP_READ_SZ		(1024 * 1024)
+#define	FILEDUP_HTAB_MIN	1024
+
+typedef struct filedup_entry {
+	struct filedup_entry *next;
+	uint64_t size;
+	uint64_t quick;
+	int have_quick, have_digest;
+	uchar_t digest[CKSUM_MAX_BYTES];
+	char *srcpath, *name;
+} filedup_entry_t;
+
+struct pc_filedup {
+	filedup_entry_t **htab;
+	uint64_t hsize;
+	int cksum, cksum_bytes;
+	uchar_t *buf, *cbuf;
+};
+
+pc_filedup_t *
+filedup_new(uint64_t nfiles, int cksum, int cksum_bytes)
+{
+	pc_filedup_t *fdp;
+
+	fdp = (pc_filedup_t *)calloc(1, sizeof (pc_filedup_t));
+	if (fdp == NULL)
+		return (NULL);
+
+	/*
+	 * A CRC is not good enough to tell files apart.
+	 */
+	if (cksum == CKSUM_CRC64) {
+		cksum = CKSUM_SHA256;
+		cksum_bytes = 32;
+	}
+	fdp->cksum = cksum;
+	fdp->cksum_bytes = cksum_bytes;
+	fdp->hsize = FILEDUP_HTAB_MIN;
+	while (fdp->hsize < nfiles)
+		fdp->hsize <<= 1;
+	fdp->htab = (filedup_entry_t **)calloc(fdp->hsize, sizeof (filedup_entry_t *));
+	fdp->buf = (uchar_t *)malloc(FILEDUP_READ_SZ);
+	fdp->cbuf = (uchar_t *)malloc(FILEDUP_READ_SZ);
+	if (fdp->htab == NULL || fdp->buf == NULL || fdp->cbuf == NULL) {
+		filedup_free(fdp);
+		return (NULL);
+	}
+	return (fdp);
+}
+
+void
+filedup_free(pc_filedup_t *fdp)
+{
+	filedup_entry_t *ent, *next;
+	uint64_t i;
+
+	if (fdp == NULL)
+		return;
+	if (fdp->htab) {
+		for (i = 0; i < fdp->hsize; i++) {
+			for (ent = fdp->htab[i]; ent != NULL; ent = next) {
+				next = ent->next;
+				free(ent->srcpath);
+				free(ent->name);
+				free(ent);
+			}
+		}
+		free(fdp->htab);
+	}
+	free(fdp->buf);
+	free(fdp->cbuf);
+	free(fdp);
+}
+
+/*
+ * Hash of the first and last FILEDUP_QUICK_SZ bytes. The data is used if the
+ * caller already has the file in memory.
+ */
+static int
+filedup_quick(pc_filedup_t *fdp, filedup_entry_t *ent, uchar_t *data)
+{
+	uchar_t *head, *tail;
+	int fd;
+
+	if (ent->have_quick)
+		return (0);
+	if (data != NULL) {
+		head = data;
+		tail = data + ent->size - FILEDUP_QUICK_SZ;
+	} else {
+		fd = open(ent->srcpath, O_RDONLY);
+		if (fd == -1)
+			return (-1);
+		head = fdp->buf;
+		tail = fdp->buf + FILEDUP_QUICK_SZ;
+		if (pread(fd, head, FILEDUP_QUICK_SZ, 0) != FILEDUP_QUICK_SZ ||
+		    pread(fd, tail, FILEDUP_QUICK_SZ, ent->size - FILEDUP_QUICK_SZ) !=
+		    FILEDUP_QUICK_SZ) {
+			close(fd);
+			return (-1);
+		}
+		close(fd);
+	}
+	ent->quick = ((uint64_t)XXH32(head, FILEDUP_QUICK_SZ, 0) << 32) |
+	    XXH32(tail, FILEDUP_QUICK_SZ, 0);
+	ent->have_quick = 1;
+	return (0);
+}
+
+/*
+ * Digest of the whole file. The data is digested in FILEDUP_READ_SZ blocks and
+ * the block digests are chained, so files never need to be held in memory.
+ */
+static void
+filedup_digest_block(pc_filedup_t *fdp, uchar_t *chain, uchar_t *buf, uint64_t len)
+{
+	uchar_t cksum[CKSUM_MAX_BYTES];
+
+	compute_checksum(chain + fdp->cksum_bytes, fdp->cksum, buf, len, 0, 0);
+	compute_checksum(cksum, fdp->cksum, chain, fdp->cksum_bytes * 2, 0, 0);
+	memcpy(chain, cksum, fdp->cksum_bytes);
+}
+
+static int
+filedup_digest(pc_filedup_t *fdp, filedup_entry_t *ent, uchar_t *data)
+{
+	uchar_t chain[CKSUM_MAX_BYTES * 2];
+	uint64_t done, len;
+	int64_t rd;
+	int fd;
+
+	if (ent->have_digest)
+		return (0);
+	memset(chain, 0, sizeof (chain));
+	if (data != NULL) {
+		for (done = 0; done < ent->size; done += len) {
+			len = ent->size - done;
+			if (len > FILEDUP_READ_SZ)
+				len = FILEDUP_READ_SZ;
+			filedup_digest_block(fdp, chain, data + done, len);
+		}
+	} else {
+		fd = open(ent->srcpath, O_RDONLY);
+		if (fd == -1)
+			return (-1);
+		done = 0;
+		while (done < ent->size) {
+			rd = Read(fd, fdp->buf, FILEDUP_READ_SZ);
+			if (rd <= 0)
+				break;
+			filedup_digest_block(fdp, chain, fdp->buf, rd);
+			done += rd;
+		}
+		close(fd);
+		if (done != ent->size)
+			return (-1);
+	}
+	memcpy(ent->digest, chain, fdp->cksum_bytes);
+	ent->have_digest = 1;
+	return (0);
+}
+
+/*
+ * Look up a file among the files seen so far. If an identical one is found
+ * its member name is returned, otherwise the file is remembered and NULL is
+ * returned. The data argument may point to the entire file contents if the
+ * caller has it in memory.
+ */
+const char *
+filedup_lookup(pc_filedup_t *fdp, const char *srcpath, const char *name,
+    uint64_t size, uchar_t *data)
+{
+	filedup_entry_t *ent, *cur;
+	uint64_t slot;
+
+	if (size < FILEDUP_MIN_SIZE)
+		return (NULL);
+
+
+	cur = (filedup_entry_t *)calloc(1, sizeof (filedup_entry_t));
+	if (cur == NULL)
+		return (NULL);
+	cur->size = size;
+	cur->srcpath = strdup(srcpath);
+	cur->name = strdup(name);
+	if (cur->srcpath == NULL || cur->name == NULL) {
+		free(cur->srcpath);
+		free(cur->name);
+		free(cur);
+		return (NULL);
+	}
+
+	slot = XXH32(&size, sizeof (size), 0) & (fdp->hsize - 1);
+	for (ent = fdp->htab[slot]; ent != NULL; ent = ent->next) {
+		if (ent->size != size)
+			continue;
+
+		/*
+		 * There is a candidate, so read a small file just once here.
+		 */
+		if (data == NULL && size <= FILEDUP_READ_SZ) {
+			int fd;
+
+			fd = open(srcpath, O_RDONLY);
+			if (fd != -1) {
+				if (Read(fd, fdp->cbuf, size) == size)
+					data = fdp->cbuf;
+				close(fd);
+			}
+		}
+		if (size > FILEDUP_QUICK_SZ * 2) {
+			if (filedup_quick(fdp, cur, data) == -1)
+				break;
+			if (filedup_quick(fdp, ent, NULL) == -1 || ent->quick != cur->quick)
+				continue;
+		}
+		if (filedup_digest(fdp, cur, data) == -1)
+			break;
+		if (filedup_digest(fdp, ent, NULL) == 0 &&
+		    memcmp(ent->digest, cur->digest, fdp->cksum_bytes) == 0) {
+			free(cur->srcpath);
+			free(cur->name);
+			free(cur);
+			return (ent->name);
+		}
+	}
+	cur->next = fdp->htab[slot];
+	fdp->htab[slot] = cur;
+	return (NULL);
+}
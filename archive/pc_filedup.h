@@ -0,0 +1,59 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_FILEDUP_H
+#define	_PC_FILEDUP_H
+
+#include <sys/types.h>
+#include <utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Files smaller than this are always archived. The reference entry costs
+ * about as much as their data.
+ */
+#define	FILEDUP_MIN_SIZE	1024
+
+/*
+ * Number of bytes hashed at the start and at the end of a file for the
+ * quick comparison.
+ */
+#define	FILEDUP_QUICK_SZ	4096
+
+typedef struct pc_filedup pc_filedup_t;
+
+pc_filedup_t *filedup_new(uint64_t nfiles, int cksum, int cksum_bytes);
+void filedup_free(pc_filedup_t *fdp);
+const char *filedup_lookup(pc_filedup_t *fdp, const char *srcpath, const char *name,
+    uint64_t size, uchar_t *data);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
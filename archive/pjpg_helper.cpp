@@ -66,35 +66,48 @@ typedef unsigned char uchar_t;
 #define	POLAROID_LE 0x64696f72616c6f50
 
 /*
- * Helper routine to bridge to packJPG C++ lib, without changing packJPG itself.
+ * Workaround for packJPG limitation, not a bug per se. Images created with
+ * Polaroid cameras appear to have some weird huffman data in the middle which
+ * appears not to be interpreted by any image viewer/editor. This data gets
+ * stripped by packJPG.
+ * So the restored images will be visually correct, but, will be smaller than the
+ * original. So we need to look at the Exif Manufacturer tag for 'Polaroid' and
+ * skip those images. This should be within the first 512 bytes of the
+ * file (really...?) so we do a simple buffer scan without trying to parse Exif
+ * data.
  */
-size_t
-packjpg_filter_process(uchar_t *in_buf, size_t len, uchar_t **out_buf)
+static int
+is_polaroid(uchar_t *in_buf)
 {
-	unsigned int len1;
 	uchar_t *pos;
 
-	/*
-	 * Workaround for packJPG limitation, not a bug per se. Images created with
-	 * Polaroid cameras appear to have some weird huffman data in the middle which
-	 * appears not to be interpreted by any image viewer/editor. This data gets
-	 * stripped by packJPG.
-	 * So the restored images will be visually correct, but, will be smaller than the
-	 * original. So we need to look at the Exif Manufacturer tag for 'Polaroid' and
-	 * skip those images. This should be within the first 512 bytes of the
-	 * file (really...?) so we do a simple buffer scan without trying to parse Exif
-	 * data.
-	 */
 	pos = (uchar_t *)memchr(in_buf, 'P', 512);
 	while (pos) {
 		if (LE64(U64_P(pos)) == POLAROID_LE)
-			return (0);
+			return (1);
 		pos++;
 		pos = (uchar_t *)memchr(pos, 'P', 512);
 	}
-	pjglib_init_streams(in_buf, 1, len, *out_buf, 1);
+	return (0);
+}
+
+/*
+ * Helper routine to bridge to packJPG C++ lib. packJPG writes directly into the
+ * caller's buffer and conversion fails if the output does not fit within
+ * out_size bytes.
+ */
+size_t
+packjpg_filter_process(uchar_t *in_buf, size_t len, uchar_t *out_buf, size_t out_size)
+{
+	unsigned int len1;
+	uchar_t *out;
+
+	if (is_polaroid(in_buf))
+		return (0);
+	out = out_buf;
+	pjglib_init_streams_sized(in_buf, 1, len, out_buf, 1, out_size);
 	len1 = len;
-	if (!pjglib_convert_stream2mem(out_buf, &len1, NULL))
+	if (!pjglib_convert_stream2mem(&out, &len1, NULL))
 		return (0);
 	if (len1 == len)
 		return (0);
@@ -38,6 +38,7 @@
 #include <openssl/rand.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/opensslv.h>
 #include <sha512.h>
 #include <blake2_digest.h>
 #include <crypto_aes.h>
@@ -99,6 +100,31 @@ extern uint64_t lzma_crc64(const uint8_t *buf, uint64_t size, uint64_t crc);
 extern uint64_t lzma_crc64_8bchk(const uint8_t *buf, uint64_t size,
 	uint64_t crc, uint64_t *cnt);
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/*
+ * OpenSSL 1.1 made HMAC_CTX opaque so it can only be allocated by the library.
+ * Provide the allocation functions for older versions.
+ */
+static HMAC_CTX *
+HMAC_CTX_new(void)
+{
+	HMAC_CTX *ctx = (HMAC_CTX *)malloc(sizeof (HMAC_CTX));
+
+	if (ctx)
+		HMAC_CTX_init(ctx);
+	return (ctx);
+}
+
+static void
+HMAC_CTX_free(HMAC_CTX *ctx)
+{
+	if (ctx) {
+		HMAC_CTX_cleanup(ctx);
+		free(ctx);
+	}
+}
+#endif
+
 #ifdef __OSSL_OLD__
 /*
  * The two functions below fill missing functionality in older versions of OpenSSL.
@@ -482,20 +508,19 @@ hmac_init(mac_ctx_t *mctx, int cksum, crypto_ctx_t *cctx)
 
 	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_CRC64) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
-			HMAC_CTX *ctx = (HMAC_CTX *)malloc(sizeof (HMAC_CTX));
+			HMAC_CTX *ctx = HMAC_CTX_new();
 			if (!ctx) return (-1);
-			HMAC_CTX_init(ctx);
 			HMAC_Init_ex(ctx, cctx->pkey, cctx->keylen, EVP_sha256(), NULL);
 			mctx->mac_ctx = ctx;
 
-			ctx = (HMAC_CTX *)malloc(sizeof (HMAC_CTX));
+			ctx = HMAC_CTX_new();
 			if (!ctx) {
-				free(mctx->mac_ctx);
+				HMAC_CTX_free((HMAC_CTX *)(mctx->mac_ctx));
 				return (-1);
 			}
 			if (!HMAC_CTX_copy(ctx, (HMAC_CTX *)(mctx->mac_ctx))) {
-				free(ctx);
-				free(mctx->mac_ctx);
+				HMAC_CTX_free(ctx);
+				HMAC_CTX_free((HMAC_CTX *)(mctx->mac_ctx));
 				return (-1);
 			}
 			mctx->mac_ctx_reinit = ctx;
@@ -515,20 +540,19 @@ hmac_init(mac_ctx_t *mctx, int cksum, crypto_ctx_t *cctx)
 		}
 	} else if (cksum == CKSUM_SHA512) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
-			HMAC_CTX *ctx = (HMAC_CTX *)malloc(sizeof (HMAC_CTX));
+			HMAC_CTX *ctx = HMAC_CTX_new();
 			if (!ctx) return (-1);
-			HMAC_CTX_init(ctx);
 			HMAC_Init_ex(ctx, cctx->pkey, cctx->keylen, EVP_sha512(), NULL);
 			mctx->mac_ctx = ctx;
 
-			ctx = (HMAC_CTX *)malloc(sizeof (HMAC_CTX));
+			ctx = HMAC_CTX_new();
 			if (!ctx) {
-				free(mctx->mac_ctx);
+				HMAC_CTX_free((HMAC_CTX *)(mctx->mac_ctx));
 				return (-1);
 			}
 			if (!HMAC_CTX_copy(ctx, (HMAC_CTX *)(mctx->mac_ctx))) {
-				free(ctx);
-				free(mctx->mac_ctx);
+				HMAC_CTX_free(ctx);
+				HMAC_CTX_free((HMAC_CTX *)(mctx->mac_ctx));
 				return (-1);
 			}
 			mctx->mac_ctx_reinit = ctx;
@@ -716,8 +740,10 @@ hmac_cleanup(mac_ctx_t *mctx)
 
 	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_SHA512 || cksum == CKSUM_CRC64) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
-			HMAC_CTX_cleanup((HMAC_CTX *)(mctx->mac_ctx));
-			HMAC_CTX_cleanup((HMAC_CTX *)(mctx->mac_ctx_reinit));
+			HMAC_CTX_free((HMAC_CTX *)(mctx->mac_ctx));
+			HMAC_CTX_free((HMAC_CTX *)(mctx->mac_ctx_reinit));
+			mctx->mac_ctx = NULL;
+			mctx->mac_ctx_reinit = NULL;
 		} else {
 			memset(mctx->mac_ctx, 0, sizeof (HMAC_SHA512_Context));
 			memset(mctx->mac_ctx_reinit, 0, sizeof (HMAC_SHA512_Context));
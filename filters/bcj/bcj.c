@@ -0,0 +1,200 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Branch/Call/Jump address conversion filters for executable code. Relative
+ * target addresses in call and branch instructions are converted to absolute
+ * offsets within the buffer. Repeated calls to the same function then produce
+ * identical byte sequences which compress a lot better. The transforms are
+ * size-preserving, linear-time and their inverses are exact.
+ *
+ * x86 (32 and 64-bit):
+ *   E8/E9 (CALL/JMP rel32) and the common REX-prefixed RIP-relative forms
+ *   of MOV and LEA (48 8B/89/8D with ModRM mod=00, r/m=101) are converted.
+ *   Conversion decisions depend only on opcode bytes that are never touched
+ *   by the transform, so the decoder always sees the same instruction
+ *   boundaries as the encoder.
+ *
+ * ARM64:
+ *   BL imm26 and ADRP page offsets are converted at 4-byte aligned positions,
+ *   along the lines of the XZ Utils ARM64 filter.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bcj.h"
+
+/*
+ * Require at least one conversion per this many bytes for the filter to be
+ * considered useful.
+ */
+#define	BCJ_MIN_DENSITY	1024
+#define	BCJ_MIN_LEN	64
+
+static uint64_t
+bcj_x86(uchar_t *src, uint64_t srclen, uchar_t *dst, int encode)
+{
+	uint64_t i, cnt;
+	uint32_t val, pc;
+	uchar_t op;
+
+	i = 0;
+	cnt = 0;
+	while (i < srclen) {
+		op = src[i];
+
+		/*
+		 * RIP-relative MOV/LEA: REX, opcode, ModRM, disp32.
+		 */
+		if ((op & 0xf0) == 0x40 && i + 7 <= srclen &&
+		    (src[i+1] == 0x8b || src[i+1] == 0x8d || src[i+1] == 0x89) &&
+		    (src[i+2] & 0xc7) == 0x05) {
+			dst[i] = op;
+			dst[i+1] = src[i+1];
+			dst[i+2] = src[i+2];
+			val = LE32(U32_P(src + i + 3));
+			pc = (uint32_t)(i + 7);
+			if (encode)
+				val += pc;
+			else
+				val -= pc;
+			U32_P(dst + i + 3) = LE32(val);
+			i += 7;
+			cnt++;
+			continue;
+		}
+
+		/*
+		 * CALL/JMP rel32.
+		 */
+		if ((op == 0xe8 || op == 0xe9) && i + 5 <= srclen) {
+			dst[i] = op;
+			val = LE32(U32_P(src + i + 1));
+			pc = (uint32_t)(i + 5);
+			if (encode)
+				val += pc;
+			else
+				val -= pc;
+			U32_P(dst + i + 1) = LE32(val);
+			i += 5;
+			cnt++;
+			continue;
+		}
+		dst[i] = op;
+		i++;
+	}
+	return (cnt);
+}
+
+static uint64_t
+bcj_arm64(uchar_t *src, uint64_t srclen, uchar_t *dst, int encode)
+{
+	uint64_t i, cnt;
+	uint32_t insn, val, pc;
+
+	cnt = 0;
+	for (i = 0; i + 4 <= srclen; i += 4) {
+		insn = LE32(U32_P(src + i));
+
+		if ((insn >> 26) == 0x25) {
+			/*
+			 * BL: 26-bit word offset.
+			 */
+			pc = (uint32_t)(i >> 2);
+			if (!encode)
+				pc = 0U - pc;
+			insn = 0x94000000 | ((insn + pc) & 0x03ffffff);
+			cnt++;
+
+		} else if ((insn & 0x9f000000) == 0x90000000) {
+			/*
+			 * ADRP: 21-bit page offset split as immlo:immhi. Only
+			 * offsets within +/-512MB are converted. The sign bits
+			 * are regenerated so the converted value stays in the
+			 * same range and the decoder makes the same decision.
+			 */
+			val = ((insn >> 29) & 3) | ((insn >> 3) & 0x001ffffc);
+			if ((val + 0x00020000) & 0x001c0000) {
+				U32_P(dst + i) = LE32(insn);
+				continue;
+			}
+			pc = (uint32_t)(i >> 12);
+			if (!encode)
+				pc = 0U - pc;
+			val += pc;
+			insn &= 0x9000001f;
+			insn |= (val & 3) << 29;
+			insn |= (val & 0x0003fffc) << 3;
+			insn |= (0U - (val & 0x00020000)) & 0x00e00000;
+			cnt++;
+		}
+		U32_P(dst + i) = LE32(insn);
+	}
+
+	/*
+	 * Copy trailing bytes that do not form a whole instruction.
+	 */
+	for (; i < srclen; i++)
+		dst[i] = src[i];
+	return (cnt);
+}
+
+int
+bcj_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen, int arch)
+{
+	uint64_t cnt;
+
+	if (srclen < BCJ_MIN_LEN || *dstlen < srclen)
+		return (-1);
+
+	if (arch == BCJ_ARCH_X86)
+		cnt = bcj_x86(src, srclen, dst, 1);
+	else if (arch == BCJ_ARCH_ARM64)
+		cnt = bcj_arm64(src, srclen, dst, 1);
+	else
+		return (-1);
+
+	DEBUG_STAT_EN(fprintf(stderr, "BCJ: srclen: %" PRIu64 ", conversions: %" PRIu64 "\n",
+	    srclen, cnt));
+	if (cnt < srclen / BCJ_MIN_DENSITY)
+		return (-1);
+	*dstlen = srclen;
+	return (0);
+}
+
+int
+bcj_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen, int arch)
+{
+	if (*dstlen < srclen)
+		return (-1);
+
+	if (arch == BCJ_ARCH_X86)
+		bcj_x86(src, srclen, dst, 0);
+	else if (arch == BCJ_ARCH_ARM64)
+		bcj_arm64(src, srclen, dst, 0);
+	else
+		return (-1);
+	*dstlen = srclen;
+	return (0);
+}
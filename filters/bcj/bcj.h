@@ -0,0 +1,47 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+#ifndef	_BCJ_H
+#define	_BCJ_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define	BCJ_ARCH_X86	1
+#define	BCJ_ARCH_ARM64	2
+
+int bcj_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen, int arch);
+int bcj_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen, int arch);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	
@@ -207,8 +207,8 @@ static inline void shift_model( model_b* model, int ctx1, int ctx2, int ctx3 )
 	----------------------------------------------- */
 static inline void encode_ari( aricoder* encoder, model_s* model, int c )
 {
-	static symbol s;
-	static int esc;
+	symbol s;
+	int esc;
 	
 	do {		
 		esc = model->convert_int_to_symbol( c, &s );
@@ -222,9 +222,9 @@ static inline void encode_ari( aricoder* encoder, model_s* model, int c )
 	----------------------------------------------- */	
 static inline int decode_ari( aricoder* decoder, model_s* model )
 {
-	static symbol s;
-	static unsigned int count;
-	static int c;
+	symbol s;
+	unsigned int count;
+	int c;
 	
 	do{
 		model->get_symbol_scale( &s );
@@ -242,7 +242,7 @@ static inline int decode_ari( aricoder* decoder, model_s* model )
 	----------------------------------------------- */	
 static inline void encode_ari( aricoder* encoder, model_b* model, int c )
 {
-	static symbol s;
+	symbol s;
 	
 	model->convert_int_to_symbol( c, &s );
 	encoder->encode( &s );
@@ -254,9 +254,9 @@ static inline void encode_ari( aricoder* encoder, model_b* model, int c )
 	----------------------------------------------- */	
 static inline int decode_ari( aricoder* decoder, model_b* model )
 {
-	static symbol s;
-	static unsigned int count;
-	static int c;
+	symbol s;
+	unsigned int count;
+	int c;
 	
 	model->get_symbol_scale( &s );
 	count = decoder->decode_count( &s );
@@ -422,6 +422,8 @@ abytewriter::abytewriter( int size )
 	error = false;
 	fmem  = true;
 	
+	fixed = false;
+	
 	dsize = ( size > 0 ) ? size : adds;
 	data = (unsigned char*) malloc( dsize );
 	if ( data == NULL ) {
@@ -430,6 +432,24 @@ abytewriter::abytewriter( int size )
 	}
 }
 
+/* -----------------------------------------------
+	constructor for abytewriter class writing into
+	a caller supplied buffer of fixed size
+	----------------------------------------------- */	
+
+abytewriter::abytewriter( unsigned char* buf, int size )
+{
+	adds  = 0;
+	cbyte = 0;
+	
+	error = false;
+	fmem  = false;
+	fixed = true;
+	
+	dsize = size;
+	data = buf;
+}
+
 /* -----------------------------------------------
 	destructor for abytewriter class
 	----------------------------------------------- */	
@@ -449,8 +469,14 @@ void abytewriter::write( unsigned char byte )
 	// safety check for error
 	if ( error ) return;
 	
+	// fixed buffers can't grow, running out of space is an error
+	if ( fixed && ( cbyte >= dsize ) ) {
+		error = true;
+		return;
+	}
+	
 	// test if pointer beyond flush threshold
-	if ( cbyte >= ( dsize - 2 ) ) {
+	if ( !fixed && ( cbyte >= ( dsize - 2 ) ) ) {
 		dsize += adds;
 		data = (unsigned char*) realloc( data, dsize );
 		if ( data == NULL ) {
@@ -472,8 +498,14 @@ void abytewriter::write_n( unsigned char* byte, int n )
 	// safety check for error
 	if ( error ) return;
 	
+	// fixed buffers can't grow, running out of space is an error
+	if ( fixed && ( ( cbyte + n ) > dsize ) ) {
+		error = true;
+		return;
+	}
+	
 	// make sure that pointer doesn't get beyond flush threshold
-	while ( ( cbyte + n ) >= ( dsize - 2 ) ) {
+	while ( !fixed && ( ( cbyte + n ) >= ( dsize - 2 ) ) ) {
 		dsize += adds;
 		data = (unsigned char*) realloc( data, dsize );
 		if ( data == NULL ) {
@@ -495,6 +527,8 @@ unsigned char* abytewriter::getptr( void )
 {
 	// safety check for error
 	if ( error ) return NULL;
+	// fixed buffers belong to the caller
+	if ( fixed ) return data;
 	// forbid freeing memory
 	fmem = false;
 	// realloc data
@@ -826,6 +860,8 @@ void iostream::open_mem( void )
 {
 	if ( mode == 0 )
 		mrdr = new abytereader( ( unsigned char* ) source, srcs );
+	else if ( ( source != NULL ) && ( srcs > 0 ) )
+		mwrt = new abytewriter( ( unsigned char* ) source, srcs );
 	else
 		mwrt = new abytewriter( srcs );
 }
@@ -108,6 +108,7 @@ class abytewriter
 {
 public:
 	abytewriter( int size );
+	abytewriter( unsigned char* buf, int size );
 	~abytewriter( void );	
 	void write( unsigned char byte );
 	void write_n( unsigned char* byte, int n );
@@ -124,6 +125,7 @@ private:
 	int lbyte;
 	int cbyte;
 	bool fmem;
+	bool fixed;
 };
 
 
@@ -281,6 +281,14 @@ packJPG by Matthias Stirner, 12/2013
 
 #define INTERN static
 
+// Library state is kept per-thread so that several threads can run packJPG
+// conversions concurrently.
+#if defined BUILD_LIB
+	#define TLS_INTERN static __thread
+#else
+	#define TLS_INTERN static
+#endif
+
 #define INIT_MODEL_S(a,b,c) new model_s( a, b, c, 255 )
 #define INIT_MODEL_B(a,b)   new model_b( a, b, 255 )
 
@@ -514,8 +522,8 @@ INTERN bool dump_pgm( void );
 	global variables: library only variables
 	----------------------------------------------- */
 #if defined(BUILD_LIB)
-INTERN int lib_in_type  = -1;
-INTERN int lib_out_type = -1;
+TLS_INTERN int lib_in_type  = -1;
+TLS_INTERN int lib_out_type = -1;
 #endif
 
 
@@ -523,39 +531,39 @@ INTERN int lib_out_type = -1;
 	global variables: data storage
 	----------------------------------------------- */
 
-INTERN unsigned short qtables[4][64];				// quantization tables
-INTERN huffCodes      hcodes[2][4];				// huffman codes
-INTERN huffTree       htrees[2][4];				// huffman decoding trees
-INTERN unsigned char  htset[2][4];					// 1 if huffman table is set
-
-INTERN unsigned char* grbgdata		   =   NULL;	// garbage data
-INTERN unsigned char* hdrdata          =   NULL;   // header data
-INTERN unsigned char* huffdata         =   NULL;   // huffman coded data
-INTERN int            hufs             =    0  ;   // size of huffman data
-INTERN int            hdrs             =    0  ;   // size of header
-INTERN int            grbs             =    0  ;   // size of garbage
-
-INTERN unsigned int*  rstp             =   NULL;   // restart markers positions in huffdata
-INTERN unsigned int*  scnp             =   NULL;   // scan start positions in huffdata
-INTERN int            rstc             =    0  ;   // count of restart markers
-INTERN int            scnc             =    0  ;   // count of scans
-INTERN int            rsti             =    0  ;   // restart interval
-INTERN char           padbit           =    -1 ;   // padbit (for huffman coding)
-INTERN unsigned char* rst_err          =   NULL;   // number of wrong-set RST markers per scan
-
-INTERN unsigned char* zdstdata[4]      = { NULL }; // zero distribution (# of non-zeroes) lists (for higher 7x7 block)
-INTERN unsigned char* eobxhigh[4]      = { NULL }; // eob in x direction (for higher 7x7 block)
-INTERN unsigned char* eobyhigh[4]      = { NULL }; // eob in y direction (for higher 7x7 block)
-INTERN unsigned char* zdstxlow[4]		= { NULL }; // # of non zeroes for first row
-INTERN unsigned char* zdstylow[4]		= { NULL }; // # of non zeroes for first collumn
-INTERN signed short*  colldata[4][64]  = {{NULL}}; // collection sorted DCT coefficients
-
-INTERN unsigned char* freqscan[4]      = { NULL }; // optimized order for frequency scans (only pointers to scans)
-INTERN unsigned char  zsrtscan[4][64];				// zero optimized frequency scan
-
-INTERN int adpt_idct_8x8[ 4 ][ 8 * 8 * 8 * 8 ];	// precalculated/adapted values for idct (8x8)
-INTERN int adpt_idct_1x8[ 4 ][ 1 * 1 * 8 * 8 ];	// precalculated/adapted values for idct (1x8)
-INTERN int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values for idct (8x1)
+TLS_INTERN unsigned short qtables[4][64];				// quantization tables
+TLS_INTERN huffCodes      hcodes[2][4];				// huffman codes
+TLS_INTERN huffTree       htrees[2][4];				// huffman decoding trees
+TLS_INTERN unsigned char  htset[2][4];					// 1 if huffman table is set
+
+TLS_INTERN unsigned char* grbgdata		   =   NULL;	// garbage data
+TLS_INTERN unsigned char* hdrdata          =   NULL;   // header data
+TLS_INTERN unsigned char* huffdata         =   NULL;   // huffman coded data
+TLS_INTERN int            hufs             =    0  ;   // size of huffman data
+TLS_INTERN int            hdrs             =    0  ;   // size of header
+TLS_INTERN int            grbs             =    0  ;   // size of garbage
+
+TLS_INTERN unsigned int*  rstp             =   NULL;   // restart markers positions in huffdata
+TLS_INTERN unsigned int*  scnp             =   NULL;   // scan start positions in huffdata
+TLS_INTERN int            rstc             =    0  ;   // count of restart markers
+TLS_INTERN int            scnc             =    0  ;   // count of scans
+TLS_INTERN int            rsti             =    0  ;   // restart interval
+TLS_INTERN char           padbit           =    -1 ;   // padbit (for huffman coding)
+TLS_INTERN unsigned char* rst_err          =   NULL;   // number of wrong-set RST markers per scan
+
+TLS_INTERN unsigned char* zdstdata[4]      = { NULL }; // zero distribution (# of non-zeroes) lists (for higher 7x7 block)
+TLS_INTERN unsigned char* eobxhigh[4]      = { NULL }; // eob in x direction (for higher 7x7 block)
+TLS_INTERN unsigned char* eobyhigh[4]      = { NULL }; // eob in y direction (for higher 7x7 block)
+TLS_INTERN unsigned char* zdstxlow[4]		= { NULL }; // # of non zeroes for first row
+TLS_INTERN unsigned char* zdstylow[4]		= { NULL }; // # of non zeroes for first collumn
+TLS_INTERN signed short*  colldata[4][64]  = {{NULL}}; // collection sorted DCT coefficients
+
+TLS_INTERN unsigned char* freqscan[4]      = { NULL }; // optimized order for frequency scans (only pointers to scans)
+TLS_INTERN unsigned char  zsrtscan[4][64];				// zero optimized frequency scan
+
+TLS_INTERN int adpt_idct_8x8[ 4 ][ 8 * 8 * 8 * 8 ];	// precalculated/adapted values for idct (8x8)
+TLS_INTERN int adpt_idct_1x8[ 4 ][ 1 * 1 * 8 * 8 ];	// precalculated/adapted values for idct (1x8)
+TLS_INTERN int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values for idct (8x1)
 
 
 /* -----------------------------------------------
@@ -563,64 +571,64 @@ INTERN int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values
 	----------------------------------------------- */
 
 // seperate info for each color component
-INTERN componentInfo cmpnfo[ 4 ];
+TLS_INTERN componentInfo cmpnfo[ 4 ];
 
-INTERN int cmpc        = 0; // component count
-INTERN int imgwidth    = 0; // width of image
-INTERN int imgheight   = 0; // height of image
+TLS_INTERN int cmpc        = 0; // component count
+TLS_INTERN int imgwidth    = 0; // width of image
+TLS_INTERN int imgheight   = 0; // height of image
 
-INTERN int sfhm        = 0; // max horizontal sample factor
-INTERN int sfvm        = 0; // max verical sample factor
-INTERN int mcuv        = 0; // mcus per line
-INTERN int mcuh        = 0; // mcus per collumn
-INTERN int mcuc        = 0; // count of mcus
+TLS_INTERN int sfhm        = 0; // max horizontal sample factor
+TLS_INTERN int sfvm        = 0; // max verical sample factor
+TLS_INTERN int mcuv        = 0; // mcus per line
+TLS_INTERN int mcuh        = 0; // mcus per collumn
+TLS_INTERN int mcuc        = 0; // count of mcus
 
 
 /* -----------------------------------------------
 	global variables: info about current scan
 	----------------------------------------------- */
 
-INTERN int cs_cmpc      =   0  ; // component count in current scan
-INTERN int cs_cmp[ 4 ]  = { 0 }; // component numbers  in current scan
-INTERN int cs_from      =   0  ; // begin - band of current scan ( inclusive )
-INTERN int cs_to        =   0  ; // end - band of current scan ( inclusive )
-INTERN int cs_sah       =   0  ; // successive approximation bit pos high
-INTERN int cs_sal       =   0  ; // successive approximation bit pos low
+TLS_INTERN int cs_cmpc      =   0  ; // component count in current scan
+TLS_INTERN int cs_cmp[ 4 ]  = { 0 }; // component numbers  in current scan
+TLS_INTERN int cs_from      =   0  ; // begin - band of current scan ( inclusive )
+TLS_INTERN int cs_to        =   0  ; // end - band of current scan ( inclusive )
+TLS_INTERN int cs_sah       =   0  ; // successive approximation bit pos high
+TLS_INTERN int cs_sal       =   0  ; // successive approximation bit pos low
 	
 
 /* -----------------------------------------------
 	global variables: info about files
 	----------------------------------------------- */
 	
-INTERN char*  jpgfilename = NULL;	// name of JPEG file
-INTERN char*  pjgfilename = NULL;	// name of PJG file
-INTERN int    jpgfilesize;			// size of JPEG file
-INTERN int    pjgfilesize;			// size of PJG file
-INTERN int    jpegtype = 0;			// type of JPEG coding: 0->unknown, 1->sequential, 2->progressive
-INTERN int    filetype;				// type of current file
-INTERN iostream* str_in  = NULL;	// input stream
-INTERN iostream* str_out = NULL;	// output stream
+TLS_INTERN char*  jpgfilename = NULL;	// name of JPEG file
+TLS_INTERN char*  pjgfilename = NULL;	// name of PJG file
+TLS_INTERN int    jpgfilesize;			// size of JPEG file
+TLS_INTERN int    pjgfilesize;			// size of PJG file
+TLS_INTERN int    jpegtype = 0;			// type of JPEG coding: 0->unknown, 1->sequential, 2->progressive
+TLS_INTERN int    filetype;				// type of current file
+TLS_INTERN iostream* str_in  = NULL;	// input stream
+TLS_INTERN iostream* str_out = NULL;	// output stream
 
 #if !defined(BUILD_LIB)
-INTERN iostream* str_str = NULL;	// storage stream
+TLS_INTERN iostream* str_str = NULL;	// storage stream
 
-INTERN char** filelist = NULL;		// list of files to process 
-INTERN int    file_cnt = 0;			// count of files in list
-INTERN int    file_no  = 0;			// number of current file
+TLS_INTERN char** filelist = NULL;		// list of files to process 
+TLS_INTERN int    file_cnt = 0;			// count of files in list
+TLS_INTERN int    file_no  = 0;			// number of current file
 
-INTERN char** err_list = NULL;		// list of error messages 
-INTERN int*   err_tp   = NULL;		// list of error types
+TLS_INTERN char** err_list = NULL;		// list of error messages 
+TLS_INTERN int*   err_tp   = NULL;		// list of error types
 #endif
 
 #if defined(DEV_INFOS)
-INTERN int    dev_size_hdr      = 0;
-INTERN int    dev_size_cmp[ 4 ] = { 0 };
-INTERN int    dev_size_zsr[ 4 ] = { 0 };
-INTERN int    dev_size_dc[ 4 ]  = { 0 };
-INTERN int    dev_size_ach[ 4 ] = { 0 };
-INTERN int    dev_size_acl[ 4 ] = { 0 };
-INTERN int    dev_size_zdh[ 4 ] = { 0 };
-INTERN int    dev_size_zdl[ 4 ] = { 0 };
+TLS_INTERN int    dev_size_hdr      = 0;
+TLS_INTERN int    dev_size_cmp[ 4 ] = { 0 };
+TLS_INTERN int    dev_size_zsr[ 4 ] = { 0 };
+TLS_INTERN int    dev_size_dc[ 4 ]  = { 0 };
+TLS_INTERN int    dev_size_ach[ 4 ] = { 0 };
+TLS_INTERN int    dev_size_acl[ 4 ] = { 0 };
+TLS_INTERN int    dev_size_zdh[ 4 ] = { 0 };
+TLS_INTERN int    dev_size_zdl[ 4 ] = { 0 };
 #endif
 
 
@@ -628,9 +636,9 @@ INTERN int    dev_size_zdl[ 4 ] = { 0 };
 	global variables: messages
 	----------------------------------------------- */
 
-INTERN char errormessage [ MSG_SIZE ];
-INTERN bool (*errorfunction)();
-INTERN int  errorlevel;
+TLS_INTERN char errormessage [ MSG_SIZE ];
+TLS_INTERN bool (*errorfunction)();
+TLS_INTERN int  errorlevel;
 // meaning of errorlevel:
 // -1 -> wrong input
 // 0 -> no error
@@ -643,30 +651,30 @@ INTERN int  errorlevel;
 	----------------------------------------------- */
 
 #if !defined( BUILD_LIB )
-INTERN int  verbosity  = -1;	// level of verbosity
-INTERN bool overwrite  = false;	// overwrite files yes / no
-INTERN bool wait_exit  = true;	// pause after finished yes / no
-INTERN int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN bool disc_meta  = false;	// discard meta-info yes / no
-
-INTERN bool developer  = false;	// allow developers functions yes/no
-INTERN bool auto_set   = true;	// automatic find best settings yes/no
-INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
-
-INTERN FILE*  msgout   = stdout;// stream for output of messages
-INTERN bool   pipe_on  = false;	// use stdin/stdout instead of filelist
+TLS_INTERN int  verbosity  = -1;	// level of verbosity
+TLS_INTERN bool overwrite  = false;	// overwrite files yes / no
+TLS_INTERN bool wait_exit  = true;	// pause after finished yes / no
+TLS_INTERN int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
+TLS_INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+TLS_INTERN bool disc_meta  = false;	// discard meta-info yes / no
+
+TLS_INTERN bool developer  = false;	// allow developers functions yes/no
+TLS_INTERN bool auto_set   = true;	// automatic find best settings yes/no
+TLS_INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
+
+TLS_INTERN FILE*  msgout   = stdout;// stream for output of messages
+TLS_INTERN bool   pipe_on  = false;	// use stdin/stdout instead of filelist
 #else
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN bool disc_meta  = false;	// discard meta-info yes / no
-INTERN bool auto_set   = true;	// automatic find best settings yes/no
-INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
+TLS_INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+TLS_INTERN bool disc_meta  = false;	// discard meta-info yes / no
+TLS_INTERN bool auto_set   = true;	// automatic find best settings yes/no
+TLS_INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
 #endif
 
-INTERN unsigned char nois_trs[ 4 ] = {6,6,6,6}; // bit pattern noise threshold
-INTERN unsigned char segm_cnt[ 4 ] = {10,10,10,10}; // number of segments
+TLS_INTERN unsigned char nois_trs[ 4 ] = {6,6,6,6}; // bit pattern noise threshold
+TLS_INTERN unsigned char segm_cnt[ 4 ] = {10,10,10,10}; // number of segments
 #if !defined( BUILD_LIB )
-INTERN unsigned char orig_set[ 8 ] = { 0 }; // store array for settings
+TLS_INTERN unsigned char orig_set[ 8 ] = { 0 }; // store array for settings
 #endif
 
 
@@ -959,6 +967,20 @@ EXPORT bool pjglib_convert_stream2mem( unsigned char** out_file, unsigned int* o
 	
 #if defined(BUILD_LIB)
 EXPORT void pjglib_init_streams( void* in_src, int in_type, int in_size, void* out_dest, int out_type )
+{
+	pjglib_init_streams_sized( in_src, in_type, in_size, out_dest, out_type, 0 );
+}
+#endif
+
+
+/* -----------------------------------------------
+	DLL export init input (file/mem), if output
+	is memory and out_dest/out_size are given the
+	output is written to that buffer and must fit
+	----------------------------------------------- */
+	
+#if defined(BUILD_LIB)
+EXPORT void pjglib_init_streams_sized( void* in_src, int in_type, int in_size, void* out_dest, int out_type, int out_size )
 {
 	/* a short reminder about input/output stream types:
 	
@@ -1000,7 +1022,7 @@ EXPORT void pjglib_init_streams( void* in_src, int in_type, int in_size, void* o
 	}	
 	
 	// open output stream, check for errors
-	str_out = new iostream( out_dest, out_type, 0, 1 );
+	str_out = new iostream( out_dest, out_type, ( out_type == 1 ) ? out_size : 0, 1 );
 	if ( str_out->chkerr() ) {
 		sprintf( errormessage, "error opening output stream" );
 		errorlevel = 2;
@@ -1053,7 +1075,7 @@ EXPORT void pjglib_init_streams( void* in_src, int in_type, int in_size, void* o
 #if defined(BUILD_LIB)
 EXPORT const char* pjglib_version_info( void )
 {
-	static char v_info[ 256 ];
+	TLS_INTERN char v_info[ 256 ];
 	
 	// copy version info to string
 	sprintf( v_info, "--> %s library v%i.%i%s (%s) by %s <--",
@@ -1071,7 +1093,7 @@ EXPORT const char* pjglib_version_info( void )
 #if defined(BUILD_LIB)
 EXPORT const char* pjglib_short_name( void )
 {
-	static char v_name[ 256 ];
+	TLS_INTERN char v_name[ 256 ];
 	
 	// copy version info to string
 	sprintf( v_name, "%s v%i.%i%s",
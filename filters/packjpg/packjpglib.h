@@ -13,6 +13,7 @@ EXPORT bool pjglib_convert_stream2stream( char* msg );
 EXPORT bool pjglib_convert_file2file( char* in, char* out, char* msg );
 EXPORT bool pjglib_convert_stream2mem( unsigned char** out_file, unsigned int* out_size, char* msg );
 EXPORT void pjglib_init_streams( void* in_src, int in_type, int in_size, void* out_dest, int out_type );
+EXPORT void pjglib_init_streams_sized( void* in_src, int in_type, int in_size, void* out_dest, int out_type, int out_size );
 EXPORT const char* pjglib_version_info( void );
 EXPORT const char* pjglib_short_name( void );
 
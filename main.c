@@ -38,6 +38,7 @@
 #include <pcompress.h>
 #include <ctype.h>
 #include <utils.h>
+#include "pc_server.h"
 
 int
 main(int argc, char *argv[])
@@ -46,6 +47,25 @@ main(int argc, char *argv[])
 	pc_ctx_t *pctx;
 
 	err = 0;
+
+	/*
+	 * Server and thin client modes take the place of the usual arguments.
+	 */
+	if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+		if (argc < 3 || argc > 4) {
+			log_msg(LOG_ERR, 0, "Usage: %s --serve <socket> [<max jobs>]", argv[0]);
+			return (1);
+		}
+		return (pc_serve(argv[2], argc > 3 ? atoi(argv[3]) : 0));
+	}
+	if (argc > 1 && strcmp(argv[1], "--connect") == 0) {
+		if (argc < 4) {
+			log_msg(LOG_ERR, 0, "Usage: %s --connect <socket> <arguments>", argv[0]);
+			return (1);
+		}
+		return (pc_client(argv[2], argv[0], argc - 3, &argv[3]));
+	}
+
 	pctx = create_pc_context();
 
 	err = init_pc_context(pctx, argc, argv);
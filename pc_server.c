@@ -0,0 +1,628 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Server mode, a fork-per-job launcher. The server sets up the process wide
+ * library state, the allocator, processor feature detection and archive type
+ * tables, once. Each job runs in a child forked from the server, so it skips
+ * exec, dynamic linking and that setup. The child receives the request, then
+ * runs the normal command line handling with the client's stdin, stdout,
+ * stderr and current directory, which are passed over the Unix domain socket.
+ *
+ * Worker threads, algorithm state and the dedupe index are still set up by
+ * each job. Threads do not survive fork() and the library keeps one job's
+ * state in globals, like signal handlers, temp files and the stdin/stdout
+ * pipe mode, so jobs cannot share persistent workers.
+ *
+ * Jobs are admitted in arrival order up to a maximum count. Unless it asks
+ * for a thread count itself, a job gets an equal share of the processors
+ * among the jobs running when it starts. The share is not changed as other
+ * jobs come and go. A job is cancelled if its client goes away.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pcompress.h>
+#include <utils.h>
+#include "pc_server.h"
+
+/*
+ * Time allowed for a client to send its request.
+ */
+#define	SERVER_REQ_TIMEOUT	10
+
+struct server_job {
+	pid_t pid;
+	int conn;
+	int cancelled;
+};
+
+static volatile sig_atomic_t server_stop = 0;
+static int chld_pipe[2] = {-1, -1};
+
+static void
+server_signal(int sig)
+{
+	int saved_errno = errno;
+
+	if (sig == SIGCHLD) {
+		/*
+		 * Wake up the poll loop. A full pipe is already enough.
+		 */
+		write(chld_pipe[1], "", 1);
+	} else {
+		server_stop = 1;
+	}
+	errno = saved_errno;
+}
+
+static void
+close_fds(int *fds, int nfds)
+{
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		if (fds[i] != -1)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+/*
+ * Receive a request and the client's descriptors. Returns the argument
+ * vector in a single allocation or NULL if the request is invalid.
+ */
+static char **
+recv_request(int conn, int *fds, int *argcp)
+{
+	struct server_req req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof (int) * SERVER_NFDS)];
+	} cbuf;
+	char **argv, *args, *pos;
+	uint32_t argc, arglen, i;
+	int64_t rb;
+	int nfds;
+
+	for (i = 0; i < SERVER_NFDS; i++)
+		fds[i] = -1;
+	memset(&msg, 0, sizeof (msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof (req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof (cbuf.buf);
+	rb = recvmsg(conn, &msg, 0);
+	if (rb <= 0)
+		return (NULL);
+
+	nfds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+			if (nfds > SERVER_NFDS)
+				nfds = SERVER_NFDS;
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof (int));
+			break;
+		}
+	}
+	if (nfds != SERVER_NFDS || (msg.msg_flags & MSG_CTRUNC)) {
+		log_msg(LOG_ERR, 0, "Request without client descriptors.");
+		close_fds(fds, SERVER_NFDS);
+		return (NULL);
+	}
+
+	if (rb < sizeof (req)) {
+		if (Read(conn, (uchar_t *)&req + rb, sizeof (req) - rb) != sizeof (req) - rb) {
+			close_fds(fds, SERVER_NFDS);
+			return (NULL);
+		}
+	}
+	argc = ntohl(req.argc);
+	arglen = ntohl(req.arglen);
+	if (memcmp(req.magic, SERVER_MAGIC, SERVER_MAGIC_LEN) != 0 || argc == 0 ||
+	    argc > SERVER_MAX_ARGS || arglen == 0 || arglen > SERVER_MAX_ARGLEN) {
+		log_msg(LOG_ERR, 0, "Invalid request.");
+		close_fds(fds, SERVER_NFDS);
+		return (NULL);
+	}
+
+	/*
+	 * Room for two extra arguments is left to insert a thread count.
+	 */
+	argv = (char **)malloc((argc + 3) * sizeof (char *) + arglen);
+	if (argv == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		close_fds(fds, SERVER_NFDS);
+		return (NULL);
+	}
+	args = (char *)(argv + argc + 3);
+	if (Read(conn, args, arglen) != arglen || args[arglen - 1] != '\0') {
+		free(argv);
+		close_fds(fds, SERVER_NFDS);
+		return (NULL);
+	}
+	pos = args;
+	for (i = 0; i < argc; i++) {
+		if (pos >= args + arglen) {
+			log_msg(LOG_ERR, 0, "Invalid request.");
+			free(argv);
+			close_fds(fds, SERVER_NFDS);
+			return (NULL);
+		}
+		argv[i] = pos;
+		pos += strlen(pos) + 1;
+	}
+	argv[argc] = NULL;
+	*argcp = argc;
+	return (argv);
+}
+
+/*
+ * Runs in the forked child. The request is received here so that a slow
+ * client only holds up its own job. Does not return.
+ */
+static void
+run_job(int conn, int nthreads)
+{
+	struct timeval tv;
+	pc_ctx_t *pctx;
+	char tbuf[16], **argv;
+	int fds[SERVER_NFDS], argc, err, i;
+
+	tv.tv_sec = SERVER_REQ_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	argv = recv_request(conn, fds, &argc);
+	close(conn);
+	if (argv == NULL)
+		exit(1);
+
+	if (dup2(fds[0], STDIN_FILENO) == -1 || dup2(fds[1], STDOUT_FILENO) == -1 ||
+	    dup2(fds[2], STDERR_FILENO) == -1)
+		exit(1);
+	if (fchdir(fds[3]) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot change to client directory: ");
+		exit(1);
+	}
+	close_fds(fds, SERVER_NFDS);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+
+	/*
+	 * Insert the thread share before the job's own arguments so that an
+	 * explicit '-t' from the client overrides it.
+	 */
+	snprintf(tbuf, sizeof (tbuf), "%d", nthreads);
+	for (i = argc; i > 0; i--)
+		argv[i + 2] = argv[i];
+	argv[1] = "-t";
+	argv[2] = tbuf;
+	argc += 2;
+
+	pctx = create_pc_context();
+	err = init_pc_context(pctx, argc, argv);
+	if (err != 0 && err != 2) {
+		log_msg(LOG_ERR, 0, "Invalid arguments to pcompress.\n");
+		log_msg(LOG_ERR, 0, "Please see usage.\n");
+	} else if (err == 2) {
+		usage(pctx);
+		err = 0;
+	} else {
+		err = start_pcompress(pctx);
+	}
+	destroy_pc_context(pctx);
+	fflush(stdout);
+	exit(err);
+}
+
+static void
+send_status(int conn, int status)
+{
+	uint32_t st;
+
+	/*
+	 * The client may be gone already.
+	 */
+	st = htonl(status);
+	Write(conn, &st, sizeof (st));
+	close(conn);
+}
+
+/*
+ * Accept a job on the given connection and fork its process.
+ */
+static void
+start_job(struct server_job *jobs, int max_jobs, int active, int nprocs, int conn,
+    int listenfd)
+{
+	int slot, nthreads, i;
+	pid_t pid;
+
+	for (slot = 0; slot < max_jobs; slot++) {
+		if (jobs[slot].pid == 0)
+			break;
+	}
+	nthreads = nprocs / (active + 1);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(listenfd);
+		close(chld_pipe[0]);
+		close(chld_pipe[1]);
+		for (i = 0; i < max_jobs; i++) {
+			if (jobs[i].pid != 0)
+				close(jobs[i].conn);
+		}
+		run_job(conn, nthreads);
+	}
+	if (pid == -1) {
+		log_msg(LOG_ERR, 1, "Cannot start job: ");
+		send_status(conn, 1);
+	} else {
+		jobs[slot].pid = pid;
+		jobs[slot].conn = conn;
+		jobs[slot].cancelled = 0;
+	}
+}
+
+static int
+reap_jobs(struct server_job *jobs, int max_jobs)
+{
+	int status, i, done;
+	pid_t pid;
+
+	done = 0;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < max_jobs; i++) {
+			if (jobs[i].pid != pid)
+				continue;
+			if (WIFEXITED(status))
+				send_status(jobs[i].conn, WEXITSTATUS(status));
+			else
+				send_status(jobs[i].conn, 128 + WTERMSIG(status));
+			jobs[i].pid = 0;
+			jobs[i].conn = -1;
+			done++;
+			break;
+		}
+	}
+	return (done);
+}
+
+int
+pc_serve(const char *sockpath, int max_jobs)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct server_job *jobs;
+	struct pollfd *pfds;
+	struct stat sbuf;
+	int listenfd, nprocs, active, npfd, i, j, rv, err;
+	mode_t omask;
+	char c;
+
+	if (strlen(sockpath) >= sizeof (addr.sun_path)) {
+		log_msg(LOG_ERR, 0, "Socket path too long: %s", sockpath);
+		return (1);
+	}
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_jobs <= 0)
+		max_jobs = nprocs;
+	jobs = (struct server_job *)calloc(max_jobs, sizeof (struct server_job));
+	pfds = (struct pollfd *)calloc(max_jobs + 2, sizeof (struct pollfd));
+	if (jobs == NULL || pfds == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		free(jobs);
+		free(pfds);
+		return (1);
+	}
+	for (i = 0; i < max_jobs; i++)
+		jobs[i].conn = -1;
+
+	if (pipe(chld_pipe) == -1) {
+		log_msg(LOG_ERR, 1, "pipe: ");
+		free(jobs);
+		free(pfds);
+		return (1);
+	}
+	fcntl(chld_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(chld_pipe[1], F_SETFL, O_NONBLOCK);
+	memset(&sa, 0, sizeof (sa));
+	sa.sa_handler = server_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/*
+	 * A stale socket from an earlier server is replaced.
+	 */
+	if (lstat(sockpath, &sbuf) == 0) {
+		if (!S_ISSOCK(sbuf.st_mode)) {
+			log_msg(LOG_ERR, 0, "%s exists and is not a socket.", sockpath);
+			err = 1;
+			goto out;
+		}
+		unlink(sockpath);
+	}
+	if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_msg(LOG_ERR, 1, "socket: ");
+		err = 1;
+		goto out;
+	}
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+
+	/*
+	 * Jobs run with the server's credentials, so only its owner may
+	 * connect.
+	 */
+	omask = umask(077);
+	rv = bind(listenfd, (struct sockaddr *)&addr, sizeof (addr));
+	umask(omask);
+	if (rv == -1 || listen(listenfd, 64) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot listen on %s: ", sockpath);
+		close(listenfd);
+		err = 1;
+		goto out;
+	}
+
+	/*
+	 * Every job inherits this.
+	 */
+	init_pc_process();
+	log_msg(LOG_INFO, 0, "Listening on %s, running up to %d jobs.", sockpath, max_jobs);
+
+	err = 0;
+	active = 0;
+	while (!server_stop) {
+		pfds[0].fd = chld_pipe[0];
+		pfds[0].events = POLLIN;
+		npfd = 1;
+
+		/*
+		 * New jobs wait in the listen backlog while all slots are busy.
+		 */
+		if (active < max_jobs) {
+			pfds[npfd].fd = listenfd;
+			pfds[npfd].events = POLLIN;
+			npfd++;
+		}
+
+		/*
+		 * A client keeps the connection open until its job ends, so a
+		 * hangup means it has gone away. The request itself is read by
+		 * the job, so input on the connection is not watched.
+		 */
+		for (i = 0; i < max_jobs; i++) {
+			if (jobs[i].pid != 0 && !jobs[i].cancelled) {
+				pfds[npfd].fd = jobs[i].conn;
+				pfds[npfd].events = 0;
+				npfd++;
+			}
+		}
+
+		rv = poll(pfds, npfd, -1);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			log_msg(LOG_ERR, 1, "poll: ");
+			err = 1;
+			break;
+		}
+		if (pfds[0].revents) {
+			while (read(chld_pipe[0], &c, 1) == 1);
+			active -= reap_jobs(jobs, max_jobs);
+		}
+		for (j = 1; j < npfd; j++) {
+			if (pfds[j].fd == listenfd || !pfds[j].revents)
+				continue;
+			for (i = 0; i < max_jobs; i++) {
+				if (jobs[i].pid != 0 && jobs[i].conn == pfds[j].fd) {
+					kill(jobs[i].pid, SIGTERM);
+					jobs[i].cancelled = 1;
+				}
+			}
+		}
+		if (npfd > 1 && pfds[1].fd == listenfd && (pfds[1].revents & POLLIN)) {
+			int conn;
+
+			if ((conn = accept(listenfd, NULL, NULL)) == -1) {
+				if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+					log_msg(LOG_ERR, 1, "accept: ");
+				continue;
+			}
+			start_job(jobs, max_jobs, active, nprocs, conn, listenfd);
+			for (i = 0, active = 0; i < max_jobs; i++) {
+				if (jobs[i].pid != 0)
+					active++;
+			}
+		}
+	}
+
+	/*
+	 * Shut down. Running jobs are cancelled.
+	 */
+	for (i = 0; i < max_jobs; i++) {
+		if (jobs[i].pid != 0)
+			kill(jobs[i].pid, SIGTERM);
+	}
+	while (active > 0) {
+		int status;
+		pid_t pid;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid == -1 && errno != EINTR)
+			break;
+		for (i = 0; i < max_jobs; i++) {
+			if (pid > 0 && jobs[i].pid == pid) {
+				send_status(jobs[i].conn, 128 + SIGTERM);
+				jobs[i].pid = 0;
+				active--;
+			}
+		}
+	}
+	close(listenfd);
+	unlink(sockpath);
+out:
+	close(chld_pipe[0]);
+	close(chld_pipe[1]);
+	free(jobs);
+	free(pfds);
+	return (err);
+}
+
+/*
+ * Thin client. Sends the command line with stdin, stdout, stderr and the
+ * current directory to the server and returns the job's exit status.
+ */
+int
+pc_client(const char *sockpath, const char *argv0, int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct server_req req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof (int) * SERVER_NFDS)];
+	} cbuf;
+	int fds[SERVER_NFDS];
+	char *args, *pos;
+	uint32_t arglen, st;
+	int sock, i;
+
+	if (strlen(sockpath) >= sizeof (addr.sun_path)) {
+		log_msg(LOG_ERR, 0, "Socket path too long: %s", sockpath);
+		return (1);
+	}
+	if (argc + 1 > SERVER_MAX_ARGS) {
+		log_msg(LOG_ERR, 0, "Too many arguments.");
+		return (1);
+	}
+	arglen = strlen(argv0) + 1;
+	for (i = 0; i < argc; i++)
+		arglen += strlen(argv[i]) + 1;
+	if (arglen > SERVER_MAX_ARGLEN) {
+		log_msg(LOG_ERR, 0, "Arguments too long.");
+		return (1);
+	}
+	if ((args = (char *)malloc(arglen)) == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (1);
+	}
+	pos = args;
+	strcpy(pos, argv0);
+	pos += strlen(argv0) + 1;
+	for (i = 0; i < argc; i++) {
+		strcpy(pos, argv[i]);
+		pos += strlen(argv[i]) + 1;
+	}
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_msg(LOG_ERR, 1, "socket: ");
+		free(args);
+		return (1);
+	}
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof (addr)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot connect to %s: ", sockpath);
+		close(sock);
+		free(args);
+		return (1);
+	}
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	if ((fds[3] = open(".", O_RDONLY)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open current directory: ");
+		close(sock);
+		free(args);
+		return (1);
+	}
+
+	memcpy(req.magic, SERVER_MAGIC, SERVER_MAGIC_LEN);
+	req.argc = htonl(argc + 1);
+	req.arglen = htonl(arglen);
+	memset(&msg, 0, sizeof (msg));
+	memset(&cbuf, 0, sizeof (cbuf));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof (req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof (cbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof (int) * SERVER_NFDS);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof (int) * SERVER_NFDS);
+
+	if (sendmsg(sock, &msg, 0) != sizeof (req) || Write(sock, args, arglen) != arglen) {
+		log_msg(LOG_ERR, 1, "Cannot send request: ");
+		close(fds[3]);
+		close(sock);
+		free(args);
+		return (1);
+	}
+	close(fds[3]);
+	free(args);
+
+	if (Read(sock, &st, sizeof (st)) != sizeof (st)) {
+		log_msg(LOG_ERR, 0, "Server closed the connection.");
+		close(sock);
+		return (1);
+	}
+	close(sock);
+	return (ntohl(st));
+}
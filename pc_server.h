@@ -0,0 +1,62 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_SERVER_H
+#define	_PC_SERVER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * A client request on the server socket is this header followed by the
+ * command line arguments as NUL terminated strings. The client's stdin,
+ * stdout, stderr and current directory are passed with the header as
+ * SCM_RIGHTS descriptors. After the job ends the server replies with its
+ * exit status as a 4 byte integer. All integers are in network byte order.
+ */
+#define	SERVER_MAGIC		"PCSERVE1"
+#define	SERVER_MAGIC_LEN	8
+#define	SERVER_NFDS		4
+#define	SERVER_MAX_ARGS		128
+#define	SERVER_MAX_ARGLEN	(64 * 1024)
+
+struct server_req {
+	char magic[SERVER_MAGIC_LEN];
+	uint32_t argc;
+	uint32_t arglen;
+};
+
+int pc_serve(const char *sockpath, int max_jobs);
+int pc_client(const char *sockpath, const char *argv0, int argc, char *argv[]);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Striping of compressed chunks across multiple volume files. Every volume
+ * has its own writer thread so chunks go to all the target devices in
+ * parallel. On decompression each chunk is read by the thread that
+ * decompresses it, so the volumes are read in parallel as well.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libgen.h>
+#include <utils.h>
+#include <pcompress.h>
+#include <crypto/crypto_utils.h>
+#include <lzma_crc.h>
+#include "pc_volume.h"
+
+static void *
+volume_writer(void *dat)
+{
+	pc_vol_t *vol = (pc_vol_t *)dat;
+	pc_ctx_t *pctx = vol->pctx;
+	struct cmp_data *tdat;
+	int64_t wbytes;
+
+	for (;;) {
+		sem_wait(&vol->avail);
+		tdat = vol->queue[vol->head % vol->qsize];
+		vol->head++;
+		if (tdat == NULL)
+			break;
+
+		/*
+		 * After an error the remaining chunks are only released.
+		 */
+		if (!pctx->main_cancel) {
+			wbytes = Write(vol->fd, tdat->cmp_seg, tdat->len_cmp);
+			if (unlikely(wbytes != tdat->len_cmp)) {
+				log_msg(LOG_ERR, 1, "Chunk Write to volume %s: ", vol->path);
+				pctx->t_errored = 1;
+				pctx->main_cancel = 1;
+			}
+			vol->off += tdat->len_cmp;
+		}
+		sem_post(&tdat->write_done_sem);
+	}
+	return (NULL);
+}
+
+static void
+volset_hdr(pc_volset_t *vs, uint32_t idx, uchar_t *hdr)
+{
+	memcpy(hdr, VOLUME_MAGIC, VOLUME_MAGIC_LEN);
+	U64_P(hdr + VOLUME_MAGIC_LEN) = htonll(vs->set_id);
+	U32_P(hdr + VOLUME_MAGIC_LEN + 8) = htonl(idx);
+	U32_P(hdr + VOLUME_MAGIC_LEN + 12) = htonl(vs->nvols);
+}
+
+/*
+ * Create one volume file in each of the comma separated directories and
+ * start their writer threads. Volume files are named after the output file
+ * with the volume number appended.
+ */
+int
+volset_create(pc_ctx_t *pctx, const char *dirs, const char *to_filename, int nprocs)
+{
+	pc_volset_t *vs;
+	char *dlist, *dir, *base, *sp, *fname;
+	uchar_t hdr[VOLUME_HDR_SZ];
+	uint32_t i;
+	int failed;
+
+	vs = (pc_volset_t *)calloc(1, sizeof (pc_volset_t));
+	if (vs == NULL || (vs->vols = (pc_vol_t *)calloc(MAX_VOLUMES,
+	    sizeof (pc_vol_t))) == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		free(vs);
+		return (-1);
+	}
+	for (i = 0; i < MAX_VOLUMES; i++)
+		vs->vols[i].fd = -1;
+	pctx->volset = vs;
+
+	if (geturandom_bytes((uchar_t *)&vs->set_id, sizeof (vs->set_id)) != 0)
+		vs->set_id = ((uint64_t)time(NULL) << 32) ^ getpid();
+
+	fname = strdup(to_filename);
+	dlist = strdup(dirs);
+	if (fname == NULL || dlist == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		free(fname);
+		free(dlist);
+		return (-1);
+	}
+	base = basename(fname);
+
+	/*
+	 * All volume headers carry the volume count, so collect the paths first.
+	 */
+	failed = 0;
+	for (dir = strtok_r(dlist, ",", &sp); dir != NULL; dir = strtok_r(NULL, ",", &sp)) {
+		if (vs->nvols == MAX_VOLUMES) {
+			log_msg(LOG_ERR, 0, "At most %d volumes are supported.", MAX_VOLUMES);
+			failed = 1;
+			break;
+		}
+		if (snprintf(vs->vols[vs->nvols].path, MAXPATHLEN, "%s/%s.%u", dir, base,
+		    vs->nvols + 1) >= MAXPATHLEN) {
+			log_msg(LOG_ERR, 0, "Volume path too long: %s", dir);
+			failed = 1;
+			break;
+		}
+		vs->nvols++;
+	}
+	free(fname);
+	free(dlist);
+	if (vs->nvols == 0 && !failed) {
+		log_msg(LOG_ERR, 0, "No volume directories given.");
+		failed = 1;
+	}
+
+	for (i = 0; i < vs->nvols && !failed; i++) {
+		pc_vol_t *vol = &(vs->vols[i]);
+
+		failed = 1;
+		if ((vol->fd = open(vol->path, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR)) == -1) {
+			log_msg(LOG_ERR, 1, "Cannot create volume %s: ", vol->path);
+			break;
+		}
+		add_fname(vol->path);
+
+		volset_hdr(vs, i, hdr);
+		if (Write(vol->fd, hdr, VOLUME_HDR_SZ) != VOLUME_HDR_SZ) {
+			log_msg(LOG_ERR, 1, "Write to volume %s: ", vol->path);
+			break;
+		}
+		vol->off = VOLUME_HDR_SZ;
+
+		/*
+		 * At most nprocs chunks are in flight, plus the end marker.
+		 */
+		vol->qsize = nprocs + 1;
+		vol->queue = (struct cmp_data **)calloc(vol->qsize, sizeof (struct cmp_data *));
+		if (vol->queue == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory.");
+			break;
+		}
+		vol->pctx = pctx;
+		sem_init(&vol->avail, 0, 0);
+		if (pthread_create(&vol->thr, NULL, volume_writer, (void *)vol) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			sem_destroy(&vol->avail);
+			break;
+		}
+		vol->thr_started = 1;
+		failed = 0;
+	}
+
+	if (failed) {
+		volset_finish(vs, 1, NULL);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Write the manifest that lists the volumes into the main file.
+ */
+int
+volset_write_manifest(pc_volset_t *vs, int fd)
+{
+	uchar_t *buf, *pos;
+	uint64_t len;
+	uint32_t i;
+	uint16_t plen;
+	int rv;
+
+	len = 4 + 8 + 4;
+	for (i = 0; i < vs->nvols; i++)
+		len += 2 + strlen(vs->vols[i].path);
+	buf = (uchar_t *)malloc(len);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (-1);
+	}
+
+	pos = buf;
+	U32_P(pos) = htonl(vs->nvols);
+	pos += 4;
+	U64_P(pos) = htonll(vs->set_id);
+	pos += 8;
+	for (i = 0; i < vs->nvols; i++) {
+		plen = strlen(vs->vols[i].path);
+		*((uint16_t *)pos) = htons(plen);
+		pos += 2;
+		memcpy(pos, vs->vols[i].path, plen);
+		pos += plen;
+	}
+	U32_P(pos) = htonl(lzma_crc32(buf, pos - buf, 0));
+	pos += 4;
+
+	rv = 0;
+	if (Write(fd, buf, len) != len) {
+		log_msg(LOG_ERR, 1, "Write ");
+		rv = -1;
+	}
+	free(buf);
+	return (rv);
+}
+
+/*
+ * Hand a compressed chunk to the writer of its volume. Only the main writer
+ * thread queues chunks and they arrive in sequence.
+ */
+void
+volset_queue(pc_volset_t *vs, struct cmp_data *tdat)
+{
+	pc_vol_t *vol = &(vs->vols[tdat->id % vs->nvols]);
+
+	vol->queue[vol->tail % vol->qsize] = tdat;
+	vol->tail++;
+	sem_post(&vol->avail);
+}
+
+/*
+ * Stop the writer threads and close the volumes. Unless there was an error
+ * the zero-length trailer is written to each volume and it gets the mode
+ * and ownership in sbuf, if given. Volumes are removed on error.
+ */
+int
+volset_finish(pc_volset_t *vs, int err, struct stat *sbuf)
+{
+	uint64_t zero;
+	uint32_t i;
+
+	for (i = 0; i < vs->nvols; i++) {
+		pc_vol_t *vol = &(vs->vols[i]);
+
+		if (vol->thr_started) {
+			vol->queue[vol->tail % vol->qsize] = NULL;
+			vol->tail++;
+			sem_post(&vol->avail);
+			pthread_join(vol->thr, NULL);
+			sem_destroy(&vol->avail);
+			vol->thr_started = 0;
+		}
+		if (vol->pctx && vol->pctx->t_errored)
+			err = 1;
+	}
+
+	for (i = 0; i < vs->nvols && !err; i++) {
+		pc_vol_t *vol = &(vs->vols[i]);
+
+		zero = 0;
+		if (Write(vol->fd, &zero, sizeof (zero)) != sizeof (zero)) {
+			log_msg(LOG_ERR, 1, "Write to volume %s: ", vol->path);
+			err = 1;
+		} else if (sbuf) {
+			fchmod(vol->fd, sbuf->st_mode);
+			if (fchown(vol->fd, sbuf->st_uid, sbuf->st_gid) == -1)
+				log_msg(LOG_ERR, 1, "chown ");
+		}
+	}
+
+	/*
+	 * Only volumes created here are removed, not files that were in the way.
+	 */
+	for (i = 0; i < vs->nvols; i++) {
+		pc_vol_t *vol = &(vs->vols[i]);
+
+		free(vol->queue);
+		vol->queue = NULL;
+		if (vol->fd == -1)
+			continue;
+		close(vol->fd);
+		vol->fd = -1;
+		if (err)
+			unlink(vol->path);
+		rm_fname(vol->path);
+	}
+	return (err);
+}
+
+static int
+volume_open(pc_volset_t *vs, uint32_t idx, const char *filename)
+{
+	pc_vol_t *vol = &(vs->vols[idx]);
+	uchar_t hdr[VOLUME_HDR_SZ], chk[VOLUME_HDR_SZ];
+	char path[MAXPATHLEN], *fdir, *vname;
+
+	vol->fd = open(vol->path, O_RDONLY);
+
+	/*
+	 * Volumes moved together with the main file are found next to it.
+	 */
+	if (vol->fd == -1 && filename != NULL) {
+		fdir = strdup(filename);
+		vname = strdup(vol->path);
+		if (fdir && vname) {
+			snprintf(path, sizeof (path), "%s/%s", dirname(fdir), basename(vname));
+			vol->fd = open(path, O_RDONLY);
+		}
+		free(fdir);
+		free(vname);
+	}
+	if (vol->fd == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open volume %s: ", vol->path);
+		return (-1);
+	}
+
+	volset_hdr(vs, idx, chk);
+	if (Read(vol->fd, hdr, VOLUME_HDR_SZ) != VOLUME_HDR_SZ ||
+	    memcmp(hdr, chk, VOLUME_HDR_SZ) != 0) {
+		log_msg(LOG_ERR, 0, "%s is not volume %u of this file.", vol->path, idx + 1);
+		return (-1);
+	}
+	vol->off = VOLUME_HDR_SZ;
+	return (0);
+}
+
+/*
+ * Read the manifest following the file header and open the volumes.
+ */
+int
+volset_open(pc_ctx_t *pctx, int fd, const char *filename)
+{
+	pc_volset_t *vs;
+	uchar_t buf[12];
+	uint32_t i, crc, crc1;
+	uint16_t plen;
+
+	if (Read(fd, buf, 12) != 12) {
+		log_msg(LOG_ERR, 0, "Volume manifest is truncated.");
+		return (-1);
+	}
+	crc = lzma_crc32(buf, 12, 0);
+
+	vs = (pc_volset_t *)calloc(1, sizeof (pc_volset_t));
+	if (vs == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (-1);
+	}
+	vs->nvols = ntohl(U32_P(buf));
+	vs->set_id = ntohll(U64_P(buf + 4));
+	if (vs->nvols == 0 || vs->nvols > MAX_VOLUMES) {
+		log_msg(LOG_ERR, 0, "Invalid volume count %u in manifest.", vs->nvols);
+		free(vs);
+		return (-1);
+	}
+	vs->vols = (pc_vol_t *)calloc(vs->nvols, sizeof (pc_vol_t));
+	if (vs->vols == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		free(vs);
+		return (-1);
+	}
+	for (i = 0; i < vs->nvols; i++)
+		vs->vols[i].fd = -1;
+	pctx->volset = vs;
+
+	for (i = 0; i < vs->nvols; i++) {
+		if (Read(fd, &plen, 2) != 2) {
+			log_msg(LOG_ERR, 0, "Volume manifest is truncated.");
+			return (-1);
+		}
+		crc = lzma_crc32((uchar_t *)&plen, 2, crc);
+		plen = ntohs(plen);
+		if (plen == 0 || plen >= MAXPATHLEN) {
+			log_msg(LOG_ERR, 0, "Volume manifest is corrupt.");
+			return (-1);
+		}
+		if (Read(fd, vs->vols[i].path, plen) != plen) {
+			log_msg(LOG_ERR, 0, "Volume manifest is truncated.");
+			return (-1);
+		}
+		crc = lzma_crc32((uchar_t *)vs->vols[i].path, plen, crc);
+	}
+	if (Read(fd, &crc1, 4) != 4 || ntohl(crc1) != crc) {
+		log_msg(LOG_ERR, 0, "Volume manifest is corrupt.");
+		return (-1);
+	}
+
+	for (i = 0; i < vs->nvols; i++) {
+		if (volume_open(vs, i, filename) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Read the length field of the given chunk from its volume.
+ */
+int
+volset_read_len(pc_volset_t *vs, uint32_t chunk, uint64_t *len)
+{
+	pc_vol_t *vol = &(vs->vols[chunk % vs->nvols]);
+	int64_t rb;
+
+	rb = Pread(vol->fd, len, sizeof (*len), vol->off);
+	if (rb > 0)
+		vol->off += rb;
+	return (rb);
+}
+
+/*
+ * Return where the rest of the chunk, of the given length, is found and move
+ * past it.
+ */
+void
+volset_chunk_pos(pc_volset_t *vs, uint32_t chunk, uint64_t len, int *fd, uint64_t *off)
+{
+	pc_vol_t *vol = &(vs->vols[chunk % vs->nvols]);
+
+	*fd = vol->fd;
+	*off = vol->off;
+	vol->off += len;
+}
+
+void
+volset_seek(pc_volset_t *vs, uint32_t chunk, uint64_t off)
+{
+	vs->vols[chunk % vs->nvols].off = off;
+}
+
+/*
+ * Catalog chunk positions are computed for a single chunk stream. Remap them
+ * to offsets within the volumes and check that they match the volume sizes.
+ */
+int
+volset_map_catalog(pc_volset_t *vs, pc_catalog_t *cat)
+{
+	uint64_t off[MAX_VOLUMES];
+	struct stat sbuf;
+	uint32_t i, v;
+
+	for (v = 0; v < vs->nvols; v++)
+		off[v] = VOLUME_HDR_SZ;
+	for (i = 0; i < cat->nchunks; i++) {
+		v = i % vs->nvols;
+		cat->chunks[i].file_off = off[v];
+		off[v] += cat->chunks[i].disk_len;
+	}
+	for (v = 0; v < vs->nvols; v++) {
+		if (fstat(vs->vols[v].fd, &sbuf) == -1 ||
+		    off[v] + sizeof (uint64_t) != sbuf.st_size) {
+			log_msg(LOG_WARN, 0, "Catalog does not match volume chunks, "
+			    "ignoring catalog.");
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+void
+volset_free(pc_volset_t *vs)
+{
+	uint32_t i;
+
+	if (vs == NULL)
+		return;
+	for (i = 0; i < vs->nvols; i++) {
+		if (vs->vols[i].fd != -1)
+			close(vs->vols[i].fd);
+	}
+	free(vs->vols);
+	free(vs);
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_VOLUME_H
+#define	_PC_VOLUME_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <pcompress.h>
+#include <pc_catalog.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * A compressed file written with '-V' has its chunks striped round-robin
+ * across a set of volume files. Chunk n is stored in volume n % nvols. The
+ * main file holds the file header followed by the manifest, the zero-length
+ * trailer and the catalog if any. The manifest is laid out as follows (all
+ * integers are in network byte order):
+ *
+ * volume count (4), set id (8), for each volume: path length (2), path,
+ * CRC32 of the preceding manifest bytes (4)
+ *
+ * Each volume starts with a header of magic (8), set id (8), volume index (4)
+ * and volume count (4) and is followed by its chunks and a zero-length
+ * trailer, just like the chunk stream of a normal file.
+ */
+#define	VOLUME_MAGIC		"PZVOLUME"
+#define	VOLUME_MAGIC_LEN	8
+#define	VOLUME_HDR_SZ		(VOLUME_MAGIC_LEN + 8 + 4 + 4)
+#define	MAX_VOLUMES		64
+
+typedef struct {
+	char path[MAXPATHLEN];
+	int fd;
+	uint64_t off;
+
+	/*
+	 * Writer thread and the queue of chunks it has to write.
+	 */
+	pthread_t thr;
+	int thr_started;
+	sem_t avail;
+	struct cmp_data **queue;
+	uint32_t head, tail, qsize;
+	pc_ctx_t *pctx;
+} pc_vol_t;
+
+typedef struct pc_volset {
+	uint64_t set_id;
+	uint32_t nvols;
+	pc_vol_t *vols;
+} pc_volset_t;
+
+int volset_create(pc_ctx_t *pctx, const char *dirs, const char *to_filename, int nprocs);
+int volset_write_manifest(pc_volset_t *vs, int fd);
+void volset_queue(pc_volset_t *vs, struct cmp_data *tdat);
+int volset_finish(pc_volset_t *vs, int err, struct stat *sbuf);
+int volset_open(pc_ctx_t *pctx, int fd, const char *filename);
+int volset_read_len(pc_volset_t *vs, uint32_t chunk, uint64_t *len);
+void volset_chunk_pos(pc_volset_t *vs, uint32_t chunk, uint64_t len, int *fd, uint64_t *off);
+void volset_seek(pc_volset_t *vs, uint32_t chunk, uint64_t off);
+int volset_map_catalog(pc_volset_t *vs, pc_catalog_t *cat);
+void volset_free(pc_volset_t *vs);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
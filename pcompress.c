@@ -38,6 +38,8 @@
 #include <strings.h>
 #include <limits.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <getopt.h>
 #if defined(sun) || defined(__sun)
 #include <sys/byteorder.h>
 #else
@@ -56,7 +58,10 @@
 #include <ctype.h>
 #include <errno.h>
 #include <pc_archive.h>
+#include <pc_catalog.h>
+#include <pc_volume.h>
 #include <filters/dispack/dis.hpp>
+#include <filters/bcj/bcj.h>
 
 /*
  * We use 8MB chunks by default.
@@ -64,12 +69,66 @@
 #define	DEFAULT_CHUNKSIZE	(8 * 1024 * 1024)
 #define	EIGHTY_PCT(x) ((x) - ((x)/5))
 
+/*
+ * Checkpoint written next to the partial output with '--checkpoint'. All
+ * integers are in network byte order:
+ *
+ * magic (8), interval (4), chunk count (4), input offset (8), output offset (8),
+ * input size (8), input mtime (8), CRC32 of the preceding bytes (4)
+ */
+#define	CKPT_MAGIC	"PZCKPT01"
+#define	CKPT_MAGIC_LEN	8
+#define	CKPT_SZ		(CKPT_MAGIC_LEN + 4 + 4 + 8 + 8 + 8 + 8 + 4)
+
+/*
+ * How often the writer checks whether the reader of the output pipe has
+ * consumed spliced chunks while it waits for the next chunk.
+ */
+#define	SPLICE_POLL_NS	(1000 * 1000)
+
+/*
+ * Options that only have a long form.
+ */
+#define	OPT_CHECKPOINT	256
+#define	OPT_RESUME	257
+#define	OPT_SPLICE	258
+
+static struct option long_opts[] = {
+	{"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+	{"resume", no_argument, NULL, OPT_RESUME},
+	{"splice", no_argument, NULL, OPT_SPLICE},
+	{NULL, 0, NULL, 0}
+};
+
 struct wdata {
 	struct cmp_data **dary;
 	int wfd;
 	int nprocs;
 	int64_t chunksize;
 	pc_ctx_t *pctx;
+	struct cmp_data **pend;
+	uint64_t *pend_end;
+	uint64_t spliced;
+	int npend, phead;
+};
+
+/*
+ * Shared state of the threads scanning chunks with '-TT'.
+ */
+struct sdata {
+	int fd;
+	uint64_t next_off, bytes;
+	int64_t chunksize, compressed_chunksize;
+	unsigned int next_id;
+	int done, errored;
+	pthread_mutex_t lock;
+	pc_ctx_t *pctx;
+};
+
+struct scan_thread {
+	struct sdata *s;
+	struct cmp_data tdat;
+	pthread_t thr;
 };
 
 pthread_mutex_t opt_parse = PTHREAD_MUTEX_INITIALIZER;
@@ -121,6 +180,8 @@ usage(pc_ctx_t *pctx)
 	    "            source filename is used with the extension '.pz' appended.\n"
 	    "2) To decompress a file compressed using above command:\n"
 	    "   %s -d <compressed file> <target file>\n"
+	    "   When extracting an archive, member names or directories can follow the\n"
+	    "   target directory to extract only those.\n"
 	    "3) To operate as a pipe, read from stdin and write to stdout:\n"
 	    "   %s -p ...\n"
 	    "4) Attempt Rabin fingerprinting based deduplication on a per-chunk basis:\n"
@@ -131,7 +192,10 @@ usage(pc_ctx_t *pctx)
 	    "6) Perform Delta Encoding in addition to Identical Dedupe:\n"
 	    "   %s -E ... - This also implies '-D'. This checks for at least 60%% similarity.\n"
 	    "   The flag can be repeated as in '-EE' to indicate at least 40%% similarity.\n\n"
-	    "7) Number of threads can optionally be specified: -t <1 - 256 count>\n"
+	    "7) Number of threads can optionally be specified: -t <1 - 256 count>\n",
+	    UTILITY_VERSION, pctx->exec_name, pctx->exec_name, pctx->exec_name, pctx->exec_name,
+	    pctx->exec_name, pctx->exec_name);
+	fprintf(stderr,
 	    "8) Other flags:\n"
 	    "   '-L'    - Enable LZP pre-compression. This improves compression ratio of all\n"
 	    "             algorithms with some extra CPU and very low RAM overhead.\n"
@@ -140,9 +204,48 @@ usage(pc_ctx_t *pctx)
 	    "             an arithmetic series.\n"
 	    "   NOTE    - Both -L and -P can be used together to give maximum benefit on most.\n"
 	    "             datasets.\n"
+	    "   '-b'    - Enable BCJ branch address conversion for x86, x86-64 and ARM64\n"
+	    "             executables. Only valid when archiving.\n"
+	    "   '-I'    - Append a catalog of members when archiving. It allows listing\n"
+	    "             an archive instantly and extracting selected members without\n"
+	    "             decompressing the whole archive.\n"
+	    "   '-i'    - List the members of an archive: %s -i <archive> [<member> ...]\n"
+	    "   '-T'    - Verify a compressed file or archive without writing any output:\n"
+	    "             %s -T <compressed file>\n"
+	    "             With '-TT' only the compressed chunks are checked, at disk speed.\n"
+	    "   '-H'    - Make the chunk CRC32 cover the compressed data as well as the\n"
+	    "             chunk header. Implied when encrypting.\n",
+	    pctx->exec_name, pctx->exec_name);
+	fprintf(stderr,
+	    "   '-V' <dir>[,<dir>...]\n"
+	    "           - Stripe the compressed chunks across volume files in the given\n"
+	    "             directories. Each volume is written and read in parallel.\n"
+	    "   '-f' <list file>\n"
+	    "           - Compress each file named in <list file>, one per line, to its\n"
+	    "             own compressed file. Files are compressed concurrently.\n"
+	    "   '-A' <compressed file>\n"
+	    "           - Append a file to an existing compressed file:\n"
+	    "             %s -A <compressed file> <file>\n"
+	    "             The compression options are taken from the compressed file. With\n"
+	    "             '-G' the global index is rebuilt from the existing data.\n"
+	    "   '--checkpoint' <seconds>\n"
+	    "           - Save a checkpoint of the partial output every <seconds> so that an\n"
+	    "             interrupted compression can be continued from it with:\n"
+	    "             %s --resume <file> [<target file>]\n"
+	    "   '--splice'\n"
+	    "           - Splice chunks into a stdout pipe with vmsplice() instead of\n"
+	    "             copying them. Only for readers that copy the data out of the\n"
+	    "             pipe and never splice it onwards.\n"
+	    "   '-O'    - Order archive members by content similarity within each file type\n"
+	    "             so that similar files are compressed together.\n"
+	    "   '-U'    - Store files identical to an earlier archived file as references\n"
+	    "             to it without archiving their data again.\n"
+	    "   '-J'    - Pack small files into combined members to cut per-member overhead.\n"
+	    "   '-R' <base archive>\n"
+	    "           - Create an incremental archive holding only members that are new\n"
+	    "             or changed since <base archive>, which must have a catalog.\n"
 	    "   '-S' <cksum>\n"
 	    "           - Specify chunk checksum to use:\n\n",
-	    UTILITY_VERSION, pctx->exec_name, pctx->exec_name, pctx->exec_name, pctx->exec_name,
 	    pctx->exec_name, pctx->exec_name);
 	list_checksums(stderr, "             ");
 	fprintf(stderr, "\n"
@@ -169,6 +272,56 @@ usage(pc_ctx_t *pctx)
 	    "   '-k <key length>\n"
 	    "           - Specify key length. Can be 16 for 128 bit or 32 for 256 bit. Default\n"
 	    "             is 32 for 256 bit keys.\n\n");
+	fprintf(stderr,
+	    "9) To run as a server that executes jobs sent by thin clients:\n"
+	    "   %s --serve <socket path> [<max concurrent jobs>]\n"
+	    "   A client runs a normal command line on the server. It passes its stdin,\n"
+	    "   stdout, stderr and current directory:\n"
+	    "   %s --connect <socket path> <arguments>\n\n",
+	    pctx->exec_name, pctx->exec_name);
+}
+
+static const char *preproc_filter_names[NUM_PREPROC_FILTERS] = {
+	"LZP", "Delta2", "Dispack", "BCJ"
+};
+
+/*
+ * Names of data sub-types, indexed by (sub-type >> 3).
+ */
+static const char *preproc_stype_names[NUM_SUB_TYPES] = {
+	"Generic", "Exe32", "JPEG", "Markup", "GZ", "LZW", "BZ2", "ZIP", "ARJ",
+	"ARC", "AR", "LZMA", "LZO", "AVI", "MP4", "FLAC", "RAR", "LZ", "PPMD",
+	"ZPAQ", "PackJPG", "DNA", "MJPEG", "Audio", "Exe64", "BMP", "TIFF",
+	"ExeARM64"
+};
+
+/*
+ * Show the adaptive pre-processing decisions taken for each data type.
+ */
+static void
+show_preproc_stats(pc_ctx_t *pctx)
+{
+	int i, j, hdr;
+	preproc_stat_t *ps;
+
+	hdr = 0;
+	for (i = 0; i < NUM_SUB_TYPES; i++) {
+		for (j = 0; j < NUM_PREPROC_FILTERS; j++) {
+			ps = &(pctx->preproc_stats[i][j]);
+			if (ps->tried == 0 && ps->skipped == 0)
+				continue;
+			if (!hdr) {
+				log_msg(LOG_INFO, 0, "Pre-processing decisions");
+				log_msg(LOG_INFO, 0, "Type     Filter   Tried  Succeeded  Skipped  Disabled");
+				hdr = 1;
+			}
+			log_msg(LOG_INFO, 0, "%-8s %-8s %5u  %9u  %7u  %8u",
+			    preproc_stype_names[i], preproc_filter_names[j],
+			    ps->tried, ps->succeeded, ps->skipped, ps->disabled);
+		}
+	}
+	if (hdr)
+		log_msg(LOG_INFO, 0, "");
 }
 
 static void
@@ -177,6 +330,16 @@ show_compression_stats(pc_ctx_t *pctx)
 	log_msg(LOG_INFO, 0, "\nCompression Statistics");
 	log_msg(LOG_INFO, 0, "======================");
 	log_msg(LOG_INFO, 0, "Total chunks           : %u", pctx->chunk_num);
+	if (pctx->numa_nodes > 1) {
+		int i;
+
+		for (i = 0; i < pctx->numa_nodes; i++) {
+			if (pctx->numa_workers[i] == 0)
+				continue;
+			log_msg(LOG_INFO, 0, "NUMA node %-3d          : %d worker(s) on CPUs %s",
+			    numa_node_id(i), pctx->numa_workers[i], numa_node_cpulist(i));
+		}
+	}
 	if (pctx->chunk_num == 0) {
 		log_msg(LOG_INFO, 0, "No statistics to display.");
 	} else {
@@ -191,6 +354,73 @@ show_compression_stats(pc_ctx_t *pctx)
 		    bytes_to_size(pctx->avg_chunk),
 		    (double)pctx->avg_chunk/(double)pctx->chunksize*100);
 	}
+	show_preproc_stats(pctx);
+}
+
+/*
+ * Check whether a pre-processing filter should be attempted on a chunk of the
+ * given sub-type. Filters that failed repeatedly on this type are skipped for
+ * a while before being probed again.
+ *
+ * The stats are kept per compression thread. Chunks are handed to the threads
+ * round robin, so every decision depends only on earlier chunks of the same
+ * thread and the output does not depend on thread timing.
+ */
+static int
+preproc_try(preproc_stat_t (*stats)[NUM_PREPROC_FILTERS], int stype, int filter)
+{
+	preproc_stat_t *ps;
+
+	ps = &(stats[stype >> 3][filter]);
+	if (ps->skip > 0) {
+		ps->skip--;
+		ps->skipped++;
+		return (0);
+	}
+	ps->tried++;
+	return (1);
+}
+
+/*
+ * Record the outcome of a filter attempt. Once the failure limit is reached
+ * every failed re-probe pushes the filter out for another interval.
+ */
+static void
+preproc_result(preproc_stat_t (*stats)[NUM_PREPROC_FILTERS], int stype, int filter,
+    int success)
+{
+	preproc_stat_t *ps;
+
+	ps = &(stats[stype >> 3][filter]);
+	if (success) {
+		ps->succeeded++;
+		ps->fails = 0;
+	} else {
+		ps->fails++;
+		if (ps->fails >= PREPROC_FAIL_LIMIT) {
+			ps->skip = PREPROC_PROBE_INTERVAL;
+			ps->disabled++;
+		}
+	}
+}
+
+/*
+ * Add the decisions taken by one compression thread to the totals shown in
+ * the statistics.
+ */
+static void
+preproc_stats_add(pc_ctx_t *pctx, preproc_stat_t (*stats)[NUM_PREPROC_FILTERS])
+{
+	int i, j;
+
+	for (i = 0; i < NUM_SUB_TYPES; i++) {
+		for (j = 0; j < NUM_PREPROC_FILTERS; j++) {
+			pctx->preproc_stats[i][j].tried += stats[i][j].tried;
+			pctx->preproc_stats[i][j].succeeded += stats[i][j].succeeded;
+			pctx->preproc_stats[i][j].skipped += stats[i][j].skipped;
+			pctx->preproc_stats[i][j].disabled += stats[i][j].disabled;
+		}
+	}
 }
 
 /*
@@ -207,7 +437,7 @@ show_compression_stats(pc_ctx_t *pctx)
 static int
 preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t srclen,
     void *dst, uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data,
-    algo_props_t *props)
+    algo_props_t *props, preproc_stat_t (*stats)[NUM_PREPROC_FILTERS])
 {
 	uchar_t *dest = (uchar_t *)dst, type = 0;
 	int64_t result;
@@ -230,9 +460,11 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	 * TODO: Is this too much to assume in the generic case? Can we look inside ar archives?
 	 */
 	if (pctx->dispack_preprocess && (stype == TYPE_EXE32 || stype == TYPE_EXE64 ||
-	    stype == TYPE_ARCHIVE_AR)) {
+	    stype == TYPE_ARCHIVE_AR) &&
+	    preproc_try(stats, stype, PREPROC_FILTER_DISPACK)) {
 		_dstlen = fromlen;
 		result = dispack_encode((uchar_t *)from, fromlen, to, &_dstlen);
+		preproc_result(stats, stype, PREPROC_FILTER_DISPACK, result != -1);
 		if (result != -1) {
 			uchar_t *tmp;
 			tmp = from;
@@ -243,12 +475,40 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 		}
 	}
 
-	if (pctx->lzp_preprocess && stype != TYPE_BMP && stype != TYPE_TIFF) {
+	/*
+	 * Branch address conversion is a cheap alternative for executables
+	 * that Dispack did not handle, notably x86-64 and ARM64 code.
+	 */
+	if (pctx->bcj_preprocess && !(type & PREPROC_TYPE_DISPACK) &&
+	    (stype == TYPE_EXE32 || stype == TYPE_EXE64 || stype == TYPE_EXE_ARM64) &&
+	    preproc_try(stats, stype, PREPROC_FILTER_BCJ)) {
+		int arch;
+
+		arch = (stype == TYPE_EXE_ARM64) ? BCJ_ARCH_ARM64 : BCJ_ARCH_X86;
+		_dstlen = fromlen;
+		result = bcj_encode((uchar_t *)from, fromlen, to, &_dstlen, arch);
+		preproc_result(stats, stype, PREPROC_FILTER_BCJ, result != -1);
+		if (result != -1) {
+			uchar_t *tmp;
+			tmp = from;
+			from = to;
+			to = tmp;
+			fromlen = _dstlen;
+			type |= PREPROC_TYPE_BCJ;
+			if (arch == BCJ_ARCH_ARM64)
+				type |= PREPROC_BCJ_ARM64;
+		}
+	}
+
+	if (pctx->lzp_preprocess && stype != TYPE_BMP && stype != TYPE_TIFF &&
+	    preproc_try(stats, stype, PREPROC_FILTER_LZP)) {
 		int hashsize;
 
 		hashsize = lzp_hash_size(level);
 		result = lzp_compress((const uchar_t *)from, to, fromlen,
 				      hashsize, LZP_DEFAULT_LZPMINLEN, 0);
+		preproc_result(stats, stype, PREPROC_FILTER_LZP,
+		    result >= 0 && result < srclen);
 		if (result >= 0 && result < srclen) {
 			uchar_t *tmp;
 			tmp = from;
@@ -261,10 +521,12 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 
 	if (pctx->enable_delta2_encode && props->delta2_span > 0 &&
 	    stype != TYPE_DNA_SEQ && stype != TYPE_BMP &&
-	    stype != TYPE_TIFF && stype != TYPE_MP4) {
+	    stype != TYPE_TIFF && stype != TYPE_MP4 &&
+	    preproc_try(stats, stype, PREPROC_FILTER_DELTA2)) {
 		_dstlen = fromlen;
 		result = delta2_encode((uchar_t *)from, fromlen, to,
 				       &_dstlen, props->delta2_span, pctx->delta2_nstrides);
+		preproc_result(stats, stype, PREPROC_FILTER_DELTA2, result != -1);
 		if (result != -1) {
 			uchar_t *tmp;
 			tmp = from;
@@ -328,6 +590,18 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 	type = *sorc;
 	++sorc;
 	--srclen;
+
+	/*
+	 * BCJ appeared in version 10 and is never combined with Dispack. Unknown
+	 * flags must not be silently ignored as that would produce wrong data.
+	 */
+	if ((type & ~(PREPROC_COMPRESSED|PREPROC_TYPE_DELTA2|PREPROC_TYPE_LZP|
+	    PREPROC_TYPE_DISPACK|PREPROC_TYPE_BCJ|PREPROC_BCJ_ARM64)) ||
+	    (pctx->file_version < 10 && (type & (PREPROC_TYPE_BCJ|PREPROC_BCJ_ARM64))) ||
+	    ((type & PREPROC_TYPE_BCJ) && (type & PREPROC_TYPE_DISPACK))) {
+		log_msg(LOG_ERR, 0, "Invalid preprocessing flags: %d", type);
+		return (-1);
+	}
 	if (type & PREPROC_COMPRESSED) {
 		*dstlen = ntohll(U64_P(sorc));
 		sorc += 8;
@@ -373,6 +647,20 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 		}
 	}
 
+	if (type & PREPROC_TYPE_BCJ) {
+		int arch;
+
+		arch = (type & PREPROC_BCJ_ARM64) ? BCJ_ARCH_ARM64 : BCJ_ARCH_X86;
+		_dstlen = srclen;
+		result = bcj_decode((uchar_t *)src, srclen, (uchar_t *)dst, &_dstlen, arch);
+		if (result != -1) {
+			*dstlen = _dstlen;
+		} else {
+			log_msg(LOG_ERR, 0, "BCJ decoding failed.");
+			return (result);
+		}
+	}
+
 	if (type & PREPROC_TYPE_DISPACK) {
 		result = dispack_decode((uchar_t *)src, srclen, (uchar_t *)dst, &_dstlen1);
 		if (result != -1) {
@@ -383,14 +671,79 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 		}
 	}
 
-	if (!(type & (PREPROC_COMPRESSED|PREPROC_TYPE_DELTA2|PREPROC_TYPE_LZP|PREPROC_TYPE_DISPACK))
-	    && type > 0) {
+	if (!(type & (PREPROC_COMPRESSED|PREPROC_TYPE_DELTA2|PREPROC_TYPE_LZP|PREPROC_TYPE_DISPACK|
+	    PREPROC_TYPE_BCJ)) && type > 0) {
 		log_msg(LOG_ERR, 0, "Invalid preprocessing flags: %d", type);
 		return (-1);
 	}
 	return (0);
 }
 
+/*
+ * Verify the HMAC of an encrypted chunk or the CRC32 of a plain one held in
+ * tdat->compressed_chunk. The CRC32 covers only the chunk header unless the
+ * file was created with payload checksums. The stored MAC bytes are zeroed.
+ */
+static int
+verify_chunk_mac(pc_ctx_t *pctx, struct cmp_data *tdat, uchar_t HDR)
+{
+	uchar_t checksum[CKSUM_MAX_BYTES];
+
+	if (pctx->encrypt_type) {
+		unsigned int len;
+		DEBUG_STAT_EN(double strt, en);
+
+		DEBUG_STAT_EN(strt = get_wtime_millis());
+		len = pctx->mac_bytes;
+		deserialize_checksum(checksum, tdat->compressed_chunk + pctx->cksum_bytes,
+		    pctx->mac_bytes);
+		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
+		hmac_reinit(&tdat->chunk_hmac);
+		hmac_update(&tdat->chunk_hmac, (uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
+		hmac_update(&tdat->chunk_hmac, tdat->compressed_chunk, tdat->rbytes);
+		if (HDR & CHSIZE_MASK) {
+			uchar_t *rseg;
+			rseg = tdat->compressed_chunk + tdat->rbytes;
+			hmac_update(&tdat->chunk_hmac, rseg, ORIGINAL_CHUNKSZ);
+		}
+		hmac_final(&tdat->chunk_hmac, tdat->checksum, &len);
+		if (memcmp(checksum, tdat->checksum, len) != 0) {
+			log_msg(LOG_ERR, 0, "Chunk %d, HMAC verification failed", tdat->id);
+			return (-1);
+		}
+		DEBUG_STAT_EN(en = get_wtime_millis());
+		DEBUG_STAT_EN(fprintf(stderr, "HMAC Verification speed %.3f MB/s",
+			      get_mb_s(tdat->rbytes + sizeof (tdat->len_cmp_be), strt, en)));
+
+	} else if (pctx->mac_bytes > 0) {
+		uint32_t crc1, crc2;
+
+		crc1 = htonl(U32_P(tdat->compressed_chunk + pctx->cksum_bytes));
+		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
+		crc2 = lzma_crc32((uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be), 0);
+		if (pctx->payload_crc)
+			crc2 = lzma_crc32(tdat->compressed_chunk, tdat->rbytes, crc2);
+		else
+			crc2 = lzma_crc32(tdat->compressed_chunk,
+			    pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ, crc2);
+		if (HDR & CHSIZE_MASK) {
+			uchar_t *rseg;
+			rseg = tdat->compressed_chunk + tdat->rbytes;
+			crc2 = lzma_crc32(rseg, ORIGINAL_CHUNKSZ, crc2);
+		}
+
+		if (crc1 != crc2) {
+			if (pctx->payload_crc)
+				log_msg(LOG_ERR, 0, "Chunk %d, CRC verification failed", tdat->id);
+			else
+				log_msg(LOG_ERR, 0, "Chunk %d, Header CRC verification failed",
+				    tdat->id);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
 /*
  * This routine is called in multiple threads. Calls the decompression handler
  * as encoded in the file header. For adaptive mode the handler adapt_decompress()
@@ -427,6 +780,22 @@ redo:
 		goto cont;
 	}
 
+	/*
+	 * Chunks of a striped file are read here so that all volumes are read
+	 * in parallel.
+	 */
+	if (tdat->vol_fd != -1) {
+		if (Pread(tdat->vol_fd, tdat->compressed_chunk, tdat->rbytes,
+		    tdat->vol_off) != tdat->rbytes) {
+			log_msg(LOG_ERR, 0, "Incomplete chunk %d, volume corrupt.", tdat->id);
+			pctx->main_cancel = 1;
+			tdat->len_cmp = 0;
+			pctx->t_errored = 1;
+			sem_post(&tdat->cmp_done_sem);
+			return (NULL);
+		}
+	}
+
 	cseg = tdat->compressed_chunk + pctx->cksum_bytes + pctx->mac_bytes;
 	HDR = *cseg;
 	cseg += CHUNK_FLAG_SZ;
@@ -441,42 +810,22 @@ redo:
 	}
 
 	/*
-	 * If this was encrypted:
-	 * Verify HMAC first before anything else and then decrypt compressed data.
+	 * Verify HMAC or CRC32 first before anything else and then decrypt
+	 * compressed data if this was encrypted.
 	 */
+	if (verify_chunk_mac(pctx, tdat, HDR) == -1) {
+		/*
+		 * Verification failure is fatal.
+		 */
+		pctx->main_cancel = 1;
+		tdat->len_cmp = 0;
+		pctx->t_errored = 1;
+		sem_post(&tdat->cmp_done_sem);
+		return (NULL);
+	}
 	if (pctx->encrypt_type) {
-		unsigned int len;
 		DEBUG_STAT_EN(double strt, en);
 
-		DEBUG_STAT_EN(strt = get_wtime_millis());
-		len = pctx->mac_bytes;
-		deserialize_checksum(checksum, tdat->compressed_chunk + pctx->cksum_bytes,
-		    pctx->mac_bytes);
-		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
-		hmac_reinit(&tdat->chunk_hmac);
-		hmac_update(&tdat->chunk_hmac, (uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
-		hmac_update(&tdat->chunk_hmac, tdat->compressed_chunk, tdat->rbytes);
-		if (HDR & CHSIZE_MASK) {
-			uchar_t *rseg;
-			rseg = tdat->compressed_chunk + tdat->rbytes;
-			hmac_update(&tdat->chunk_hmac, rseg, ORIGINAL_CHUNKSZ);
-		}
-		hmac_final(&tdat->chunk_hmac, tdat->checksum, &len);
-		if (memcmp(checksum, tdat->checksum, len) != 0) {
-			/*
-			 * HMAC verification failure is fatal.
-			 */
-			log_msg(LOG_ERR, 0, "Chunk %d, HMAC verification failed", tdat->id);
-			pctx->main_cancel = 1;
-			tdat->len_cmp = 0;
-			pctx->t_errored = 1;
-			sem_post(&tdat->cmp_done_sem);
-			return (NULL);
-		}
-		DEBUG_STAT_EN(en = get_wtime_millis());
-		DEBUG_STAT_EN(fprintf(stderr, "HMAC Verification speed %.3f MB/s",
-			      get_mb_s(tdat->rbytes + sizeof (tdat->len_cmp_be), strt, en)));
-
 		/*
 		 * Encryption algorithm should not change the size and
 		 * encryption is in-place.
@@ -496,34 +845,6 @@ redo:
 		DEBUG_STAT_EN(fprintf(stderr, "Decryption speed %.3f MB/s\n",
 			      get_mb_s(tdat->len_cmp, strt, en)));
 	} else if (pctx->mac_bytes > 0) {
-		/*
-		 * Verify header CRC32 in non-crypto mode.
-		 */
-		uint32_t crc1, crc2;
-
-		crc1 = htonl(U32_P(tdat->compressed_chunk + pctx->cksum_bytes));
-		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
-		crc2 = lzma_crc32((uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be), 0);
-		crc2 = lzma_crc32(tdat->compressed_chunk,
-		    pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ, crc2);
-		if (HDR & CHSIZE_MASK) {
-			uchar_t *rseg;
-			rseg = tdat->compressed_chunk + tdat->rbytes;
-			crc2 = lzma_crc32(rseg, ORIGINAL_CHUNKSZ, crc2);
-		}
-
-		if (crc1 != crc2) {
-			/*
-			 * Header CRC32 verification failure is fatal.
-			 */
-			log_msg(LOG_ERR, 0, "Chunk %d, Header CRC verification failed", tdat->id);
-			pctx->main_cancel = 1;
-			tdat->len_cmp = 0;
-			pctx->t_errored = 1;
-			sem_post(&tdat->cmp_done_sem);
-			return (NULL);
-		}
-
 		/*
 		 * Now that header CRC32 was verified, recover the stored message
 		 * digest.
@@ -671,6 +992,174 @@ cont:
 	goto redo;
 }
 
+/*
+ * Scan thread for '-TT'. Chunk boundaries are found by walking the chunk
+ * length fields under the lock. The chunk itself is then read with pread()
+ * and its HMAC or CRC32 verified outside the lock so that several chunks are
+ * read and checked in parallel. Verification failures are reported and the
+ * scan continues, a damaged chunk length ends it.
+ */
+static void *
+scan_chunks_thread(void *dat)
+{
+	struct scan_thread *st = (struct scan_thread *)dat;
+	struct sdata *s = st->s;
+	struct cmp_data *tdat = &(st->tdat);
+	pc_ctx_t *pctx = s->pctx;
+	uint64_t off, len_cmp_be, len_cmp, hdr_sz;
+	int64_t rb;
+	unsigned int id;
+	uchar_t HDR;
+
+	hdr_sz = pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ;
+	tdat->compressed_chunk = (uchar_t *)slab_alloc(NULL, s->compressed_chunksize);
+	if (tdat->compressed_chunk == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		pthread_mutex_lock(&s->lock);
+		s->done = 1;
+		s->errored = 1;
+		pthread_mutex_unlock(&s->lock);
+		return (NULL);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		if (s->done) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		off = s->next_off;
+		id = s->next_id;
+		rb = Pread(s->fd, &len_cmp_be, sizeof (len_cmp_be), off);
+		if (rb != sizeof (len_cmp_be)) {
+			if (rb < 0) log_msg(LOG_ERR, 1, "Read: ");
+			else
+				log_msg(LOG_ERR, 0, "Incomplete chunk %u header, "
+				    "file corrupt", id);
+			s->done = 1;
+			s->errored = 1;
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		len_cmp = ntohll(len_cmp_be);
+		if (len_cmp == 0) {
+			s->done = 1;
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		if (len_cmp > s->chunksize + 256) {
+			log_msg(LOG_ERR, 0, "Compressed length too big for chunk: %u", id);
+			s->done = 1;
+			s->errored = 1;
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		s->next_off = off + sizeof (len_cmp_be) + len_cmp + hdr_sz;
+		s->next_id++;
+		s->bytes += sizeof (len_cmp_be) + len_cmp + hdr_sz;
+		pthread_mutex_unlock(&s->lock);
+
+		rb = Pread(s->fd, tdat->compressed_chunk, len_cmp + hdr_sz,
+		    off + sizeof (len_cmp_be));
+		if (rb != len_cmp + hdr_sz) {
+			if (rb < 0) log_msg(LOG_ERR, 1, "Read: ");
+			else
+				log_msg(LOG_ERR, 0, "Incomplete chunk %u, file corrupt.", id);
+			pthread_mutex_lock(&s->lock);
+			s->done = 1;
+			s->errored = 1;
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		tdat->id = id;
+		tdat->len_cmp_be = len_cmp_be;
+		tdat->rbytes = rb;
+		HDR = tdat->compressed_chunk[pctx->cksum_bytes + pctx->mac_bytes];
+		if (HDR & CHSIZE_MASK)
+			tdat->rbytes -= ORIGINAL_CHUNKSZ;
+		if (verify_chunk_mac(pctx, tdat, HDR) == -1) {
+			pthread_mutex_lock(&s->lock);
+			s->errored = 1;
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+	slab_free(NULL, tdat->compressed_chunk);
+	return (NULL);
+}
+
+/*
+ * Verify the compressed chunks of a file without decompressing them. The file
+ * must be seekable and compfd positioned at the first chunk.
+ */
+static int
+scan_chunks(pc_ctx_t *pctx, int compfd, int64_t chunksize, int64_t compressed_chunksize)
+{
+	struct sdata s;
+	struct scan_thread *sthr;
+	off_t base_off;
+	int nprocs, i, started;
+
+	if ((base_off = lseek(compfd, 0, SEEK_CUR)) == -1) {
+		log_msg(LOG_ERR, 0, "Scanning chunks needs a seekable file.");
+		return (1);
+	}
+	if (!pctx->encrypt_type && !pctx->payload_crc)
+		log_msg(LOG_WARN, 0, "File has no payload checksums, only chunk headers "
+		    "are verified.");
+
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (pctx->nthreads > 0 && pctx->nthreads < nprocs)
+		nprocs = pctx->nthreads;
+
+	memset(&s, 0, sizeof (s));
+	s.fd = compfd;
+	s.next_off = base_off;
+	s.chunksize = chunksize;
+	s.compressed_chunksize = compressed_chunksize;
+	s.pctx = pctx;
+	pthread_mutex_init(&s.lock, NULL);
+	sthr = (struct scan_thread *)slab_calloc(NULL, nprocs, sizeof (struct scan_thread));
+	if (sthr == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (1);
+	}
+	for (i = 0; i < nprocs; i++) {
+		sthr[i].s = &s;
+		if (pctx->encrypt_type &&
+		    hmac_init(&(sthr[i].tdat.chunk_hmac), pctx->cksum, &(pctx->crypto_ctx)) == -1) {
+			log_msg(LOG_ERR, 0, "Cannot initialize chunk hmac.");
+			s.errored = 1;
+			break;
+		}
+	}
+	started = 0;
+	if (!s.errored) {
+		for (; started < nprocs; started++) {
+			if (pthread_create(&(sthr[started].thr), NULL, scan_chunks_thread,
+			    (void *)&sthr[started]) != 0) {
+				log_msg(LOG_ERR, 1, "Error in thread creation: ");
+				pthread_mutex_lock(&s.lock);
+				s.done = 1;
+				s.errored = 1;
+				pthread_mutex_unlock(&s.lock);
+				break;
+			}
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(sthr[i].thr, NULL);
+	if (pctx->encrypt_type) {
+		for (i = 0; i < nprocs; i++)
+			hmac_cleanup(&(sthr[i].tdat.chunk_hmac));
+	}
+	slab_free(NULL, sthr);
+	pthread_mutex_destroy(&s.lock);
+
+	pctx->chunk_num = s.next_id;
+	pctx->verify_bytes = s.bytes;
+	return (s.errored);
+}
+
 /*
  * File decompression routine.
  *
@@ -723,11 +1212,13 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	struct cmp_data **dary, *tdat;
 	pthread_t writer_thr;
 	algo_props_t props;
+	double strt, en;
 
 	err = 0;
 	flags = 0;
 	thread = 0;
 	dary = NULL;
+	strt = 0;
 	init_algo_props(&props);
 
 	/*
@@ -810,16 +1301,38 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		err = 1;
 		goto uncomp_done;
 	}
-	if (version < VERSION-3) {
+	if (version < VERSION-4) {
 		log_msg(LOG_ERR, 0, "Unsupported version: %d", version);
 		err = 1;
 		goto uncomp_done;
 	}
+	pctx->file_version = version;
+
+	/*
+	 * Chunk CRCs covering the compressed payload and the volume manifest
+	 * following the header came with version 10.
+	 */
+	if (version < 10 && (flags & (FLAG_PAYLOAD_CRC | FLAG_VOLUMES))) {
+		log_msg(LOG_ERR, 0, "Invalid header flags for version %d: 0x%x", version,
+		    flags);
+		err = 1;
+		goto uncomp_done;
+	}
+
+	if (!(flags & FLAG_ARCHIVE) && (pctx->list_mode || pctx->member_names != NULL)) {
+		log_msg(LOG_ERR, 0, "Listing or selecting members needs an archive created "
+		    "with '-a'.");
+		err = 1;
+		goto uncomp_done;
+	}
 
 	/*
 	 * First check for archive mode. In that case the to_filename must be a directory.
+	 * Nothing is written when only verifying so there is no target to check.
 	 */
-	if (flags & FLAG_ARCHIVE) {
+	if (pctx->verify_mode) {
+		to_filename = NULL;
+	} else if (flags & FLAG_ARCHIVE) {
 		/*
 		 * If to_filename is not set, we just use the current directory.
 		 */
@@ -845,7 +1358,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			err = 1;
 			goto uncomp_done;
 		}
-	} else {
+	} else if (!pctx->pipe_mode) {
 		const char *origf;
 
 		if (to_filename == NULL) {
@@ -888,6 +1401,12 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 
 	compressed_chunksize = chunksize + CHUNK_HDR_SZ + zlib_buf_extra(chunksize);
 
+	/*
+	 * A larger input pipe lets a whole chunk be read with fewer wakeups.
+	 */
+	if (pctx->pipe_mode || filename == NULL)
+		pipe_grow(compfd, compressed_chunksize);
+
 	if (pctx->_props_func) {
 		pctx->_props_func(&props, level, chunksize);
 		if (chunksize + props.buf_extra > compressed_chunksize) {
@@ -927,6 +1446,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	}
 
 	pctx->cksum = flags & CKSUM_MASK;
+	pctx->payload_crc = ((flags & FLAG_PAYLOAD_CRC) != 0);
 
 	/*
 	 * Backward compatibility check for SKEIN in archives version 5 or below.
@@ -1183,7 +1703,131 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 	}
 
-	if (flags & FLAG_ARCHIVE) {
+	/*
+	 * The chunks of a striped file are in the volumes listed by the manifest.
+	 */
+	if (flags & FLAG_VOLUMES) {
+		if (volset_open(pctx, compfd, filename) == -1) {
+			UNCOMP_BAIL;
+		}
+	}
+
+	/*
+	 * If the archive has a catalog, members can be listed without decompressing
+	 * anything and selected members can be extracted by decompressing only the
+	 * chunks that hold them. The catalog needs a seekable file.
+	 */
+	if ((flags & FLAG_CATALOG) && (pctx->list_mode || pctx->member_names != NULL) &&
+	    !pctx->pipe_mode && filename != NULL) {
+		pc_catalog_t *cat;
+		off_t base_off;
+		int rv;
+
+		base_off = lseek(compfd, 0, SEEK_CUR);
+		rv = -1;
+		if (base_off != -1)
+			rv = catalog_read(compfd, pctx->volset ? CATALOG_NO_BASE : base_off, &cat);
+		if (rv == 0 && pctx->volset && volset_map_catalog(pctx->volset, cat) == -1) {
+			catalog_free(cat);
+			rv = 1;
+		}
+		if (rv == -1) {
+			log_msg(LOG_ERR, 0, "Unable to read archive catalog.");
+			UNCOMP_BAIL;
+		}
+		if (rv == 0) {
+			if (pctx->list_mode) {
+				catalog_list(cat, stdout, pctx->member_names, pctx->member_count);
+				catalog_free(cat);
+				close(compfd);
+				volset_free(pctx->volset);
+				pctx->volset = NULL;
+				return (0);
+			}
+			if (catalog_select(cat, pctx->member_names, pctx->member_count) == 0) {
+				log_msg(LOG_ERR, 0, "No matching members found in archive.");
+				catalog_free(cat);
+				close(compfd);
+				volset_free(pctx->volset);
+				pctx->volset = NULL;
+				return (1);
+			}
+			if (catalog_index(cat) == -1) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				catalog_free(cat);
+				close(compfd);
+				volset_free(pctx->volset);
+				pctx->volset = NULL;
+				return (1);
+			}
+			pctx->catalog = cat;
+		}
+	}
+
+	/*
+	 * When verifying, the catalog is only checked for consistency with the
+	 * chunks in the file. A damaged catalog would otherwise go unnoticed until
+	 * a listing or selective extraction is attempted.
+	 */
+	if ((flags & FLAG_CATALOG) && pctx->verify_mode && !pctx->pipe_mode &&
+	    filename != NULL) {
+		pc_catalog_t *cat;
+		off_t base_off;
+		int rv;
+
+		base_off = lseek(compfd, 0, SEEK_CUR);
+		rv = -1;
+		if (base_off != -1)
+			rv = catalog_read(compfd, pctx->volset ? CATALOG_NO_BASE : base_off, &cat);
+		if (rv == 0 && pctx->volset && volset_map_catalog(pctx->volset, cat) == -1) {
+			catalog_free(cat);
+			rv = 1;
+		}
+		if (rv != 0) {
+			log_msg(LOG_ERR, 0, "Archive catalog is damaged.");
+			UNCOMP_BAIL;
+		}
+		catalog_free(cat);
+	}
+
+	/*
+	 * With '-TT' only the compressed chunks are checked.
+	 */
+	if (pctx->verify_mode > 1) {
+		if (pctx->volset) {
+			log_msg(LOG_ERR, 0, "'-TT' is not supported for striped files, use '-T'.");
+			UNCOMP_BAIL;
+		}
+		strt = get_wtime_millis();
+		err = scan_chunks(pctx, compfd, chunksize, compressed_chunksize);
+		if (pctx->encrypt_type)
+			crypto_clean_pkey(&(pctx->crypto_ctx));
+		goto uncomp_done;
+	}
+
+	if (pctx->verify_mode) {
+		uncompfd = -1;
+
+		/*
+		 * Global Dedupe chunks refer back to data decompressed earlier, so
+		 * that has to be kept in a temporary file for them to read from.
+		 * Nothing is written otherwise.
+		 */
+		if (pctx->enable_rabin_global) {
+			char *tmp;
+
+			tmp = get_temp_dir();
+			snprintf(pctx->archive_temp_file, sizeof (pctx->archive_temp_file),
+			    "%s/.pcompXXXXXX", tmp);
+			free(tmp);
+			if ((uncompfd = mkstemp(pctx->archive_temp_file)) == -1) {
+				log_msg(LOG_ERR, 1, "Cannot create temporary data file.");
+				UNCOMP_BAIL;
+			}
+			add_fname(pctx->archive_temp_file);
+			to_filename = pctx->archive_temp_file;
+		}
+	} else if (flags & FLAG_ARCHIVE) {
 		if (pctx->enable_rabin_global) {
 			strcpy(pctx->archive_temp_file, to_filename);
 			strcat(pctx->archive_temp_file, "/.data");
@@ -1218,6 +1862,10 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				log_msg(LOG_ERR, 1, "fileno ");
 				UNCOMP_BAIL;
 			}
+			if (pipe_splice_ok(uncompfd)) {
+				pipe_grow(uncompfd, chunksize);
+				pctx->splice_out = pctx->splice_req;
+			}
 		}
 	}
 
@@ -1255,6 +1903,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		tdat->decompress = pctx->_decompress_func;
 		tdat->cancel = 0;
 		tdat->decompressing = 1;
+		tdat->index_only = 0;
 		if (props.is_single_chunk) {
 			tdat->cksum_mt = 1;
 			if (version == 6) {
@@ -1338,6 +1987,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	w.nprocs = nprocs;
 	w.chunksize = chunksize;
 	w.pctx = pctx;
+	strt = get_wtime_millis();
 	if (pthread_create(&writer_thr, NULL, writer_thread, (void *)(&w)) != 0) {
 		log_msg(LOG_ERR, 1, "Error in thread creation: ");
 		UNCOMP_BAIL;
@@ -1361,13 +2011,42 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			tdat = dary[p];
 			sem_wait(&tdat->write_done_sem);
 			if (pctx->main_cancel) break;
+
+			/*
+			 * When extracting selected members via the catalog skip over
+			 * chunks that do not hold any of them. Global dedupe chunks can
+			 * refer to data in any earlier chunk so all of them are needed.
+			 */
+			if (pctx->catalog && !pctx->enable_rabin_global) {
+				unsigned int next;
+
+				next = catalog_next_chunk(pctx->catalog, pctx->chunk_num);
+				if (next >= pctx->catalog->nchunks) {
+					bail = 1;
+					break;
+				}
+				if (pctx->volset) {
+					volset_seek(pctx->volset, next,
+					    pctx->catalog->chunks[next].file_off);
+				} else if (next != pctx->chunk_num) {
+					if (lseek(compfd, pctx->catalog->chunks[next].file_off,
+					    SEEK_SET) == -1) {
+						log_msg(LOG_ERR, 1, "Seek: ");
+						UNCOMP_BAIL;
+					}
+				}
+				pctx->chunk_num = next;
+			}
 			tdat->id = pctx->chunk_num;
 			if (tdat->rctx) tdat->rctx->id = tdat->id;
 
 			/*
 			 * First read length of compressed chunk.
 			 */
-			rb = Read(compfd, &tdat->len_cmp, sizeof (tdat->len_cmp));
+			if (pctx->volset)
+				rb = volset_read_len(pctx->volset, pctx->chunk_num, &tdat->len_cmp);
+			else
+				rb = Read(compfd, &tdat->len_cmp, sizeof (tdat->len_cmp));
 			if (rb != sizeof (tdat->len_cmp)) {
 				if (rb < 0) log_msg(LOG_ERR, 1, "Read: ");
 				else
@@ -1425,10 +2104,20 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			pctx->avg_chunk += tdat->len_cmp;
 
 			/*
-			 * Now read compressed chunk including the checksum.
+			 * Now read compressed chunk including the checksum. The chunks
+			 * of a striped file are read by the decompression thread.
 			 */
-			tdat->rbytes = Read(compfd, tdat->compressed_chunk,
-			    tdat->len_cmp + pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ);
+			tdat->vol_fd = -1;
+			if (pctx->volset) {
+				tdat->rbytes = tdat->len_cmp + pctx->cksum_bytes +
+				    pctx->mac_bytes + CHUNK_FLAG_SZ;
+				volset_chunk_pos(pctx->volset, pctx->chunk_num, tdat->rbytes,
+				    &tdat->vol_fd, &tdat->vol_off);
+			} else {
+				tdat->rbytes = Read(compfd, tdat->compressed_chunk,
+				    tdat->len_cmp + pctx->cksum_bytes + pctx->mac_bytes +
+				    CHUNK_FLAG_SZ);
+			}
 			if (pctx->main_cancel) break;
 			if (tdat->rbytes < tdat->len_cmp + pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ) {
 				if (tdat->rbytes < 0) {
@@ -1467,6 +2156,23 @@ uncomp_done:
 		pthread_join(writer_thr, NULL);
 	}
 
+	if (pctx->verify_mode) {
+		if (uncompfd != -1) {
+			close(uncompfd);
+			unlink(pctx->archive_temp_file);
+			uncompfd = -1;
+		}
+		if (err) {
+			log_msg(LOG_ERR, 0, "%s: Verification failed.",
+			    filename ? filename : "stdin");
+		} else if (strt > 0) {
+			en = get_wtime_millis();
+			log_msg(LOG_INFO, 0, "%s: Verified %s in %u chunks, %.3f MB/s",
+			    filename ? filename : "stdin", bytes_to_size(pctx->verify_bytes),
+			    pctx->chunk_num, get_mb_s(pctx->verify_bytes, strt, en));
+		}
+	}
+
 	/*
 	 * Ownership and mode of target should be same as original.
 	 */
@@ -1502,12 +2208,64 @@ uncomp_done:
 			unlink(pctx->archive_temp_file);
 		}
 	}
+	catalog_free(pctx->catalog);
+	pctx->catalog = NULL;
+	volset_free(pctx->volset);
+	pctx->volset = NULL;
 
 	if (!pctx->hide_cmp_stats) show_compression_stats(pctx);
 
 	return (err);
 }
 
+/*
+ * With NUMA worker groups each compression thread runs on the CPUs of its
+ * node and allocates its own chunk buffers. They are zeroed here so that the
+ * pages are placed on the node by first touch. The first worker of a node
+ * also sets up the buffer that the node's chunks are read into. Buffers that
+ * cannot be allocated are left to the delayed allocation in start_compress.
+ */
+static void
+numa_setup_worker(struct cmp_data *tdat)
+{
+	pc_ctx_t *pctx = tdat->pctx;
+	uint64_t usize, rsize;
+
+	if (bind_numa_node(tdat->numa_node) == -1)
+		log_msg(LOG_WARN, 0, "Cannot bind thread to NUMA node %d.", tdat->numa_node);
+
+	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
+		usize = tdat->compressed_chunksize;
+		rsize = tdat->compressed_chunksize;
+	} else {
+		usize = tdat->chunksize;
+		rsize = tdat->chunksize;
+	}
+	tdat->cmp_seg = (uchar_t *)slab_alloc(NULL, tdat->compressed_chunksize);
+	tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL, usize);
+	if (!tdat->cmp_seg || !tdat->uncompressed_chunk) {
+		slab_free(NULL, tdat->cmp_seg);
+		slab_free(NULL, tdat->uncompressed_chunk);
+		tdat->cmp_seg = NULL;
+		tdat->uncompressed_chunk = (uchar_t *)1;
+	} else {
+		memset(tdat->cmp_seg, 0, tdat->compressed_chunksize);
+		memset(tdat->uncompressed_chunk, 0, usize);
+		tdat->compressed_chunk = tdat->cmp_seg + COMPRESSED_CHUNKSZ +
+		    pctx->cksum_bytes + pctx->mac_bytes;
+	}
+	if (tdat->numa_rbuf) {
+		*(tdat->numa_rbuf) = (uchar_t *)slab_alloc(NULL, rsize);
+		if (*(tdat->numa_rbuf))
+			memset(*(tdat->numa_rbuf), 0, rsize);
+	}
+
+	/*
+	 * The reader waits for this before handing out the first chunk.
+	 */
+	sem_post(&tdat->write_done_sem);
+}
+
 static void *
 perform_compress(void *dat) {
 	struct cmp_data *tdat = (struct cmp_data *)dat;
@@ -1518,6 +2276,8 @@ perform_compress(void *dat) {
 	pc_ctx_t *pctx;
 
 	pctx = tdat->pctx;
+	if (tdat->numa_node != -1)
+		numa_setup_worker(tdat);
 redo:
 	sem_wait(&tdat->start_sem);
 	if (unlikely(tdat->cancel)) {
@@ -1541,7 +2301,7 @@ redo:
 		 * into uncompressed_chunk so that compress transforms uncompressed_chunk
 		 * back into cmp_seg. Avoids an extra memcpy().
 		 */
-		if (!pctx->encrypt_type)
+		if (!pctx->encrypt_type && !tdat->index_only)
 			compute_checksum(tdat->checksum, pctx->cksum, tdat->cmp_seg, tdat->rbytes,
 					 tdat->cksum_mt, 1);
 
@@ -1550,6 +2310,16 @@ redo:
 		rctx->cbuf = tdat->uncompressed_chunk;
 		dedupe_index_sz = dedupe_compress(tdat->rctx, tdat->cmp_seg, &(tdat->rbytes), 0,
 						  NULL, tdat->cksum_mt);
+
+		/*
+		 * Existing data of a file being appended to is only added to the
+		 * global index.
+		 */
+		if (tdat->index_only) {
+			tdat->len_cmp = rbytes;
+			sem_post(&tdat->cmp_done_sem);
+			goto redo;
+		}
 		if (!rctx->valid) {
 			memcpy(tdat->uncompressed_chunk, tdat->cmp_seg, rbytes);
 			tdat->rbytes = rbytes;
@@ -1618,7 +2388,7 @@ plain_index:
 			rv = preproc_compress(pctx, tdat->compress,
 			    tdat->uncompressed_chunk + dedupe_index_sz, _chunksize,
 			    compressed_chunk + index_size_cmp, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props);
+			    tdat->btype, tdat->data, tdat->props, tdat->preproc_stats);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
@@ -1646,7 +2416,7 @@ plain_index:
 		if (pctx->preprocess_mode) {
 			rv = preproc_compress(pctx, tdat->compress, tdat->uncompressed_chunk,
 			    tdat->rbytes, compressed_chunk, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props);
+			    tdat->btype, tdat->data, tdat->props, tdat->preproc_stats);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
@@ -1763,7 +2533,8 @@ plain_index:
 			      get_mb_s(tdat->len_cmp, strt, en)));
 	} else {
 		/*
-		 * Compute header CRC32 in non-crypto mode.
+		 * Compute header CRC32 in non-crypto mode. With payload checksums
+		 * it covers the entire chunk.
 		 */
 		uchar_t *mac_ptr;
 		uint32_t crc;
@@ -1771,10 +2542,14 @@ plain_index:
 		/* Clean out mac_bytes to 0 for stable CRC32. */
 		mac_ptr = tdat->cmp_seg + sizeof (tdat->len_cmp) + pctx->cksum_bytes;
 		memset(mac_ptr, 0, pctx->mac_bytes);
-		crc = lzma_crc32(tdat->cmp_seg, rbytes, 0);
-		if (type & CHSIZE_MASK)
-			crc = lzma_crc32(tdat->cmp_seg + tdat->len_cmp - ORIGINAL_CHUNKSZ,
-			    ORIGINAL_CHUNKSZ, crc);
+		if (pctx->payload_crc) {
+			crc = lzma_crc32(tdat->cmp_seg, tdat->len_cmp, 0);
+		} else {
+			crc = lzma_crc32(tdat->cmp_seg, rbytes, 0);
+			if (type & CHSIZE_MASK)
+				crc = lzma_crc32(tdat->cmp_seg + tdat->len_cmp - ORIGINAL_CHUNKSZ,
+				    ORIGINAL_CHUNKSZ, crc);
+		}
 		U32_P(mac_ptr) = htonl(crc);
 	}
 	
@@ -1782,22 +2557,211 @@ plain_index:
 	goto redo;
 }
 
+/*
+ * Record that the output up to its current offset holds the compressed data
+ * of the input up to in_off. The output is synced first so the checkpoint
+ * never refers to data that is not on disk and the checkpoint file is
+ * replaced atomically. A failed checkpoint only loses the ability to resume
+ * from it so compression goes on.
+ */
+static void
+write_checkpoint(pc_ctx_t *pctx, int fd, uint64_t in_off, uint32_t nchunks)
+{
+	uchar_t buf[CKPT_SZ], *pos;
+	char tmpfile[MAXPATHLEN];
+	off_t out_off;
+	int cfd;
+
+	if ((out_off = lseek(fd, 0, SEEK_CUR)) == -1 || fsync(fd) == -1) {
+		log_msg(LOG_WARN, 1, "Cannot checkpoint: ");
+		return;
+	}
+	memcpy(buf, CKPT_MAGIC, CKPT_MAGIC_LEN);
+	pos = buf + CKPT_MAGIC_LEN;
+	U32_P(pos) = htonl(pctx->checkpoint_secs);
+	pos += sizeof (uint32_t);
+	U32_P(pos) = htonl(nchunks);
+	pos += sizeof (uint32_t);
+	U64_P(pos) = htonll(in_off);
+	pos += sizeof (uint64_t);
+	U64_P(pos) = htonll(out_off);
+	pos += sizeof (uint64_t);
+	U64_P(pos) = htonll(pctx->ckpt_in_size);
+	pos += sizeof (uint64_t);
+	U64_P(pos) = htonll(pctx->ckpt_in_mtime);
+	pos += sizeof (uint64_t);
+	U32_P(pos) = htonl(lzma_crc32(buf, pos - buf, 0));
+
+	if (snprintf(tmpfile, sizeof (tmpfile), "%s.tmp", pctx->ckpt_file) >=
+	    sizeof (tmpfile)) {
+		log_msg(LOG_WARN, 0, "Cannot checkpoint: pathname too long.");
+		return;
+	}
+	if ((cfd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) == -1) {
+		log_msg(LOG_WARN, 1, "Cannot checkpoint: ");
+		return;
+	}
+	if (Write(cfd, buf, CKPT_SZ) != CKPT_SZ || fsync(cfd) == -1 ||
+	    rename(tmpfile, pctx->ckpt_file) == -1) {
+		log_msg(LOG_WARN, 1, "Cannot checkpoint: ");
+		close(cfd);
+		unlink(tmpfile);
+		return;
+	}
+	close(cfd);
+	pctx->ckpt_written = 1;
+}
+
+/*
+ * Load the checkpoint to resume from and check that the input is unchanged.
+ */
+static int
+read_checkpoint(pc_ctx_t *pctx, const char *filename)
+{
+	uchar_t buf[CKPT_SZ], *pos;
+	struct stat sbuf;
+	int fd, interval;
+
+	if ((fd = open(pctx->ckpt_file, O_RDONLY)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open checkpoint %s", pctx->ckpt_file);
+		return (1);
+	}
+	if (Read(fd, buf, CKPT_SZ) != CKPT_SZ || memcmp(buf, CKPT_MAGIC, CKPT_MAGIC_LEN) != 0 ||
+	    ntohl(U32_P(buf + CKPT_SZ - sizeof (uint32_t))) !=
+	    lzma_crc32(buf, CKPT_SZ - sizeof (uint32_t), 0)) {
+		log_msg(LOG_ERR, 0, "Invalid checkpoint %s", pctx->ckpt_file);
+		close(fd);
+		return (1);
+	}
+	close(fd);
+
+	pos = buf + CKPT_MAGIC_LEN;
+	interval = ntohl(U32_P(pos));
+	pos += sizeof (uint32_t);
+	pctx->ckpt_chunks = ntohl(U32_P(pos));
+	pos += sizeof (uint32_t);
+	pctx->ckpt_in_off = ntohll(U64_P(pos));
+	pos += sizeof (uint64_t);
+	pctx->ckpt_out_off = ntohll(U64_P(pos));
+	pos += sizeof (uint64_t);
+	pctx->ckpt_in_size = ntohll(U64_P(pos));
+	pos += sizeof (uint64_t);
+	pctx->ckpt_in_mtime = ntohll(U64_P(pos));
+
+	if (stat(filename, &sbuf) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot stat: %s", filename);
+		return (1);
+	}
+	if (sbuf.st_size != pctx->ckpt_in_size || sbuf.st_mtime != pctx->ckpt_in_mtime ||
+	    pctx->ckpt_in_off >= sbuf.st_size) {
+		log_msg(LOG_ERR, 0, "%s has changed since the checkpoint.", filename);
+		return (1);
+	}
+
+	/*
+	 * Keep checkpointing at the same interval unless asked otherwise.
+	 */
+	if (pctx->checkpoint_secs == 0)
+		pctx->checkpoint_secs = interval;
+	return (0);
+}
+
+/*
+ * Chunks spliced into the output pipe stay referenced by the pipe until the
+ * reader consumes them. Their write_done_sem is held back until then so that
+ * the chunk buffers are not refilled meanwhile. Chunks are released in order
+ * as the pipe drains. When the writer stops, at the end or on cancel, all of
+ * them are released once the pipe is empty, since the buffers are freed then.
+ */
+static void
+splice_release(struct wdata *w, int all)
+{
+	int64_t queued;
+	uint64_t done;
+
+	if (all && w->npend > 0)
+		pipe_drain(w->wfd);
+
+	/*
+	 * Data written before the writer started, like the file header, may
+	 * still be queued, which only makes this estimate low.
+	 */
+	done = 0;
+	if (!all) {
+		if ((queued = pipe_queued(w->wfd)) == -1)
+			all = 1;
+		else if (queued < w->spliced)
+			done = w->spliced - queued;
+	}
+	while (w->npend > 0 && (all || w->pend_end[w->phead] <= done)) {
+		sem_post(&w->pend[w->phead]->write_done_sem);
+		w->phead = (w->phead + 1) % w->nprocs;
+		w->npend--;
+	}
+}
+
+/*
+ * Wait for the next chunk to be compressed. While spliced chunks are held the
+ * pipe is polled so that their workers are not kept waiting, since the chunk
+ * waited for may itself be one of them.
+ */
+static void
+writer_wait(struct wdata *w, struct cmp_data *tdat)
+{
+	struct timespec ts;
+
+	while (w->npend > 0) {
+		splice_release(w, 0);
+		if (w->npend == 0)
+			break;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += SPLICE_POLL_NS;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (sem_timedwait(&tdat->cmp_done_sem, &ts) == 0)
+			return;
+	}
+	sem_wait(&tdat->cmp_done_sem);
+}
+
 static void *
 writer_thread(void *dat) {
-	int p;
+	int p, spliced;
 	struct wdata *w = (struct wdata *)dat;
 	struct cmp_data *tdat;
 	int64_t wbytes;
 	pc_ctx_t *pctx;
 
 	pctx = w->pctx;
+	w->pend = NULL;
+	w->pend_end = NULL;
+	w->spliced = 0;
+	w->npend = 0;
+	w->phead = 0;
+	if (pctx->splice_out) {
+		w->pend = (struct cmp_data **)malloc(w->nprocs * sizeof (struct cmp_data *));
+		w->pend_end = (uint64_t *)malloc(w->nprocs * sizeof (uint64_t));
+		if (w->pend == NULL || w->pend_end == NULL) {
+			free(w->pend);
+			free(w->pend_end);
+			w->pend = NULL;
+			w->pend_end = NULL;
+		}
+	}
 repeat:
 	for (p = 0; p < w->nprocs; p++) {
 		tdat = w->dary[p];
-		sem_wait(&tdat->cmp_done_sem);
+		writer_wait(w, tdat);
+		spliced = 0;
 		if (tdat->len_cmp == 0) {
 			goto do_cancel;
 		}
+		if (tdat->index_only) {
+			sem_post(&tdat->write_done_sem);
+			continue;
+		}
 
 		if (pctx->do_compress) {
 			if (tdat->len_cmp > pctx->largest_chunk)
@@ -1805,13 +2769,46 @@ repeat:
 			if (tdat->len_cmp < pctx->smallest_chunk)
 				pctx->smallest_chunk = tdat->len_cmp;
 			pctx->avg_chunk += tdat->len_cmp;
+			if (pctx->catalog && catalog_add_chunk(pctx->catalog, tdat->stream_off,
+			    tdat->len_cmp) == -1) {
+				log_msg(LOG_ERR, 0, "Out of memory adding catalog chunk.");
+				goto do_cancel;
+			}
 		}
 
 		if (pctx->archive_mode && tdat->decompressing) {
-			wbytes = archiver_write(pctx, tdat->cmp_seg, tdat->len_cmp);
+			if (pctx->catalog)
+				wbytes = catalog_archiver_write(pctx, pctx->catalog, tdat->id,
+				    tdat->cmp_seg, tdat->len_cmp);
+			else
+				wbytes = archiver_write(pctx, tdat->cmp_seg, tdat->len_cmp);
+		} else if (pctx->verify_mode && w->wfd == -1) {
+			wbytes = tdat->len_cmp;
+		} else if (pctx->volset && pctx->do_compress) {
+			/*
+			 * The volume writer signals write_done once the chunk is written.
+			 */
+			volset_queue(pctx->volset, tdat);
+			continue;
 		} else {
-			wbytes = Write(w->wfd, tdat->cmp_seg, tdat->len_cmp);
+			/*
+			 * Checkpoint at a chunk boundary, all earlier chunks are written.
+			 */
+			if (pctx->ckpt_file[0] != '\0' && pctx->do_compress &&
+			    time(NULL) - pctx->ckpt_time >= pctx->checkpoint_secs) {
+				write_checkpoint(pctx, w->wfd, tdat->stream_off,
+				    pctx->append_chunks + tdat->id);
+				pctx->ckpt_time = time(NULL);
+			}
+			if (w->pend) {
+				wbytes = Write_Pipe(w->wfd, tdat->cmp_seg, tdat->len_cmp);
+				spliced = 1;
+			} else {
+				wbytes = Write(w->wfd, tdat->cmp_seg, tdat->len_cmp);
+			}
 		}
+		if (pctx->verify_mode)
+			pctx->verify_bytes += tdat->len_cmp;
 		if (pctx->archive_temp_fd != -1 && wbytes == tdat->len_cmp) {
 			wbytes = Write(pctx->archive_temp_fd, tdat->cmp_seg, tdat->len_cmp);
 		}
@@ -1825,16 +2822,173 @@ do_cancel:
 			if (tdat->rctx && pctx->enable_rabin_global)
 				sem_post(tdat->rctx->index_sem_next);
 			sem_post(&tdat->write_done_sem);
+			splice_release(w, 1);
+			free(w->pend);
+			free(w->pend_end);
 			return (0);
 		}
 		if (tdat->decompressing && tdat->rctx && pctx->enable_rabin_global) {
 			sem_post(tdat->rctx->index_sem_next);
 		}
-		sem_post(&tdat->write_done_sem);
+		if (spliced) {
+			int i;
+
+			w->spliced += tdat->len_cmp;
+			i = (w->phead + w->npend) % w->nprocs;
+			w->pend[i] = tdat;
+			w->pend_end[i] = w->spliced;
+			w->npend++;
+		} else {
+			sem_post(&tdat->write_done_sem);
+		}
 	}
 	goto repeat;
 }
 
+/*
+ * Get the encryption password from the user or from the password file. The
+ * password file is zeroed out after reading.
+ */
+static int
+get_encrypt_pw(pc_ctx_t *pctx, uchar_t *pw)
+{
+	int pw_len = -1;
+
+	if (!pctx->pwd_file) {
+		pw_len = get_pw_string(pw,
+			"Please enter encryption password", 1);
+		if (pw_len == -1) {
+			log_msg(LOG_ERR, 0, "Failed to get password.");
+			return (-1);
+		}
+	} else {
+		int fd, len;
+		uchar_t zero[MAX_PW_LEN];
+
+		/*
+		 * Read password from a file and zero out the file after reading.
+		 */
+		memset(zero, 0, MAX_PW_LEN);
+		fd = open(pctx->pwd_file, O_RDWR);
+		if (fd != -1) {
+			pw_len = lseek(fd, 0, SEEK_END);
+			if (pw_len != -1) {
+				if (pw_len > MAX_PW_LEN) pw_len = MAX_PW_LEN-1;
+				lseek(fd, 0, SEEK_SET);
+				len = Read(fd, pw, pw_len);
+				if (len != -1 && len == pw_len) {
+					pw[pw_len] = '\0';
+					if (isspace(pw[pw_len - 1]))
+						pw[pw_len-1] = '\0';
+					lseek(fd, 0, SEEK_SET);
+					Write(fd, zero, pw_len);
+				} else {
+					pw_len = -1;
+				}
+			}
+		}
+		if (pw_len == -1) {
+			log_msg(LOG_ERR, 1, "Failed to get password.");
+			return (-1);
+		}
+		close(fd);
+	}
+	return (pw_len);
+}
+
+/*
+ * Decompress the file being appended to into a temporary file from which the
+ * global index is rebuilt, so that appended data dedupes against it.
+ */
+static int
+append_extract(pc_ctx_t *pctx, const char *tmpdir, char *tmpfile)
+{
+	char tbuf[16], *argv[7];
+	pc_ctx_t *dctx;
+	pid_t pid;
+	int status, fd;
+
+	snprintf(tmpfile, MAXPATHLEN, "%s/.pcompXXXXXX", tmpdir);
+	if (mkdtemp(tmpfile) == NULL) {
+		log_msg(LOG_ERR, 1, "mkdtemp ");
+		tmpfile[0] = '\0';
+		return (-1);
+	}
+	strcat(tmpfile, "/data");
+	add_fname(tmpfile);
+
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid == 0) {
+		snprintf(tbuf, sizeof (tbuf), "%d", pctx->nthreads);
+		argv[0] = pctx->exec_name;
+		argv[1] = "-d";
+		argv[2] = "-t";
+		argv[3] = tbuf;
+		argv[4] = pctx->append_file;
+		argv[5] = tmpfile;
+		argv[6] = NULL;
+		dctx = create_pc_context();
+		if (init_pc_context(dctx, 6, argv) != 0)
+			exit(1);
+		exit(start_pcompress(dctx));
+	}
+	if (pid == -1) {
+		log_msg(LOG_ERR, 1, "fork ");
+		return (-1);
+	}
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			log_msg(LOG_ERR, 1, "waitpid ");
+			return (-1);
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		log_msg(LOG_ERR, 0, "Cannot decompress %s to rebuild the index.",
+		    pctx->append_file);
+		return (-1);
+	}
+	if ((fd = open(tmpfile, O_RDONLY)) == -1)
+		log_msg(LOG_ERR, 1, "Cannot open: %s", tmpfile);
+	return (fd);
+}
+
+/*
+ * Put the read buffer of one NUMA node back and take the read buffer of the
+ * node that the next chunk goes to.
+ */
+static uchar_t *
+numa_switch_rbuf(uchar_t *cread_buf, uchar_t **node_rbuf, int from, int to)
+{
+	if (from == to)
+		return (cread_buf);
+	if (from != -1)
+		node_rbuf[from] = cread_buf;
+	cread_buf = node_rbuf[to];
+	node_rbuf[to] = NULL;
+	return (cread_buf);
+}
+
+/*
+ * Read the next buffer of existing data that only populates the global index,
+ * up to the size of the data already compressed.
+ */
+static int64_t
+read_index_data(int fd, uchar_t *buf, uint64_t len, uint64_t *rem)
+{
+	int64_t rb;
+
+	if (len > *rem)
+		len = *rem;
+	if (len == 0)
+		return (0);
+	rb = Read(fd, buf, len);
+	if (rb > 0)
+		*rem -= rb;
+	return (rb);
+}
+
 /*
  * File compression routine. Can use as many threads as there are
  * logical cores unless user specified something different. There is
@@ -1847,27 +3001,31 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 {
 	struct wdata w;
 	char tmpfile1[MAXPATHLEN], tmpdir[MAXPATHLEN];
-	char to_filename[MAXPATHLEN];
-	uint64_t compressed_chunksize, n_chunksize, file_offset;
+	char to_filename[MAXPATHLEN], index_file[MAXPATHLEN];
+	uint64_t compressed_chunksize, n_chunksize, file_offset, index_rem;
 	int64_t rbytes, rabin_count;
 	unsigned short version, flags;
 	struct stat sbuf;
-	int compfd = -1, uncompfd = -1, err;
-	int thread, wthread, bail, single_chunk;
+	int compfd = -1, uncompfd = -1, index_fd = -1, err;
+	int thread, wthread, bail, single_chunk, cread_index;
 	uint32_t i, nprocs, np, p, dedupe_flag;
 	struct cmp_data **dary = NULL, *tdat;
 	pthread_t writer_thr;
-	uchar_t *cread_buf, *pos;
+	uchar_t *cread_buf, *pos, **node_rbuf;
 	dedupe_context_t *rctx;
 	algo_props_t props;
+	int nnodes;
 
 	init_algo_props(&props);
 	props.cksum = pctx->cksum;
+	node_rbuf = NULL;
+	nnodes = 1;
 	props.buf_extra = 0;
 	cread_buf = NULL;
 	pctx->btype = TYPE_UNKNOWN;
 	flags = 0;
 	sbuf.st_size = 0;
+	index_file[0] = '\0';
 	err = 0;
 	thread = 0;
 	wthread = 0;
@@ -1878,44 +3036,10 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		int pw_len = -1;
 
 		compressed_chunksize += pctx->mac_bytes;
-		if (!pctx->pwd_file && !pctx->user_pw) {
-			pw_len = get_pw_string(pw,
-				"Please enter encryption password", 1);
-			if (pw_len == -1) {
-				log_msg(LOG_ERR, 0, "Failed to get password.");
-				return (1);
-			}
-		} else if (!pctx->user_pw) {
-			int fd, len;
-			uchar_t zero[MAX_PW_LEN];
-
-			/*
-			 * Read password from a file and zero out the file after reading.
-			 */
-			memset(zero, 0, MAX_PW_LEN);
-			fd = open(pctx->pwd_file, O_RDWR);
-			if (fd != -1) {
-				pw_len = lseek(fd, 0, SEEK_END);
-				if (pw_len != -1) {
-					if (pw_len > MAX_PW_LEN) pw_len = MAX_PW_LEN-1;
-					lseek(fd, 0, SEEK_SET);
-					len = Read(fd, pw, pw_len);
-					if (len != -1 && len == pw_len) {
-						pw[pw_len] = '\0';
-						if (isspace(pw[pw_len - 1]))
-							pw[pw_len-1] = '\0';
-						lseek(fd, 0, SEEK_SET);
-						Write(fd, zero, pw_len);
-					} else {
-						pw_len = -1;
-					}
-				}
-			}
-			if (pw_len == -1) {
-				log_msg(LOG_ERR, 1, "Failed to get password.");
+		if (!pctx->user_pw) {
+			pw_len = get_encrypt_pw(pctx, pw);
+			if (pw_len == -1)
 				return (1);
-			}
-			close(fd);
 		}
 		if (pctx->user_pw) {
 			if (init_crypto(&(pctx->crypto_ctx), pctx->user_pw, pctx->user_pw_len, pctx->encrypt_type,
@@ -1970,9 +3094,32 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 
 			if (sbuf.st_size == 0) {
 				close(uncompfd);
-				return (1);
+
+				/* Nothing to append is not an error. */
+				return (pctx->append_file ? 0 : 1);
 			}
 		} else {
+			/*
+			 * For an incremental archive load the catalog of the base archive.
+			 * Only the member list is needed so its chunks are not located.
+			 */
+			if (pctx->base_archive) {
+				int bfd, rv;
+
+				if ((bfd = open(pctx->base_archive, O_RDONLY)) == -1) {
+					log_msg(LOG_ERR, 1, "Cannot open base archive %s", pctx->base_archive);
+					return (1);
+				}
+				rv = catalog_read(bfd, CATALOG_NO_BASE, &(pctx->base_catalog));
+				close(bfd);
+				if (rv != 0 || catalog_index(pctx->base_catalog) == -1) {
+					log_msg(LOG_ERR, 0, "Base archive %s does not have a usable catalog.",
+					    pctx->base_archive);
+					catalog_free(pctx->base_catalog);
+					pctx->base_catalog = NULL;
+					return (1);
+				}
+			}
 			if (setup_archiver(pctx, &sbuf) == -1) {
 				log_msg(LOG_ERR, 0, "Setup archiver failed.");
 				return (1);
@@ -1985,7 +3132,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		 * This is not valid for archive mode since we cannot accurately estimate
 		 * final archive size.
 		 */
-		if (sbuf.st_size <= chunksize && !(pctx->archive_mode)) {
+		if (sbuf.st_size <= chunksize && !(pctx->archive_mode) && !pctx->append_file) {
 			chunksize = sbuf.st_size;
 			pctx->enable_rabin_split = 0; // Do not split for whole files.
 			pctx->nthreads = 1;
@@ -2052,22 +3199,85 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				log_msg(LOG_ERR, 1, "fileno ");
 				COMP_BAIL;
 			}
+		} else if (pctx->append_file) {
+			/*
+			 * New chunks are written over the trailer of the file.
+			 */
+			if ((compfd = open(pctx->append_file, O_RDWR, 0)) == -1) {
+				log_msg(LOG_ERR, 1, "Cannot open: %s", pctx->append_file);
+				COMP_BAIL;
+			}
+			if (lseek(compfd, pctx->append_off, SEEK_SET) == -1) {
+				log_msg(LOG_ERR, 1, "Cannot seek in: %s", pctx->append_file);
+				COMP_BAIL;
+			}
+			if (pctx->resume) {
+				/*
+				 * Drop whatever was written after the checkpoint and
+				 * continue reading the input from there. The input read
+				 * so far rebuilds the global index.
+				 */
+				strcpy(tmpfile1, pctx->append_file);
+				strcpy(to_filename, pctx->append_file);
+				to_filename[strlen(to_filename) - strlen(PART_EXTN)] = '\0';
+				if (ftruncate(compfd, pctx->append_off) == -1 ||
+				    lseek(uncompfd, pctx->append_size, SEEK_SET) == -1) {
+					log_msg(LOG_ERR, 1, "Cannot resume %s ", pctx->append_file);
+					COMP_BAIL;
+				}
+				if (pctx->append_reindex &&
+				    (index_fd = open(filename, O_RDONLY)) == -1) {
+					log_msg(LOG_ERR, 1, "Cannot open: %s", filename);
+					COMP_BAIL;
+				}
+			} else if (pctx->append_reindex) {
+				index_fd = append_extract(pctx, tmpdir, index_file);
+				if (index_fd == -1) {
+					COMP_BAIL;
+				}
+			}
 		} else {
+			int n;
+
 			if (pctx->to_filename == NULL) {
+				n = snprintf(to_filename, sizeof (to_filename), "%s" COMP_EXTN,
+				    filename);
+			} else {
+				if (!endswith(pctx->to_filename, COMP_EXTN))
+					n = snprintf(to_filename, sizeof (to_filename),
+					    "%s" COMP_EXTN, pctx->to_filename);
+				else
+					n = snprintf(to_filename, sizeof (to_filename),
+					    "%s", pctx->to_filename);
+			}
+			if (n >= sizeof (to_filename)) {
+				log_msg(LOG_ERR, 0, "Pathname too long.");
+				COMP_BAIL;
+			}
+
+			/*
+			 * With checkpoints the output goes to a partial file next to
+			 * the target. It is kept if compression is interrupted.
+			 */
+			if (pctx->checkpoint_secs) {
+				if (snprintf(tmpfile1, sizeof (tmpfile1), "%s" PART_EXTN,
+				    to_filename) >= sizeof (tmpfile1)) {
+					log_msg(LOG_ERR, 0, "Pathname too long.");
+					COMP_BAIL;
+				}
+				if ((compfd = open(tmpfile1, O_CREAT|O_TRUNC|O_RDWR,
+				    S_IRUSR|S_IWUSR)) == -1) {
+					log_msg(LOG_ERR, 1, "Cannot open: %s", tmpfile1);
+					COMP_BAIL;
+				}
+			} else if (pctx->to_filename == NULL) {
 				strcat(tmpfile1, "/.pcompXXXXXX");
-				snprintf(to_filename, sizeof (to_filename), "%s" COMP_EXTN, filename);
 				if ((compfd = mkstemp(tmpfile1)) == -1) {
 					log_msg(LOG_ERR, 1, "mkstemp ");
 					COMP_BAIL;
 				}
 				add_fname(tmpfile1);
 			} else {
-				if (!endswith(pctx->to_filename, COMP_EXTN))
-					snprintf(to_filename, sizeof (to_filename),
-					    "%s" COMP_EXTN, pctx->to_filename);
-				else
-					snprintf(to_filename, sizeof (to_filename),
-					    "%s", pctx->to_filename);
 				if ((compfd = open(to_filename, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR)) == -1) {
 					log_msg(LOG_ERR, 1, "open ");
 					COMP_BAIL;
@@ -2075,6 +3285,23 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				add_fname(to_filename);
 			}
 		}
+
+		/*
+		 * Single chunk files are not checkpointed as there is nothing to
+		 * resume from.
+		 */
+		if (pctx->checkpoint_secs && !single_chunk) {
+			if (snprintf(pctx->ckpt_file, sizeof (pctx->ckpt_file), "%s" CKPT_EXTN,
+			    to_filename) >= sizeof (pctx->ckpt_file)) {
+				log_msg(LOG_ERR, 0, "Pathname too long.");
+				COMP_BAIL;
+			}
+			if (!pctx->resume)
+				unlink(pctx->ckpt_file);
+			pctx->ckpt_in_size = sbuf.st_size;
+			pctx->ckpt_in_mtime = sbuf.st_mtime;
+			pctx->ckpt_time = time(NULL);
+		}
 	} else {
 		char *tmp;
 
@@ -2100,7 +3327,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		free(tmp);
 	}
 
-	if (pctx->enable_rabin_global) {
+	if (pctx->enable_rabin_global && !pctx->append_file) {
 		my_sysinfo msys_info;
 
 		get_sys_limits(&msys_info);
@@ -2167,6 +3394,19 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	else
 		log_msg(LOG_INFO, 0, "Scaling to 1 thread");
 	nprocs = pctx->nthreads;
+
+	/*
+	 * On a NUMA system the workers are split into one group per node. Each
+	 * group runs on its node and works on memory of that node.
+	 */
+	pctx->numa_nodes = 0;
+	memset(pctx->numa_workers, 0, sizeof (pctx->numa_workers));
+	if (nprocs > 1 && !single_chunk && (nnodes = get_numa_nodes()) > 1) {
+		node_rbuf = (uchar_t **)slab_calloc(NULL, nnodes, sizeof (uchar_t *));
+		if (node_rbuf)
+			pctx->numa_nodes = nnodes;
+	}
+
 	dary = (struct cmp_data **)slab_calloc(NULL, nprocs, sizeof (struct cmp_data *));
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan))
 		cread_buf = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
@@ -2187,11 +3427,13 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		tdat->pctx = pctx;
 		tdat->cmp_seg = NULL;
 		tdat->chunksize = chunksize;
+		tdat->compressed_chunksize = compressed_chunksize;
 		tdat->compress = pctx->_compress_func;
 		tdat->decompress = pctx->_decompress_func;
 		tdat->uncompressed_chunk = (uchar_t *)1;
 		tdat->cancel = 0;
 		tdat->decompressing = 0;
+		tdat->index_only = 0;
 		if (single_chunk)
 			tdat->cksum_mt = 1;
 		else
@@ -2200,11 +3442,28 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		tdat->data = NULL;
 		tdat->rctx = NULL;
 		tdat->props = &props;
+		tdat->numa_node = -1;
+		tdat->numa_rbuf = NULL;
+		memset(tdat->preproc_stats, 0, sizeof (tdat->preproc_stats));
 		sem_init(&(tdat->start_sem), 0, 0);
 		sem_init(&(tdat->cmp_done_sem), 0, 0);
 		sem_init(&(tdat->write_done_sem), 0, 1);
 		sem_init(&(tdat->index_sem), 0, 0);
 
+		/*
+		 * The first worker of each group also sets up the node's read buffer.
+		 * A worker is ready for its first chunk once its buffers are set up.
+		 * The algorithm state is allocated while running on the node.
+		 */
+		if (node_rbuf) {
+			tdat->numa_node = i * nnodes / nprocs;
+			if (i == 0 || dary[i - 1]->numa_node != tdat->numa_node)
+				tdat->numa_rbuf = &node_rbuf[tdat->numa_node];
+			pctx->numa_workers[tdat->numa_node]++;
+			sem_init(&(tdat->write_done_sem), 0, 0);
+			bind_numa_node(tdat->numa_node);
+		}
+
 		if (pctx->_init_func) {
 			if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads, chunksize,
 			    VERSION, COMPRESS) != 0) {
@@ -2225,6 +3484,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		}
 	}
 	thread = 1;
+	if (node_rbuf)
+		bind_numa_node(-1);
 
 	/*
 	 * initialize Dedupe Context here after all other allocations so that index size can be correctly
@@ -2233,8 +3494,11 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) {
 		for (i = 0; i < nprocs; i++) {
 			tdat = dary[i];
+			if (node_rbuf)
+				bind_numa_node(tdat->numa_node);
 			tdat->rctx = create_dedupe_context(chunksize, compressed_chunksize, pctx->rab_blk_size,
-			    pctx->algo, &props, pctx->enable_delta_encode, dedupe_flag, VERSION, COMPRESS, sbuf.st_size,
+			    pctx->algo, &props, pctx->enable_delta_encode, dedupe_flag, VERSION, COMPRESS,
+			    sbuf.st_size + (index_fd != -1 && !pctx->resume ? pctx->append_size : 0),
 			    tmpdir, pctx->pipe_mode, nprocs);
 			if (tdat->rctx == NULL) {
 				COMP_BAIL;
@@ -2243,6 +3507,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			tdat->rctx->index_sem = &(tdat->index_sem);
 			tdat->rctx->id = i;
 		}
+		if (node_rbuf)
+			bind_numa_node(-1);
 	}
 	if (pctx->enable_rabin_global) {
 		for (i = 0; i < nprocs; i++) {
@@ -2253,6 +3519,27 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		sem_post(&(dary[0]->index_sem));
 	}
 
+	/*
+	 * Chunks are striped across the volumes if requested.
+	 */
+	if (pctx->volume_dirs) {
+		if (volset_create(pctx, pctx->volume_dirs, to_filename, nprocs) == -1) {
+			COMP_BAIL;
+		}
+		flags |= FLAG_VOLUMES;
+	}
+
+	/*
+	 * Larger pipes let a whole chunk pass with fewer wakeups. Chunks are
+	 * spliced into an output pipe only when asked for with '--splice'.
+	 */
+	if ((pctx->pipe_mode || pctx->pipe_out) && pipe_splice_ok(compfd)) {
+		pipe_grow(compfd, chunksize);
+		pctx->splice_out = pctx->splice_req;
+	}
+	if (pctx->pipe_mode)
+		pipe_grow(uncompfd, chunksize);
+
 	w.dary = dary;
 	w.wfd = compfd;
 	w.nprocs = nprocs;
@@ -2267,6 +3554,13 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	 * Start the archiver thread if needed.
 	 */
 	if (pctx->archive_mode) {
+		if (pctx->enable_catalog) {
+			if ((pctx->catalog = catalog_new()) == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				COMP_BAIL;
+			}
+			flags |= FLAG_CATALOG;
+		}
 		if (start_archiver(pctx) != 0) {
 			COMP_BAIL;
 		}
@@ -2274,89 +3568,104 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	}
 
 	/*
-	 * Write out file header. First insert hdr elements into mem buffer
-	 * then write out the full hdr in one shot.
-	 */
-	flags |= pctx->cksum;
-	memset(cread_buf, 0, ALGO_SZ);
-	strncpy((char *)cread_buf, pctx->algo, ALGO_SZ);
-	version = htons(VERSION);
-	flags = htons(flags);
-	n_chunksize = htonll(chunksize);
-	level = htonl(level);
-	pos = cread_buf + ALGO_SZ;
-	memcpy(pos, &version, sizeof (version));
-	pos += sizeof (version);
-	memcpy(pos, &flags, sizeof (flags));
-	pos += sizeof (flags);
-	memcpy(pos, &n_chunksize, sizeof (n_chunksize));
-	pos += sizeof (n_chunksize);
-	memcpy(pos, &level, sizeof (level));
-	pos += sizeof (level);
-
-	/*
-	 * If encryption is enabled, include salt, nonce and keylen in the header
-	 * to be HMAC-ed (archive version 7 and greater).
+	 * Encrypted chunks always carry an HMAC over the entire chunk.
 	 */
-	if (pctx->encrypt_type) {
-		*((int *)pos) = htonl(pctx->crypto_ctx.saltlen);
-		pos += sizeof (int);
-		serialize_checksum(pctx->crypto_ctx.salt, pos, pctx->crypto_ctx.saltlen);
-		pos += pctx->crypto_ctx.saltlen;
-		if (pctx->encrypt_type == CRYPTO_ALG_AES) {
-			U64_P(pos) = htonll(U64_P(crypto_nonce(&(pctx->crypto_ctx))));
-			pos += 8;
-
-		} else if (pctx->encrypt_type == CRYPTO_ALG_SALSA20) {
-			serialize_checksum(crypto_nonce(&(pctx->crypto_ctx)), pos, XSALSA20_CRYPTO_NONCEBYTES);
-			pos += XSALSA20_CRYPTO_NONCEBYTES;
-		}
-		*((int *)pos) = htonl(pctx->keylen);
-		pos += sizeof (int);
-	}
-	if (Write(compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
-		log_msg(LOG_ERR, 1, "Write ");
-		COMP_BAIL;
-	}
+	if (pctx->payload_crc && !pctx->encrypt_type)
+		flags |= FLAG_PAYLOAD_CRC;
 
 	/*
-	 * If encryption is enabled, compute header HMAC and write it.
+	 * An existing file being appended to already has its header.
 	 */
-	if (pctx->encrypt_type) {
-		mac_ctx_t hdr_mac;
-		uchar_t hdr_hash[pctx->mac_bytes];
-		unsigned int hlen;
+	if (!pctx->append_file) {
+		/*
+		 * Write out file header. First insert hdr elements into mem buffer
+		 * then write out the full hdr in one shot.
+		 */
+		flags |= pctx->cksum;
+		memset(cread_buf, 0, ALGO_SZ);
+		strncpy((char *)cread_buf, pctx->algo, ALGO_SZ);
+		version = htons(VERSION);
+		flags = htons(flags);
+		n_chunksize = htonll(chunksize);
+		level = htonl(level);
+		pos = cread_buf + ALGO_SZ;
+		memcpy(pos, &version, sizeof (version));
+		pos += sizeof (version);
+		memcpy(pos, &flags, sizeof (flags));
+		pos += sizeof (flags);
+		memcpy(pos, &n_chunksize, sizeof (n_chunksize));
+		pos += sizeof (n_chunksize);
+		memcpy(pos, &level, sizeof (level));
+		pos += sizeof (level);
 
-		if (hmac_init(&hdr_mac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
-			log_msg(LOG_ERR, 0, "Cannot initialize header hmac.");
-			COMP_BAIL;
+		/*
+		 * If encryption is enabled, include salt, nonce and keylen in the header
+		 * to be HMAC-ed (archive version 7 and greater).
+		 */
+		if (pctx->encrypt_type) {
+			*((int *)pos) = htonl(pctx->crypto_ctx.saltlen);
+			pos += sizeof (int);
+			serialize_checksum(pctx->crypto_ctx.salt, pos, pctx->crypto_ctx.saltlen);
+			pos += pctx->crypto_ctx.saltlen;
+			if (pctx->encrypt_type == CRYPTO_ALG_AES) {
+				U64_P(pos) = htonll(U64_P(crypto_nonce(&(pctx->crypto_ctx))));
+				pos += 8;
+
+			} else if (pctx->encrypt_type == CRYPTO_ALG_SALSA20) {
+				serialize_checksum(crypto_nonce(&(pctx->crypto_ctx)), pos, XSALSA20_CRYPTO_NONCEBYTES);
+				pos += XSALSA20_CRYPTO_NONCEBYTES;
+			}
+			*((int *)pos) = htonl(pctx->keylen);
+			pos += sizeof (int);
 		}
-		hmac_update(&hdr_mac, cread_buf, pos - cread_buf);
-		hmac_final(&hdr_mac, hdr_hash, &hlen);
-		hmac_cleanup(&hdr_mac);
-
-		/* Erase encryption key bytes stored as a plain array. No longer reqd. */
-		crypto_clean_pkey(&(pctx->crypto_ctx));
-
-		pos = cread_buf;
-		serialize_checksum(hdr_hash, pos, hlen);
-		pos += hlen;
 		if (Write(compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
 			log_msg(LOG_ERR, 1, "Write ");
 			COMP_BAIL;
 		}
-	} else {
+
 		/*
-		 * Compute header CRC32 and store that. Only archive version 5 and above.
+		 * If encryption is enabled, compute header HMAC and write it.
 		 */
-		uint32_t crc = lzma_crc32(cread_buf, pos - cread_buf, 0);
-		U32_P(cread_buf) = htonl(crc);
-		if (Write(compfd, cread_buf, sizeof (uint32_t)) != sizeof (uint32_t)) {
-			log_msg(LOG_ERR, 1, "Write ");
-			COMP_BAIL;
+		if (pctx->encrypt_type) {
+			mac_ctx_t hdr_mac;
+			uchar_t hdr_hash[pctx->mac_bytes];
+			unsigned int hlen;
+
+			if (hmac_init(&hdr_mac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
+				log_msg(LOG_ERR, 0, "Cannot initialize header hmac.");
+				COMP_BAIL;
+			}
+			hmac_update(&hdr_mac, cread_buf, pos - cread_buf);
+			hmac_final(&hdr_mac, hdr_hash, &hlen);
+			hmac_cleanup(&hdr_mac);
+
+			/* Erase encryption key bytes stored as a plain array. No longer reqd. */
+			crypto_clean_pkey(&(pctx->crypto_ctx));
+
+			pos = cread_buf;
+			serialize_checksum(hdr_hash, pos, hlen);
+			pos += hlen;
+			if (Write(compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
+				log_msg(LOG_ERR, 1, "Write ");
+				COMP_BAIL;
+			}
+		} else {
+			/*
+			 * Compute header CRC32 and store that. Only archive version 5 and above.
+			 */
+			uint32_t crc = lzma_crc32(cread_buf, pos - cread_buf, 0);
+			U32_P(cread_buf) = htonl(crc);
+			if (Write(compfd, cread_buf, sizeof (uint32_t)) != sizeof (uint32_t)) {
+				log_msg(LOG_ERR, 1, "Write ");
+				COMP_BAIL;
+			}
 		}
 	}
 
+	if (pctx->volset && volset_write_manifest(pctx->volset, compfd) == -1) {
+		COMP_BAIL;
+	}
+
 	/*
 	 * Now read from the uncompressed file in 'chunksize' sized chunks, independently
 	 * compress each chunk and write it out. Chunk sequencing is ensured.
@@ -2369,20 +3678,68 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	pctx->avg_chunk = 0;
 	rabin_count = 0;
 
+	/*
+	 * Detect content types in the input while reading it, unless the
+	 * archiver already provides them.
+	 */
+	if (!pctx->archive_mode && stream_scan_init(pctx, uncompfd, filename, chunksize,
+	    !single_chunk) == -1)
+		log_msg(LOG_WARN, 0, "Out of memory, content types will not be detected.");
+
+	/*
+	 * With NUMA worker groups wait for the workers to set up their buffers.
+	 * A chunk is then always read into the read buffer of the node of the
+	 * worker it goes to, so buffers are only swapped within a node.
+	 */
+	if (node_rbuf) {
+		for (p = 0; p < nprocs; p++) {
+			sem_wait(&dary[p]->write_done_sem);
+			sem_post(&dary[p]->write_done_sem);
+		}
+		for (i = 0; i < nnodes; i++) {
+			if (pctx->numa_workers[i] == 0 || node_rbuf[i])
+				continue;
+			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan))
+				node_rbuf[i] = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
+			else
+				node_rbuf[i] = (uchar_t *)slab_alloc(NULL, chunksize);
+			if (!node_rbuf[i]) {
+				log_msg(LOG_ERR, 0, "3: Out of memory");
+				COMP_BAIL;
+			}
+		}
+		slab_free(NULL, cread_buf);
+		cread_buf = numa_switch_rbuf(NULL, node_rbuf, -1, dary[0]->numa_node);
+	}
+
 	/*
 	 * Read the first chunk into a spare buffer (a simple double-buffering).
 	 */
 	file_offset = 0;
+	if (pctx->append_file && index_fd == -1)
+		file_offset = pctx->append_size;
 	if (pctx->enable_rabin_split) {
 		rctx = create_dedupe_context(chunksize, 0, pctx->rab_blk_size, pctx->algo, &props,
 		    pctx->enable_delta_encode, pctx->enable_fixed_scan, VERSION, COMPRESS, 0, NULL,
 		    pctx->pipe_mode, nprocs);
-		if (pctx->archive_mode)
+	}
+
+	/*
+	 * When rebuilding the global index for appending the existing data is
+	 * read first. Those chunks only go through dedupe to populate the index.
+	 */
+	cread_index = 0;
+	index_rem = pctx->append_size;
+	if (index_fd != -1 &&
+	    (rbytes = read_index_data(index_fd, cread_buf, chunksize, &index_rem)) != 0) {
+		cread_index = 1;
+	} else if (pctx->enable_rabin_split) {
+		if (pctx->archive_mode || pctx->stream_scan)
 			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, pctx);
 		else
 			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, NULL);
 	} else {
-		if (pctx->archive_mode)
+		if (pctx->archive_mode || pctx->stream_scan)
 			rbytes = archiver_read(pctx, cread_buf, chunksize);
 		else
 			rbytes = Read(uncompfd, cread_buf, chunksize);
@@ -2443,6 +3800,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			 * cmp_seg -> dedup -> uncompressed_chunk -> compression -> cmp_seg
 			 */
 			tdat->id = pctx->chunk_num;
+			tdat->index_only = cread_index;
 			tdat->rbytes = rbytes;
 			tdat->btype = pctx->btype; // Have to copy btype for this buffer as pctx->btype will change
 			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global)) {
@@ -2452,6 +3810,9 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				tdat->compressed_chunk = tdat->cmp_seg + COMPRESSED_CHUNKSZ +
 				    pctx->cksum_bytes + pctx->mac_bytes;
 				if (tdat->rctx) tdat->rctx->file_offset = file_offset;
+				if (node_rbuf)
+					cread_buf = numa_switch_rbuf(cread_buf, node_rbuf,
+					    tdat->numa_node, dary[(p + 1) % nprocs]->numa_node);
 
 				/*
 				 * If there is data after the last rabin boundary in the chunk, then
@@ -2468,7 +3829,11 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				tmp = tdat->uncompressed_chunk;
 				tdat->uncompressed_chunk = cread_buf;
 				cread_buf = tmp;
+				if (node_rbuf)
+					cread_buf = numa_switch_rbuf(cread_buf, node_rbuf,
+					    tdat->numa_node, dary[(p + 1) % nprocs]->numa_node);
 			}
+			tdat->stream_off = file_offset;
 			file_offset += tdat->rbytes;
 
 			if (rbytes < chunksize) {
@@ -2481,7 +3846,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 
 			/* Signal the compression thread to start */
 			sem_post(&tdat->start_sem);
-			++(pctx->chunk_num);
+			if (!cread_index)
+				++(pctx->chunk_num);
 
 			if (single_chunk) {
 				rbytes = 0;
@@ -2492,15 +3858,19 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			 * Read the next buffer we want to process while previous
 			 * buffer is in progress.
 			 */
-			if (pctx->enable_rabin_split) {
-				if (pctx->archive_mode)
+			cread_index = 0;
+			if (index_fd != -1 && (rbytes = read_index_data(index_fd,
+			    cread_buf, chunksize, &index_rem)) != 0) {
+				cread_index = 1;
+			} else if (pctx->enable_rabin_split) {
+				if (pctx->archive_mode || pctx->stream_scan)
 					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
 					    &rabin_count, rctx, pctx);
 				else
 					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
 					    &rabin_count, rctx, NULL);
 			} else {
-				if (pctx->archive_mode)
+				if (pctx->archive_mode || pctx->stream_scan)
 					rbytes = archiver_read(pctx, cread_buf, chunksize);
 				else
 					rbytes = Read(uncompfd, cread_buf, chunksize);
@@ -2546,8 +3916,41 @@ comp_done:
 			pthread_join(writer_thr, NULL);
 	}
 
+	/*
+	 * The archiver thread records the end of the member stream in the catalog
+	 * so wait for it to exit before the catalog is written.
+	 */
+	if (pctx->archive_mode)
+		pthread_join(pctx->archive_thread, NULL);
+
+	/*
+	 * All chunks are queued once the writer thread is done. Wait for the
+	 * volumes to be written out.
+	 */
+	if (pctx->volset && volset_finish(pctx->volset, err, &sbuf))
+		err = 1;
+
 	if (err) {
-		if (compfd != -1 && !pctx->pipe_mode && !pctx->pipe_out) {
+		if (pctx->ckpt_written || pctx->resume) {
+			/*
+			 * Keep the partial output to resume from the last checkpoint.
+			 */
+			log_msg(LOG_ERR, 0, "Partial output kept in %s, use '--resume' "
+			    "to continue.", pctx->resume ? pctx->append_file : tmpfile1);
+		} else if (pctx->append_file) {
+			/*
+			 * Put back the trailer so that the file is left as it was.
+			 */
+			if (compfd != -1) {
+				compressed_chunksize = 0;
+				if (lseek(compfd, pctx->append_off, SEEK_SET) == -1 ||
+				    Write(compfd, &compressed_chunksize,
+				    sizeof (compressed_chunksize)) < 0 ||
+				    ftruncate(compfd, pctx->append_off +
+				    sizeof (compressed_chunksize)) == -1)
+					log_msg(LOG_ERR, 1, "Cannot restore %s ", pctx->append_file);
+			}
+		} else if (compfd != -1 && !pctx->pipe_mode && !pctx->pipe_out) {
 			unlink(tmpfile1);
 			rm_fname(tmpfile1);
 		}
@@ -2566,11 +3969,19 @@ comp_done:
 			err = 1;
 		}
 
+		/*
+		 * The member catalog, if any, goes after the trailer.
+		 */
+		if (pctx->catalog && !err) {
+			if (catalog_write(pctx->catalog, compfd) == -1)
+				err = 1;
+		}
+
 		/*
 		 * Rename the temporary file to the actual compressed file
-		 * unless we are in a pipe.
+		 * unless we are in a pipe or appending.
 		 */
-		if (!pctx->pipe_mode && !pctx->pipe_out) {
+		if (!pctx->pipe_mode && !pctx->pipe_out && (!pctx->append_file || pctx->resume)) {
 			/*
 			 * Ownership and mode of target should be same as original.
 			 */
@@ -2579,7 +3990,7 @@ comp_done:
 				log_msg(LOG_ERR, 1, "chown ");
 			close(compfd);
 
-			if (pctx->to_filename == NULL) {
+			if (pctx->to_filename == NULL || pctx->checkpoint_secs) {
 				if (rename(tmpfile1, to_filename) == -1) {
 					log_msg(LOG_ERR, 1, "Cannot rename temporary file ");
 					unlink(tmpfile1);
@@ -2588,11 +3999,21 @@ comp_done:
 			} else {
 				rm_fname(to_filename);
 			}
+			if (pctx->ckpt_file[0] != '\0')
+				unlink(pctx->ckpt_file);
 		}
 	}
+	if (index_file[0] != '\0') {
+		if (index_fd != -1) close(index_fd);
+		unlink(index_file);
+		rm_fname(index_file);
+		rmdir(dirname(index_file));
+	}
+	stream_scan_free(pctx);
 	if (dary != NULL) {
 		for (i = 0; i < nprocs; i++) {
 			if (!dary[i]) continue;
+			preproc_stats_add(pctx, dary[i]->preproc_stats);
 			if (dary[i]->uncompressed_chunk != (uchar_t *)1)
 				slab_free(NULL, dary[i]->uncompressed_chunk);
 			if (dary[i]->cmp_seg != (uchar_t *)1)
@@ -2609,14 +4030,25 @@ comp_done:
 	if (pctx->enable_rabin_split) destroy_dedupe_context(rctx);
 	if (cread_buf != (uchar_t *)1)
 		slab_free(NULL, cread_buf);
+	if (node_rbuf) {
+		for (i = 0; i < nnodes; i++)
+			slab_free(NULL, node_rbuf[i]);
+		slab_free(NULL, node_rbuf);
+		bind_numa_node(-1);
+	}
 	if (!pctx->pipe_mode) {
 		if (compfd != -1) close(compfd);
 	}
+	volset_free(pctx->volset);
+	pctx->volset = NULL;
 
 	if (pctx->archive_mode) {
 		struct fn_list *fn, *fn1;
 
-		pthread_join(pctx->archive_thread, NULL);
+		catalog_free(pctx->catalog);
+		pctx->catalog = NULL;
+		catalog_free(pctx->base_catalog);
+		pctx->base_catalog = NULL;
 		fn = pctx->fn;
 		while (fn) {
 			fn1 = fn;
@@ -2750,6 +4182,204 @@ init_algo(pc_ctx_t *pctx, const char *algo, int bail)
 	return (rv);
 }
 
+/*
+ * Load the compression parameters for appending from the header of the
+ * compressed file and locate its zero-length trailer. The new chunks are
+ * written in place of the trailer.
+ */
+static int
+init_append(pc_ctx_t *pctx)
+{
+	uchar_t hdr[ALGO_SZ + 16], *pos, flag;
+	unsigned short version, flags;
+	uint64_t chunksize, len, off, orig;
+	struct stat sbuf;
+	uint32_t crc;
+	int fd, level, hdr_sz;
+
+	if ((fd = open(pctx->append_file, O_RDONLY)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open: %s", pctx->append_file);
+		return (1);
+	}
+	if (fstat(fd, &sbuf) == -1 || Read(fd, hdr, sizeof (hdr)) != sizeof (hdr) ||
+	    Read(fd, &crc, sizeof (crc)) != sizeof (crc)) {
+		log_msg(LOG_ERR, 0, "%s is not a pcompressed file.", pctx->append_file);
+		close(fd);
+		return (1);
+	}
+	memcpy(pctx->append_algo, hdr, ALGO_SZ);
+	pctx->append_algo[ALGO_SZ] = '\0';
+	pos = hdr + ALGO_SZ;
+	version = ntohs(U16_P(pos));
+	pos += sizeof (version);
+	flags = ntohs(U16_P(pos));
+	pos += sizeof (flags);
+	chunksize = ntohll(U64_P(pos));
+	pos += sizeof (chunksize);
+	level = ntohl(U32_P(pos));
+
+	if (init_algo(pctx, pctx->append_algo, 0) != 0) {
+		log_msg(LOG_ERR, 0, "%s is not a pcompressed file.", pctx->append_file);
+		close(fd);
+		return (1);
+	}
+	if (version != VERSION) {
+		log_msg(LOG_ERR, 0, "Can only append to files of version %d.", VERSION);
+		close(fd);
+		return (1);
+	}
+	if (flags & (MASK_CRYPTO_ALG | FLAG_ARCHIVE | FLAG_VOLUMES | FLAG_SINGLE_CHUNK)) {
+		log_msg(LOG_ERR, 0, "Cannot append to encrypted, archive, multi-volume or "
+		    "single chunk files.");
+		close(fd);
+		return (1);
+	}
+	if (ntohl(crc) != lzma_crc32(hdr, sizeof (hdr), 0)) {
+		log_msg(LOG_ERR, 0, "Header checksum mismatch. %s corrupt ?", pctx->append_file);
+		close(fd);
+		return (1);
+	}
+	if (chunksize < MIN_CHUNK || chunksize > EIGHTY_PCT(get_total_ram()) ||
+	    level < 0 || level > MAX_LEVEL) {
+		log_msg(LOG_ERR, 0, "Invalid chunk size or level in header. %s corrupt ?",
+		    pctx->append_file);
+		close(fd);
+		return (1);
+	}
+
+	pctx->algo = pctx->append_algo;
+	pctx->level = level;
+	pctx->chunksize = chunksize;
+	pctx->cksum = flags & CKSUM_MASK;
+	if (get_checksum_props(NULL, &(pctx->cksum), &(pctx->cksum_bytes),
+	    &(pctx->mac_bytes), 1) == -1) {
+		log_msg(LOG_ERR, 0, "Invalid checksum algorithm code: %d. File corrupt ?",
+		    pctx->cksum);
+		close(fd);
+		return (1);
+	}
+	pctx->mac_bytes = sizeof (uint32_t); // CRC32 in non-crypto mode
+	pctx->payload_crc = ((flags & FLAG_PAYLOAD_CRC) != 0);
+
+	/*
+	 * The dedupe type must match the header. The user's '-G' asks for the
+	 * global index to be rebuilt from the existing data. That is always done
+	 * when resuming, as the interrupted run would have had the index.
+	 */
+	pctx->append_reindex = pctx->enable_rabin_global;
+	pctx->enable_rabin_global = 0;
+	if ((flags & FLAG_DEDUP) && (flags & FLAG_DEDUP_FIXED)) {
+		pctx->enable_rabin_scan = 1;
+		pctx->enable_rabin_global = 1;
+		if (pctx->rab_blk_size == -1 && level > 3) {
+			pctx->rab_blk_size = 2;
+			if (level > 5) pctx->rab_blk_size = 1;
+			if (level > 8) pctx->rab_blk_size = 0;
+		}
+	} else if (flags & FLAG_DEDUP) {
+		pctx->enable_rabin_scan = 1;
+	} else if (flags & FLAG_DEDUP_FIXED) {
+		pctx->enable_fixed_scan = 1;
+		pctx->enable_rabin_split = 0;
+	}
+	if (pctx->resume)
+		pctx->append_reindex = pctx->enable_rabin_global;
+	if (pctx->append_reindex && !pctx->enable_rabin_global) {
+		log_msg(LOG_ERR, 0, "%s was not compressed with Global Deduplication.",
+		    pctx->append_file);
+		close(fd);
+		return (1);
+	}
+	pctx->advanced_opts = 1;
+
+	/*
+	 * Walk the chunk headers up to the trailer and add up the original
+	 * chunk sizes. Global Dedupe references are offsets into the original
+	 * data so the appended data continues from there. A partial file being
+	 * resumed has no trailer, the walk stops at the checkpoint.
+	 */
+	hdr_sz = pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ;
+	off = sizeof (hdr) + sizeof (crc);
+	pctx->append_size = 0;
+	pctx->append_chunks = 0;
+	while (1) {
+		if (pctx->resume && off >= pctx->ckpt_out_off)
+			break;
+		if (Pread(fd, &len, sizeof (len), off) != sizeof (len)) {
+			log_msg(LOG_ERR, 0, "Trailer not found. %s truncated ?",
+			    pctx->append_file);
+			close(fd);
+			return (1);
+		}
+		len = ntohll(len);
+		if (len == 0)
+			break;
+		if (len > chunksize + 256 || off + sizeof (len) + hdr_sz + len > sbuf.st_size ||
+		    Pread(fd, &flag, 1, off + sizeof (len) + hdr_sz - 1) != 1) {
+			log_msg(LOG_ERR, 0, "Invalid chunk length. %s corrupt ?",
+			    pctx->append_file);
+			close(fd);
+			return (1);
+		}
+		orig = chunksize;
+		if (flag & CHSIZE_MASK) {
+			if (Pread(fd, &orig, sizeof (orig), off + sizeof (len) + hdr_sz +
+			    len - ORIGINAL_CHUNKSZ) != sizeof (orig)) {
+				log_msg(LOG_ERR, 1, "Read: ");
+				close(fd);
+				return (1);
+			}
+			orig = ntohll(orig);
+		}
+
+		/*
+		 * Deduped chunks record the deduped size. The original size is in
+		 * the dedupe header at the start of the chunk data.
+		 */
+		if (flag & CHUNK_FLAG_DEDUP) {
+			uchar_t rhdr[RABIN_HDR_SIZE];
+			uint64_t isz, isz_cmp, dsz_cmp, dd_sz;
+			uint32_t blknum;
+
+			if (len < RABIN_HDR_SIZE || Pread(fd, rhdr, RABIN_HDR_SIZE,
+			    off + sizeof (len) + hdr_sz) != RABIN_HDR_SIZE) {
+				log_msg(LOG_ERR, 0, "Invalid dedupe chunk. %s corrupt ?",
+				    pctx->append_file);
+				close(fd);
+				return (1);
+			}
+			parse_dedupe_hdr(rhdr, &blknum, &isz, &orig, &isz_cmp, &dsz_cmp, &dd_sz);
+		}
+		pctx->append_size += orig;
+		pctx->append_chunks++;
+		off += sizeof (len) + hdr_sz + len;
+	}
+	if (pctx->resume && (off != pctx->ckpt_out_off ||
+	    pctx->append_size != pctx->ckpt_in_off ||
+	    pctx->append_chunks != pctx->ckpt_chunks)) {
+		log_msg(LOG_ERR, 0, "%s does not match its checkpoint.", pctx->append_file);
+		close(fd);
+		return (1);
+	}
+	pctx->append_off = off;
+	close(fd);
+
+	return (0);
+}
+
+/*
+ * Set up the process wide state: the allocator, processor feature detection
+ * and the archive type tables. Contexts created later in this process, or in
+ * processes forked from it, reuse this state.
+ */
+void DLL_EXPORT
+init_pc_process(void)
+{
+	slab_init();
+	init_pcompress();
+	init_archive_mod();
+}
+
 /*
  * Pcompress context handling functions.
  */
@@ -2758,9 +4388,7 @@ create_pc_context(void)
 {
 	pc_ctx_t *ctx = (pc_ctx_t *)malloc(sizeof (pc_ctx_t));
 
-	slab_init();
-	init_pcompress();
-	init_archive_mod();
+	init_pc_process();
 
 	memset(ctx, 0, sizeof (pc_ctx_t));
 	ctx->exec_name = (char *)malloc(NAME_MAX);
@@ -2827,7 +4455,8 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	ff.enable_packjpg = 0;
 
 	pthread_mutex_lock(&opt_parse);
-	while ((opt = getopt(argc, argv, "dc:s:l:pt:MCDGEe:w:LPS:B:Fk:avnmK")) != -1) {
+	while ((opt = getopt_long(argc, argv, "dc:s:l:pt:MCDGEe:w:LPS:B:Fk:avnmKjxbIiOUJR:THV:f:A:",
+	    long_opts, NULL)) != -1) {
 		int ovr;
 		int64_t chunksize;
 
@@ -2981,6 +4610,23 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->enable_archive_sort = -1;
 			break;
 
+		    case 'O':
+			pctx->enable_similarity_sort = 1;
+			break;
+
+		    case 'U':
+			pctx->enable_file_dedup = 1;
+			break;
+
+		    case 'J':
+			pctx->enable_file_pack = 1;
+			break;
+
+		    case 'R':
+			pctx->base_archive = optarg;
+			pctx->enable_catalog = 1;
+			break;
+
 		    case 'm':
 			pctx->force_archive_perms = 1;
 			break;
@@ -2999,6 +4645,59 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->dispack_preprocess = 1;
 			break;
 
+		    case 'b':
+			pctx->advanced_opts = 1;
+			pctx->bcj_preprocess = 1;
+			break;
+
+		    case 'I':
+			pctx->enable_catalog = 1;
+			break;
+
+		    case 'H':
+			pctx->payload_crc = 1;
+			break;
+
+		    case 'V':
+			pctx->volume_dirs = optarg;
+			break;
+
+		    case 'f':
+			pctx->batch_list = optarg;
+			break;
+
+		    case 'A':
+			pctx->append_file = optarg;
+			pctx->do_compress = 1;
+			break;
+
+		    case OPT_CHECKPOINT:
+			pctx->checkpoint_secs = atoi(optarg);
+			if (pctx->checkpoint_secs < 1) {
+				log_msg(LOG_ERR, 0, "Checkpoint interval must be at least 1 second.");
+				return (1);
+			}
+			break;
+
+		    case OPT_RESUME:
+			pctx->resume = 1;
+			pctx->do_compress = 1;
+			break;
+
+		    case OPT_SPLICE:
+			pctx->splice_req = 1;
+			break;
+
+		    case 'i':
+			pctx->list_mode = 1;
+			pctx->do_uncompress = 1;
+			break;
+
+		    case 'T':
+			pctx->verify_mode++;
+			pctx->do_uncompress = 1;
+			break;
+
 		    case '?':
 		    default:
 			return (2);
@@ -3018,6 +4717,127 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
+	if (pctx->verify_mode && pctx->list_mode) {
+		log_msg(LOG_ERR, 0, "'-T' and '-i' cannot be used together.");
+		return (1);
+	}
+
+	if (pctx->payload_crc && pctx->do_uncompress) {
+		log_msg(LOG_ERR, 0, "'-H' flag is only valid when compressing.");
+		return (1);
+	}
+
+	if (pctx->volume_dirs && pctx->do_uncompress) {
+		log_msg(LOG_ERR, 0, "'-V' flag is only valid when compressing.");
+		return (1);
+	}
+
+	if (pctx->volume_dirs && pctx->pipe_mode) {
+		log_msg(LOG_ERR, 0, "'-V' cannot be used in pipe mode.");
+		return (1);
+	}
+
+	if (pctx->batch_list && (!pctx->do_compress || pctx->archive_mode ||
+	    pctx->pipe_mode)) {
+		log_msg(LOG_ERR, 0, "'-f' is only valid when compressing individual files.");
+		return (1);
+	}
+
+	/*
+	 * Resuming appends to the partial output of an interrupted compression
+	 * from its last checkpoint, reading the input from there.
+	 */
+	if (pctx->resume) {
+		char target[MAXPATHLEN];
+		int n;
+
+		num_rem = argc - my_optind;
+		if (pctx->append_file || num_rem < 1 || num_rem > 2 ||
+		    (num_rem == 2 && *(argv[my_optind + 1]) == '-')) {
+			log_msg(LOG_ERR, 0, "'--resume' takes the file being compressed and "
+			    "optionally the target file.");
+			return (1);
+		}
+		if (num_rem == 1)
+			n = snprintf(target, sizeof (target), "%s" COMP_EXTN, argv[my_optind]);
+		else if (!endswith(argv[my_optind + 1], COMP_EXTN))
+			n = snprintf(target, sizeof (target), "%s" COMP_EXTN, argv[my_optind + 1]);
+		else
+			n = snprintf(target, sizeof (target), "%s", argv[my_optind + 1]);
+		if (n >= sizeof (target) ||
+		    snprintf(pctx->part_file, sizeof (pctx->part_file), "%s" PART_EXTN,
+		    target) >= sizeof (pctx->part_file) ||
+		    snprintf(pctx->ckpt_file, sizeof (pctx->ckpt_file), "%s" CKPT_EXTN,
+		    target) >= sizeof (pctx->ckpt_file)) {
+			log_msg(LOG_ERR, 0, "Pathname too long.");
+			return (1);
+		}
+		if (read_checkpoint(pctx, argv[my_optind]) != 0)
+			return (1);
+		pctx->append_file = pctx->part_file;
+	}
+
+	/*
+	 * When appending the compression parameters come from the file header.
+	 */
+	if (pctx->append_file) {
+		const char *opt_name = pctx->resume ? "--resume" : "-A";
+
+		if (pctx->algo || pctx->level != -1 || pctx->chunksize != DEFAULT_CHUNKSIZE ||
+		    pctx->cksum || pctx->enable_rabin_scan || pctx->enable_fixed_scan ||
+		    pctx->payload_crc) {
+			log_msg(LOG_ERR, 0, "'%s' uses the compression options of the compressed file.",
+			    opt_name);
+			return (1);
+		}
+		if (pctx->archive_mode || pctx->pipe_mode || pctx->encrypt_type ||
+		    pctx->volume_dirs || pctx->batch_list) {
+			log_msg(LOG_ERR, 0, "'%s' cannot be used when archiving, encrypting, "
+			    "in pipe mode or with '-V' or '-f'.", opt_name);
+			return (1);
+		}
+		if (init_append(pctx) != 0)
+			return (1);
+	}
+
+	if (pctx->enable_similarity_sort && !pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "'-O' flag is only valid when archiving.");
+		return (1);
+	}
+
+	if (pctx->enable_similarity_sort && pctx->enable_archive_sort == -1) {
+		log_msg(LOG_ERR, 0, "'-O' cannot be used when sorting is disabled via '-n'.");
+		return (1);
+	}
+
+	if (pctx->enable_file_dedup && !pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "'-U' flag is only valid when archiving.");
+		return (1);
+	}
+
+	if (pctx->enable_file_pack && !pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "'-J' flag is only valid when archiving.");
+		return (1);
+	}
+
+	if (pctx->base_archive && !pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "'-R' flag is only valid when archiving.");
+		return (1);
+	}
+
+	if (pctx->enable_catalog && !pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "'-I' flag is only valid when archiving.");
+		return (1);
+	}
+
+	/*
+	 * The catalog is stored in the clear so it would expose member names.
+	 */
+	if (pctx->enable_catalog && pctx->encrypt_type) {
+		log_msg(LOG_ERR, 0, "Archive catalog is not supported with encryption.");
+		return (1);
+	}
+
 	/*
 	 * Default compression algorithm during archiving is Adaptive2.
 	 */
@@ -3036,10 +4856,11 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 
 	/*
 	 * Sorting of members when archiving is enabled for compression levels >6 (>2 for lz4),
-	 * unless it is explicitly disabled via '-n'.
+	 * unless it is explicitly disabled via '-n'. Similarity ordering always needs it.
 	 */
 	if (pctx->enable_archive_sort != -1 && pctx->do_compress) {
-		if ((memcmp(pctx->algo, "lz4", 3) == 0 && pctx->level > 2) || pctx->level > 6)
+		if ((memcmp(pctx->algo, "lz4", 3) == 0 && pctx->level > 2) || pctx->level > 6 ||
+		    pctx->enable_similarity_sort)
 			pctx->enable_archive_sort = 1;
 	} else {
 		pctx->enable_archive_sort = 0;
@@ -3105,18 +4926,29 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	}
 
 	/*
-	 * Dispack and PackJPG are only valid when archiving files.
+	 * PackJPG works on whole files so it is only valid when archiving. Dispack
+	 * and BCJ also work on executables detected in other input.
 	 */
-	if ((pctx->dispack_preprocess || ff.enable_packjpg) && !pctx->archive_mode) {
-		log_msg(LOG_ERR, 0, "Dispack Executable Preprocessor and PackJPG are only valid when archiving.");
+	if (ff.enable_packjpg && !pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "PackJPG is only valid when archiving.");
 		return (1);
 	}
 
-	if (num_rem == 0 && !pctx->pipe_mode) {
+	if (pctx->batch_list) {
+		/*
+		 * Files to compress are read from the list.
+		 */
+		if (num_rem > 0) {
+			log_msg(LOG_ERR, 0, "Filename(s) unexpected with '-f'.");
+			return (1);
+		}
+
+	} else if (num_rem == 0 && !pctx->pipe_mode) {
 		log_msg(LOG_ERR, 0, "Expected at least one filename.");
 		return (1);
 
-	} else if (num_rem == 1 || num_rem == 2 || (num_rem > 0 && pctx->archive_mode)) {
+	} else if (num_rem == 1 || num_rem == 2 || (num_rem > 0 &&
+	    (pctx->archive_mode || pctx->do_uncompress))) {
 		if (pctx->do_compress) {
 			char apath[MAXPATHLEN];
 
@@ -3170,7 +5002,12 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 				my_optind++;
 			}
 
-			if (num_rem > 0) {
+			if (pctx->append_file && !pctx->resume) {
+				if (num_rem > 0) {
+					log_msg(LOG_ERR, 0, "'-A' takes a single file to append.");
+					return (1);
+				}
+			} else if (num_rem > 0) {
 				if (*(argv[my_optind]) == '-') {
 					pctx->to_filename = "-";
 					pctx->pipe_out = 1;
@@ -3215,11 +5052,23 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 					return (1);
 				}
 			}
-			if (num_rem == 2) {
+			pctx->to_filename = NULL;
+			if (pctx->verify_mode && num_rem > 1) {
+				log_msg(LOG_ERR, 0, "'-T' only takes the file to verify.");
+				return (1);
+			}
+			if (num_rem >= 2 && !pctx->list_mode) {
 				my_optind++;
 				pctx->to_filename = argv[my_optind];
-			} else {
-				pctx->to_filename = NULL;
+				num_rem--;
+			}
+
+			/*
+			 * Any further arguments name archive members to extract or list.
+			 */
+			if (num_rem > 1) {
+				pctx->member_names = &argv[my_optind + 1];
+				pctx->member_count = num_rem - 1;
 			}
 		} else {
 			return (1);
@@ -3230,6 +5079,24 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	}
 	pctx->main_cancel = 0;
 
+	if (pctx->volume_dirs && pctx->pipe_out) {
+		log_msg(LOG_ERR, 0, "'-V' needs a compressed file to write the manifest to.");
+		return (1);
+	}
+
+	if (pctx->splice_req && !pctx->pipe_mode && !pctx->pipe_out) {
+		log_msg(LOG_ERR, 0, "'--splice' is only valid when writing to stdout.");
+		return (1);
+	}
+
+	if (pctx->checkpoint_secs && (!pctx->do_compress || pctx->pipe_mode ||
+	    pctx->pipe_out || pctx->archive_mode || pctx->encrypt_type || pctx->volume_dirs ||
+	    pctx->batch_list || (pctx->append_file && !pctx->resume))) {
+		log_msg(LOG_ERR, 0, "'--checkpoint' is only valid when compressing a file to "
+		    "a compressed file without encryption or '-V', '-f' or '-A'.");
+		return (1);
+	}
+
 	if (pctx->cksum == 0)
 		get_checksum_props(DEFAULT_CKSUM, &(pctx->cksum), &(pctx->cksum_bytes), &(pctx->mac_bytes), 0);
 
@@ -3269,10 +5136,9 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			 */
 			if (pctx->archive_mode) {
 				if (pctx->level > 10) ff.enable_packjpg = 1;
-				init_filters(&ff);
-				pctx->enable_packjpg = ff.enable_packjpg;
-				if (pctx->level > 8) pctx->dispack_preprocess = 1;
 			}
+			if (pctx->level > 8) pctx->dispack_preprocess = 1;
+			if (pctx->level > 2) pctx->bcj_preprocess = 1;
 
 			/*
 			 * Enable other preprocessors based on compresion level.
@@ -3289,7 +5155,12 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			}
 			if (pctx->level > 9) pctx->delta2_nstrides = NSTRIDES_EXTRA;
 		}
-		if (pctx->lzp_preprocess || pctx->enable_delta2_encode || pctx->dispack_preprocess) {
+		if (pctx->archive_mode) {
+			init_filters(&ff);
+			pctx->enable_packjpg = ff.enable_packjpg;
+		}
+		if (pctx->lzp_preprocess || pctx->enable_delta2_encode || pctx->dispack_preprocess ||
+		    pctx->bcj_preprocess) {
 			pctx->preprocess_mode = 1;
 		}
 	} else if (pctx->do_uncompress) {
@@ -3306,6 +5177,175 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	return (0);
 }
 
+/*
+ * Batch mode: compress every file named in the list to its own '.pz' file.
+ * Each file is compressed by a child process forked from the fully set up
+ * context and given as many threads as the file has chunks. Children are
+ * started as long as their threads fit within the processor budget so that
+ * many small files keep all the cores busy while a large file still gets a
+ * full set of threads. The output of each file is sequenced by its own
+ * writer thread as usual.
+ */
+static int
+start_batch(pc_ctx_t *pctx)
+{
+	FILE *lst;
+	char *line, apath[MAXPATHLEN], *fpath = NULL;
+	size_t sz;
+	ssize_t len;
+	pid_t *jobs, pid;
+	int *jthr, nprocs, busy, nfiles, nfailed, need, i, status, pw_len;
+	uchar_t pw[MAX_PW_LEN];
+	struct stat sbuf;
+
+	if (strcmp(pctx->batch_list, "-") == 0) {
+		lst = stdin;
+	} else {
+		if ((lst = fopen(pctx->batch_list, "r")) == NULL) {
+			log_msg(LOG_ERR, 1, "Cannot open file list %s", pctx->batch_list);
+			return (1);
+		}
+	}
+
+	/*
+	 * Ask for the password only once for all the files.
+	 */
+	pw_len = 0;
+	if (pctx->encrypt_type && !pctx->user_pw) {
+		pw_len = get_encrypt_pw(pctx, pw);
+		if (pw_len == -1) {
+			if (lst != stdin) fclose(lst);
+			return (1);
+		}
+		pc_set_userpw(pctx, pw, pw_len);
+	}
+
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (pctx->nthreads > 0 && pctx->nthreads < nprocs)
+		nprocs = pctx->nthreads;
+	if (nprocs < 1)
+		nprocs = 1;
+	jobs = (pid_t *)calloc(nprocs, sizeof (pid_t));
+	jthr = (int *)calloc(nprocs, sizeof (int));
+	if (jobs == NULL || jthr == NULL) {
+		log_msg(LOG_ERR, 1, "Out of memory");
+		free(jobs);
+		free(jthr);
+		if (lst != stdin) fclose(lst);
+		memset(pw, 0, MAX_PW_LEN);
+		return (1);
+	}
+
+	line = NULL;
+	sz = 0;
+	busy = 0;
+	nfiles = 0;
+	nfailed = 0;
+	while (1) {
+		len = getline(&line, &sz, lst);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		/*
+		 * Wait for running jobs to release enough threads for the next
+		 * file, or for all of them at the end of the list.
+		 */
+		need = 0;
+		if (len > 0) {
+			nfiles++;
+			fpath = realpath(line, NULL);
+			if (fpath == NULL) {
+				log_msg(LOG_ERR, 1, "%s", line);
+				nfailed++;
+				continue;
+			}
+			if (stat(fpath, &sbuf) == -1 || !S_ISREG(sbuf.st_mode)) {
+				log_msg(LOG_ERR, 0, "%s is not a regular file", fpath);
+				free(fpath);
+				nfailed++;
+				continue;
+			}
+			snprintf(apath, sizeof (apath), "%s" COMP_EXTN, fpath);
+			if (access(apath, F_OK) == 0) {
+				log_msg(LOG_ERR, 0, "Compressed file %s exists", apath);
+				free(fpath);
+				nfailed++;
+				continue;
+			}
+			need = sbuf.st_size / pctx->chunksize;
+			if (sbuf.st_size % pctx->chunksize)
+				need++;
+			if (need < 1)
+				need = 1;
+			else if (need > nprocs)
+				need = nprocs;
+		} else if (len == 0) {
+			continue;
+		}
+
+		while (busy > 0 && (len < 0 || busy + need > nprocs)) {
+			pid = waitpid(-1, &status, 0);
+			if (pid == -1) {
+				if (errno == EINTR)
+					continue;
+				log_msg(LOG_ERR, 1, "waitpid ");
+				break;
+			}
+			for (i = 0; i < nprocs; i++) {
+				if (jobs[i] == pid) {
+					busy -= jthr[i];
+					jobs[i] = 0;
+					if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+						nfailed++;
+					break;
+				}
+			}
+		}
+		if (len < 0)
+			break;
+
+		for (i = 0; i < nprocs && jobs[i] != 0; i++);
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid == -1) {
+			log_msg(LOG_ERR, 1, "fork ");
+			free(fpath);
+			nfailed++;
+			continue;
+		}
+		if (pid == 0) {
+			if (lst != stdin) fclose(lst);
+			pctx->filename = fpath;
+			pctx->to_filename = NULL;
+			pctx->nthreads = need;
+			exit(start_compress(pctx, fpath, pctx->chunksize, pctx->level) ? 1:0);
+		}
+		jobs[i] = pid;
+		jthr[i] = need;
+		busy += need;
+		free(fpath);
+	}
+
+	free(line);
+	free(jobs);
+	free(jthr);
+	if (lst != stdin) fclose(lst);
+	memset(pw, 0, MAX_PW_LEN);
+	pctx->user_pw = NULL;
+	pctx->user_pw_len = 0;
+
+	if (nfiles == 0) {
+		log_msg(LOG_ERR, 0, "No files to compress in %s", pctx->batch_list);
+		return (1);
+	}
+	if (nfailed > 0) {
+		log_msg(LOG_ERR, 0, "%d of %d files failed to compress.", nfailed, nfiles);
+		return (1);
+	}
+	return (0);
+}
+
 int DLL_EXPORT
 start_pcompress(pc_ctx_t *pctx)
 {
@@ -3316,7 +5356,9 @@ start_pcompress(pc_ctx_t *pctx)
 
 	handle_signals();
 	err = 0;
-	if (pctx->do_compress)
+	if (pctx->do_compress && pctx->batch_list)
+		err = start_batch(pctx);
+	else if (pctx->do_compress)
 		err = start_compress(pctx, pctx->filename, pctx->chunksize, pctx->level);
 	else if (pctx->do_uncompress)
 		err = start_decompress(pctx, pctx->filename, pctx->to_filename);
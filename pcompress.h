@@ -36,15 +36,20 @@ extern "C" {
 
 #include <rabin_dedup.h>
 #include <crypto_utils.h>
+#include <pc_numa.h>
+#include <pc_pipe.h>
 
 #define	CHUNK_FLAG_SZ	1
 #define	ALGO_SZ		8
 #define	MIN_CHUNK	2048
-#define	VERSION		9
+#define	VERSION		10
 #define	FLAG_DEDUP	1
 #define	FLAG_DEDUP_FIXED	2
 #define	FLAG_SINGLE_CHUNK	4
 #define	FLAG_ARCHIVE	2048
+#define	FLAG_CATALOG	4096
+#define	FLAG_PAYLOAD_CRC	8192
+#define	FLAG_VOLUMES	16384
 #define	UTILITY_VERSION	"2.4"
 #define	MASK_CRYPTO_ALG	0x30
 #define	MAX_LEVEL	14
@@ -57,12 +62,36 @@ extern "C" {
 #define	CHUNK_FLAG_DEDUP		2
 #define	CHUNK_FLAG_PREPROC	4
 #define	COMP_EXTN	".pz"
+#define	PART_EXTN	".part"
+#define	CKPT_EXTN	".ckpt"
 
 #define	PREPROC_TYPE_LZP		1
 #define	PREPROC_TYPE_DELTA2	2
 #define	PREPROC_TYPE_DISPACK	4
+#define	PREPROC_TYPE_BCJ	8
+#define	PREPROC_BCJ_ARM64	16
 #define	PREPROC_COMPRESSED	128
 
+/*
+ * Adaptive pre-processing. Per data sub-type statistics are kept for each
+ * filter. A filter that fails to reduce the data PREPROC_FAIL_LIMIT times in
+ * a row is skipped for the next PREPROC_PROBE_INTERVAL chunks of that type
+ * and then re-probed.
+ */
+#define	PREPROC_FILTER_LZP	0
+#define	PREPROC_FILTER_DELTA2	1
+#define	PREPROC_FILTER_DISPACK	2
+#define	PREPROC_FILTER_BCJ	3
+#define	NUM_PREPROC_FILTERS	4
+#define	PREPROC_FAIL_LIMIT	3
+#define	PREPROC_PROBE_INTERVAL	16
+
+typedef struct {
+	uint32_t fails;
+	uint32_t skip;
+	uint32_t tried, succeeded, skipped, disabled;
+} preproc_stat_t;
+
 /*
  * Sizes of chunk header components.
  */
@@ -193,8 +222,10 @@ typedef struct pc_ctx {
 
 	int inited;
 	int main_cancel;
+	int file_version;
 	int adapt_mode;
 	int pipe_mode, pipe_out;
+	int splice_req, splice_out;
 	int nthreads;
 	int hide_mem_stats;
 	int hide_cmp_stats;
@@ -208,14 +239,50 @@ typedef struct pc_ctx {
 	int preprocess_mode;
 	int lzp_preprocess;
 	int dispack_preprocess;
+	int bcj_preprocess;
 	int encrypt_type;
 	int archive_mode;
 	int verbose;
 	int enable_archive_sort;
+	int enable_similarity_sort;
 	int pagesize;
 	int force_archive_perms;
 	int no_overwrite_newer;
 	int advanced_opts;
+	int enable_catalog;
+	int list_mode;
+	int verify_mode;
+	int payload_crc;
+	char *volume_dirs;
+	struct pc_volset *volset;
+	char *batch_list;
+	char *append_file;
+	char append_algo[ALGO_SZ + 1];
+	int append_reindex;
+	uint64_t append_off, append_size;
+	uint32_t append_chunks;
+
+	/*
+	 * Checkpointing of long compressions and resuming from the last one.
+	 */
+	int checkpoint_secs;
+	int resume;
+	char part_file[MAXPATHLEN];
+	char ckpt_file[MAXPATHLEN];
+	time_t ckpt_time;
+	int ckpt_written;
+	uint64_t ckpt_in_size, ckpt_in_mtime;
+	uint64_t ckpt_in_off, ckpt_out_off;
+	uint32_t ckpt_chunks;
+
+	/*
+	 * Worker groups per NUMA node, for the statistics.
+	 */
+	int numa_nodes;
+	int numa_workers[MAX_NUMA_NODES];
+	int enable_file_dedup;
+	int enable_file_pack;
+	char *base_archive;
 
 	/*
 	 * Archiving related context data.
@@ -236,12 +303,21 @@ typedef struct pc_ctx {
 	uchar_t *arc_buf;
 	uint64_t arc_buf_size, arc_buf_pos;
 	int arc_closed, arc_writing;
+	int arc_src_fd, arc_src_short, arc_direct;
+	uint64_t arc_stream_pos;
+	struct pc_catalog *catalog, *base_catalog;
+	struct pc_filedup *filedup;
+	struct stream_scan *stream_scan;
+	char **member_names;
+	int member_count;
 	uchar_t btype, ctype;
 	int min_chunk;
 	int enable_packjpg;
 
 	unsigned int chunk_num;
 	uint64_t largest_chunk, smallest_chunk, avg_chunk;
+	uint64_t verify_bytes;
+	preproc_stat_t preproc_stats[NUM_SUB_TYPES][NUM_PREPROC_FILTERS];
 	uint64_t chunksize;
 	const char *algo, *filename;
 	char *to_filename;
@@ -266,8 +342,11 @@ struct cmp_data {
 	uchar_t *uncompressed_chunk;
 	dedupe_context_t *rctx;
 	uint64_t rbytes;
-	uint64_t chunksize;
+	uint64_t chunksize, compressed_chunksize;
+	uint64_t stream_off;
 	uint64_t len_cmp, len_cmp_be;
+	uint64_t vol_off;
+	int vol_fd;
 	uchar_t checksum[CKSUM_MAX_BYTES];
 	int level, cksum_mt, out_fd;
 	unsigned int id;
@@ -283,11 +362,16 @@ struct cmp_data {
 	mac_ctx_t chunk_hmac;
 	algo_props_t *props;
 	int decompressing;
+	int index_only;
+	int numa_node;
+	uchar_t **numa_rbuf;
 	uchar_t btype;
+	preproc_stat_t preproc_stats[NUM_SUB_TYPES][NUM_PREPROC_FILTERS];
 	pc_ctx_t *pctx;
 };
 
 void usage(pc_ctx_t *pctx);
+void init_pc_process(void);
 pc_ctx_t *create_pc_context(void);
 int init_pc_context_argstr(pc_ctx_t *pctx, char *args);
 int init_pc_context(pc_ctx_t *pctx, int argc, char *argv[]);
@@ -36,6 +36,8 @@
 #include <pthread.h>
 #include <xxhash.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
 
 #include "index.h"
 
@@ -51,8 +53,224 @@ typedef struct {
 	uint64_t memlimit;
 	uint64_t memused;
 	int hash_entry_size, intervals, hash_slots;
+	int budget_slot;
 } index_t;
 
+/*
+ * Index memory budget shared by concurrent Global Dedupe jobs of the same user.
+ * It is enabled by setting PCOMPRESS_INDEX_SHARED in the environment. Only the
+ * memory budget is shared, each job still has its own index.
+ *
+ * The budget lives in a per-uid POSIX shared memory segment and is handed out
+ * without locks: every job publishes its reservation as a single (pid, MB) word
+ * in a slot array. Reservations of jobs that have exited are reclaimed by the
+ * next job that scans the slots. Liveness is checked with kill(pid, 0), so jobs
+ * must run in the same PID namespace, and a slot whose pid was reused stays
+ * reserved until that process exits. The segment is fixed size and is left in
+ * place; the budget is recomputed by a job that finds no live reservations.
+ */
+#define	BUDGET_MAGIC	0x504342554447ULL
+#define	BUDGET_SLOTS	256
+#define	BUDGET_MIN_MB	16
+#define	BUDGET_UNIT	(1024 * 1024)
+#define	SLOT_PID(v)	((pid_t)((v) >> 32))
+#define	SLOT_MB(v)	((uint32_t)((v) & 0xffffffffULL))
+#define	SLOT_VAL(p, m)	(((uint64_t)(p) << 32) | (uint64_t)(m))
+
+typedef struct {
+	uint64_t magic;
+	uint32_t budget_mb;
+	volatile uint32_t inited;
+	volatile uint64_t slots[BUDGET_SLOTS];
+} index_budget_t;
+
+static index_budget_t *
+budget_attach(uint64_t memlimit, int create)
+{
+	index_budget_t *bdg;
+	char name[64];
+	struct stat sbuf;
+	int fd, created, tries;
+
+	snprintf(name, sizeof (name), "/pcompress-index-%u", (unsigned int)getuid());
+	created = create;
+	fd = -1;
+	if (create)
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (!create || (fd == -1 && errno == EEXIST)) {
+		created = 0;
+		fd = shm_open(name, O_RDWR, 0);
+	}
+	if (fd == -1) {
+		log_msg(LOG_WARN, 1, "Cannot open shared index budget: ");
+		return (NULL);
+	}
+
+	if (created) {
+		if (ftruncate(fd, sizeof (index_budget_t)) == -1) {
+			log_msg(LOG_WARN, 1, "Cannot size shared index budget: ");
+			close(fd);
+			shm_unlink(name);
+			return (NULL);
+		}
+	} else {
+		/*
+		 * Wait for the creator to size the segment.
+		 */
+		for (tries = 0; tries < 100; tries++) {
+			if (fstat(fd, &sbuf) == 0 && sbuf.st_size >= sizeof (index_budget_t))
+				break;
+			usleep(10000);
+		}
+		if (tries == 100) {
+			log_msg(LOG_WARN, 0, "Shared index budget %s is not initialized.", name);
+			close(fd);
+			return (NULL);
+		}
+	}
+
+	bdg = (index_budget_t *)mmap(NULL, sizeof (index_budget_t), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+	if (bdg == MAP_FAILED) {
+		log_msg(LOG_WARN, 1, "Cannot map shared index budget: ");
+		return (NULL);
+	}
+
+	/*
+	 * The creator sets an initial budget from its own view of the memory limit.
+	 */
+	if (created) {
+		bdg->magic = BUDGET_MAGIC;
+		bdg->budget_mb = MAX(memlimit / BUDGET_UNIT, BUDGET_MIN_MB);
+		__sync_synchronize();
+		bdg->inited = 1;
+	} else {
+		for (tries = 0; tries < 100 && !bdg->inited; tries++)
+			usleep(10000);
+		if (!bdg->inited || bdg->magic != BUDGET_MAGIC) {
+			log_msg(LOG_WARN, 0, "Shared index budget %s is not valid.", name);
+			munmap(bdg, sizeof (index_budget_t));
+			return (NULL);
+		}
+	}
+	return (bdg);
+}
+
+/*
+ * Sum up the live reservations other than our own slot and count them in
+ * *live if given. Slots held by exited processes are released on the way.
+ */
+static uint64_t
+budget_used(index_budget_t *bdg, int myslot, int *live)
+{
+	uint64_t v, used;
+	int i;
+
+	used = 0;
+	if (live)
+		*live = 0;
+	for (i = 0; i < BUDGET_SLOTS; i++) {
+		if (i == myslot)
+			continue;
+		v = bdg->slots[i];
+		if (v == 0)
+			continue;
+		if (kill(SLOT_PID(v), 0) == -1 && errno == ESRCH) {
+			__sync_bool_compare_and_swap(&bdg->slots[i], v, 0);
+			continue;
+		}
+		used += SLOT_MB(v);
+		if (live)
+			(*live)++;
+	}
+	return (used);
+}
+
+/*
+ * Reserve up to memreqd bytes of index memory from the shared budget. A new
+ * budget is sized to memlimit. Returns the granted amount and the slot holding
+ * the reservation, or memreqd and -1 if the budget is unavailable.
+ */
+static uint64_t
+budget_reserve(uint64_t memreqd, uint64_t memlimit, int *slot)
+{
+	index_budget_t *bdg;
+	uint64_t used, want, grant, total;
+	pid_t pid;
+	int i, live;
+
+	*slot = -1;
+	if (getenv("PCOMPRESS_INDEX_SHARED") == NULL)
+		return (memreqd);
+	if ((bdg = budget_attach(memlimit, 1)) == NULL)
+		return (memreqd);
+
+	pid = getpid();
+	for (i = 0; i < BUDGET_SLOTS; i++) {
+		if (bdg->slots[i] == 0 &&
+		    __sync_bool_compare_and_swap(&bdg->slots[i], 0, SLOT_VAL(pid, 0)))
+			break;
+	}
+	if (i == BUDGET_SLOTS) {
+		log_msg(LOG_WARN, 0, "Shared index budget has no free slots.");
+		munmap(bdg, sizeof (index_budget_t));
+		return (memreqd);
+	}
+	*slot = i;
+
+	/*
+	 * Take what is left of the budget. Jobs racing here may together exceed
+	 * the budget, so every job re-checks after publishing its grant and backs
+	 * off by the excess. A job always gets a small minimum index.
+	 *
+	 * When no other job holds a reservation the budget is resized to our
+	 * memlimit, so it follows the memory currently available rather than
+	 * what the job that created the segment saw. Our slot is published
+	 * before the scan, so of two jobs starting together at most one resizes.
+	 */
+	want = (memreqd + BUDGET_UNIT - 1) / BUDGET_UNIT;
+	if (want < BUDGET_MIN_MB)
+		want = BUDGET_MIN_MB;
+	used = budget_used(bdg, i, &live);
+	if (live == 0) {
+		bdg->budget_mb = MAX(memlimit / BUDGET_UNIT, BUDGET_MIN_MB);
+		__sync_synchronize();
+	}
+	grant = (used < bdg->budget_mb) ? bdg->budget_mb - used : 0;
+	if (grant > want)
+		grant = want;
+	if (grant < BUDGET_MIN_MB)
+		grant = BUDGET_MIN_MB;
+	bdg->slots[i] = SLOT_VAL(pid, grant);
+	__sync_synchronize();
+
+	total = budget_used(bdg, i, NULL) + grant;
+	if (total > bdg->budget_mb) {
+		grant -= MIN(total - bdg->budget_mb, grant - BUDGET_MIN_MB);
+		bdg->slots[i] = SLOT_VAL(pid, grant);
+		__sync_synchronize();
+	}
+	munmap(bdg, sizeof (index_budget_t));
+	return (MIN(grant * BUDGET_UNIT, memreqd));
+}
+
+static void
+budget_release(int slot)
+{
+	index_budget_t *bdg;
+	uint64_t v;
+
+	if (slot < 0)
+		return;
+	if ((bdg = budget_attach(0, 0)) == NULL)
+		return;
+	v = bdg->slots[slot];
+	if (SLOT_PID(v) == getpid())
+		__sync_bool_compare_and_swap(&bdg->slots[slot], v, 0);
+	munmap(bdg, sizeof (index_budget_t));
+}
+
 archive_config_t *
 init_global_db(char *configfile)
 {
@@ -78,6 +296,7 @@ static cleanup_indx(index_t *indx)
 	int i, j;
 
 	if (indx) {
+		budget_release(indx->budget_slot);
 		if (indx->list) {
 			for (i = 0; i < indx->intervals; i++) {
 				if (indx->list[i].tab) {
@@ -208,9 +427,9 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 		 size_t file_sz, size_t memlimit, int nthreads)
 {
 	archive_config_t *cfg;
-	int rv;
+	int rv, budget_slot, pct_interval_in;
 	uint32_t hash_slots, intervals, i;
-	uint64_t memreqd;
+	uint64_t memreqd, grant, user_chunk_sz_in;
 	int hash_entry_size;
 	index_t *indx;
 
@@ -220,9 +439,25 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 	}
 	cfg = calloc(1, sizeof (archive_config_t));
 
+	user_chunk_sz_in = user_chunk_sz;
+	pct_interval_in = pct_interval;
 	rv = setup_db_config_s(cfg, chunksize, &user_chunk_sz, &pct_interval, algo, ck, ck_sim,
 		 file_sz, &hash_slots, &hash_entry_size, &memreqd, memlimit, tmppath);
 
+	/*
+	 * Take the index memory out of the shared budget if one is in use. If less
+	 * than needed is granted the index is set up again for the lower limit.
+	 */
+	grant = budget_reserve(MIN(memreqd, memlimit), memlimit, &budget_slot);
+	if (grant < memlimit && grant < memreqd) {
+		memlimit = grant;
+		user_chunk_sz = user_chunk_sz_in;
+		pct_interval = pct_interval_in;
+		memset(cfg, 0, sizeof (archive_config_t));
+		rv = setup_db_config_s(cfg, chunksize, &user_chunk_sz, &pct_interval, algo, ck,
+			ck_sim, file_sz, &hash_slots, &hash_entry_size, &memreqd, memlimit, tmppath);
+	}
+
 	/*
 	 * Reduce hash_slots to remain within memlimit
 	 */
@@ -236,9 +471,11 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 	 */
 	indx = calloc(1, sizeof (index_t));
 	if (!indx) {
+		budget_release(budget_slot);
 		free(cfg);
 		return (NULL);
 	}
+	indx->budget_slot = budget_slot;
 
 	cfg->nthreads = nthreads;
 	if (cfg->dedupe_mode == MODE_SIMILARITY)
@@ -0,0 +1,175 @@
+#
+# Archiving with BCJ, member catalogs and incremental archives
+#
+echo "#################################################"
+echo "# Test archiving with BCJ, catalogs and incremental archives"
+echo "#################################################"
+
+#
+# Build a small directory tree with executables and some text.
+#
+rm -rf arc arc.1 arc*.pz
+mkdir -p arc/bin arc/res
+for f in `ls /usr/bin | head -40`
+do
+	[ -f /usr/bin/${f} -a ! -h /usr/bin/${f} ] && cp /usr/bin/${f} arc/bin/
+done
+cp ../res/jpg/*.jpg ../res/xml/*.xml arc/res/
+
+for algo in lz4 zlib lzma
+do
+	for feat in "-b" "-b -L" "-b -D" "-b -L -P -D"
+	do
+		cmd="../../pcompress -a -c ${algo} -l 3 -s 1m $feat arc arc.pz"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Archiving failed."
+			rm -f arc.pz
+			continue
+		fi
+		mkdir arc.1
+		cmd="../../pcompress -d arc.pz arc.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extraction failed."
+			rm -rf arc.pz arc.1
+			continue
+		fi
+		diff -r arc arc.1/arc > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extraction was not correct"
+		fi
+		rm -rf arc.pz arc.1
+	done
+done
+
+#
+# Listing and selective extraction through the catalog.
+#
+for algo in lz4 lzma
+do
+	cmd="../../pcompress -a -I -c ${algo} -l 3 -s 1m arc arc.pz"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Archiving with a catalog failed."
+		rm -f arc.pz
+		continue
+	fi
+
+	cmd="../../pcompress -i arc.pz"
+	echo "Running $cmd"
+	eval $cmd > arc.lst
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Listing failed."
+	fi
+	for f in `cd arc/res; ls`
+	do
+		grep " arc/res/${f}$" arc.lst > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Member arc/res/${f} not listed."
+		fi
+	done
+
+	cmd="../../pcompress -i arc.pz arc/res"
+	echo "Running $cmd"
+	eval $cmd > arc.lst
+	grep " arc/bin/." arc.lst > /dev/null
+	if [ $? -eq 0 ]
+	then
+		echo "FATAL: Listing selected members showed others."
+	fi
+
+	mkdir arc.1
+	cmd="../../pcompress -d arc.pz arc.1 arc/res"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Selective extraction failed."
+		rm -rf arc.pz arc.1 arc.lst
+		continue
+	fi
+	diff -r arc/res arc.1/arc/res > /dev/null
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Selective extraction was not correct"
+	fi
+	if [ -d arc.1/arc/bin ]
+	then
+		echo "FATAL: Selective extraction restored other members"
+	fi
+	rm -rf arc.pz arc.1 arc.lst
+done
+
+#
+# Incremental archive on top of a base archive. One file changes, one is
+# deleted and one is added.
+#
+cmd="../../pcompress -a -I -c lzma -l 3 -s 1m arc arc.pz"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Archiving the base failed."
+else
+	sleep 1
+	echo "changed" >> arc/res/iso_639_3.xml
+	rm -f arc/res/screen.jpg
+	cp ../res/xml/iso_639_3.xml arc/res/new.xml
+
+	cmd="../../pcompress -a -R arc.pz -c lzma -l 3 -s 1m arc arc.2.pz"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Incremental archiving failed."
+	else
+		cmd="../../pcompress -i arc.2.pz"
+		echo "Running $cmd"
+		eval $cmd > arc.lst
+		grep " arc/res/screen.jpg (deleted)$" arc.lst > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Deleted member not recorded."
+		fi
+		grep " arc/bin/." arc.lst > /dev/null
+		if [ $? -eq 0 ]
+		then
+			echo "FATAL: Unchanged members were archived again."
+		fi
+
+		mkdir arc.1
+		cmd="../../pcompress -d arc.pz arc.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extracting the base failed."
+		fi
+		cmd="../../pcompress -d arc.2.pz arc.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extracting the incremental archive failed."
+		fi
+		diff -r arc arc.1/arc > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Incremental extraction was not correct"
+		fi
+	fi
+fi
+rm -rf arc arc.1 arc*.pz arc.lst
+
+echo "#################################################"
+echo ""
@@ -0,0 +1,122 @@
+#
+# Chunk CRCs, verification and volumes
+#
+echo "#################################################"
+echo "# Test payload CRCs, verify-only mode and volumes"
+echo "#################################################"
+
+for algo in lz4 zlib lzma
+do
+	for tf in `cat files.lst`
+	do
+		rm -f ${tf}.*
+		for feat in "-H" "-H -D" "-H -L -P"
+		do
+			cmd="../../pcompress -c ${algo} -l 3 -s 1m $feat ${tf}"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Compression errored."
+				rm -f ${tf}.pz
+				continue
+			fi
+
+			for vf in "-T" "-TT"
+			do
+				cmd="../../pcompress $vf ${tf}.pz"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Verification failed."
+				fi
+			done
+
+			cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression errored."
+				rm -f ${tf}.pz ${tf}.1
+				continue
+			fi
+			diff ${tf} ${tf}.1 > /dev/null
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression was not correct"
+			fi
+
+			#
+			# With '-H' the CRC covers the compressed data so that '-TT'
+			# finds corruption without decompressing.
+			#
+			echo "Corrupting file ..."
+			sz=`ls -l ${tf}.pz | awk '{ print $5 }'`
+			dd if=/dev/urandom conv=notrunc of=${tf}.pz bs=4 seek=$((sz / 8)) count=1
+			cmd="../../pcompress -TT ${tf}.pz"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -eq 0 ]
+			then
+				echo "FATAL: Verification DID NOT ERROR where expected."
+			fi
+			rm -f ${tf}.pz ${tf}.1
+		done
+	done
+done
+
+#
+# Stripe the chunks across volumes in several directories.
+#
+for tf in `cat files.lst`
+do
+	rm -rf ${tf}.* vol1 vol2 vol3
+	mkdir vol1 vol2 vol3
+	for feat in "-c lz4 -l 3 -s 1m" "-c zlib -l 3 -s 1m -D" "-c lzma -l 3 -s 2m -G -D"
+	do
+		cmd="../../pcompress $feat -V vol1,vol2,vol3 ${tf}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression errored."
+			rm -f ${tf}.pz vol1/* vol2/* vol3/*
+			continue
+		fi
+		bn=`basename ${tf}`
+		if [ ! -f vol1/${bn}.pz.1 -o ! -f vol2/${bn}.pz.2 -o ! -f vol3/${bn}.pz.3 ]
+		then
+			echo "FATAL: Volumes not created."
+		fi
+
+		cmd="../../pcompress -T ${tf}.pz"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Verification failed."
+		fi
+
+		cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression errored."
+			rm -f ${tf}.pz ${tf}.1 vol1/* vol2/* vol3/*
+			continue
+		fi
+		diff ${tf} ${tf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+		rm -f ${tf}.pz ${tf}.1 vol1/* vol2/* vol3/*
+	done
+done
+rm -rf vol1 vol2 vol3
+
+echo "#################################################"
+echo ""
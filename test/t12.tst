@@ -0,0 +1,119 @@
+#
+# Append mode and checkpointed compression
+#
+echo "#################################################"
+echo "# Test appending and checkpoint/resume"
+echo "#################################################"
+
+#
+# Compress the first part of a file, append the rest and check that
+# decompression gives back the whole file.
+#
+for tf in `cat files.lst`
+do
+	rm -f ${tf}.*
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	hsz=$((sz / 2))
+	head -c ${hsz} ${tf} > ${tf}.h1
+	tail -c +$((hsz + 1)) ${tf} > ${tf}.h2
+
+	for feat in "-c lz4 -l 3 -s 1m" "-c zlib -l 3 -s 1m -D" "-c lzma -l 3 -s 2m -L -P" \
+			"-c lzma -l 3 -s 2m -G -D"
+	do
+		rm -f ${tf}.h1.pz ${tf}.1
+		cmd="../../pcompress $feat ${tf}.h1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression errored."
+			continue
+		fi
+
+		aflags=
+		echo "$feat" | grep "\-G" > /dev/null
+		[ $? -eq 0 ] && aflags="-G"
+		cmd="../../pcompress $aflags -A ${tf}.h1.pz ${tf}.h2"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Append errored."
+			continue
+		fi
+
+		cmd="../../pcompress -d ${tf}.h1.pz ${tf}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression errored."
+			continue
+		fi
+		diff ${tf} ${tf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression after append was not correct"
+		fi
+	done
+	rm -f ${tf}.h1 ${tf}.h2 ${tf}.h1.pz ${tf}.1
+done
+
+#
+# Kill a checkpointed compression once it has saved a checkpoint and
+# resume it.
+#
+for tf in `cat files.lst`
+do
+	for feat in "-c lzma -l 9 -s 2m" "-c lzma -l 9 -s 2m -G -D"
+	do
+		rm -f ${tf}.*
+		echo "Running ../../pcompress --checkpoint 1 $feat ${tf}"
+		../../pcompress --checkpoint 1 $feat ${tf} &
+		pid=$!
+		while kill -0 $pid 2> /dev/null && [ ! -f ${tf}.pz.ckpt ]
+		do
+			sleep 1
+		done
+		kill -9 $pid 2> /dev/null
+		wait $pid
+
+		if [ -f ${tf}.pz.ckpt ]
+		then
+			cmd="../../pcompress --resume ${tf}"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Resume errored."
+				rm -f ${tf}.*
+				continue
+			fi
+		else
+			echo "Compression finished before a checkpoint was saved."
+		fi
+		if [ -f ${tf}.pz.part -o -f ${tf}.pz.ckpt ]
+		then
+			echo "FATAL: Partial output left behind."
+		fi
+
+		cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression errored."
+			rm -f ${tf}.*
+			continue
+		fi
+		diff ${tf} ${tf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression after resume was not correct"
+		fi
+		rm -f ${tf}.*
+	done
+done
+
+echo "#################################################"
+echo ""
@@ -0,0 +1,70 @@
+#
+# Files from older versions
+#
+echo "#################################################"
+echo "# Test decompressing version 9 files"
+echo "#################################################"
+
+#
+# The files in res/v9 were created from res/xml by pcompress before the
+# file format moved to version 10. The encrypted one uses the password v9pass.
+#
+for tf in iso_639_3.xml.zlib.pz iso_639_3.xml.lzma.pz iso_639_3.xml.aes.pz
+do
+	rm -f v9.1
+	pwf=
+	echo "${tf}" | grep "aes" > /dev/null
+	[ $? -eq 0 ] && pwf="-w /tmp/pwf"
+	echo "v9pass" > /tmp/pwf
+	cmd="../../pcompress -d ${pwf} ../res/v9/${tf} v9.1"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression errored."
+		continue
+	fi
+	diff ../res/xml/iso_639_3.xml v9.1 > /dev/null
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression was not correct"
+	fi
+
+	cmd="../../pcompress -T ${pwf} ../res/v9/${tf}"
+	echo "v9pass" > /tmp/pwf
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Verification failed."
+	fi
+done
+rm -f v9.1 /tmp/pwf
+
+rm -rf v9.d
+mkdir v9.d
+cmd="../../pcompress -d ../res/v9/xml.pz v9.d"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Extraction errored."
+else
+	diff -r ../res/xml v9.d/xml > /dev/null
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Extraction was not correct"
+	fi
+fi
+
+cmd="../../pcompress -i ../res/v9/xml.pz"
+echo "Running $cmd"
+eval $cmd | grep " xml/iso_639_3.xml$" > /dev/null
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Listing was not correct"
+fi
+rm -rf v9.d
+
+echo "#################################################"
+echo ""
@@ -0,0 +1,179 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * NUMA topology discovery and thread placement. The topology is read from
+ * sysfs so that no NUMA library is needed. Memory placement relies on the
+ * default first-touch policy of the kernel: pages land on the node of the
+ * CPU that first writes them.
+ */
+#ifndef	_GNU_SOURCE
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pc_numa.h"
+
+#ifdef	__linux__
+#define	NODE_CPULIST	"/sys/devices/system/node/node%d/cpulist"
+#define	CPULIST_LEN	256
+
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int numa_nodes = 1;
+static cpu_set_t proc_cpus;
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+static int node_ids[MAX_NUMA_NODES];
+static char node_cpulist[MAX_NUMA_NODES][CPULIST_LEN];
+
+/*
+ * Parse a sysfs CPU list like "0-7,16-23" into a CPU set, keeping only the
+ * CPUs the process may run on. Returns the number of CPUs kept.
+ */
+static int
+parse_cpulist(const char *list, cpu_set_t *set)
+{
+	const char *pos;
+	char *end;
+	long first, last, c;
+	int ncpus;
+
+	CPU_ZERO(set);
+	ncpus = 0;
+	pos = list;
+	while (*pos >= '0' && *pos <= '9') {
+		first = strtol(pos, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (c = first; c <= last && c < CPU_SETSIZE; c++) {
+			if (CPU_ISSET(c, &proc_cpus)) {
+				CPU_SET(c, set);
+				ncpus++;
+			}
+		}
+		if (*end != ',')
+			break;
+		pos = end + 1;
+	}
+	return (ncpus);
+}
+
+static void
+numa_init(void)
+{
+	char path[64], list[CPULIST_LEN];
+	FILE *fp;
+	int node, n;
+
+	if (getenv("PCOMPRESS_NO_NUMA") != NULL)
+		return;
+	if (sched_getaffinity(0, sizeof (proc_cpus), &proc_cpus) == -1)
+		return;
+
+	/*
+	 * Node ids can have gaps so compact the nodes that have usable CPUs.
+	 */
+	n = 0;
+	for (node = 0; node < MAX_NUMA_NODES * 4 && n < MAX_NUMA_NODES; node++) {
+		snprintf(path, sizeof (path), NODE_CPULIST, node);
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;
+		if (fgets(list, sizeof (list), fp) != NULL &&
+		    parse_cpulist(list, &node_cpus[n]) > 0) {
+			list[strcspn(list, "\n")] = '\0';
+			strcpy(node_cpulist[n], list);
+			node_ids[n] = node;
+			n++;
+		}
+		fclose(fp);
+	}
+	if (n > 1)
+		numa_nodes = n;
+}
+
+int
+get_numa_nodes(void)
+{
+	pthread_once(&numa_once, numa_init);
+	return (numa_nodes);
+}
+
+int
+numa_node_id(int node)
+{
+	if (node < 0 || node >= get_numa_nodes() || numa_nodes == 1)
+		return (0);
+	return (node_ids[node]);
+}
+
+const char *
+numa_node_cpulist(int node)
+{
+	if (node < 0 || node >= get_numa_nodes() || numa_nodes == 1)
+		return ("");
+	return (node_cpulist[node]);
+}
+
+int
+bind_numa_node(int node)
+{
+	cpu_set_t *set;
+
+	if (node >= get_numa_nodes() || numa_nodes == 1)
+		return (-1);
+	set = (node < 0 ? &proc_cpus : &node_cpus[node]);
+	if (pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t), set) != 0)
+		return (-1);
+	return (0);
+}
+
+#else
+
+int
+get_numa_nodes(void)
+{
+	return (1);
+}
+
+int
+numa_node_id(int node)
+{
+	return (0);
+}
+
+const char *
+numa_node_cpulist(int node)
+{
+	return ("");
+}
+
+int
+bind_numa_node(int node)
+{
+	return (-1);
+}
+#endif
@@ -0,0 +1,54 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+#ifndef	_PC_NUMA_H
+#define	_PC_NUMA_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define	MAX_NUMA_NODES	64
+
+/*
+ * NUMA nodes are numbered 0 .. get_numa_nodes() - 1, counting only nodes that
+ * have CPUs this process may run on. A single node is reported when the
+ * topology is not known or NUMA placement is disabled with PCOMPRESS_NO_NUMA.
+ * The system's id and CPU list of a node are available for reporting.
+ */
+int get_numa_nodes(void);
+int numa_node_id(int node);
+const char *numa_node_cpulist(int node);
+
+/*
+ * Restrict the calling thread to the CPUs of a node. Node -1 restores the CPU
+ * set the process started with.
+ */
+int bind_numa_node(int node);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+
+/*
+ * Zero-copy output to pipes. vmsplice() hands user pages to the pipe by
+ * reference, which saves the copy into the pipe buffer that write() does.
+ * The pipe goes on referencing those pages until the reader consumes them,
+ * so they must not be modified meanwhile. The caller keeps the buffer out of
+ * use until pipe_queued() shows that the reader has read past it. A reader
+ * that splices the data on to another pipe or socket instead of reading it
+ * still references the pages after that, so this is only safe with readers
+ * that copy the data out, and vmsplice() is only used when the user asks
+ * for it.
+ */
+#ifndef	_GNU_SOURCE
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <utils.h>
+#include "pc_pipe.h"
+
+#ifdef	__linux__
+#define	PIPE_MAX_SIZE	"/proc/sys/fs/pipe-max-size"
+#define	PIPE_DEF_MAX	(1024 * 1024)
+#define	PIPE_DRAIN_POLL_MS	1
+
+int
+pipe_splice_ok(int fd)
+{
+	struct stat sbuf;
+
+	if (fstat(fd, &sbuf) == -1 || !S_ISFIFO(sbuf.st_mode) || pipe_queued(fd) == -1)
+		return (0);
+	return (1);
+}
+
+int64_t
+pipe_queued(int fd)
+{
+	int n;
+
+	if (ioctl(fd, FIONREAD, &n) == -1)
+		return (-1);
+	return (n);
+}
+
+void
+pipe_grow(int fd, uint64_t size)
+{
+	FILE *fp;
+	long max;
+	int cur;
+
+	if ((cur = fcntl(fd, F_GETPIPE_SZ)) == -1 || cur >= size)
+		return;
+	max = PIPE_DEF_MAX;
+	if ((fp = fopen(PIPE_MAX_SIZE, "r")) != NULL) {
+		if (fscanf(fp, "%ld", &max) != 1 || max <= 0)
+			max = PIPE_DEF_MAX;
+		fclose(fp);
+	}
+	if (size > max)
+		size = max;
+	if (size > cur)
+		(void) fcntl(fd, F_SETPIPE_SZ, (int)size);
+}
+
+void
+pipe_drain(int fd)
+{
+	struct pollfd pfd;
+
+	/*
+	 * With no events asked for poll() only returns on POLLERR, which a pipe
+	 * reports once it has no reader left.
+	 */
+	pfd.fd = fd;
+	pfd.events = 0;
+	while (pipe_queued(fd) > 0) {
+		if (poll(&pfd, 1, PIPE_DRAIN_POLL_MS) > 0)
+			break;
+	}
+}
+
+int64_t
+Write_Pipe(int fd, void *buf, uint64_t count)
+{
+	uchar_t *pos, *end, *pstart, *pend;
+	struct iovec iov;
+	uintptr_t pgsz;
+	ssize_t rv;
+
+	pgsz = sysconf(_SC_PAGESIZE);
+	pos = (uchar_t *)buf;
+	end = pos + count;
+	pstart = (uchar_t *)(((uintptr_t)pos + pgsz - 1) & ~(pgsz - 1));
+	pend = (uchar_t *)((uintptr_t)end & ~(pgsz - 1));
+	if (pend <= pstart)
+		return (Write(fd, buf, count));
+
+	/*
+	 * The partial pages at either end are shared with other data and are
+	 * copied as usual.
+	 */
+	if (pstart > pos && Write(fd, pos, pstart - pos) != pstart - pos)
+		return (-1);
+	pos = pstart;
+	while (pos < pend) {
+		iov.iov_base = pos;
+		iov.iov_len = pend - pos;
+		rv = vmsplice(fd, &iov, 1, 0);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		pos += rv;
+	}
+	if (pos < end && Write(fd, pos, end - pos) != end - pos)
+		return (-1);
+	return (count);
+}
+
+#else
+
+int
+pipe_splice_ok(int fd)
+{
+	return (0);
+}
+
+void
+pipe_grow(int fd, uint64_t size)
+{
+}
+
+int64_t
+pipe_queued(int fd)
+{
+	return (-1);
+}
+
+void
+pipe_drain(int fd)
+{
+}
+
+int64_t
+Write_Pipe(int fd, void *buf, uint64_t count)
+{
+	return (Write(fd, buf, count));
+}
+#endif
@@ -0,0 +1,69 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+
+#ifndef	_PC_PIPE_H
+#define	_PC_PIPE_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Returns 1 if fd is a pipe that data can be spliced into, 0 otherwise.
+ */
+int pipe_splice_ok(int fd);
+
+/*
+ * Try to grow a pipe's buffer to hold size bytes. The size is capped by the
+ * system limit and failures are ignored.
+ */
+void pipe_grow(int fd, uint64_t size);
+
+/*
+ * Returns the number of bytes in a pipe that have not been read yet, or -1
+ * on error.
+ */
+int64_t pipe_queued(int fd);
+
+/*
+ * Wait until the reader has consumed all the data queued in a pipe, or has
+ * closed its end.
+ */
+void pipe_drain(int fd);
+
+/*
+ * Same as Write(), but the page-aligned part of the buffer is spliced into the
+ * pipe instead of being copied. The buffer must not be modified until the
+ * reader has consumed it, as shown by pipe_queued().
+ */
+int64_t Write_Pipe(int fd, void *buf, uint64_t count);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -187,7 +187,7 @@ bytes_to_size(uint64_t bytes)
  * Additionally can be given an offset in the buf where the data
  * should be inserted.
  */
-int64_t
+int64_t DLL_EXPORT
 Read(int fd, void *buf, uint64_t count)
 {
 	int64_t rcount, rem;
@@ -205,6 +205,28 @@ Read(int fd, void *buf, uint64_t count)
 	return (count - rem);
 }
 
+/*
+ * Same as Read() but at the given file offset without moving the file pointer.
+ */
+int64_t
+Pread(int fd, void *buf, uint64_t count, uint64_t offset)
+{
+	int64_t rcount, rem;
+	uchar_t *cbuf;
+
+	rem = count;
+	cbuf = (uchar_t *)buf;
+	do {
+		rcount = pread(fd, cbuf, rem, offset);
+		if (rcount < 0) return (rcount);
+		if (rcount == 0) break;
+		rem = rem - rcount;
+		cbuf += rcount;
+		offset += rcount;
+	} while (rem);
+	return (count - rem);
+}
+
 /*
  * Read the requested chunk and return the last rabin boundary in the chunk.
  * This helps in splitting chunks at rabin boundaries rather than fixed points.
@@ -257,7 +279,7 @@ Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *
         return (rcount);
 }
 
-int64_t
+int64_t DLL_EXPORT
 Write(int fd, const void *buf, uint64_t count)
 {
 	int64_t wcount, rem;
@@ -246,7 +246,7 @@ typedef enum {
 	/*
 	 * Sub-types.
 	 */
-#define	NUM_SUB_TYPES	26
+#define	NUM_SUB_TYPES	28
 	TYPE_EXE32 = 8,
 	TYPE_JPEG = 16,
 	TYPE_MARKUP = 24,
@@ -272,7 +272,8 @@ typedef enum {
 	TYPE_AUDIO_COMPRESSED = 184,
 	TYPE_EXE64 = 192,
 	TYPE_BMP = 200,
-	TYPE_TIFF = 208
+	TYPE_TIFF = 208,
+	TYPE_EXE_ARM64 = 216
 } data_type_t;
 
 /*
@@ -301,6 +302,7 @@ extern const char *get_execname(const char *);
 extern int parse_numeric(int64_t *val, const char *str);
 extern char *bytes_to_size(uint64_t bytes);
 extern int64_t Read(int fd, void *buf, uint64_t count);
+extern int64_t Pread(int fd, void *buf, uint64_t count, uint64_t offset);
 extern int64_t Read_Adjusted(int fd, uchar_t *buf, uint64_t count,
 	int64_t *rabin_count, void *ctx, void *pctx);
 extern int64_t Write(int fd, const void *buf, uint64_t count);